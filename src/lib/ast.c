@@ -10,6 +10,7 @@ struct sp_ast *sp_new_ast(struct sp_mem_pool *pool, struct sp_string_table *file
   ast->pool = pool;
   ast->file_names = file_names;
   sp_init_string_table(&ast->strings, pool);
+  sp_init_src_loc_table(&ast->src_locs, pool);
   return ast;
 }
 
@@ -27,3 +28,18 @@ const char *sp_get_ast_file_name(struct sp_ast *ast, sp_string_id file_id)
 {
   return sp_get_string(ast->file_names, file_id);
 }
+
+sp_src_loc_id sp_add_ast_src_file(struct sp_ast *ast, sp_string_id file_id, const void *data, size_t size)
+{
+  return sp_add_src_loc_file(&ast->src_locs, (uint16_t) file_id, data, size);
+}
+
+int sp_copy_ast_src_locs(struct sp_ast *ast, struct sp_ast *from)
+{
+  return sp_copy_src_loc_ranges(&ast->src_locs, &from->src_locs);
+}
+
+bool sp_get_ast_src_loc(struct sp_ast *ast, sp_src_loc_id loc_id, struct sp_src_loc *loc)
+{
+  return sp_get_src_loc(&ast->src_locs, loc_id, loc);
+}
@@ -4,16 +4,21 @@
 #define AST_H_FILE
 
 #include "internal.h"
+#include "src_loc.h"
 
 struct sp_ast {
   struct sp_mem_pool *pool;
   struct sp_string_table strings;
   struct sp_string_table *file_names;
+  struct sp_src_loc_table src_locs;
 };
 
 struct sp_ast *sp_new_ast(struct sp_mem_pool *pool, struct sp_string_table *file_names);
 const char *sp_get_ast_string(struct sp_ast *ast, sp_string_id id);
 const char *sp_get_ast_file_name(struct sp_ast *ast, sp_string_id file_id);
 sp_string_id sp_add_ast_file_name(struct sp_ast *ast, const char *filename);
+sp_src_loc_id sp_add_ast_src_file(struct sp_ast *ast, sp_string_id file_id, const void *data, size_t size);
+int sp_copy_ast_src_locs(struct sp_ast *ast, struct sp_ast *from);
+bool sp_get_ast_src_loc(struct sp_ast *ast, sp_src_loc_id loc_id, struct sp_src_loc *loc);
 
 #endif /* AST_H_FILE */
@@ -31,9 +31,16 @@ int sp_buf_grow(struct sp_buffer *buf, size_t add_size)
     size_t new_cap = ((new_size + 1024 - 1) / 1024) * 1024;
     if (new_cap > INT_MAX || new_cap < new_size)
       return -1;
-    void *new_p = sp_realloc(buf->pool, buf->p, new_cap);
+    // grow geometrically, so adding a little at a time stays linear
+    if (new_cap < 2 * (size_t) buf->cap && 2 * (size_t) buf->cap <= INT_MAX)
+      new_cap = 2 * (size_t) buf->cap;
+    char *new_p = sp_malloc(buf->pool, new_cap);
     if (new_p == NULL)
       return -1;
+    if (buf->p) {
+      memcpy(new_p, buf->p, buf->size);
+      sp_free(buf->pool, buf->p);
+    }
     buf->p = new_p;
     buf->cap = (int) new_cap;
   }
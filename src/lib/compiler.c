@@ -3,12 +3,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include "internal.h"
 #include "compiler.h"
 #include "ast.h"
 #include "program.h"
 #include "preprocessor.h"
+#include "pp_output.h"
 #include "token.h"
 
 int sp_init_compiler(struct sp_compiler *comp, struct sp_program *prog)
@@ -16,6 +18,25 @@ int sp_init_compiler(struct sp_compiler *comp, struct sp_program *prog)
   comp->prog = prog;
   comp->sys_include_search_dirs = NULL;
   comp->user_include_search_dirs = NULL;
+  comp->macro_engine = SP_MACRO_ENGINE_DEFAULT;
+  comp->macro_memo = false;
+  memset(&comp->macro_memo_stats, 0, sizeof(comp->macro_memo_stats));
+  memset(&comp->include_stats, 0, sizeof(comp->include_stats));
+  comp->macro_profile = false;
+  sp_init_pp_profile(&comp->profile);
+  sp_init_pp_scan_cache(&comp->scan_cache);
+  sp_init_pp_skip_index(&comp->skip_index);
+  comp->pch.data = NULL;
+  comp->pch.size = 0;
+  sp_init_mem_pool(&comp->prelude.pool);
+  comp->prelude.ast = NULL;
+  comp->prelude.pp = NULL;
+  comp->prelude.no_prelude = false;
+  comp->spec_threads = 0;
+  sp_init_pp_spec(&comp->spec);
+  comp->token_stream_input = false;
+  comp->stream.data = NULL;
+  comp->stream.size = 0;
   sp_init_mem_pool(&comp->pool);
   return 0;
 }
@@ -29,10 +50,28 @@ static void free_include_search_dirs(struct sp_include_search_dir *list)
   }
 }
 
+static void clear_prelude(struct sp_compiler *comp)
+{
+  if (comp->prelude.pp)
+    sp_destroy_preprocessor(comp->prelude.pp);
+  comp->prelude.ast = NULL;
+  comp->prelude.pp = NULL;
+  comp->prelude.no_prelude = false;
+  sp_clear_mem_pool(&comp->prelude.pool);
+}
+
 void sp_destroy_compiler(struct sp_compiler *comp)
 {
+  sp_destroy_pp_spec(&comp->spec);
+  clear_prelude(comp);
+  sp_destroy_mem_pool(&comp->prelude.pool);
   free_include_search_dirs(comp->sys_include_search_dirs);
   free_include_search_dirs(comp->user_include_search_dirs);
+  sp_destroy_pp_profile(&comp->profile);
+  sp_destroy_pp_scan_cache(&comp->scan_cache);
+  sp_destroy_pp_skip_index(&comp->skip_index);
+  sp_unmap_pp_pch(&comp->pch);
+  sp_unmap_pp_stream(&comp->stream);
   sp_destroy_mem_pool(&comp->pool);
 }
 
@@ -56,46 +95,451 @@ int sp_comp_add_include_search_dir(struct sp_compiler *comp, const char *dir, bo
   return 0;
 }
 
+/*
+ * Start the preprocessor of a file from the prelude snapshot if there
+ * is one, or else from the precompiled header (if any).
+ */
+static int start_preprocessor(struct sp_compiler *comp, struct sp_preprocessor *pp, struct sp_ast *ast)
+{
+  comp->pp = pp;
+  if (comp->prelude.pp) {
+    if (sp_init_forked_preprocessor(pp, comp, &comp->pool, comp->prelude.pp) < 0)
+      return -1;
+    if (sp_copy_ast_src_locs(ast, comp->prelude.ast) < 0)
+      return sp_set_error(comp->prog, "out of memory");
+    return 0;
+  }
+  sp_init_preprocessor(pp, comp, &comp->pool);
+  if (comp->pch.data && sp_load_pp_pch(pp, &comp->pch) < 0)
+    return -1;
+  return 0;
+}
+
+/*
+ * Keep the state of a preprocessor after reading a prelude (if not
+ * NULL), to start other preprocessors from.
+ */
+static int make_snapshot(struct sp_compiler *comp, const char *filename)
+{
+  clear_prelude(comp);
+
+  struct sp_pp_snapshot *snap = &comp->prelude;
+  snap->ast = sp_new_ast(&snap->pool, &comp->prog->src_file_names);
+  struct sp_preprocessor *pp = sp_malloc(&snap->pool, sizeof(struct sp_preprocessor));
+  if (! snap->ast || ! pp) {
+    sp_set_error(comp->prog, "out of memory");
+    goto err;
+  }
+
+  comp->pp = pp;
+  comp->ast = snap->ast;
+  sp_init_preprocessor(pp, comp, &snap->pool);
+  if (comp->pch.data && sp_load_pp_pch(pp, &comp->pch) < 0)
+    goto err_pp;
+  pp->scan_only = true;
+
+  if (filename) {
+    if (sp_set_preprocessor_io(pp, filename, snap->ast) < 0)
+      goto err_pp;
+
+    struct sp_pp_token tok;
+    do {
+      if (sp_next_pp_token(pp, &tok) < 0)
+        goto err_pp;
+    } while (! pp_tok_is_eof(&tok));
+
+    if (sp_add_pp_once_file(pp, filename) < 0)
+      goto err_pp;
+  }
+  if (sp_freeze_preprocessor(pp) < 0)
+    goto err_pp;
+
+  comp->ast = NULL;
+  comp->pp = NULL;
+  snap->pp = pp;
+  snap->no_prelude = (filename == NULL);
+  return 0;
+
+ err_pp:
+  sp_destroy_preprocessor(pp);
+ err:
+  comp->ast = NULL;
+  comp->pp = NULL;
+  clear_prelude(comp);
+  return -1;
+}
+
+// profiling needs everything preprocessed by the main thread, and token streams have no headers
+static bool use_spec(struct sp_compiler *comp)
+{
+  return comp->spec_threads > 0 && ! comp->macro_profile && ! comp->token_stream_input;
+}
+
+/*
+ * Headers are preprocessed ahead from a snapshot, so one is made
+ * without a prelude if there's none.
+ */
+static int prepare_spec(struct sp_compiler *comp)
+{
+  if (! use_spec(comp) || comp->prelude.pp)
+    return 0;
+  return make_snapshot(comp, NULL);
+}
+
+static int start_spec(struct sp_compiler *comp, struct sp_preprocessor *pp, const char *filename)
+{
+  if (! use_spec(comp))
+    return 0;
+  if (sp_start_pp_spec(&comp->spec, comp, filename, comp->spec_threads) < 0)
+    return -1;
+  if (comp->spec.n_threads > 0)
+    pp->spec = &comp->spec;
+  return 0;
+}
+
+/*
+ * Start the preprocessor of a file, or of a token stream saved by
+ * sp_comp_save_token_stream() if those are read instead.
+ */
+static int start_file(struct sp_compiler *comp, struct sp_preprocessor *pp, struct sp_ast *ast, const char *filename)
+{
+  if (comp->token_stream_input) {
+    comp->pp = pp;
+    sp_init_preprocessor(pp, comp, &comp->pool);
+    if (sp_map_pp_stream(&comp->stream, comp->prog, filename) < 0)
+      return -1;
+    return sp_load_pp_stream(pp, &comp->stream, ast);
+  }
+
+  if (start_preprocessor(comp, pp, ast) < 0
+      || sp_set_preprocessor_io(comp->pp, filename, ast) < 0
+      || start_spec(comp, comp->pp, filename) < 0)
+    return -1;
+  return 0;
+}
+
 int sp_comp_preprocess_file(struct sp_compiler *comp, const char *filename)
 {
+  if (prepare_spec(comp) < 0)
+    return -1;
   sp_clear_mem_pool(&comp->pool);
 
   comp->ast = sp_new_ast(&comp->pool, &comp->prog->src_file_names);
   if (! comp->ast) {
-    sp_set_error(comp->prog, "out of memory");
-    goto err;
+    sp_clear_mem_pool(&comp->pool);
+    return sp_set_error(comp->prog, "out of memory");
   }
 
   struct sp_preprocessor pp;
-  comp->pp = &pp;
-  sp_init_preprocessor(comp->pp, comp, &comp->pool);
-
-  if (sp_set_preprocessor_io(comp->pp, filename, comp->ast) < 0)
+  if (start_file(comp, &pp, comp->ast, filename) < 0)
     goto err;
 
   printf("===================================\n");
   struct sp_pp_token tok;
+  bool first = true;
   do {
     if (sp_next_pp_token(comp->pp, &tok) < 0)
       goto err;
-    printf("%s", sp_dump_pp_token(comp->pp, &tok));
-    if (pp_tok_is_newline(&tok))
+    if (! first && pp_tok_is_bol(&tok))
       printf("\n");
+    else if (! first && pp_tok_has_space(&tok))
+      printf(" ");
+    printf("%s", sp_dump_pp_token(comp->pp, &tok));
+    first = false;
   } while (! pp_tok_is_eof(&tok));
   printf("\n");
   printf("===================================\n");
 
-  if (pp.macros.len > 0) {
+  if (pp.macros.defs.len > 0 || pp.macros.base) {
     printf("// macros:\n");
-    sp_dump_macros(comp->pp);
+    if (sp_dump_macros(comp->pp) < 0)
+      goto err;
     printf("===================================\n");
   }
 
   comp->ast = NULL;
   sp_destroy_preprocessor(comp->pp);
+  sp_stop_pp_spec(&comp->spec);
+  sp_unmap_pp_stream(&comp->stream);
   sp_clear_mem_pool(&comp->pool);
   return 0;
       
+ err:
+  comp->ast = NULL;
+  sp_destroy_preprocessor(comp->pp);
+  sp_stop_pp_spec(&comp->spec);
+  sp_unmap_pp_stream(&comp->stream);
+  sp_clear_mem_pool(&comp->pool);
+  return -1;
+}
+
+/*
+ * Write the preprocessed text of a file to 'fd', with line markers.
+ */
+int sp_comp_write_preprocessed_file(struct sp_compiler *comp, const char *filename, int fd)
+{
+  if (prepare_spec(comp) < 0)
+    return -1;
+  sp_clear_mem_pool(&comp->pool);
+
+  struct sp_pp_output out;
+  comp->ast = sp_new_ast(&comp->pool, &comp->prog->src_file_names);
+  if (! comp->ast || sp_init_pp_output(&out, &comp->pool, fd) < 0) {
+    comp->ast = NULL;
+    sp_clear_mem_pool(&comp->pool);
+    return sp_set_error(comp->prog, "out of memory");
+  }
+
+  struct sp_preprocessor pp;
+  if (start_file(comp, &pp, comp->ast, filename) < 0)
+    goto err;
+
+  struct sp_pp_token tok;
+  do {
+    if (sp_next_pp_token(comp->pp, &tok) < 0) {
+      sp_flush_pp_output(&out);
+      goto err;
+    }
+    if (sp_write_pp_output_token(&out, comp->pp, &tok) < 0)
+      goto err_write;
+  } while (! pp_tok_is_eof(&tok));
+  if (sp_flush_pp_output(&out) < 0)
+    goto err_write;
+
+  comp->ast = NULL;
+  sp_destroy_preprocessor(comp->pp);
+  sp_stop_pp_spec(&comp->spec);
+  sp_unmap_pp_stream(&comp->stream);
+  sp_clear_mem_pool(&comp->pool);
+  return 0;
+
+ err_write:
+  sp_set_error(comp->prog, "can't write output: %s", strerror(errno));
+ err:
+  comp->ast = NULL;
+  sp_destroy_preprocessor(comp->pp);
+  sp_stop_pp_spec(&comp->spec);
+  sp_unmap_pp_stream(&comp->stream);
+  sp_clear_mem_pool(&comp->pool);
+  return -1;
+}
+
+/*
+ * Make every file preprocessed from now on start from the state saved
+ * in a precompiled header.
+ */
+int sp_comp_use_pch(struct sp_compiler *comp, const char *filename)
+{
+  struct sp_pp_pch pch;
+  if (sp_map_pp_pch(&pch, comp->prog, filename) < 0)
+    return -1;
+  sp_unmap_pp_pch(&comp->pch);
+  comp->pch = pch;
+  if (comp->prelude.no_prelude)
+    clear_prelude(comp);  // made from the old state
+  return 0;
+}
+
+/*
+ * Run the directives of a prelude file and save the resulting state
+ * to a precompiled header.  As with the files included by it, the
+ * text of the prelude is skipped.
+ */
+int sp_comp_save_pch(struct sp_compiler *comp, const char *prelude_filename, const char *filename)
+{
+  sp_clear_mem_pool(&comp->pool);
+
+  comp->ast = sp_new_ast(&comp->pool, &comp->prog->src_file_names);
+  if (! comp->ast) {
+    sp_clear_mem_pool(&comp->pool);
+    return sp_set_error(comp->prog, "out of memory");
+  }
+
+  struct sp_preprocessor pp;
+  if (start_preprocessor(comp, &pp, comp->ast) < 0)
+    goto err;
+  pp.scan_only = true;
+
+  if (sp_set_preprocessor_io(comp->pp, prelude_filename, comp->ast) < 0)
+    goto err;
+
+  struct sp_pp_token tok;
+  do {
+    if (sp_next_pp_token(comp->pp, &tok) < 0)
+      goto err;
+  } while (! pp_tok_is_eof(&tok));
+
+  if (sp_write_pp_pch(comp->pp, prelude_filename, filename) < 0)
+    goto err;
+
+  comp->ast = NULL;
+  sp_destroy_preprocessor(comp->pp);
+  sp_clear_mem_pool(&comp->pool);
+  return 0;
+
+ err:
+  comp->ast = NULL;
+  sp_destroy_preprocessor(comp->pp);
+  sp_clear_mem_pool(&comp->pool);
+  return -1;
+}
+
+/*
+ * Run the directives of a prelude file and keep the resulting state,
+ * so that every file preprocessed from now on starts from it without
+ * reading the prelude again.  As with sp_comp_save_pch(), the text of
+ * the prelude is skipped, and including it again does nothing.
+ */
+int sp_comp_set_prelude(struct sp_compiler *comp, const char *filename)
+{
+  return make_snapshot(comp, filename);
+}
+
+/*
+ * Preprocess a file and save its tokens to a token stream, to be
+ * compiled or output later without preprocessing it again.
+ */
+int sp_comp_save_token_stream(struct sp_compiler *comp, const char *filename, const char *stream_filename)
+{
+  if (prepare_spec(comp) < 0)
+    return -1;
+  sp_clear_mem_pool(&comp->pool);
+
+  comp->ast = sp_new_ast(&comp->pool, &comp->prog->src_file_names);
+  struct sp_pp_token_list *tokens = sp_new_pp_token_list(&comp->pool, 0);
+  if (! comp->ast || ! tokens) {
+    comp->ast = NULL;
+    sp_clear_mem_pool(&comp->pool);
+    return sp_set_error(comp->prog, "out of memory");
+  }
+
+  struct sp_preprocessor pp;
+  if (start_file(comp, &pp, comp->ast, filename) < 0)
+    goto err;
+
+  struct sp_pp_token tok;
+  while (true) {
+    if (sp_next_pp_token(comp->pp, &tok) < 0)
+      goto err;
+    if (pp_tok_is_eof(&tok))
+      break;
+    if (sp_append_pp_token(tokens, &tok) < 0) {
+      sp_set_error(comp->prog, "out of memory");
+      goto err;
+    }
+  }
+
+  if (sp_write_pp_stream(comp->pp, tokens, tok.loc, stream_filename) < 0)
+    goto err;
+
+  comp->ast = NULL;
+  sp_destroy_preprocessor(comp->pp);
+  sp_stop_pp_spec(&comp->spec);
+  sp_unmap_pp_stream(&comp->stream);
+  sp_clear_mem_pool(&comp->pool);
+  return 0;
+
+ err:
+  comp->ast = NULL;
+  sp_destroy_preprocessor(comp->pp);
+  sp_stop_pp_spec(&comp->spec);
+  sp_unmap_pp_stream(&comp->stream);
+  sp_clear_mem_pool(&comp->pool);
+  return -1;
+}
+
+static void print_make_path(const char *path)
+{
+  for (const char *p = path; *p != '\0'; p++) {
+    if (*p == ' ' || *p == '#')
+      printf("\\");
+    else if (*p == '$')
+      printf("$");
+    printf("%c", *p);
+  }
+}
+
+static void print_make_deps(struct sp_preprocessor *pp, const char *filename)
+{
+  // the target is the object file of the source, in the current directory
+  const char *base = strrchr(filename, '/');
+  base = (base) ? base + 1 : filename;
+  const char *ext = strrchr(base, '.');
+  int base_len = (ext) ? (int) (ext - base) : (int) strlen(base);
+  printf("%.*s.o: ", base_len, base);
+  print_make_path(filename);
+  for (struct sp_pp_include_file *file = pp->include_file_list; file; file = file->next) {
+    printf(" \\\n  ");
+    print_make_path(file->path);
+  }
+  printf("\n");
+}
+
+static void print_json_string(const char *str)
+{
+  printf("\"");
+  for (const unsigned char *p = (const unsigned char *) str; *p != '\0'; p++) {
+    if (*p == '"' || *p == '\\')
+      printf("\\%c", *p);
+    else if (*p < 0x20)
+      printf("\\u%04x", *p);
+    else
+      printf("%c", *p);
+  }
+  printf("\"");
+}
+
+static void print_json_deps(struct sp_preprocessor *pp, const char *filename)
+{
+  printf("{\n  \"file\": ");
+  print_json_string(filename);
+  printf(",\n  \"includes\": [");
+  for (struct sp_pp_include_file *file = pp->include_file_list; file; file = file->next) {
+    printf((file == pp->include_file_list) ? "\n    " : ",\n    ");
+    print_json_string(file->path);
+  }
+  printf((pp->include_file_list) ? "\n  ]\n}\n" : "]\n}\n");
+}
+
+/*
+ * Print the files included by a source file.  Only the directives are
+ * run: lines of text are skipped without being expanded, and files
+ * are read in their directive-only form, made once per program.
+ */
+int sp_comp_scan_file(struct sp_compiler *comp, const char *filename, enum sp_deps_format format)
+{
+  sp_clear_mem_pool(&comp->pool);
+
+  comp->ast = sp_new_ast(&comp->pool, &comp->prog->src_file_names);
+  if (! comp->ast) {
+    sp_clear_mem_pool(&comp->pool);
+    return sp_set_error(comp->prog, "out of memory");
+  }
+
+  struct sp_preprocessor pp;
+  if (start_preprocessor(comp, &pp, comp->ast) < 0)
+    goto err;
+  pp.scan_only = true;
+
+  if (sp_set_preprocessor_io(comp->pp, filename, comp->ast) < 0)
+    goto err;
+
+  struct sp_pp_token tok;
+  do {
+    if (sp_next_pp_token(comp->pp, &tok) < 0)
+      goto err;
+  } while (! pp_tok_is_eof(&tok));
+
+  switch (format) {
+  case SP_DEPS_MAKE: print_make_deps(comp->pp, filename); break;
+  case SP_DEPS_JSON: print_json_deps(comp->pp, filename); break;
+  }
+
+  comp->ast = NULL;
+  sp_destroy_preprocessor(comp->pp);
+  sp_clear_mem_pool(&comp->pool);
+  return 0;
+
  err:
   comp->ast = NULL;
   sp_destroy_preprocessor(comp->pp);
@@ -105,15 +549,14 @@ int sp_comp_preprocess_file(struct sp_compiler *comp, const char *filename)
 
 int sp_comp_compile_file(struct sp_compiler *comp, const char *filename, struct sp_ast *ast)
 {
+  if (prepare_spec(comp) < 0)
+    return -1;
   sp_clear_mem_pool(&comp->pool);
 
   comp->ast = ast;
   
   struct sp_preprocessor pp;
-  comp->pp = &pp;
-  sp_init_preprocessor(comp->pp, comp, &comp->pool);
-
-  if (sp_set_preprocessor_io(comp->pp, filename, ast) < 0)
+  if (start_file(comp, &pp, ast, filename) < 0)
     goto err;
 
   struct sp_token tok;
@@ -128,12 +571,16 @@ int sp_comp_compile_file(struct sp_compiler *comp, const char *filename, struct
 
   comp->ast = NULL;
   sp_destroy_preprocessor(comp->pp);
+  sp_stop_pp_spec(&comp->spec);
+  sp_unmap_pp_stream(&comp->stream);
   sp_clear_mem_pool(&comp->pool);
   return 0;
       
  err:
   comp->ast = NULL;
   sp_destroy_preprocessor(comp->pp);
+  sp_stop_pp_spec(&comp->spec);
+  sp_unmap_pp_stream(&comp->stream);
   sp_clear_mem_pool(&comp->pool);
   return -1;
 }
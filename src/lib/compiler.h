@@ -4,12 +4,29 @@
 #define COMPILER_H_FILE
 
 #include "internal.h"
+#include "pp_profile.h"
+#include "pp_scan.h"
+#include "pp_pch.h"
+#include "pp_skip.h"
+#include "pp_spec.h"
+#include "pp_stream.h"
 
 struct sp_include_search_dir {
   struct sp_include_search_dir *next;
   char dir[];
 };
 
+/*
+ * The state of a preprocessor after reading a prelude, that every file
+ * preprocessed starts from (see sp_comp_set_prelude()).
+ */
+struct sp_pp_snapshot {
+  struct sp_mem_pool pool;
+  struct sp_ast *ast;
+  struct sp_preprocessor *pp;  // NULL if there's no snapshot
+  bool no_prelude;             // made only for speculative preprocessing
+};
+
 struct sp_compiler {
   struct sp_program *prog;
   struct sp_mem_pool pool;
@@ -18,12 +35,32 @@ struct sp_compiler {
 
   struct sp_include_search_dir *sys_include_search_dirs;
   struct sp_include_search_dir *user_include_search_dirs;
+  enum sp_macro_engine macro_engine;
+  bool macro_memo;
+  struct sp_macro_memo_stats macro_memo_stats;
+  struct sp_include_stats include_stats;
+  bool macro_profile;
+  struct sp_pp_profile profile;
+  struct sp_pp_scan_cache scan_cache;
+  struct sp_pp_skip_index skip_index;
+  struct sp_pp_pch pch;  // state every file starts from, if mapped
+  struct sp_pp_snapshot prelude;  // used instead of 'pch' if set
+  int spec_threads;               // threads to preprocess headers ahead, 0 if disabled
+  struct sp_pp_spec spec;
+  bool token_stream_input;        // files to preprocess are token streams
+  struct sp_pp_stream stream;     // token stream being read
 };
 
 int sp_init_compiler(struct sp_compiler *comp, struct sp_program *prog);
 void sp_destroy_compiler(struct sp_compiler *comp);
 int sp_comp_add_include_search_dir(struct sp_compiler *comp, const char *dir, bool is_system);
 int sp_comp_preprocess_file(struct sp_compiler *comp, const char *filename);
+int sp_comp_write_preprocessed_file(struct sp_compiler *comp, const char *filename, int fd);
+int sp_comp_use_pch(struct sp_compiler *comp, const char *filename);
+int sp_comp_save_pch(struct sp_compiler *comp, const char *prelude_filename, const char *filename);
+int sp_comp_set_prelude(struct sp_compiler *comp, const char *filename);
+int sp_comp_save_token_stream(struct sp_compiler *comp, const char *filename, const char *stream_filename);
+int sp_comp_scan_file(struct sp_compiler *comp, const char *filename, enum sp_deps_format format);
 int sp_comp_compile_file(struct sp_compiler *comp, const char *filename, struct sp_ast *ast);
 
 #endif /* COMPILER_H_FILE */
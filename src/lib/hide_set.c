@@ -0,0 +1,261 @@
+/* hide_set.c */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "hide_set.h"
+
+#define CACHE_SLOT(hs1, hs2) ((((unsigned) (hs1) * 31) ^ (unsigned) (hs2)) & (HIDE_SET_CACHE_SIZE-1))
+
+void sp_init_hide_set_table(struct sp_hide_set_table *t, struct sp_mem_pool *pool)
+{
+  t->pool = pool;
+  t->sets = NULL;
+  t->len = 1;  // the empty set is implicit
+  t->cap = 0;
+  t->slots = NULL;
+  t->n_slots = 0;
+  memset(t->union_cache, 0, sizeof(t->union_cache));
+  memset(t->intersection_cache, 0, sizeof(t->intersection_cache));
+}
+
+void sp_clear_hide_set_table(struct sp_hide_set_table *t)
+{
+  // cheap when no set was ever created, which is always the case with the default engine
+  if (t->len > 1)
+    sp_init_hide_set_table(t, t->pool);
+}
+
+static uint32_t get_priority(sp_string_id name)
+{
+  uint32_t h = (uint32_t) name;
+  h = (h ^ (h >> 16)) * 0x45d9f3b;
+  h = (h ^ (h >> 16)) * 0x45d9f3b;
+  return h ^ (h >> 16);
+}
+
+/*
+ * Check if 'name1' goes above 'name2' in a tree.  Priorities are
+ * scrambled names, so trees stay balanced when names are added in
+ * order, which is the usual case.
+ */
+static bool is_above(sp_string_id name1, sp_string_id name2)
+{
+  uint32_t prio1 = get_priority(name1);
+  uint32_t prio2 = get_priority(name2);
+  return prio1 > prio2 || (prio1 == prio2 && name1 > name2);
+}
+
+static uint32_t hash_hide_set(sp_string_id name, sp_hide_set_id left, sp_hide_set_id right)
+{
+  uint32_t h = (uint32_t) name * 0x9e3779b1;
+  h = (h ^ left) * 0x85ebca6b;
+  h = (h ^ right) * 0xc2b2ae35;
+  return h ^ (h >> 16);
+}
+
+static int grow_hide_set_table(struct sp_hide_set_table *t)
+{
+  if (t->cap > INT32_MAX/4)
+    return -1;
+  int new_cap = (t->cap == 0) ? 64 : 2*t->cap;
+  struct sp_hide_set *new_sets = sp_malloc(t->pool, new_cap * sizeof(struct sp_hide_set));
+  sp_hide_set_id *new_slots = sp_malloc(t->pool, 2*new_cap * sizeof(sp_hide_set_id));
+  if (! new_sets || ! new_slots)
+    return -1;
+  if (t->sets) {
+    memcpy(new_sets, t->sets, t->len * sizeof(struct sp_hide_set));
+    sp_free(t->pool, t->sets);
+    sp_free(t->pool, t->slots);
+  }
+  t->sets = new_sets;
+  t->cap = new_cap;
+  t->slots = new_slots;
+  t->n_slots = 2*new_cap;
+
+  memset(t->slots, 0, t->n_slots * sizeof(sp_hide_set_id));
+  for (int id = 1; id < t->len; id++) {
+    struct sp_hide_set *set = &t->sets[id];
+    uint32_t i = hash_hide_set(set->name, set->left, set->right) & (t->n_slots-1);
+    while (t->slots[i] != 0)
+      i = (i+1) & (t->n_slots-1);
+    t->slots[i] = id;
+  }
+  return 0;
+}
+
+/*
+ * Return the id of the node with the given name and subtrees, adding
+ * it if it's new.
+ */
+static int intern_hide_set(struct sp_hide_set_table *t, sp_string_id name, sp_hide_set_id left, sp_hide_set_id right)
+{
+  if (t->len >= t->cap && grow_hide_set_table(t) < 0)
+    return -1;
+
+  uint32_t i = hash_hide_set(name, left, right) & (t->n_slots-1);
+  while (t->slots[i] != 0) {
+    struct sp_hide_set *set = &t->sets[t->slots[i]];
+    if (set->name == name && set->left == left && set->right == right)
+      return t->slots[i];
+    i = (i+1) & (t->n_slots-1);
+  }
+
+  int new_id = t->len++;
+  t->sets[new_id] = (struct sp_hide_set) { name, left, right };
+  t->slots[i] = new_id;
+  return new_id;
+}
+
+bool sp_hide_set_contains(struct sp_hide_set_table *t, sp_hide_set_id hs, sp_string_id name)
+{
+  while (hs != SP_EMPTY_HIDE_SET) {
+    struct sp_hide_set *set = &t->sets[hs];
+    if (set->name == name)
+      return true;
+    hs = (name < set->name) ? set->left : set->right;
+  }
+  return false;
+}
+
+/*
+ * Split a set into the names less than and greater than 'name'.
+ * Returns 1 if 'name' is in the set, 0 if not, or -1 on error.
+ */
+static int split_hide_set(struct sp_hide_set_table *t, sp_hide_set_id hs, sp_string_id name, sp_hide_set_id *ret_left, sp_hide_set_id *ret_right)
+{
+  if (hs == SP_EMPTY_HIDE_SET) {
+    *ret_left = *ret_right = SP_EMPTY_HIDE_SET;
+    return 0;
+  }
+  struct sp_hide_set set = t->sets[hs];  // copied, since 't->sets' may move
+  if (name == set.name) {
+    *ret_left = set.left;
+    *ret_right = set.right;
+    return 1;
+  }
+  sp_hide_set_id left, right;
+  int found;
+  if (name < set.name) {
+    found = split_hide_set(t, set.left, name, ret_left, &left);
+    int new_right = (found < 0) ? -1 : intern_hide_set(t, set.name, left, set.right);
+    if (new_right < 0)
+      return -1;
+    *ret_right = (sp_hide_set_id) new_right;
+  } else {
+    found = split_hide_set(t, set.right, name, &right, ret_right);
+    int new_left = (found < 0) ? -1 : intern_hide_set(t, set.name, set.left, right);
+    if (new_left < 0)
+      return -1;
+    *ret_left = (sp_hide_set_id) new_left;
+  }
+  return found;
+}
+
+/*
+ * Join two sets, all names of 'hs1' being less than those of 'hs2'.
+ */
+static int join_hide_sets(struct sp_hide_set_table *t, sp_hide_set_id hs1, sp_hide_set_id hs2)
+{
+  if (hs1 == SP_EMPTY_HIDE_SET)
+    return hs2;
+  if (hs2 == SP_EMPTY_HIDE_SET)
+    return hs1;
+  struct sp_hide_set s1 = t->sets[hs1];
+  struct sp_hide_set s2 = t->sets[hs2];
+  if (is_above(s1.name, s2.name)) {
+    int right = join_hide_sets(t, s1.right, hs2);
+    return (right < 0) ? -1 : intern_hide_set(t, s1.name, s1.left, right);
+  }
+  int left = join_hide_sets(t, hs1, s2.left);
+  return (left < 0) ? -1 : intern_hide_set(t, s2.name, left, s2.right);
+}
+
+static int union_hide_sets(struct sp_hide_set_table *t, sp_hide_set_id hs1, sp_hide_set_id hs2)
+{
+  if (hs1 == hs2 || hs2 == SP_EMPTY_HIDE_SET)
+    return hs1;
+  if (hs1 == SP_EMPTY_HIDE_SET)
+    return hs2;
+  struct sp_hide_set top = t->sets[hs1];
+  if (is_above(t->sets[hs2].name, top.name)) {
+    top = t->sets[hs2];
+    hs2 = hs1;
+  }
+  sp_hide_set_id left2, right2;
+  if (split_hide_set(t, hs2, top.name, &left2, &right2) < 0)
+    return -1;
+  int left = union_hide_sets(t, top.left, left2);
+  int right = (left < 0) ? -1 : union_hide_sets(t, top.right, right2);
+  return (right < 0) ? -1 : intern_hide_set(t, top.name, left, right);
+}
+
+static int intersect_hide_sets(struct sp_hide_set_table *t, sp_hide_set_id hs1, sp_hide_set_id hs2)
+{
+  if (hs1 == hs2)
+    return hs1;
+  if (hs1 == SP_EMPTY_HIDE_SET || hs2 == SP_EMPTY_HIDE_SET)
+    return SP_EMPTY_HIDE_SET;
+  struct sp_hide_set top = t->sets[hs1];
+  if (is_above(t->sets[hs2].name, top.name)) {
+    top = t->sets[hs2];
+    hs2 = hs1;
+  }
+  sp_hide_set_id left2, right2;
+  int found = split_hide_set(t, hs2, top.name, &left2, &right2);
+  if (found < 0)
+    return -1;
+  int left = intersect_hide_sets(t, top.left, left2);
+  int right = (left < 0) ? -1 : intersect_hide_sets(t, top.right, right2);
+  if (right < 0)
+    return -1;
+  if (found)
+    return intern_hide_set(t, top.name, left, right);
+  return join_hide_sets(t, left, right);
+}
+
+int sp_hide_set_add(struct sp_hide_set_table *t, sp_hide_set_id hs, sp_string_id name)
+{
+  if (sp_hide_set_contains(t, hs, name))
+    return hs;
+  int single = intern_hide_set(t, name, SP_EMPTY_HIDE_SET, SP_EMPTY_HIDE_SET);
+  if (single < 0)
+    return -1;
+  return sp_hide_set_union(t, hs, single);
+}
+
+int sp_hide_set_union(struct sp_hide_set_table *t, sp_hide_set_id hs1, sp_hide_set_id hs2)
+{
+  if (hs1 == hs2 || hs2 == SP_EMPTY_HIDE_SET)
+    return hs1;
+  if (hs1 == SP_EMPTY_HIDE_SET)
+    return hs2;
+
+  struct sp_hide_set_cache_entry *cache = &t->union_cache[CACHE_SLOT(hs1, hs2)];
+  if (cache->hs1 == hs1 && cache->hs2 == hs2)
+    return cache->result;
+
+  int result = union_hide_sets(t, hs1, hs2);
+  if (result < 0)
+    return -1;
+  *cache = (struct sp_hide_set_cache_entry) { hs1, hs2, (sp_hide_set_id) result };
+  return result;
+}
+
+int sp_hide_set_intersection(struct sp_hide_set_table *t, sp_hide_set_id hs1, sp_hide_set_id hs2)
+{
+  if (hs1 == hs2)
+    return hs1;
+  if (hs1 == SP_EMPTY_HIDE_SET || hs2 == SP_EMPTY_HIDE_SET)
+    return SP_EMPTY_HIDE_SET;
+
+  struct sp_hide_set_cache_entry *cache = &t->intersection_cache[CACHE_SLOT(hs1, hs2)];
+  if (cache->hs1 == hs1 && cache->hs2 == hs2)
+    return cache->result;
+
+  int result = intersect_hide_sets(t, hs1, hs2);
+  if (result < 0)
+    return -1;
+  *cache = (struct sp_hide_set_cache_entry) { hs1, hs2, (sp_hide_set_id) result };
+  return result;
+}
@@ -0,0 +1,65 @@
+/* hide_set.h */
+
+#ifndef HIDE_SET_H_FILE
+#define HIDE_SET_H_FILE
+
+#include "internal.h"
+
+typedef uint32_t sp_hide_set_id;
+
+#define SP_EMPTY_HIDE_SET      0
+#define HIDE_SET_CACHE_SIZE    1024
+
+/*
+ * A node of a hide set tree: the set of 'name' and the names of its
+ * subtrees.
+ */
+struct sp_hide_set {
+  sp_string_id name;
+  sp_hide_set_id left;   // names less than 'name'
+  sp_hide_set_id right;  // names greater than 'name'
+};
+
+struct sp_hide_set_cache_entry {
+  sp_hide_set_id hs1;
+  sp_hide_set_id hs2;
+  sp_hide_set_id result;
+};
+
+/*
+ * Hide sets (sets of macro names, as in Prosser's expansion algorithm)
+ * are interned, so each distinct set is stored once and known by a
+ * 32-bit id.  Unions and intersections are memoized in small
+ * direct-mapped caches.
+ *
+ * A set is stored as a treap whose priorities come from the names, so
+ * it has one shape whatever order its names were added in, and whose
+ * nodes are interned, so its id is the id of its root.  Adding a name
+ * makes a new path to it and shares the rest of the tree, so a chain
+ * of N macros expanding each other takes O(N log N) space instead of
+ * O(N^2).  Unions and intersections split and join trees, and stop at
+ * subtrees the two sets share.
+ *
+ * All sets live in 'pool' and are forgotten by
+ * sp_clear_hide_set_table(), which must be called when the pool is
+ * cleared.
+ */
+struct sp_hide_set_table {
+  struct sp_mem_pool *pool;
+  struct sp_hide_set *sets;  // by id
+  int len;
+  int cap;
+  sp_hide_set_id *slots;     // hash table of the ids of 'sets', 0 in free slots
+  int n_slots;
+  struct sp_hide_set_cache_entry union_cache[HIDE_SET_CACHE_SIZE];
+  struct sp_hide_set_cache_entry intersection_cache[HIDE_SET_CACHE_SIZE];
+};
+
+void sp_init_hide_set_table(struct sp_hide_set_table *t, struct sp_mem_pool *pool);
+void sp_clear_hide_set_table(struct sp_hide_set_table *t);
+bool sp_hide_set_contains(struct sp_hide_set_table *t, sp_hide_set_id hs, sp_string_id name);
+int sp_hide_set_add(struct sp_hide_set_table *t, sp_hide_set_id hs, sp_string_id name);
+int sp_hide_set_union(struct sp_hide_set_table *t, sp_hide_set_id hs1, sp_hide_set_id hs2);
+int sp_hide_set_intersection(struct sp_hide_set_table *t, sp_hide_set_id hs1, sp_hide_set_id hs2);
+
+#endif /* HIDE_SET_H_FILE */
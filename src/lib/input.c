@@ -4,9 +4,27 @@
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
+#include <sys/stat.h>
 
 #include "input.h"
 
+static struct sp_input *new_input(size_t size)
+{
+  struct sp_input *in = malloc(sizeof(struct sp_input) + size);
+  if (! in)
+    return NULL;
+  in->next = NULL;
+  in->size = size;
+  in->pos = 0;
+  in->file_id = -1;
+  in->loc_base = 0;
+  in->include_file = NULL;
+  in->skips = NULL;
+  in->guard_state = SP_INPUT_GUARD_NONE;
+  in->guard_id = -1;
+  return in;
+}
+
 struct sp_input *sp_new_input_from_file(const char *filename)
 {
   FILE *f = fopen(filename, "r");
@@ -20,7 +38,7 @@ struct sp_input *sp_new_input_from_file(const char *filename)
   if (fseek(f, 0, SEEK_SET) < 0)
     goto err;
   
-  struct sp_input *in = malloc(sizeof(struct sp_input) + size);
+  struct sp_input *in = new_input(size);
   if (! in)
     goto err;
   
@@ -28,11 +46,6 @@ struct sp_input *sp_new_input_from_file(const char *filename)
     free(in);
     goto err;
   }
-  
-  in->next = NULL;
-  in->size = size;
-  in->pos = 0;
-  in->file_id = -1;
   fclose(f);
   return in;
 
@@ -41,6 +54,26 @@ struct sp_input *sp_new_input_from_file(const char *filename)
   return NULL;
 }
 
+struct sp_input *sp_new_input_from_data(const void *data, size_t size)
+{
+  struct sp_input *in = new_input(size);
+  if (! in)
+    return NULL;
+  memcpy(in->data, data, size);
+  return in;
+}
+
+bool sp_get_file_identity(const char *filename, struct sp_file_identity *ret)
+{
+  struct stat st;
+  if (stat(filename, &st) != 0 || ! S_ISREG(st.st_mode))
+    return false;
+  memset(ret, 0, sizeof(*ret));  // the key is hashed as bytes
+  ret->dev = (uint64_t) st.st_dev;
+  ret->ino = (uint64_t) st.st_ino;
+  return true;
+}
+
 void sp_free_input(struct sp_input *in)
 {
   free(in);
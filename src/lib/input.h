@@ -5,16 +5,48 @@
 
 #include <stdint.h>
 
+#include "internal.h"
+
+struct sp_pp_include_file;
+struct sp_pp_skip_file;
+
+/*
+ * State of the detection of an include guard: the file must be a
+ * single '#ifndef' group, with nothing before or after it.
+ */
+enum sp_input_guard_state {
+  SP_INPUT_GUARD_START,     // nothing read yet
+  SP_INPUT_GUARD_IN_GROUP,  // inside the '#ifndef' group
+  SP_INPUT_GUARD_ENDED,     // after its '#endif'
+  SP_INPUT_GUARD_NONE,      // not guarded
+};
+
 struct sp_input {
   struct sp_input *next;
   uint16_t file_id;
+  sp_src_loc_id loc_base;
   int base_cond_level;
+  struct sp_pp_include_file *include_file;  // NULL if not included
+  struct sp_pp_skip_file *skips;            // groups skipped before, or NULL if not kept
+  enum sp_input_guard_state guard_state;
+  sp_string_id guard_id;
   size_t size;
   size_t pos;
   unsigned char data[];
 };
 
+/*
+ * What identifies a file in the file system, whatever path is used to
+ * reach it.
+ */
+struct sp_file_identity {
+  uint64_t dev;
+  uint64_t ino;
+};
+
 struct sp_input *sp_new_input_from_file(const char *filename);
+struct sp_input *sp_new_input_from_data(const void *data, size_t size);
+bool sp_get_file_identity(const char *filename, struct sp_file_identity *ret);
 void sp_free_input(struct sp_input *in);
 
 #define sp_get_input_file_id(in)  ((in)->file_id)
@@ -10,6 +10,13 @@
 #define ARRAY_SIZE(a)  ((int)(sizeof(a)/sizeof((a)[0])))
 #define UNUSED(v)      ((void)(v))
 
+// for static buffers used by functions called from worker threads
+#if defined(__GNUC__)
+#define SP_THREAD_LOCAL __thread
+#else
+#define SP_THREAD_LOCAL
+#endif
+
 struct sp_src_loc {
   uint16_t line;
   uint16_t col;
@@ -18,6 +25,8 @@ struct sp_src_loc {
 
 #define sp_make_src_loc(f, l, c) ((struct sp_src_loc) { .file_id = (f), .line = (l), .col = (c) })
 
+typedef uint32_t sp_src_loc_id;
+
 uint32_t sp_hash(const void *data, size_t len);
 int sp_utf8_len(char *str, size_t size);
 void sp_dump_string(const char *str);
@@ -101,6 +101,22 @@ void *sp_malloc(struct sp_mem_pool *p, size_t size)
   goto again;
 }
 
+bool sp_extend(struct sp_mem_pool *p, void *data, size_t old_size, size_t new_size)
+{
+  if (! p || ! p->page_list)
+    return false;
+
+  // only the last block allocated from the current page can grow in place
+  struct sp_mem_page *page = p->page_list;
+  old_size = ALIGN(old_size);
+  new_size = ALIGN(new_size);
+  if ((char *) data + old_size != page->free || page->free_size < new_size - old_size)
+    return false;
+  page->free += new_size - old_size;
+  page->free_size -= new_size - old_size;
+  return true;
+}
+
 void *sp_realloc(struct sp_mem_pool *p, void *old_data, size_t size)
 {
   if (! p) {
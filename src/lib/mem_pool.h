@@ -4,6 +4,7 @@
 #define MEM_POOL_H_FILE
 
 #include <stddef.h>
+#include <stdbool.h>
 
 struct sp_mem_page;
 
@@ -17,6 +18,7 @@ void sp_destroy_mem_pool(struct sp_mem_pool *p);
 void sp_clear_mem_pool(struct sp_mem_pool *p);
 void *sp_malloc(struct sp_mem_pool *p, size_t size);
 void *sp_realloc(struct sp_mem_pool *p, void *data, size_t size);
+bool sp_extend(struct sp_mem_pool *p, void *data, size_t old_size, size_t new_size);
 
 #define sp_free(p, data) sp_realloc((p), (data), 0)
 
@@ -0,0 +1,463 @@
+/* pp_cond_expr.c
+ *
+ * Evaluation of the controlling expression of '#if' and '#elif'
+ * [6.10.1], after macro expansion and replacement of 'defined'.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "preprocessor.h"
+#include "pp_token.h"
+#include "punct.h"
+
+#define MAX_COND_EXPR_DEPTH 256
+#define VALUE_BITS          ((intmax_t) sizeof(uintmax_t) * 8)
+
+/*
+ * A value is computed in the bits of an uintmax_t, read as intmax_t
+ * when it's signed.  Arithmetic is always done unsigned, so signed
+ * overflow wraps instead of being undefined.
+ */
+struct cond_value {
+  uintmax_t val;
+  bool is_unsigned;
+};
+
+struct cond_eval {
+  struct sp_preprocessor *pp;
+  struct sp_pp_token *toks;
+  int n_toks;
+  int pos;
+  int skip;   // > 0 while evaluating an operand whose value is not used
+  int depth;
+};
+
+/*
+ * Binary operators, by precedence.  '?:' and ',' have lower
+ * precedence than all of these and are parsed apart.
+ */
+static const struct cond_binary_op {
+  int32_t punct_id;
+  int prec;
+} cond_binary_ops[] = {
+  { '*',          10 },
+  { '/',          10 },
+  { '%',          10 },
+  { '+',           9 },
+  { '-',           9 },
+  { PUNCT_LSHIFT,  8 },
+  { PUNCT_RSHIFT,  8 },
+  { '<',           7 },
+  { '>',           7 },
+  { PUNCT_LEQ,     7 },
+  { PUNCT_GEQ,     7 },
+  { PUNCT_EQ,      6 },
+  { PUNCT_NEQ,     6 },
+  { '&',           5 },
+  { '^',           4 },
+  { '|',           3 },
+  { PUNCT_AND,     2 },
+  { PUNCT_OR,      1 },
+};
+
+#define SIGNED(v)      ((intmax_t) (v)->val)
+#define SET_BOOL(v, b) ((v)->val = (b) ? 1 : 0, (v)->is_unsigned = false)
+
+static int eval_comma(struct cond_eval *ev, struct cond_value *ret);
+
+static const struct cond_binary_op *get_binary_op(struct sp_pp_token *tok)
+{
+  if (! pp_tok_is_any_punct(tok))
+    return NULL;
+  for (int i = 0; i < ARRAY_SIZE(cond_binary_ops); i++) {
+    if (cond_binary_ops[i].punct_id == tok->data.punct_id)
+      return &cond_binary_ops[i];
+  }
+  return NULL;
+}
+
+#define PEEK(ev)  (((ev)->pos < (ev)->n_toks) ? &(ev)->toks[(ev)->pos] : NULL)
+
+static int set_error_at_token(struct cond_eval *ev, struct sp_pp_token *tok, const char *msg)
+{
+  if (! tok)
+    tok = (ev->n_toks > 0) ? &ev->toks[ev->n_toks-1] : NULL;
+  if (! tok)
+    return sp_set_pp_error(ev->pp, "%s", msg);
+  return sp_set_pp_error_at(ev->pp, tok->loc, "%s", msg);
+}
+
+static int parse_number(struct cond_eval *ev, struct sp_pp_token *tok, struct cond_value *ret)
+{
+  const char *str = sp_get_pp_token_string(ev->pp, tok);
+  const char *p = str;
+  int base = 10;
+  if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    base = 16;
+    p += 2;
+  } else if (p[0] == '0')
+    base = 8;
+
+  uintmax_t val = 0;
+  bool overflow = false;
+  int n_digits = 0;
+  while (true) {
+    int digit;
+    if (*p >= '0' && *p <= '9')
+      digit = *p - '0';
+    else if (base == 16 && *p >= 'a' && *p <= 'f')
+      digit = *p - 'a' + 10;
+    else if (base == 16 && *p >= 'A' && *p <= 'F')
+      digit = *p - 'A' + 10;
+    else
+      break;
+    if (digit >= base)
+      return sp_set_pp_error_at(ev->pp, tok->loc, "invalid digit in octal constant '%s'", str);
+    if (val > (UINTMAX_MAX - digit) / base)
+      overflow = true;
+    val = val * base + digit;
+    n_digits++;
+    p++;
+  }
+
+  // suffix: 'u' and 'l'/'ll' in any order
+  bool is_unsigned = false;
+  int n_longs = 0;
+  while (*p) {
+    if ((*p == 'u' || *p == 'U') && ! is_unsigned) {
+      is_unsigned = true;
+      p++;
+    } else if ((*p == 'l' || *p == 'L') && n_longs == 0) {
+      n_longs = (p[1] == p[0]) ? 2 : 1;
+      p += n_longs;
+    } else
+      break;
+  }
+
+  if (*p != '\0' || n_digits == 0) {
+    if (base != 16 && strpbrk(str, ".eE"))
+      return sp_set_pp_error_at(ev->pp, tok->loc, "floating constant in preprocessor expression: '%s'", str);
+    return sp_set_pp_error_at(ev->pp, tok->loc, "invalid integer constant: '%s'", str);
+  }
+  if (overflow)
+    return sp_set_pp_error_at(ev->pp, tok->loc, "integer constant is too large: '%s'", str);
+
+  // constants that don't fit in intmax_t are unsigned
+  ret->val = val;
+  ret->is_unsigned = is_unsigned || val > INTMAX_MAX;
+  return 0;
+}
+
+static uint32_t read_char_const_char(const char **pstr)
+{
+  const char *p = *pstr;
+  uint32_t c;
+  if (*p != '\\') {
+    c = (unsigned char) *p++;
+    *pstr = p;
+    return c;
+  }
+
+  p++;
+  switch (*p) {
+  case 'n': c = '\n'; p++; break;
+  case 't': c = '\t'; p++; break;
+  case 'r': c = '\r'; p++; break;
+  case 'a': c = '\a'; p++; break;
+  case 'b': c = '\b'; p++; break;
+  case 'f': c = '\f'; p++; break;
+  case 'v': c = '\v'; p++; break;
+
+  case 'x':
+  case 'u':
+  case 'U':
+    {
+      int max_digits = (*p == 'x') ? 8 : (*p == 'u') ? 4 : 8;
+      p++;
+      c = 0;
+      for (int i = 0; i < max_digits; i++) {
+        if (*p >= '0' && *p <= '9')
+          c = c*16 + (*p - '0');
+        else if (*p >= 'a' && *p <= 'f')
+          c = c*16 + (*p - 'a' + 10);
+        else if (*p >= 'A' && *p <= 'F')
+          c = c*16 + (*p - 'A' + 10);
+        else
+          break;
+        p++;
+      }
+    }
+    break;
+
+  default:
+    if (*p >= '0' && *p <= '7') {
+      c = 0;
+      for (int i = 0; i < 3 && *p >= '0' && *p <= '7'; i++)
+        c = c*8 + (*p++ - '0');
+    } else
+      c = (unsigned char) *p++;  // \' \" \? \\ (the lexer rejects others)
+    break;
+  }
+  *pstr = p;
+  return c;
+}
+
+/*
+ * Character constants are evaluated as int like the compiler does:
+ * 'char' is signed, and each character of a multi-character constant
+ * takes 8 bits.
+ */
+static int parse_char_const(struct cond_eval *ev, struct sp_pp_token *tok, struct cond_value *ret)
+{
+  const char *str = sp_get_pp_token_string(ev->pp, tok);
+  const char *p = str;
+  char prefix = 0;
+  if (*p != '\'')
+    prefix = *p++;
+  if (*p == '8')
+    p++;
+  p++;  // '
+
+  uint32_t multi = 0;
+  uint32_t last = 0;
+  int n_chars = 0;
+  while (*p && *p != '\'') {
+    last = read_char_const_char(&p);
+    multi = (multi << 8) | (last & 0xff);
+    n_chars++;
+  }
+  if (n_chars == 0)
+    return sp_set_pp_error_at(ev->pp, tok->loc, "empty character constant");
+
+  intmax_t val;
+  switch (prefix) {
+  case 'L': val = (int32_t) last;  break;
+  case 'u': val = (uint16_t) last; break;
+  case 'U': val = last;            break;
+  default:  val = (n_chars == 1) ? (intmax_t) (signed char) last : (intmax_t) (int32_t) multi; break;
+  }
+  ret->val = (uintmax_t) val;
+  ret->is_unsigned = false;
+  return 0;
+}
+
+static int eval_unary(struct cond_eval *ev, struct cond_value *ret)
+{
+  struct sp_pp_token *tok = PEEK(ev);
+  if (! tok)
+    return set_error_at_token(ev, NULL, "expected value in conditional expression");
+  ev->pos++;
+
+  switch (tok->type) {
+  case TOK_PP_NUMBER:     return parse_number(ev, tok, ret);
+  case TOK_PP_CHAR_CONST: return parse_char_const(ev, tok, ret);
+
+  case TOK_PP_IDENTIFIER:
+    // identifiers left after macro expansion are 0
+    ret->val = 0;
+    ret->is_unsigned = false;
+    return 0;
+
+  case TOK_PP_PUNCT:
+    switch (tok->data.punct_id) {
+    case '(':
+      if (++ev->depth > MAX_COND_EXPR_DEPTH)
+        return set_error_at_token(ev, tok, "conditional expression is too deeply nested");
+      if (eval_comma(ev, ret) < 0)
+        return -1;
+      ev->depth--;
+      tok = PEEK(ev);
+      if (! tok || ! pp_tok_is_punct(tok, ')'))
+        return set_error_at_token(ev, tok, "expected ')' in conditional expression");
+      ev->pos++;
+      return 0;
+
+    case '+':
+    case '-':
+    case '~':
+    case '!':
+      if (++ev->depth > MAX_COND_EXPR_DEPTH)
+        return set_error_at_token(ev, tok, "conditional expression is too deeply nested");
+      if (eval_unary(ev, ret) < 0)
+        return -1;
+      ev->depth--;
+      switch (tok->data.punct_id) {
+      case '-': ret->val = -ret->val; break;
+      case '~': ret->val = ~ret->val; break;
+      case '!': SET_BOOL(ret, ret->val == 0); break;
+      }
+      return 0;
+    }
+    break;
+  }
+  return sp_set_pp_error_at(ev->pp, tok->loc, "invalid token in conditional expression: '%s'", sp_dump_pp_token(ev->pp, tok));
+}
+
+static uintmax_t shift_value(struct cond_value *left, intmax_t count, bool to_left)
+{
+  if (count < 0) {
+    count = (count < -INTMAX_MAX) ? INTMAX_MAX : -count;
+    to_left = ! to_left;
+  }
+  if (to_left)
+    return (count >= VALUE_BITS) ? 0 : left->val << count;
+  if (left->is_unsigned)
+    return (count >= VALUE_BITS) ? 0 : left->val >> count;
+  intmax_t s = SIGNED(left);
+  if (count >= VALUE_BITS)
+    return (s < 0) ? UINTMAX_MAX : 0;
+  return (s < 0) ? ~(~left->val >> count) : left->val >> count;
+}
+
+static int apply_binary_op(struct cond_eval *ev, struct sp_pp_token *op_tok, struct cond_value *left, struct cond_value *right)
+{
+  int32_t op = op_tok->data.punct_id;
+
+  // shifts have the type of the left operand
+  if (op == PUNCT_LSHIFT || op == PUNCT_RSHIFT) {
+    intmax_t count = (right->is_unsigned && right->val > INTMAX_MAX) ? INTMAX_MAX : SIGNED(right);
+    left->val = shift_value(left, count, op == PUNCT_LSHIFT);
+    return 0;
+  }
+
+  // usual arithmetic conversions
+  bool is_unsigned = left->is_unsigned || right->is_unsigned;
+  uintmax_t l = left->val;
+  uintmax_t r = right->val;
+
+  switch (op) {
+  case '*': left->val = l * r; break;
+  case '+': left->val = l + r; break;
+  case '-': left->val = l - r; break;
+  case '&': left->val = l & r; break;
+  case '^': left->val = l ^ r; break;
+  case '|': left->val = l | r; break;
+
+  case '/':
+  case '%':
+    if (r == 0) {
+      if (ev->skip > 0) {
+        left->val = 0;
+        break;
+      }
+      return sp_set_pp_error_at(ev->pp, op_tok->loc, "division by zero in conditional expression");
+    }
+    if (is_unsigned)
+      left->val = (op == '/') ? l / r : l % r;
+    else if ((intmax_t) l == INTMAX_MIN && (intmax_t) r == -1)
+      left->val = (op == '/') ? l : 0;  // overflow: wrap around
+    else
+      left->val = (uintmax_t) ((op == '/') ? (intmax_t) l / (intmax_t) r : (intmax_t) l % (intmax_t) r);
+    break;
+
+  case '<':       SET_BOOL(left, is_unsigned ? l <  r : (intmax_t) l <  (intmax_t) r); return 0;
+  case '>':       SET_BOOL(left, is_unsigned ? l >  r : (intmax_t) l >  (intmax_t) r); return 0;
+  case PUNCT_LEQ: SET_BOOL(left, is_unsigned ? l <= r : (intmax_t) l <= (intmax_t) r); return 0;
+  case PUNCT_GEQ: SET_BOOL(left, is_unsigned ? l >= r : (intmax_t) l >= (intmax_t) r); return 0;
+  case PUNCT_EQ:  SET_BOOL(left, l == r); return 0;
+  case PUNCT_NEQ: SET_BOOL(left, l != r); return 0;
+  }
+  left->is_unsigned = is_unsigned;
+  return 0;
+}
+
+/*
+ * Evaluate operators of precedence 'min_prec' or higher, by
+ * precedence climbing.
+ */
+static int eval_binary(struct cond_eval *ev, int min_prec, struct cond_value *ret)
+{
+  if (eval_unary(ev, ret) < 0)
+    return -1;
+
+  while (true) {
+    struct sp_pp_token *op_tok = PEEK(ev);
+    const struct cond_binary_op *op = (op_tok) ? get_binary_op(op_tok) : NULL;
+    if (! op || op->prec < min_prec)
+      return 0;
+    ev->pos++;
+
+    struct cond_value right;
+    if (op->punct_id == PUNCT_AND || op->punct_id == PUNCT_OR) {
+      // the right operand is not evaluated if the left one decides
+      bool left = (ret->val != 0);
+      bool skip_right = (op->punct_id == PUNCT_AND) ? ! left : left;
+      ev->skip += skip_right;
+      if (eval_binary(ev, op->prec + 1, &right) < 0)
+        return -1;
+      ev->skip -= skip_right;
+      SET_BOOL(ret, (op->punct_id == PUNCT_AND) ? left && right.val != 0 : left || right.val != 0);
+      continue;
+    }
+
+    if (eval_binary(ev, op->prec + 1, &right) < 0)
+      return -1;
+    if (apply_binary_op(ev, op_tok, ret, &right) < 0)
+      return -1;
+  }
+}
+
+static int eval_cond(struct cond_eval *ev, struct cond_value *ret)
+{
+  if (eval_binary(ev, 1, ret) < 0)
+    return -1;
+  struct sp_pp_token *tok = PEEK(ev);
+  if (! tok || ! pp_tok_is_punct(tok, '?'))
+    return 0;
+  ev->pos++;
+
+  bool cond = (ret->val != 0);
+  struct cond_value if_true, if_false;
+  ev->skip += ! cond;
+  if (eval_comma(ev, &if_true) < 0)
+    return -1;
+  ev->skip -= ! cond;
+  tok = PEEK(ev);
+  if (! tok || ! pp_tok_is_punct(tok, ':'))
+    return set_error_at_token(ev, tok, "expected ':' in conditional expression");
+  ev->pos++;
+  ev->skip += cond;
+  if (eval_cond(ev, &if_false) < 0)
+    return -1;
+  ev->skip -= cond;
+
+  *ret = (cond) ? if_true : if_false;
+  ret->is_unsigned = if_true.is_unsigned || if_false.is_unsigned;
+  return 0;
+}
+
+static int eval_comma(struct cond_eval *ev, struct cond_value *ret)
+{
+  if (eval_cond(ev, ret) < 0)
+    return -1;
+  while (true) {
+    struct sp_pp_token *tok = PEEK(ev);
+    if (! tok || ! pp_tok_is_punct(tok, ','))
+      return 0;
+    ev->pos++;
+    if (eval_cond(ev, ret) < 0)
+      return -1;
+  }
+}
+
+/*
+ * Evaluate the tokens of a conditional expression, where macros have
+ * been expanded and 'defined' operators replaced by their values.
+ */
+int sp_eval_pp_cond_expr(struct sp_preprocessor *pp, struct sp_pp_token *toks, int n_toks, bool *ret)
+{
+  struct cond_eval ev = {
+    .pp = pp,
+    .toks = toks,
+    .n_toks = n_toks,
+  };
+  struct cond_value val;
+  if (eval_comma(&ev, &val) < 0)
+    return -1;
+  if (ev.pos < n_toks)
+    return sp_set_pp_error_at(pp, toks[ev.pos].loc, "extra token in conditional expression: '%s'", sp_dump_pp_token(pp, &toks[ev.pos]));
+  *ret = (val.val != 0);
+  return 0;
+}
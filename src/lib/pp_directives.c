@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <inttypes.h>
+#include <limits.h>
 
 #include "preprocessor.h"
 #include "compiler.h"
@@ -55,7 +56,6 @@ static const struct pp_directive {
 #define IS_TOK_TYPE(t)         (pp->tok.type == t)
 #define IS_EOF()               IS_TOK_TYPE(TOK_PP_EOF)
 #define IS_END_OF_LIST()       IS_TOK_TYPE(TOK_PP_END_OF_LIST)
-#define IS_SPACE()             IS_TOK_TYPE(TOK_PP_SPACE)
 #define IS_NEWLINE()           IS_TOK_TYPE(TOK_PP_NEWLINE)
 #define IS_PP_HEADER_NAME()    IS_TOK_TYPE(TOK_PP_HEADER_NAME)
 #define IS_STRING()            IS_TOK_TYPE(TOK_PP_STRING)
@@ -149,7 +149,7 @@ static int read_expanded_directive_args(struct sp_preprocessor *pp, bool allow_h
 /* ================================================ */
 /* == #error ====================================== */
 
-static int process_error(struct sp_preprocessor *pp, struct sp_src_loc loc)
+static int process_error(struct sp_preprocessor *pp, sp_src_loc_id loc)
 {
   // read unexpanded tokens
   struct sp_pp_token_list *args = NULL;
@@ -166,6 +166,8 @@ static int process_error(struct sp_preprocessor *pp, struct sp_src_loc loc)
     size_t s_len = strlen(s);
     if (str_len + s_len + 2 < str_len || str_len + s_len + 2 > sizeof(str))
       return set_error(pp, "error message too long");
+    if (str_len > 0 && pp_tok_has_space(tok))
+      str[str_len++] = ' ';
     memcpy(str + str_len, s, s_len);
     str_len += s_len;
   }
@@ -176,11 +178,15 @@ static int process_error(struct sp_preprocessor *pp, struct sp_src_loc loc)
 /* ================================================ */
 /* == #include ==================================== */
 
-static struct sp_input *try_open_include_file(struct sp_preprocessor *pp, struct sp_src_loc loc, const char *filename)
+static struct sp_input *open_include_file(struct sp_preprocessor *pp, sp_src_loc_id loc, const char *filename)
 {
   //printf("-> trying '%s'\n", filename);
   
-  struct sp_input *in = sp_new_input_from_file(filename);
+  struct sp_input *in;
+  if (pp->scan_only)
+    in = sp_open_pp_scan_input(&pp->comp->scan_cache, filename);
+  else
+    in = sp_new_input_from_file(filename);
   if (! in) {
     set_error_at(pp, loc, "can't open file '%s'", filename);
     return NULL;
@@ -192,13 +198,157 @@ static struct sp_input *try_open_include_file(struct sp_preprocessor *pp, struct
     return NULL;
   }
   in->file_id = file_id;
+  in->loc_base = sp_add_ast_src_file(pp->ast, file_id, in->data, in->size);
+  if (in->loc_base == 0) {
+    sp_free_input(in);
+    set_error_at(pp, loc, "out of memory");
+    return NULL;
+  }
   return in;
 }
 
-static struct sp_input *try_open_include_file_at(struct sp_preprocessor *pp, struct sp_src_loc loc, const char *filename, const char *dir, size_t dir_len)
+static bool include_file_is_skipped(struct sp_preprocessor *pp, struct sp_pp_include_file *file)
+{
+  return file->once || (file->guard_id >= 0 && sp_get_macro(&pp->macros, file->guard_id));
+}
+
+static const char *add_include_file_path(struct sp_preprocessor *pp, struct sp_pp_include_file *file, const char *filename, size_t filename_len)
+{
+  char *path = sp_malloc(pp->pool, filename_len + 1);
+  if (! path)
+    return NULL;
+  memcpy(path, filename, filename_len + 1);
+  if (sp_add_ht_entry(&pp->include_files, path, filename_len, file) < 0)
+    return NULL;
+  return path;
+}
+
+static struct sp_pp_include_file *new_include_file(struct sp_preprocessor *pp, const struct sp_file_identity *identity, const char *filename, size_t filename_len)
+{
+  struct sp_pp_include_file *file = sp_malloc(pp->pool, sizeof(struct sp_pp_include_file));
+  if (! file)
+    return NULL;
+  file->identity = *identity;
+  file->guard_id = -1;
+  file->once = false;
+  file->next = NULL;
+  if (sp_add_ht_entry(&pp->include_file_ids, &file->identity, sizeof(file->identity), file) < 0)
+    return NULL;
+  file->path = add_include_file_path(pp, file, filename, filename_len);
+  if (! file->path)
+    return NULL;
+  *pp->include_file_list_end = file;
+  pp->include_file_list_end = &file->next;
+  return file;
+}
+
+/*
+ * Find the record of an included file, and open the file unless it
+ * must be skipped ('*ret_in' is then NULL).  A new path to a known
+ * file is recognized by the file identity, without reading the file.
+ */
+static struct sp_pp_include_file *try_open_include_file(struct sp_preprocessor *pp, sp_src_loc_id loc, const char *filename, struct sp_input **ret_in)
+{
+  size_t filename_len = strlen(filename);
+  struct sp_pp_include_file *file = sp_get_ht_value(&pp->include_files, filename, filename_len);
+  struct sp_file_identity identity;
+  if (! file) {
+    if (! sp_get_file_identity(filename, &identity)) {
+      set_error_at(pp, loc, "can't open file '%s'", filename);
+      return NULL;
+    }
+    file = sp_get_ht_value(&pp->include_file_ids, &identity, sizeof(identity));
+    if (file && ! add_include_file_path(pp, file, filename, filename_len))
+      goto err_oom;
+  }
+  if (file && include_file_is_skipped(pp, file)) {
+    *ret_in = NULL;
+    return file;
+  }
+
+  struct sp_input *in = open_include_file(pp, loc, filename);
+  if (! in)
+    return NULL;
+  if (! file) {
+    file = new_include_file(pp, &identity, filename, filename_len);
+    if (! file)
+      goto err_oom_in;
+  }
+  *ret_in = in;
+  return file;
+
+ err_oom_in:
+  sp_free_input(in);
+ err_oom:
+  set_error_at(pp, loc, "out of memory");
+  return NULL;
+}
+
+/*
+ * Return the record of a file not opened by '#include' (e.g., the
+ * prelude of a snapshot), adding it if the file was never included.
+ */
+static struct sp_pp_include_file *get_include_file(struct sp_preprocessor *pp, const char *filename, bool *ret_is_new)
+{
+  struct sp_file_identity identity;
+  if (! sp_get_file_identity(filename, &identity)) {
+    sp_set_error(pp->prog, "can't open file '%s'", filename);
+    return NULL;
+  }
+  struct sp_pp_include_file *file = sp_get_ht_value(&pp->include_file_ids, &identity, sizeof(identity));
+  *ret_is_new = (file == NULL);
+  if (file)
+    return file;
+
+  file = new_include_file(pp, &identity, filename, strlen(filename));
+  if (! file)
+    sp_set_error(pp->prog, "out of memory");
+  return file;
+}
+
+struct sp_pp_include_file *sp_get_pp_include_file(struct sp_preprocessor *pp, const char *filename)
+{
+  bool is_new;
+  return get_include_file(pp, filename, &is_new);
+}
+
+/*
+ * Add a path to the record of a file known by its identity, adding
+ * the record if the file was never included.  Returns NULL if out of
+ * memory.
+ */
+struct sp_pp_include_file *sp_add_pp_include_path(struct sp_preprocessor *pp, const struct sp_file_identity *identity, const char *filename)
+{
+  size_t filename_len = strlen(filename);
+  struct sp_pp_include_file *file = sp_get_ht_value(&pp->include_file_ids, identity, sizeof(*identity));
+  if (! file)
+    return new_include_file(pp, identity, filename, filename_len);
+  if (! sp_get_ht_value(&pp->include_files, filename, filename_len)
+      && ! add_include_file_path(pp, file, filename, filename_len))
+    return NULL;
+  return file;
+}
+
+/*
+ * Record a file as included with '#pragma once', so that including it
+ * does nothing.  This is used for the prelude of a snapshot, whose
+ * text is not part of the files preprocessed from it.
+ */
+int sp_add_pp_once_file(struct sp_preprocessor *pp, const char *filename)
+{
+  bool is_new;
+  struct sp_pp_include_file *file = get_include_file(pp, filename, &is_new);
+  if (! file)
+    return -1;
+  if (is_new)
+    file->once = true;
+  return 0;
+}
+
+static struct sp_pp_include_file *try_open_include_file_at(struct sp_preprocessor *pp, sp_src_loc_id loc, const char *filename, const char *dir, size_t dir_len, struct sp_input **ret_in)
 {
   if (! dir)
-    return try_open_include_file(pp, loc, filename);
+    return try_open_include_file(pp, loc, filename, ret_in);
 
   char path[1024];
 
@@ -216,14 +366,14 @@ static struct sp_input *try_open_include_file_at(struct sp_preprocessor *pp, str
   memcpy(path + len, filename, file_len);
   len += file_len;
   path[len] = '\0';
-  return try_open_include_file(pp, loc, path);
+  return try_open_include_file(pp, loc, path, ret_in);
 }
 
-static struct sp_input *search_include_file(struct sp_preprocessor *pp, struct sp_src_loc loc, const char *filename, const char *base_filename, bool is_system_header)
+static struct sp_pp_include_file *search_include_file(struct sp_preprocessor *pp, sp_src_loc_id loc, const char *filename, const char *base_filename, bool is_system_header, struct sp_input **ret_in)
 {
   // if filename is absolute, just try to open it
   if (filename[0] == '/' || filename[0] == '\\')
-    return try_open_include_file(pp, loc, filename);
+    return try_open_include_file(pp, loc, filename, ret_in);
 
   // if it's an "include", search the directory of the base file
   if (! is_system_header) {
@@ -241,32 +391,32 @@ static struct sp_input *search_include_file(struct sp_preprocessor *pp, struct s
       dir = NULL;
       dir_len = 0;
     }
-    struct sp_input *in = try_open_include_file_at(pp, loc, filename, dir, dir_len);
-    if (in)
-      return in;
+    struct sp_pp_include_file *file = try_open_include_file_at(pp, loc, filename, dir, dir_len, ret_in);
+    if (file)
+      return file;
   }
 
   // if it's an "include", search the user directories
   if (! is_system_header) {
     for (struct sp_include_search_dir *search = pp->comp->user_include_search_dirs; search != NULL; search = search->next) {
-      struct sp_input *in = try_open_include_file_at(pp, loc, filename, search->dir, strlen(search->dir));
-      if (in)
-        return in;
+      struct sp_pp_include_file *file = try_open_include_file_at(pp, loc, filename, search->dir, strlen(search->dir), ret_in);
+      if (file)
+        return file;
     }
   }
   
   // search the system directories
   for (struct sp_include_search_dir *search = pp->comp->sys_include_search_dirs; search != NULL; search = search->next) {
-    struct sp_input *in = try_open_include_file_at(pp, loc, filename, search->dir, strlen(search->dir));
-    if (in)
-      return in;
+    struct sp_pp_include_file *file = try_open_include_file_at(pp, loc, filename, search->dir, strlen(search->dir), ret_in);
+    if (file)
+      return file;
   }
   
   set_error_at(pp, loc, "can't find include file '%s'", filename);
   return NULL;
 }
 
-static int process_include(struct sp_preprocessor *pp, struct sp_src_loc loc)
+static int process_include(struct sp_preprocessor *pp, sp_src_loc_id loc)
 {
   struct sp_pp_token_list *args = NULL;
   if (read_expanded_directive_args(pp, true, &args) < 0)
@@ -280,11 +430,9 @@ static int process_include(struct sp_preprocessor *pp, struct sp_src_loc loc)
       header = tok;
       continue;
     }
-    if (! pp_tok_is_space(tok)) {
-      if (header)
-        return set_error(pp, "extra token after include file name: '%s'", sp_dump_pp_token(pp, tok));
-      break;
-    }
+    if (header)
+      return set_error(pp, "extra token after include file name: '%s'", sp_dump_pp_token(pp, tok));
+    break;
   }
   if (! header)
     return set_error(pp, "expected <filename> or \"filename\"");
@@ -301,13 +449,53 @@ static int process_include(struct sp_preprocessor *pp, struct sp_src_loc loc)
   memcpy(filename, include_file+1, include_filename_len-2);
   filename[include_filename_len-2] = '\0';
   bool is_system_header = (include_file[0] == '<');
+  pp->include_stats.includes++;
   
   // open file (TODO: search file according to 'is_system_header')
   const char *base_filename = sp_get_ast_file_name(pp->ast, sp_get_input_file_id(pp->in));
-  struct sp_input *in = search_include_file(pp, loc, filename, base_filename, is_system_header);
-  if (! in)
+  struct sp_input *in = NULL;
+  struct sp_pp_include_file *file = search_include_file(pp, loc, filename, base_filename, is_system_header, &in);
+  if (! file)
     return -1;
+
+  // speculative preprocessing needs to know what files were looked at
+  if (pp->spec_log) {
+    const char *path = (in) ? sp_get_ast_file_name(pp->ast, sp_get_input_file_id(in)) : NULL;
+    if (sp_log_pp_spec_include(pp->spec_log, file, path, ! pp->in->next) < 0) {
+      if (in)
+        sp_free_input(in);
+      return set_error(pp, "out of memory");
+    }
+  }
+
+  if (! in) {
+    if (file->once)
+      pp->include_stats.skipped_once++;
+    else
+      pp->include_stats.skipped_guarded++;
+    return 0;
+  }
+
+  // a header included by the main file may have been preprocessed already
+  if (pp->spec && ! pp->in->next) {
+    int spliced = sp_splice_pp_spec_include(pp->spec, pp, file, in);
+    if (spliced != 0) {
+      sp_free_input(in);
+      return (spliced < 0) ? -1 : 0;
+    }
+  }
+
   in->base_cond_level = pp->cond_level;
+  in->include_file = file;
+  in->guard_state = SP_INPUT_GUARD_START;
+  if (! pp->scan_only) {
+    // dependency scans read files without text, with different offsets
+    in->skips = sp_get_pp_skip_file(&pp->comp->skip_index, &file->identity);
+    if (! in->skips) {
+      sp_free_input(in);
+      return set_error(pp, "out of memory");
+    }
+  }
   in->next = pp->in;
   pp->in = in;
   
@@ -315,24 +503,42 @@ static int process_include(struct sp_preprocessor *pp, struct sp_src_loc loc)
 }
 
 /* ================================================ */
-/* == #define / #undef ============================ */
+/* == #pragma ===================================== */
 
-static int process_undef(struct sp_preprocessor *pp, struct sp_src_loc loc)
+static int process_pragma(struct sp_preprocessor *pp)
 {
   NEXT_TOKEN();
-  if (IS_SPACE())
+  if (IS_IDENTIFIER() && strcmp(sp_get_pp_token_string(pp, &pp->tok), "once") == 0) {
     NEXT_TOKEN();
+    if (! IS_NEWLINE() && ! IS_EOF())
+      return set_error(pp, "extra token in '#pragma once': '%s'", sp_dump_pp_token(pp, &pp->tok));
+    if (pp->in->include_file)
+      pp->in->include_file->once = true;
+    return 0;
+  }
+
+  // other pragmas are ignored
+  return 0;
+}
+
+/* ================================================ */
+/* == #define / #undef ============================ */
+
+static int process_undef(struct sp_preprocessor *pp, sp_src_loc_id loc)
+{
+  NEXT_TOKEN();
   if (IS_NEWLINE())
     return set_error_at(pp, loc, "macro name required");
   
   if (! IS_IDENTIFIER())
     return set_error(pp, "macro name must be an identifier, found '%s'", sp_dump_pp_token(pp, &pp->tok));
   
-  sp_delete_idht_entry(&pp->macros, sp_get_pp_token_string_id(&pp->tok));
+  if (sp_delete_macro(&pp->macros, sp_get_pp_token_string_id(&pp->tok)) < 0)
+    return set_error(pp, "out of memory");
+  if (pp->macro_memo)
+    sp_pp_memo_macro_changed(&pp->memo, sp_get_pp_token_string_id(&pp->tok));
 
-  do {
-    NEXT_TOKEN();
-  } while (IS_SPACE());
+  NEXT_TOKEN();
   if (! IS_NEWLINE())
     return set_error(pp, "unexpected input after #undef MACRO: '%s'", sp_dump_pp_token(pp, &pp->tok));
   return 0;
@@ -347,8 +553,6 @@ static int read_macro_params(struct sp_preprocessor *pp, struct sp_pp_token_list
   bool found_ellipsis = false;
   while (true) {
     NEXT_TOKEN();
-    if (IS_SPACE())
-      NEXT_TOKEN();
     if (IS_EOF() || IS_NEWLINE())
       return set_error(pp, "unterminated macro parameter list");
     if (IS_PUNCT(')') && (found_ellipsis || sp_pp_token_list_size(params) == 0))
@@ -363,12 +567,12 @@ static int read_macro_params(struct sp_preprocessor *pp, struct sp_pp_token_list
     if (! IS_IDENTIFIER() && ! IS_PUNCT(PUNCT_ELLIPSIS))
       return set_error(pp, "invalid macro parameter: '%s'", sp_dump_pp_token(pp, &pp->tok));
 
+    // parameter lists are compared by name only
+    pp->tok.flags &= ~PP_TOK_WHITESPACE_FLAGS;
     if (sp_append_pp_token(params, &pp->tok) < 0)
       return set_error(pp, "out of memory");
 
     NEXT_TOKEN();
-    if (IS_SPACE())
-      NEXT_TOKEN();
     if (IS_EOF() || IS_NEWLINE())
       return set_error(pp, "unterminated macro parameter list");
     if (IS_PUNCT(PUNCT_ELLIPSIS)) {
@@ -393,23 +597,12 @@ static int read_macro_body(struct sp_preprocessor *pp, struct sp_pp_token_list *
 {
   NEXT_TOKEN();
 
-  // skip leading space  
-  if (IS_SPACE())
-    NEXT_TOKEN();
+  // the space between the name and the body doesn't count
+  pp->tok.flags &= ~PP_TOK_WHITESPACE_FLAGS;
   
   while (true) {
-    if (IS_NEWLINE())
+    if (IS_NEWLINE() || IS_EOF())
       break;
-    if (IS_SPACE()) {
-      // skip trailing space
-      struct sp_pp_token space = pp->tok;
-      NEXT_TOKEN();
-      if (IS_NEWLINE())
-        break;
-      // it wasn't the body's end, so we put the space back
-      if (sp_append_pp_token(body, &space) < 0)
-        return set_error(pp, "out of memory");
-    }
     if (sp_append_pp_token(body, &pp->tok) < 0)
       return set_error(pp, "out of memory");
     NEXT_TOKEN();
@@ -417,26 +610,14 @@ static int read_macro_body(struct sp_preprocessor *pp, struct sp_pp_token_list *
   return 0;
 }
 
-static int process_define(struct sp_preprocessor *pp, struct sp_src_loc loc)
+static int read_macro_def(struct sp_preprocessor *pp, struct sp_macro_def *macro)
 {
-  do {
-    NEXT_TOKEN();
-  } while (IS_SPACE());
-  if (IS_NEWLINE())
-    return set_error(pp, "macro name required");
-  
-  if (! IS_IDENTIFIER())
-    return set_error_at(pp, loc, "macro name must be an identifier, found '%s'", sp_dump_pp_token(pp, &pp->tok));
-  
-  sp_string_id macro_name_id = sp_get_pp_token_string_id(&pp->tok);
-  bool is_function = sp_next_pp_ph3_char_is_lparen(pp);
-
   // params
   struct sp_pp_token_list params;
   sp_init_pp_token_list(&params, pp->pool, 4);
   bool is_variadic = false;
   bool is_named_variadic = false;
-  if (is_function) {
+  if (macro->is_function) {
     if (read_macro_params(pp, &params, &is_variadic, &is_named_variadic) < 0)
       return -1;
   }
@@ -447,52 +628,119 @@ static int process_define(struct sp_preprocessor *pp, struct sp_src_loc loc)
   if (read_macro_body(pp, &body) < 0)
     return -1;
 
-  struct sp_macro_def *macro = sp_new_macro_def(pp, macro_name_id, is_function, is_variadic,
-                                                is_named_variadic, &params, &body);
+  return sp_set_macro_def_body(pp, macro, is_variadic, is_named_variadic, &params, &body);
+}
+
+/*
+ * Read the params and body of a macro from the text of its '#define',
+ * unless already read.  The text is tokenized as the rest of the
+ * directive line, from wherever the preprocessor is reading now.
+ */
+int sp_parse_pp_macro_def(struct sp_preprocessor *pp, struct sp_macro_def *macro)
+{
+  if (macro->is_parsed)
+    return 0;
+
+  struct sp_input *in = sp_new_input_from_data(macro->def, macro->def_size);
+  if (! in)
+    return set_error_at(pp, macro->def_loc, "out of memory");
+  in->loc_base = macro->def_loc;
+
+  struct sp_input *save_in = pp->in;
+  struct sp_pp_token save_tok = pp->tok;
+  uint8_t save_next_tok_flags = pp->next_tok_flags;
+  bool save_in_directive = pp->in_directive;
+  struct sp_pp_ph3_peek save_ph3_peek = pp->ph3_peek;
+  pp->in = in;
+  pp->tok.loc = macro->def_loc;  // for errors before the first token
+  pp->next_tok_flags = 0;
+  pp->in_directive = true;
+  pp->ph3_peek.in = NULL;
+
+  int ret = read_macro_def(pp, macro);
+
+  pp->in = save_in;
+  pp->tok = save_tok;
+  pp->next_tok_flags = save_next_tok_flags;
+  pp->in_directive = save_in_directive;
+  pp->ph3_peek = save_ph3_peek;
+  sp_free_input(in);
+  return ret;
+}
+
+static int process_define(struct sp_preprocessor *pp, sp_src_loc_id loc)
+{
+  NEXT_TOKEN();
+  if (IS_NEWLINE())
+    return set_error(pp, "macro name required");
+  
+  if (! IS_IDENTIFIER())
+    return set_error_at(pp, loc, "macro name must be an identifier, found '%s'", sp_dump_pp_token(pp, &pp->tok));
+  
+  sp_string_id macro_name_id = sp_get_pp_token_string_id(&pp->tok);
+  bool is_function = sp_next_pp_ph3_char_is_lparen(pp);
+
+  // params and body are read when the macro is first needed
+  const char *def;
+  size_t def_size;
+  sp_src_loc_id def_loc;
+  if (sp_read_pp_ph3_directive_text(pp, &def, &def_size, &def_loc) < 0)
+    return -1;
+  if (def_size >= INT_MAX)
+    return set_error_at(pp, loc, "macro definition too long");
+  def = sp_add_macro_def_text(pp, def, (int) def_size);
+  if (! def)
+    return set_error_at(pp, loc, "out of memory");
+
+  // a redefinition with the same text changes nothing
+  struct sp_macro_def *old_macro = sp_get_macro(&pp->macros, macro_name_id);
+  if (old_macro && old_macro->def == def && old_macro->is_function == is_function)
+    return 0;
+
+  struct sp_macro_def *macro = sp_new_unparsed_macro_def(pp, macro_name_id, is_function, def, (int) def_size, def_loc);
   if (! macro)
     return -1;
 
-  struct sp_macro_def *old_macro = sp_get_idht_value(&pp->macros, macro_name_id);
   if (old_macro) {
+    if (sp_parse_pp_macro_def(pp, macro) < 0 || sp_parse_pp_macro_def(pp, old_macro) < 0)
+      return -1;
     if (! sp_macros_are_equal(macro, old_macro))
       return set_error_at(pp, loc, "redefinition of macro '%s'", sp_get_string(&pp->token_strings, macro_name_id));
     return 0;
   }
   
-  if (sp_add_idht_entry(&pp->macros, macro_name_id, macro) < 0)
+  if (sp_set_macro(&pp->macros, macro) < 0)
     return set_error_at(pp, loc, "out of memory");
+  if (pp->macro_memo)
+    sp_pp_memo_macro_changed(&pp->memo, macro_name_id);
   return 0;
 }
 
 /* ================================================ */
 /* == #if / #else / #endif ======================== */
 
-static int eval_cond_expr_list(struct sp_preprocessor *pp, struct sp_pp_token_list *expr, bool *ret)
+static int add_cond_expr_token(struct sp_preprocessor *pp, int *len, struct sp_pp_token *tok)
 {
-  // TODO: properly eval conditional expression according to [6.10.1]
-  // paragraph 4.  We should convert the pp-tokens in 'expr' to
-  // tokens, parse the resulting expression and evaluate it.
-  
-  sp_string_id str_id_zero = sp_add_string(&pp->token_strings, "0");
-  if (str_id_zero < 0)
-    return set_error(pp, "out of memory");
-  
-  if (sp_pp_token_list_size(expr) == 1) {
-    struct sp_pp_token_list_walker w;
-    struct sp_pp_token *tok = sp_rewind_pp_token_list(&w, expr);
-    while (sp_read_pp_token_from_list(&w, &tok)) {
-      if (pp_tok_is_number(tok)) {
-        if (tok->data.str_id == str_id_zero)
-          *ret = false;
-        else
-          *ret = true;
-        return true;
-      }
+  if (*len == pp->cond_expr_cap) {
+    int new_cap = (pp->cond_expr_cap == 0) ? 64 : 2*pp->cond_expr_cap;
+    struct sp_pp_token *new_cond_expr = sp_malloc(pp->pool, new_cap * sizeof(struct sp_pp_token));
+    if (! new_cond_expr)
+      return -1;
+    if (pp->cond_expr) {
+      memcpy(new_cond_expr, pp->cond_expr, *len * sizeof(struct sp_pp_token));
+      sp_free(pp->pool, pp->cond_expr);
     }
+    pp->cond_expr = new_cond_expr;
+    pp->cond_expr_cap = new_cap;
   }
-  return set_error(pp, "evaluation of complex conditionals is not implemented, only '0', '1' or 'defined IDENT' are supported");
+  pp->cond_expr[(*len)++] = *tok;
+  return 0;
 }
 
+/*
+ * Expand the expression of a #if into 'pp->cond_expr', replacing
+ * "defined" and identifiers with numbers, and evaluate it there.
+ */
 static int test_cond_expr(struct sp_preprocessor *pp, bool *ret)
 {
   // read unexpanded expression
@@ -526,10 +774,10 @@ static int test_cond_expr(struct sp_preprocessor *pp, bool *ret)
   while (sp_read_pp_token_from_list(&w, &tok)) {
     if (pp_tok_is_identifier(tok)) {
       if (tok->data.str_id == str_id_defined) {
-        tok->macro_dead = true;
+        pp_tok_set_flag(tok, PP_TOK_FLAG_MACRO_DEAD);
         last_was_defined = true;
       } else if (last_was_defined) {
-        tok->macro_dead = true;
+        pp_tok_set_flag(tok, PP_TOK_FLAG_MACRO_DEAD);
         last_was_defined = false;
       }
     }
@@ -539,9 +787,7 @@ static int test_cond_expr(struct sp_preprocessor *pp, bool *ret)
   //printf("EXPANDING: << "); sp_dump_pp_token_list(expr, pp); printf(" >>\n");
   if (sp_add_pp_token_list_to_ph4_input(pp, expr) < 0)
     return -1;
-  struct sp_pp_token_list *exp_expr = sp_new_pp_token_list(&pp->directive_pool, sp_pp_token_list_size(expr));
-  if (! exp_expr)
-    goto err_oom;
+  int n_toks = 0;
   int defined_reading_state = 0;
   while (true) {
     if (sp_next_pp_ph4_processed_token(pp, true) < 0)
@@ -550,8 +796,6 @@ static int test_cond_expr(struct sp_preprocessor *pp, bool *ret)
       return set_error(pp, "unterminated conditional expression");
     if (IS_END_OF_LIST())
       break;
-    if (IS_SPACE())
-      continue;
 
     // "defined"
     if (IS_IDENTIFIER() && sp_get_pp_token_string_id(&pp->tok) == str_id_defined) {
@@ -574,11 +818,11 @@ static int test_cond_expr(struct sp_preprocessor *pp, bool *ret)
         // replace "defined IDENT" with "0" or "1"
         struct sp_pp_token val = pp->tok;
         val.type = TOK_PP_NUMBER;
-        if (sp_get_idht_value(&pp->macros, sp_get_pp_token_string_id(&pp->tok)))
+        if (sp_get_macro(&pp->macros, sp_get_pp_token_string_id(&pp->tok)))
           val.data.str_id = str_id_one;
         else
           val.data.str_id = str_id_zero;
-        if (sp_append_pp_token(exp_expr, &val) < 0)
+        if (add_cond_expr_token(pp, &n_toks, &val) < 0)
           goto err_oom;
         continue;
       }
@@ -600,11 +844,11 @@ static int test_cond_expr(struct sp_preprocessor *pp, bool *ret)
     }
 
     //printf("adding -> '%s'\n", sp_dump_pp_token(pp, &tok));
-    if (sp_append_pp_token(exp_expr, &tok) < 0)
+    if (add_cond_expr_token(pp, &n_toks, &tok) < 0)
       goto err_oom;
   }
   
-  if (eval_cond_expr_list(pp, exp_expr, ret) < 0)
+  if (sp_eval_pp_cond_expr(pp, pp->cond_expr, n_toks, ret) < 0)
     return -1;
   
   sp_clear_mem_pool(&pp->directive_pool);
@@ -623,9 +867,7 @@ static int skip_cond_expr(struct sp_preprocessor *pp)
 
 static int process_conditional(struct sp_preprocessor *pp, enum pp_directive_type directive)
 {
-  do {
-    NEXT_TOKEN();
-  } while (IS_SPACE());
+  NEXT_TOKEN();
 
   switch (directive) {
   case PP_DIR_if:
@@ -656,12 +898,14 @@ static int process_conditional(struct sp_preprocessor *pp, enum pp_directive_typ
         if (! IS_IDENTIFIER())
           return set_error(pp, "expected identifier for '#%s'", get_pp_directive_name(directive));
 
-        bool is_defined = sp_get_idht_value(&pp->macros, sp_get_pp_token_string_id(&pp->tok)) != NULL;
+        if (directive == PP_DIR_ifndef && pp->in->guard_state == SP_INPUT_GUARD_START) {
+          pp->in->guard_state = SP_INPUT_GUARD_IN_GROUP;
+          pp->in->guard_id = sp_get_pp_token_string_id(&pp->tok);
+        }
+        bool is_defined = sp_get_macro(&pp->macros, sp_get_pp_token_string_id(&pp->tok)) != NULL;
         pp->cond_state[++pp->cond_level] = ((directive == PP_DIR_ifdef) == is_defined) ? PP_COND_ACTIVE : PP_COND_INACTIVE;
         
-        do {
-          NEXT_TOKEN();
-        } while (IS_SPACE());
+        NEXT_TOKEN();
         if (! IS_NEWLINE() && ! IS_EOF())
           return set_error(pp, "extra token in '#%s': '%s'", get_pp_directive_name(directive), sp_dump_pp_token(pp, &pp->tok));
       }
@@ -713,12 +957,39 @@ static int process_conditional(struct sp_preprocessor *pp, enum pp_directive_typ
 
 /* ================================================ */
 
-int sp_process_pp_directive(struct sp_preprocessor *pp)
+/*
+ * Follow the directives of a file to see if it's a single '#ifndef'
+ * group.  The '#ifndef' itself is recorded by process_conditional().
+ */
+static void track_include_guard(struct sp_preprocessor *pp, enum pp_directive_type directive)
+{
+  struct sp_input *in = pp->in;
+  switch (in->guard_state) {
+  case SP_INPUT_GUARD_START:
+    if (directive != PP_DIR_ifndef)
+      in->guard_state = SP_INPUT_GUARD_NONE;
+    break;
+
+  case SP_INPUT_GUARD_IN_GROUP:
+    if (pp->cond_level == in->base_cond_level + 1) {
+      if (directive == PP_DIR_endif)
+        in->guard_state = SP_INPUT_GUARD_ENDED;
+      else if (directive == PP_DIR_elif || directive == PP_DIR_else)
+        in->guard_state = SP_INPUT_GUARD_NONE;
+    }
+    break;
+
+  case SP_INPUT_GUARD_ENDED:
+  case SP_INPUT_GUARD_NONE:
+    in->guard_state = SP_INPUT_GUARD_NONE;
+    break;
+  }
+}
+
+static int process_directive(struct sp_preprocessor *pp)
 {
   NEXT_TOKEN();
-  while (IS_SPACE())
-    NEXT_TOKEN();
-  if (IS_NEWLINE())
+  if (IS_NEWLINE() || IS_EOF())
     return 0;
   
   if (! IS_IDENTIFIER()) {
@@ -726,7 +997,7 @@ int sp_process_pp_directive(struct sp_preprocessor *pp)
     goto err;
   }
 
-  struct sp_src_loc loc = pp->tok.loc;
+  sp_src_loc_id loc = pp->tok.loc;
   const char *directive_name = sp_get_pp_token_string(pp, &pp->tok);
   enum pp_directive_type directive;
   if (! find_pp_directive(directive_name, &directive)) {
@@ -734,6 +1005,9 @@ int sp_process_pp_directive(struct sp_preprocessor *pp)
     goto err;
   }
 
+  if (pp->in->guard_state != SP_INPUT_GUARD_NONE)
+    track_include_guard(pp, directive);
+
   // always process conditionals
   switch (directive) {
   case PP_DIR_if:
@@ -757,8 +1031,9 @@ int sp_process_pp_directive(struct sp_preprocessor *pp)
   case PP_DIR_undef:   return process_undef(pp, loc);
   case PP_DIR_error:   return process_error(pp, loc);
 
+  case PP_DIR_pragma:  return process_pragma(pp);
+
   case PP_DIR_line:
-  case PP_DIR_pragma:
     return set_error(pp, "preprocessor directive is not implemented: '%s'", directive_name);
 
   case PP_DIR_if:
@@ -776,3 +1051,19 @@ int sp_process_pp_directive(struct sp_preprocessor *pp)
     return -1;
   return 0;
 }
+
+int sp_process_pp_directive(struct sp_preprocessor *pp)
+{
+  pp->in_directive = true;
+  if (process_directive(pp) < 0)
+    return -1;
+
+  // skip the rest of the line of directives that were not processed
+  while (pp->in_directive)
+    NEXT_TOKEN();
+
+  // the lines of a group that's not active are skipped without making tokens
+  if (pp->cond_level >= 0 && pp->cond_state[pp->cond_level] != PP_COND_ACTIVE)
+    return sp_skip_pp_ph3_group(pp);
+  return 0;
+}
@@ -36,6 +36,147 @@ static const struct {
   ADD_PREDEF_FUNC_MACRO(_Pragma, 1),
 };
 
+// value of an undefined base macro in the table
+static struct sp_macro_def undefined_macro;
+
+void sp_init_macro_table(struct sp_macro_table *t, struct sp_macro_table *base, struct sp_mem_pool *pool)
+{
+  sp_init_idht(&t->defs, pool);
+  t->base = base;
+  t->log = NULL;
+}
+
+void sp_init_macro_log(struct sp_macro_log *log, struct sp_mem_pool *pool)
+{
+  sp_init_idht(&log->reads, pool);
+  log->writes = NULL;
+  log->n_writes = 0;
+  log->cap_writes = 0;
+  log->incomplete = false;
+}
+
+/*
+ * Read the next name read from the base of a logged table, with the
+ * macro it had then (NULL if undefined).  Start with '*name_id' = -1.
+ */
+bool sp_next_macro_log_read(struct sp_macro_log *log, sp_string_id *name_id, struct sp_macro_def **ret)
+{
+  if (! sp_next_idht_key(&log->reads, name_id))
+    return false;
+  struct sp_macro_def *macro = sp_get_idht_value(&log->reads, *name_id);
+  *ret = (macro == &undefined_macro) ? NULL : macro;
+  return true;
+}
+
+// only the first read counts: later ones see what the table did since
+static void log_read(struct sp_macro_table *t, sp_string_id name_id, struct sp_macro_def *macro)
+{
+  if (! sp_get_idht_value(&t->log->reads, name_id)
+      && sp_add_idht_entry(&t->log->reads, name_id, (macro) ? macro : &undefined_macro) < 0)
+    t->log->incomplete = true;
+}
+
+static int log_write(struct sp_macro_table *t, sp_string_id name_id, struct sp_macro_def *macro)
+{
+  struct sp_macro_log *log = t->log;
+  if (log->n_writes == log->cap_writes) {
+    int new_cap = (log->cap_writes == 0) ? 16 : 2*log->cap_writes;
+    struct sp_macro_write *new_writes = sp_malloc(t->defs.pool, new_cap * sizeof(struct sp_macro_write));
+    if (! new_writes)
+      return -1;
+    if (log->writes)
+      memcpy(new_writes, log->writes, log->n_writes * sizeof(struct sp_macro_write));
+    log->writes = new_writes;
+    log->cap_writes = new_cap;
+  }
+  log->writes[log->n_writes].name_id = name_id;
+  log->writes[log->n_writes].macro = macro;
+  log->n_writes++;
+  return 0;
+}
+
+struct sp_macro_def *sp_get_macro(struct sp_macro_table *t, sp_string_id name_id)
+{
+  struct sp_macro_def *macro = sp_get_idht_value(&t->defs, name_id);
+  if (macro)
+    return (macro == &undefined_macro) ? NULL : macro;
+  if (! t->base)
+    return NULL;
+  macro = sp_get_macro(t->base, name_id);
+  if (t->log)
+    log_read(t, name_id, macro);
+  return macro;
+}
+
+/*
+ * Return a macro that can be changed (i.e., parsed or disabled while
+ * expanded): a macro of the base table is copied to the table first.
+ */
+struct sp_macro_def *sp_get_own_macro(struct sp_macro_table *t, sp_string_id name_id)
+{
+  struct sp_macro_def *macro = sp_get_idht_value(&t->defs, name_id);
+  if (macro)
+    return (macro == &undefined_macro) ? NULL : macro;
+  if (! t->base)
+    return NULL;
+  struct sp_macro_def *base_macro = sp_get_macro(t->base, name_id);
+  if (t->log)
+    log_read(t, name_id, base_macro);
+  if (! base_macro)
+    return NULL;
+  macro = sp_malloc(t->defs.pool, sizeof(struct sp_macro_def));
+  if (! macro)
+    return NULL;
+  *macro = *base_macro;
+  if (sp_add_idht_entry(&t->defs, name_id, macro) < 0)
+    return NULL;
+  return macro;
+}
+
+int sp_set_macro(struct sp_macro_table *t, struct sp_macro_def *macro)
+{
+  if (t->log && log_write(t, macro->name_id, macro) < 0)
+    return -1;
+  return sp_add_idht_entry(&t->defs, macro->name_id, macro);
+}
+
+int sp_delete_macro(struct sp_macro_table *t, sp_string_id name_id)
+{
+  if (t->log && log_write(t, name_id, NULL) < 0)
+    return -1;
+  if (t->base && sp_get_macro(t->base, name_id))
+    return sp_add_idht_entry(&t->defs, name_id, &undefined_macro);
+  sp_delete_idht_entry(&t->defs, name_id);
+  return 0;
+}
+
+void sp_rewind_macro_table(struct sp_macro_table_walker *w, struct sp_macro_table *t)
+{
+  w->table = t;
+  w->level = t;
+  w->name_id = -1;
+}
+
+/*
+ * Read the next macro of the table, including the macros of the base
+ * that were not redefined or undefined.
+ */
+bool sp_read_macro_from_table(struct sp_macro_table_walker *w, struct sp_macro_def **ret)
+{
+  while (w->level) {
+    while (sp_next_idht_key(&w->level->defs, &w->name_id)) {
+      struct sp_macro_def *macro = sp_get_idht_value(&w->level->defs, w->name_id);
+      if (macro != &undefined_macro && sp_get_macro(w->table, w->name_id) == macro) {
+        *ret = macro;
+        return true;
+      }
+    }
+    w->level = w->level->base;
+    w->name_id = -1;
+  }
+  return false;
+}
+
 static int validate_macro_params(struct sp_macro_def *macro, struct sp_preprocessor *pp)
 {
   int param_n = 0;
@@ -73,7 +214,7 @@ static int validate_macro_body(struct sp_macro_def *macro, struct sp_preprocesso
         return sp_set_pp_error(pp, "__VA_ARGS__ is only allowed in variadic macros");
     }
     
-    struct sp_pp_token *next = sp_peek_nonblank_pp_token_from_list(&w);
+    struct sp_pp_token *next = sp_peek_pp_token_from_list(&w);
     if (pp_tok_is_punct(tok, PUNCT_HASHES) && (pos == 0 || next == NULL))
       return sp_set_pp_error(pp, "## is not allowed at the start or end of macro body");
   
@@ -95,32 +236,179 @@ static int validate_macro_body(struct sp_macro_def *macro, struct sp_preprocesso
   return 0;
 }
 
-struct sp_macro_def *sp_new_macro_def(struct sp_preprocessor *pp, sp_string_id name_id,
-                                      bool is_function, bool is_variadic, bool is_named_variadic,
-                                      struct sp_pp_token_list *params, struct sp_pp_token_list *body)
+static int get_param_index(struct sp_macro_def *macro, struct sp_pp_token *tok)
 {
-  int n_params = sp_pp_token_list_size(params);
-  struct sp_macro_def *macro = sp_malloc(pp->pool, sizeof(struct sp_macro_def) + n_params*sizeof(sp_string_id));
+  if (! pp_tok_is_identifier(tok))
+    return -1;
+  for (int i = 0; i < macro->n_params; i++) {
+    if (sp_get_pp_token_string_id(tok) == macro->param_name_ids[i])
+      return i;
+  }
+  return -1;
+}
+
+/*
+ * Write the ops for the macro body to 'ops' (if not NULL) and return
+ * the number of ops.  The body must be valid.
+ */
+static int compile_macro_body(struct sp_macro_def *macro, struct sp_macro_op *ops)
+{
+  int n_ops = 0;
+  struct sp_macro_op last = { MACRO_OP_PASTE, -1, -1, -1 };
+  struct sp_pp_token *body = sp_pp_token_list_tokens(&macro->body);
+  int body_size = sp_pp_token_list_size(&macro->body);
+  for (int i = 0; i < body_size; i++) {
+    struct sp_macro_op op = { MACRO_OP_TOKENS, -1, i, i+1 };
+    if (pp_tok_is_punct(&body[i], PUNCT_HASHES)) {
+      op.type = MACRO_OP_PASTE;
+    } else if (macro->is_function && pp_tok_is_punct(&body[i], '#')) {
+      op.type = MACRO_OP_STRINGIFY;
+      op.param = get_param_index(macro, &body[++i]);
+    } else if (macro->is_function && (op.param = get_param_index(macro, &body[i])) >= 0) {
+      // [6.10.3.3] parameter preceded or followed by '##' is not expanded
+      if ((i > 0 && pp_tok_is_punct(&body[i-1], PUNCT_HASHES))
+          || (i+1 < body_size && pp_tok_is_punct(&body[i+1], PUNCT_HASHES)))
+        op.type = MACRO_OP_PARAM_NOEXP;
+      else
+        op.type = MACRO_OP_PARAM;
+    } else if (last.type == MACRO_OP_TOKENS && last.end == i) {
+      // extend the current run of tokens
+      last.end++;
+      if (ops)
+        ops[n_ops-1].end++;
+      continue;
+    }
+    if (ops)
+      ops[n_ops] = op;
+    n_ops++;
+    last = op;
+  }
+  return n_ops;
+}
+
+static struct sp_macro_def *alloc_macro_def(struct sp_preprocessor *pp, sp_string_id name_id, bool is_function)
+{
+  struct sp_macro_def *macro = sp_malloc(pp->pool, sizeof(struct sp_macro_def));
   if (! macro)
     return NULL;
   macro->pre_id = PP_MACRO_NOT_PREDEFINED;
   macro->name_id = name_id;
-  macro->n_params = n_params;
   macro->enabled = true;
   macro->is_function = is_function;
+  macro->is_variadic = false;
+  macro->is_named_variadic = false;
+  macro->is_parsed = false;
+  macro->def = NULL;
+  macro->def_size = 0;
+  macro->def_loc = 0;
+  macro->ops = NULL;
+  macro->n_ops = 0;
+  macro->n_params = 0;
+  macro->param_name_ids = NULL;
+  return macro;
+}
+
+/*
+ * Set the parameters and body of a macro, which are checked and
+ * compiled to ops.
+ */
+int sp_set_macro_def_body(struct sp_preprocessor *pp, struct sp_macro_def *macro,
+                          bool is_variadic, bool is_named_variadic,
+                          struct sp_pp_token_list *params, struct sp_pp_token_list *body)
+{
+  macro->n_params = sp_pp_token_list_size(params);
   macro->is_variadic = is_variadic;
   macro->is_named_variadic = is_named_variadic;
   macro->params = *params;
   macro->body = *body;
+  if (macro->n_params > 0) {
+    macro->param_name_ids = sp_malloc(pp->pool, macro->n_params * sizeof(sp_string_id));
+    if (! macro->param_name_ids)
+      return sp_set_pp_error(pp, "out of memory");
+  }
+
+  // [6.10.3.4] 2. the macro name is never replaced again if found in the body
+  struct sp_pp_token *t = sp_pp_token_list_tokens(&macro->body);
+  for (int i = 0; i < sp_pp_token_list_size(&macro->body); i++) {
+    if (pp_tok_is_identifier(&t[i]) && t[i].data.str_id == macro->name_id)
+      pp_tok_set_flag(&t[i], PP_TOK_FLAG_MACRO_DEAD);
+  }
 
   if (validate_macro_params(macro, pp) < 0)
-    return NULL;
+    return -1;
   if (validate_macro_body(macro, pp) < 0)
+    return -1;
+
+  macro->n_ops = compile_macro_body(macro, NULL);
+  macro->ops = NULL;
+  if (macro->n_ops > 0) {
+    macro->ops = sp_malloc(pp->pool, macro->n_ops * sizeof(struct sp_macro_op));
+    if (! macro->ops)
+      return sp_set_pp_error(pp, "out of memory");
+    compile_macro_body(macro, macro->ops);
+  }
+
+  macro->is_parsed = true;
+  return 0;
+}
+
+struct sp_macro_def *sp_new_macro_def(struct sp_preprocessor *pp, sp_string_id name_id,
+                                      bool is_function, bool is_variadic, bool is_named_variadic,
+                                      struct sp_pp_token_list *params, struct sp_pp_token_list *body)
+{
+  struct sp_macro_def *macro = alloc_macro_def(pp, name_id, is_function);
+  if (! macro) {
+    sp_set_pp_error(pp, "out of memory");
+    return NULL;
+  }
+  if (sp_set_macro_def_body(pp, macro, is_variadic, is_named_variadic, params, body) < 0)
+    return NULL;
+  return macro;
+}
+
+/*
+ * Return the copy of the text of a '#define' kept by the preprocessor,
+ * or NULL if out of memory.  Equal texts are only stored once, so
+ * definitions with the same text have the same pointer.  The copy is
+ * needed anyway, since the input the text is read from is freed when
+ * it ends.
+ */
+const char *sp_add_macro_def_text(struct sp_preprocessor *pp, const char *text, int size)
+{
+  char *copy = sp_get_ht_value(&pp->macro_def_texts, text, size);
+  if (copy)
+    return copy;
+  copy = sp_malloc(pp->pool, size + 1);  // never empty, so the pointer is unique
+  if (! copy)
+    return NULL;
+  memcpy(copy, text, size);
+  copy[size] = '\0';
+  if (sp_add_ht_entry(&pp->macro_def_texts, copy, size, copy) < 0)
     return NULL;
+  return copy;
+}
 
+/*
+ * Make a macro from the text following its name in a '#define' (from
+ * sp_add_macro_def_text()), to be parsed later.
+ */
+struct sp_macro_def *sp_new_unparsed_macro_def(struct sp_preprocessor *pp, sp_string_id name_id, bool is_function,
+                                               const char *def, int def_size, sp_src_loc_id def_loc)
+{
+  struct sp_macro_def *macro = alloc_macro_def(pp, name_id, is_function);
+  if (! macro) {
+    sp_set_pp_error(pp, "out of memory");
+    return NULL;
+  }
+  macro->def = def;
+  macro->def_size = def_size;
+  macro->def_loc = def_loc;
   return macro;
 }
 
+/*
+ * Both macros must be parsed.
+ */
 bool sp_macros_are_equal(struct sp_macro_def *m1, struct sp_macro_def *m2)
 {
   if (m1->is_function != m2->is_function
@@ -134,8 +422,11 @@ bool sp_macros_are_equal(struct sp_macro_def *m1, struct sp_macro_def *m2)
   return true;
 }
 
-void sp_dump_macro(struct sp_macro_def *macro, struct sp_preprocessor *pp)
+int sp_dump_macro(struct sp_macro_def *macro, struct sp_preprocessor *pp)
 {
+  if (sp_parse_pp_macro_def(pp, macro) < 0)
+    return -1;
+
   printf("#define %s", sp_get_macro_name(macro, pp));
   if (macro->is_function) {
     printf("(");
@@ -160,12 +451,10 @@ void sp_dump_macro(struct sp_macro_def *macro, struct sp_preprocessor *pp)
   if (macro->pre_id != PP_MACRO_NOT_PREDEFINED) {
     printf("<predefined>\n");
   } else {
-    struct sp_pp_token_list_walker w;
-    struct sp_pp_token *t = sp_rewind_pp_token_list(&w, &macro->body);
-    while (sp_read_pp_token_from_list(&w, &t))
-      printf("%s", sp_dump_pp_token(pp, t));
+    sp_dump_pp_token_list(&macro->body, pp);
     printf("\n");
   }
+  return 0;
 }
 
 const char *sp_get_macro_name(struct sp_macro_def *macro, struct sp_preprocessor *pp)
@@ -176,18 +465,23 @@ const char *sp_get_macro_name(struct sp_macro_def *macro, struct sp_preprocessor
 struct sp_macro_args *sp_new_macro_args(struct sp_macro_def *macro, struct sp_mem_pool *pool)
 {
   int n_args = sp_pp_token_list_size(&macro->params);
-  struct sp_macro_args *args = sp_malloc(pool, sizeof(struct sp_macro_args) + n_args*sizeof(struct sp_pp_token_list));
+  struct sp_macro_args *args = sp_malloc(pool, sizeof(struct sp_macro_args)
+                                         + n_args*sizeof(struct sp_pp_token_span)
+                                         + n_args*sizeof(struct sp_pp_token_list *));
   if (! args)
     return NULL;
   args->pool = pool;
   args->cap = n_args;
   args->len = 0;
-  for (int i = 0; i < n_args; i++)
-    sp_init_pp_token_list(&args->args[i], pool, 16);
+  args->exp_args = (struct sp_pp_token_list **) &args->args[n_args];
+  for (int i = 0; i < n_args; i++) {
+    args->args[i] = (struct sp_pp_token_span) { .list = NULL, .start = 0, .end = 0, .ws = PP_SPAN_KEEP_WS, .hide_set = SP_EMPTY_HIDE_SET };
+    args->exp_args[i] = NULL;
+  }
   return args;
 }
 
-struct sp_pp_token_list *sp_get_macro_arg(struct sp_macro_def *macro, struct sp_macro_args *args, sp_string_id param_name_id)
+struct sp_pp_token_span *sp_get_macro_arg(struct sp_macro_def *macro, struct sp_macro_args *args, sp_string_id param_name_id)
 {
   for (int i = 0; i < macro->n_params; i++) {
     if (param_name_id == macro->param_name_ids[i])
@@ -196,17 +490,6 @@ struct sp_pp_token_list *sp_get_macro_arg(struct sp_macro_def *macro, struct sp_
   return NULL;
 }
 
-bool sp_macro_arg_is_empty(struct sp_pp_token_list *arg)
-{
-  struct sp_pp_token_list_walker w;
-  struct sp_pp_token *a = sp_rewind_pp_token_list(&w, arg);
-  while (sp_read_pp_token_from_list(&w, &a)) {
-    if (! pp_tok_is_end_of_list(a))
-      return false;
-  }
-  return true;
-}
-
 static int add_predefined_obj_macro(struct sp_preprocessor *pp, enum sp_predefined_macro_id pre_macro_id, const char *name)
 {
   sp_string_id name_id = sp_add_string(&pp->token_strings, name);
@@ -221,7 +504,7 @@ static int add_predefined_obj_macro(struct sp_preprocessor *pp, enum sp_predefin
     return -1;
   macro->pre_id = pre_macro_id;
   
-  if (sp_add_idht_entry(&pp->macros, name_id, macro) < 0)
+  if (sp_set_macro(&pp->macros, macro) < 0)
     return -1;
   return 0;
 }
@@ -238,6 +521,8 @@ static int add_predefined_func_macro(struct sp_preprocessor *pp, enum sp_predefi
     char param_name[2] = { 'a' + i, '\0' };
     struct sp_pp_token param;
     param.type = TOK_PP_IDENTIFIER;
+    param.flags = 0;
+    param.loc = 0;
     param.data.str_id = sp_add_string(&pp->token_strings, param_name);
     if (param.data.str_id < 0)
       return -1;
@@ -250,7 +535,7 @@ static int add_predefined_func_macro(struct sp_preprocessor *pp, enum sp_predefi
     return -1;
   macro->pre_id = pre_macro_id;
   
-  if (sp_add_idht_entry(&pp->macros, name_id, macro) < 0)
+  if (sp_set_macro(&pp->macros, macro) < 0)
     return -1;
   return 0;
 }
@@ -289,7 +574,7 @@ static void escape_file_name(char *dest, size_t dest_len, const char *src)
   dest[p++] = '\0';
 }
 
-static int get_current_datetime(struct sp_preprocessor *pp, struct sp_src_loc loc)
+static int get_current_datetime(struct sp_preprocessor *pp, sp_src_loc_id loc)
 {
   if (pp->date_str_id >= 0 && pp->time_str_id >= 0)
     return 0;
@@ -326,13 +611,19 @@ static int get_current_datetime(struct sp_preprocessor *pp, struct sp_src_loc lo
   return sp_set_pp_error_at(pp, loc, "out of memory");
 }
 
-struct sp_pp_token_list *sp_expand_predefined_macro(struct sp_preprocessor *pp, struct sp_macro_def *macro, struct sp_macro_args *args, struct sp_src_loc loc)
+struct sp_pp_token_list *sp_expand_predefined_macro(struct sp_preprocessor *pp, struct sp_macro_def *macro, struct sp_macro_args *args, sp_src_loc_id loc)
 {
-  static char str[256];
+  static SP_THREAD_LOCAL char str[256];
   
   UNUSED(args);
   
+  struct sp_src_loc src_loc;
+  if (! sp_get_ast_src_loc(pp->ast, loc, &src_loc))
+    src_loc = sp_make_src_loc(0, 0, 0);
+
   struct sp_pp_token tok;
+  tok.flags = 0;
+  tok.loc = loc;
   switch (macro->pre_id) {
   case PP_MACRO_NOT_PREDEFINED:
     tok.type = TOK_PP_EOF;
@@ -344,7 +635,7 @@ struct sp_pp_token_list *sp_expand_predefined_macro(struct sp_preprocessor *pp,
 
   case PP_MACRO_LINE:
     tok.type = TOK_PP_NUMBER;
-    snprintf(str, sizeof(str), "%d", loc.line);
+    snprintf(str, sizeof(str), "%d", src_loc.line);
     tok.data.str_id = sp_add_string(&pp->token_strings, str);
     if (tok.data.str_id < 0)
       goto err_oom;
@@ -352,7 +643,7 @@ struct sp_pp_token_list *sp_expand_predefined_macro(struct sp_preprocessor *pp,
 
   case PP_MACRO_FILE:
     tok.type = TOK_PP_STRING;
-    escape_file_name(str, sizeof(str), sp_get_ast_file_name(pp->ast, loc.file_id));
+    escape_file_name(str, sizeof(str), sp_get_ast_file_name(pp->ast, src_loc.file_id));
     tok.data.str_id = sp_add_string(&pp->token_strings, str);
     if (tok.data.str_id < 0)
       goto err_oom;
@@ -7,6 +7,7 @@
 #include "mem_pool.h"
 #include "string_tab.h"
 #include "pp_token_list.h"
+#include "id_hashtable.h"
 
 struct sp_preprocessor;
 
@@ -23,6 +24,33 @@ enum sp_predefined_macro_id {
   PP_MACRO_Pragma,
 };
 
+enum sp_macro_op_type {
+  MACRO_OP_TOKENS,        // body tokens [start, end)
+  MACRO_OP_PARAM,         // argument, macro-expanded
+  MACRO_OP_PARAM_NOEXP,   // argument next to '##', not macro-expanded
+  MACRO_OP_STRINGIFY,     // '#' applied to an argument
+  MACRO_OP_PASTE,         // '##'
+};
+
+/*
+ * The macro body is compiled to a list of ops when the macro is
+ * defined.  For ops with a parameter, 'start' is the index in the body
+ * of the parameter name (or of the '#' for MACRO_OP_STRINGIFY), whose
+ * whitespace goes to the first token of the argument.
+ */
+struct sp_macro_op {
+  enum sp_macro_op_type type;
+  int param;
+  int start;
+  int end;
+};
+
+/*
+ * A '#define' only records the text after the macro name.  The
+ * parameters and body are read from it when the macro is first needed
+ * (see sp_parse_pp_macro_def()), so macros that are never used are
+ * never tokenized.
+ */
 struct sp_macro_def {
   enum sp_predefined_macro_id pre_id;
   sp_string_id name_id;
@@ -30,33 +58,99 @@ struct sp_macro_def {
   bool is_variadic;
   bool is_named_variadic;
   bool enabled;
+  bool is_parsed;         // false until the fields below are set
+  const char *def;        // text after the name (shared, see sp_add_macro_def_text()), NULL if not from a '#define'
+  int def_size;
+  sp_src_loc_id def_loc;  // location of the text
   struct sp_pp_token_list params;
   struct sp_pp_token_list body;
+  struct sp_macro_op *ops;
+  int n_ops;
   int n_params;
-  sp_string_id param_name_ids[];
+  sp_string_id *param_name_ids;
+};
+
+struct sp_macro_write {
+  sp_string_id name_id;
+  struct sp_macro_def *macro;  // NULL if undefined
+};
+
+/*
+ * What a table did with the macros of its base: the value of every
+ * name read from the base (before the table changed it), and every
+ * change, in order.  Kept for speculative preprocessing (see
+ * pp_spec.c), to check it against the real state.
+ */
+struct sp_macro_log {
+  struct sp_id_hashtable reads;  // name id -> macro, or the marker of an undefined macro
+  struct sp_macro_write *writes;
+  int n_writes;
+  int cap_writes;
+  bool incomplete;  // a read couldn't be logged (out of memory)
+};
+
+/*
+ * The macros of a preprocessor, over the ones of the preprocessor it
+ * was forked from (if any).  The base table and its macros are never
+ * changed: '#undef' of a base macro leaves a marker in 'defs', and a
+ * base macro is copied to 'defs' before it's changed (see
+ * sp_get_own_macro()).
+ */
+struct sp_macro_table {
+  struct sp_id_hashtable defs;  // name id -> macro, or the marker of an undefined macro
+  struct sp_macro_table *base;  // NULL if none
+  struct sp_macro_log *log;     // NULL if not logging
+};
+
+struct sp_macro_table_walker {
+  struct sp_macro_table *table;
+  struct sp_macro_table *level;
+  sp_string_id name_id;
 };
 
+/*
+ * Each argument is a span: a view of the buffered list it was read
+ * from when its tokens are contiguous there, otherwise a copy.
+ */
 struct sp_macro_args {
   struct sp_mem_pool *pool;
   int cap;
   int len;
-  struct sp_pp_token_list args[];
+  struct sp_pp_token_list **exp_args;  // fully macro-expanded args, NULL until needed
+  struct sp_pp_token_span args[];
 };
 
+void sp_init_macro_table(struct sp_macro_table *t, struct sp_macro_table *base, struct sp_mem_pool *pool);
+struct sp_macro_def *sp_get_macro(struct sp_macro_table *t, sp_string_id name_id);
+struct sp_macro_def *sp_get_own_macro(struct sp_macro_table *t, sp_string_id name_id);
+int sp_set_macro(struct sp_macro_table *t, struct sp_macro_def *macro);
+int sp_delete_macro(struct sp_macro_table *t, sp_string_id name_id);
+void sp_rewind_macro_table(struct sp_macro_table_walker *w, struct sp_macro_table *t);
+bool sp_read_macro_from_table(struct sp_macro_table_walker *w, struct sp_macro_def **ret);
+void sp_init_macro_log(struct sp_macro_log *log, struct sp_mem_pool *pool);
+bool sp_next_macro_log_read(struct sp_macro_log *log, sp_string_id *name_id, struct sp_macro_def **ret);
+
 int sp_add_predefined_macros(struct sp_preprocessor *pp);
 struct sp_pp_token_list *sp_expand_predefined_macro(struct sp_preprocessor *pp, struct sp_macro_def *macro,
-                                                    struct sp_macro_args *args, struct sp_src_loc loc);
+                                                    struct sp_macro_args *args, sp_src_loc_id loc);
 
 struct sp_macro_def *sp_new_macro_def(struct sp_preprocessor *pp, sp_string_id name_id,
                                       bool is_function, bool is_variadic, bool is_named_variadic,
                                       struct sp_pp_token_list *params, struct sp_pp_token_list *body);
+const char *sp_add_macro_def_text(struct sp_preprocessor *pp, const char *text, int size);
+struct sp_macro_def *sp_new_unparsed_macro_def(struct sp_preprocessor *pp, sp_string_id name_id, bool is_function,
+                                               const char *def, int def_size, sp_src_loc_id def_loc);
+int sp_set_macro_def_body(struct sp_preprocessor *pp, struct sp_macro_def *macro,
+                          bool is_variadic, bool is_named_variadic,
+                          struct sp_pp_token_list *params, struct sp_pp_token_list *body);
 const char *sp_get_macro_name(struct sp_macro_def *macro, struct sp_preprocessor *pp);
 
 struct sp_macro_args *sp_new_macro_args(struct sp_macro_def *macro, struct sp_mem_pool *pool);
-struct sp_pp_token_list *sp_get_macro_arg(struct sp_macro_def *macro, struct sp_macro_args *args, int param_name_id);
-bool sp_macro_arg_is_empty(struct sp_pp_token_list *arg);
+struct sp_pp_token_span *sp_get_macro_arg(struct sp_macro_def *macro, struct sp_macro_args *args, int param_name_id);
+
+#define sp_macro_arg_is_empty(arg) ((arg)->start >= (arg)->end)
 
-void sp_dump_macro(struct sp_macro_def *macro, struct sp_preprocessor *pp);
+int sp_dump_macro(struct sp_macro_def *macro, struct sp_preprocessor *pp);
 bool sp_macros_are_equal(struct sp_macro_def *m1, struct sp_macro_def *m2);
 
 #endif /* PP_MACRO_H_FILE */
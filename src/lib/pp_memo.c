@@ -0,0 +1,175 @@
+/* pp_memo.c */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pp_memo.h"
+#include "pp_macro.h"
+#include "pp_token.h"
+
+void sp_init_pp_memo(struct sp_pp_memo *memo)
+{
+  sp_init_mem_pool(&memo->pool);
+  sp_init_ht(&memo->entries, &memo->pool);
+  sp_init_idht(&memo->changed, &memo->pool);
+  memo->generation = 0;
+  sp_init_buffer(&memo->key, &memo->pool);
+  memo->recording = false;
+  sp_init_buffer(&memo->deps, &memo->pool);
+  sp_init_pp_token_list(&memo->result, &memo->pool, 0);
+  memset(&memo->stats, 0, sizeof(memo->stats));
+}
+
+void sp_destroy_pp_memo(struct sp_pp_memo *memo)
+{
+  sp_destroy_mem_pool(&memo->pool);
+}
+
+void sp_pp_memo_macro_changed(struct sp_pp_memo *memo, sp_string_id name_id)
+{
+  memo->generation++;
+  // if this fails the name is just not tracked; entries still checked against older changes
+  sp_add_idht_entry(&memo->changed, name_id, (void *) (uintptr_t) memo->generation);
+}
+
+static int add_key_token(struct sp_buffer *key, struct sp_pp_token *tok)
+{
+  uint8_t head[4] = { tok->type, tok->flags, 0, 0 };
+  int32_t data;
+  switch (tok->type) {
+  case TOK_PP_OTHER: data = tok->data.other; break;
+  case TOK_PP_PUNCT: data = tok->data.punct_id; break;
+  default:           data = tok->data.str_id; break;
+  }
+  if (sp_buf_add_data(key, head, sizeof(head)) < 0 || sp_buf_add_data(key, &data, sizeof(data)) < 0)
+    return -1;
+  return 0;
+}
+
+/*
+ * Make the key of an invocation from the macro name, the whitespace
+ * before it and the tokens of the arguments.
+ */
+int sp_pp_memo_make_key(struct sp_pp_memo *memo, struct sp_macro_def *macro, struct sp_macro_args *args, uint8_t ws)
+{
+  memo->key.size = 0;
+  int32_t head[2] = { macro->name_id, ws };
+  if (sp_buf_add_data(&memo->key, head, sizeof(head)) < 0)
+    return -1;
+  for (int i = 0; i < args->len; i++) {
+    struct sp_pp_token_span *arg = &args->args[i];
+    int32_t len = arg->end - arg->start;
+    if (sp_buf_add_data(&memo->key, &len, sizeof(len)) < 0)
+      return -1;
+    for (int j = arg->start; j < arg->end; j++) {
+      if (add_key_token(&memo->key, sp_get_pp_token_span_token(arg, j)) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+struct sp_pp_memo_entry *sp_pp_memo_lookup(struct sp_pp_memo *memo)
+{
+  memo->stats.lookups++;
+  struct sp_pp_memo_entry *entry = sp_get_ht_value(&memo->entries, memo->key.p, memo->key.size);
+  if (! entry)
+    return NULL;
+  for (int i = 0; i < entry->n_deps; i++) {
+    uint32_t changed = (uint32_t) (uintptr_t) sp_get_idht_value(&memo->changed, entry->deps[i]);
+    if (changed > entry->generation) {
+      memo->stats.stale++;
+      sp_delete_ht_entry(&memo->entries, memo->key.p, memo->key.size);
+      return NULL;
+    }
+  }
+  memo->stats.hits++;
+  return entry;
+}
+
+void sp_pp_memo_start(struct sp_pp_memo *memo, sp_string_id name_id)
+{
+  memo->recording = true;
+  memo->name_id = name_id;
+  memo->deps.size = 0;
+  memo->result.size = 0;
+  if (sp_pp_memo_add_dep(memo, name_id) < 0)
+    sp_pp_memo_abort(memo);
+}
+
+int sp_pp_memo_add_dep(struct sp_pp_memo *memo, sp_string_id name_id)
+{
+  if (sp_buf_add_data(&memo->deps, &name_id, sizeof(name_id)) < 0)
+    return -1;
+  return 0;
+}
+
+int sp_pp_memo_add_token(struct sp_pp_memo *memo, struct sp_pp_token *tok)
+{
+  if (sp_pp_token_list_size(&memo->result) >= PP_MEMO_MAX_TOKENS) {
+    sp_pp_memo_abort(memo);
+    return 0;
+  }
+  return sp_append_pp_token(&memo->result, tok);
+}
+
+static int compare_ids(const void *p1, const void *p2)
+{
+  sp_string_id id1 = *(const sp_string_id *) p1;
+  sp_string_id id2 = *(const sp_string_id *) p2;
+  return (id1 > id2) - (id1 < id2);
+}
+
+/*
+ * Store the recorded expansion.  Whitespace left by empty expansions
+ * at the end goes in a final enable-macro marker for the macro, which
+ * hands it to the token after the expansion when it's replayed.
+ */
+int sp_pp_memo_finish(struct sp_pp_memo *memo, uint8_t trailing_ws)
+{
+  memo->recording = false;
+  if (trailing_ws) {
+    struct sp_pp_token marker = { .type = TOK_PP_ENABLE_MACRO, .flags = trailing_ws };
+    marker.data.str_id = memo->name_id;
+    if (sp_append_pp_token(&memo->result, &marker) < 0)
+      return -1;
+  }
+
+  sp_string_id *deps = (sp_string_id *) memo->deps.p;
+  int n_deps = memo->deps.size / (int) sizeof(sp_string_id);
+  qsort(deps, n_deps, sizeof(sp_string_id), compare_ids);
+  int n_unique = 0;
+  for (int i = 0; i < n_deps; i++) {
+    if (n_unique == 0 || deps[n_unique-1] != deps[i])
+      deps[n_unique++] = deps[i];
+  }
+
+  struct sp_pp_memo_entry *entry = sp_malloc(&memo->pool, sizeof(struct sp_pp_memo_entry));
+  void *key = sp_malloc(&memo->pool, memo->key.size);
+  if (! entry || ! key)
+    return -1;
+  entry->generation = memo->generation;
+  entry->n_deps = n_unique;
+  entry->deps = sp_malloc(&memo->pool, n_unique * sizeof(sp_string_id));
+  if (! entry->deps)
+    return -1;
+  memcpy(entry->deps, deps, n_unique * sizeof(sp_string_id));
+  int n_tokens = sp_pp_token_list_size(&memo->result);
+  sp_init_pp_token_list(&entry->result, &memo->pool, n_tokens);
+  struct sp_pp_token *tokens = sp_pp_token_list_tokens(&memo->result);
+  for (int i = 0; i < n_tokens; i++) {
+    if (sp_append_pp_token(&entry->result, &tokens[i]) < 0)
+      return -1;
+  }
+  memcpy(key, memo->key.p, memo->key.size);
+  if (sp_add_ht_entry(&memo->entries, key, memo->key.size, entry) < 0)
+    return -1;
+  memo->stats.stores++;
+  return 0;
+}
+
+void sp_pp_memo_abort(struct sp_pp_memo *memo)
+{
+  memo->recording = false;
+  memo->stats.uncacheable++;
+}
@@ -0,0 +1,63 @@
+/* pp_memo.h */
+
+#ifndef PP_MEMO_H_FILE
+#define PP_MEMO_H_FILE
+
+#include "internal.h"
+#include "hashtable.h"
+#include "id_hashtable.h"
+#include "buffer.h"
+#include "pp_token_list.h"
+
+struct sp_macro_def;
+struct sp_macro_args;
+
+#define PP_MEMO_MAX_TOKENS 4096  // longest expansion remembered
+
+struct sp_pp_memo_entry {
+  uint32_t generation;        // macro table generation when recorded
+  int n_deps;
+  sp_string_id *deps;         // sorted names looked up in the macro table while expanding
+  struct sp_pp_token_list result;
+};
+
+/*
+ * Memo of the final expansions of function-like macro invocations,
+ * keyed by the macro name and the tokens of the arguments.
+ *
+ * An entry is recorded while the expansion of an invocation in the
+ * source text is read, and only kept if the whole expansion was read
+ * without reaching past its end.  It stays valid while none of the
+ * names looked up in the macro table during the expansion is defined
+ * or undefined.
+ */
+struct sp_pp_memo {
+  struct sp_mem_pool pool;
+  struct sp_hashtable entries;
+  struct sp_id_hashtable changed;  // name -> generation of its last #define or #undef
+  uint32_t generation;
+  struct sp_buffer key;
+
+  // expansion being recorded:
+  bool recording;
+  sp_string_id name_id;
+  struct sp_buffer deps;
+  struct sp_pp_token_list result;
+
+  struct sp_macro_memo_stats stats;
+};
+
+void sp_init_pp_memo(struct sp_pp_memo *memo);
+void sp_destroy_pp_memo(struct sp_pp_memo *memo);
+void sp_pp_memo_macro_changed(struct sp_pp_memo *memo, sp_string_id name_id);
+
+int sp_pp_memo_make_key(struct sp_pp_memo *memo, struct sp_macro_def *macro, struct sp_macro_args *args, uint8_t ws);
+struct sp_pp_memo_entry *sp_pp_memo_lookup(struct sp_pp_memo *memo);
+
+void sp_pp_memo_start(struct sp_pp_memo *memo, sp_string_id name_id);
+int sp_pp_memo_add_dep(struct sp_pp_memo *memo, sp_string_id name_id);
+int sp_pp_memo_add_token(struct sp_pp_memo *memo, struct sp_pp_token *tok);
+int sp_pp_memo_finish(struct sp_pp_memo *memo, uint8_t trailing_ws);
+void sp_pp_memo_abort(struct sp_pp_memo *memo);
+
+#endif /* PP_MEMO_H_FILE */
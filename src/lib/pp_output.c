@@ -0,0 +1,227 @@
+/* pp_output.c */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "pp_output.h"
+#include "preprocessor.h"
+#include "ast.h"
+#include "punct.h"
+
+#define MAX_BLANK_LINES 8  // longer jumps in the same file get a line marker
+
+int sp_init_pp_output(struct sp_pp_output *out, struct sp_mem_pool *pool, int fd)
+{
+  out->buf = sp_malloc(pool, PP_OUTPUT_BUF_SIZE);
+  if (! out->buf)
+    return -1;
+  out->fd = fd;
+  out->len = 0;
+  out->file_id = 0;
+  out->line = 0;
+  out->line_loc = 0;
+  out->started = false;
+  out->at_bol = true;
+  out->last_type = TOK_PP_EOF;
+  out->last_char = '\0';
+  return 0;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int sp_flush_pp_output(struct sp_pp_output *out)
+{
+  if (write_all(out->fd, out->buf, out->len) < 0)
+    return -1;
+  out->len = 0;
+  return 0;
+}
+
+static int put_data(struct sp_pp_output *out, const char *data, size_t len)
+{
+  if (out->len + len > PP_OUTPUT_BUF_SIZE) {
+    if (sp_flush_pp_output(out) < 0)
+      return -1;
+    if (len > PP_OUTPUT_BUF_SIZE)
+      return write_all(out->fd, data, len);
+  }
+  memcpy(out->buf + out->len, data, len);
+  out->len += len;
+  return 0;
+}
+
+static int put_char(struct sp_pp_output *out, char c)
+{
+  if (out->len == PP_OUTPUT_BUF_SIZE && sp_flush_pp_output(out) < 0)
+    return -1;
+  out->buf[out->len++] = c;
+  return 0;
+}
+
+static int put_number(struct sp_pp_output *out, unsigned int n)
+{
+  char digits[16];
+  int pos = sizeof(digits);
+  do {
+    digits[--pos] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  return put_data(out, digits + pos, sizeof(digits) - pos);
+}
+
+/*
+ * Write '# line "file"', escaping the file name like a string literal.
+ */
+static int put_line_marker(struct sp_pp_output *out, struct sp_preprocessor *pp, sp_string_id file_id, int line)
+{
+  if (! out->at_bol && put_char(out, '\n') < 0)
+    return -1;
+  if (put_data(out, "# ", 2) < 0 || put_number(out, line) < 0 || put_data(out, " \"", 2) < 0)
+    return -1;
+  for (const char *p = sp_get_ast_file_name(pp->ast, file_id); *p != '\0'; p++) {
+    if ((*p == '"' || *p == '\\') && put_char(out, '\\') < 0)
+      return -1;
+    if (put_char(out, *p) < 0)
+      return -1;
+  }
+  if (put_data(out, "\"\n", 2) < 0)
+    return -1;
+  out->file_id = file_id;
+  out->line = line;
+  out->started = true;
+  out->at_bol = true;
+  return 0;
+}
+
+/*
+ * Move the output to the line of a token that begins a line.  Tokens
+ * of macro arguments that span lines are placed at the invocation, so
+ * they stay on its line.  A file included again may start on the line
+ * its last inclusion ended on, so that gets a new line marker.
+ */
+static int start_line(struct sp_pp_output *out, struct sp_preprocessor *pp, struct sp_pp_token *tok)
+{
+  struct sp_src_loc loc;
+  if (! sp_get_ast_src_loc(pp->ast, tok->loc, &loc)) {
+    if (out->at_bol)
+      return 0;
+    out->line++;
+    out->at_bol = true;
+    return put_char(out, '\n');
+  }
+
+  sp_src_loc_id line_loc = out->line_loc;
+  out->line_loc = tok->loc;
+  int n_newlines = loc.line - out->line;
+  if (out->started && loc.file_id == out->file_id && n_newlines == 0
+      && sp_get_src_loc_base(&pp->ast->src_locs, tok->loc) == sp_get_src_loc_base(&pp->ast->src_locs, line_loc))
+    return 0;
+  if (! out->started || loc.file_id != out->file_id || n_newlines <= 0 || n_newlines > MAX_BLANK_LINES)
+    return put_line_marker(out, pp, loc.file_id, loc.line);
+
+  for (; n_newlines > 0; n_newlines--)
+    if (put_char(out, '\n') < 0)
+      return -1;
+  out->line = loc.line;
+  out->at_bol = true;
+  return 0;
+}
+
+static bool is_word_char(char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+/*
+ * Check if writing 'first' right after the last token written could
+ * lex as something else (like '+' '+' from different macros becoming
+ * '++').  Errs on the side of adding a space.
+ */
+static bool tokens_could_merge(struct sp_pp_output *out, uint8_t type, char first)
+{
+  char last = out->last_char;
+  if (out->last_type == TOK_PP_NUMBER && strchr("eEpP", last) && (first == '+' || first == '-'))
+    return true;  // an exponent sign continues the number
+  if (is_word_char(last))
+    return is_word_char(first) || first == '"' || first == '\'' || (out->last_type == TOK_PP_NUMBER && first == '.');
+  if (out->last_type == TOK_PP_NUMBER)
+    return first == '.' || first == '+' || first == '-';
+  if (out->last_type == TOK_PP_PUNCT && type == TOK_PP_PUNCT)
+    return strchr("+-*/%<>=!&|^#.:", last) && strchr("+-*/%<>=&|^#.:", first);
+  if (last == '.')
+    return first >= '0' && first <= '9';
+  return false;
+}
+
+int sp_write_pp_output_token(struct sp_pp_output *out, struct sp_preprocessor *pp, struct sp_pp_token *tok)
+{
+  const char *str;
+  size_t len;
+  char other;
+  switch (tok->type) {
+  case TOK_PP_IDENTIFIER:
+  case TOK_PP_NUMBER:
+  case TOK_PP_CHAR_CONST:
+  case TOK_PP_STRING:
+  case TOK_PP_HEADER_NAME:
+    str = sp_get_string(&pp->token_strings, tok->data.str_id);
+    len = sp_get_string_len(&pp->token_strings, tok->data.str_id);
+    break;
+
+  case TOK_PP_PUNCT:
+    if (tok->data.punct_id < 256) {
+      other = (char) tok->data.punct_id;
+      str = &other;
+      len = 1;
+    } else {
+      str = sp_get_punct_name(tok->data.punct_id);
+      len = strlen(str);
+    }
+    break;
+
+  case TOK_PP_OTHER:
+    other = (char) tok->data.other;
+    str = &other;
+    len = 1;
+    break;
+
+  case TOK_PP_EOF:
+    if (! out->at_bol && put_char(out, '\n') < 0)
+      return -1;
+    out->at_bol = true;
+    return 0;
+
+  default:
+    return 0;
+  }
+
+  if (pp_tok_is_bol(tok) && start_line(out, pp, tok) < 0)
+    return -1;
+  if (! out->at_bol) {
+    if (pp_tok_has_space(tok) || tokens_could_merge(out, tok->type, str[0]))
+      if (put_char(out, ' ') < 0)
+        return -1;
+  }
+  if (put_data(out, str, len) < 0)
+    return -1;
+  out->at_bol = false;
+  out->last_type = tok->type;
+  out->last_char = str[len-1];
+  return 0;
+}
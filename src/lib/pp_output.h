@@ -0,0 +1,36 @@
+/* pp_output.h */
+
+#ifndef PP_OUTPUT_H_FILE
+#define PP_OUTPUT_H_FILE
+
+#include "internal.h"
+#include "pp_token.h"
+
+#define PP_OUTPUT_BUF_SIZE (64*1024)
+
+struct sp_preprocessor;
+
+/*
+ * Writes preprocessed tokens as C source text to a file descriptor,
+ * through a buffer so each token costs a copy instead of a write.
+ * Tokens read from the source text get '# line "file"' markers (or
+ * blank lines, for short jumps) so the output keeps their lines.
+ */
+struct sp_pp_output {
+  int fd;
+  char *buf;
+  size_t len;
+  sp_string_id file_id;  // file of the current output line
+  int line;              // line of 'file_id' the current output line comes from
+  sp_src_loc_id line_loc; // location of the token that started the current output line
+  bool started;          // a line marker was written
+  bool at_bol;           // nothing written on the current line
+  uint8_t last_type;     // type of the last token written
+  char last_char;        // last character of the last token written
+};
+
+int sp_init_pp_output(struct sp_pp_output *out, struct sp_mem_pool *pool, int fd);
+int sp_write_pp_output_token(struct sp_pp_output *out, struct sp_preprocessor *pp, struct sp_pp_token *tok);
+int sp_flush_pp_output(struct sp_pp_output *out);
+
+#endif /* PP_OUTPUT_H_FILE */
@@ -0,0 +1,554 @@
+/* pp_pch.c
+ *
+ * Snapshots of the preprocessor state after a prelude file
+ * (precompiled headers).
+ */
+
+#define _POSIX_C_SOURCE 200809L  // for mmap()
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pp_pch.h"
+#include "preprocessor.h"
+#include "pp_macro.h"
+#include "punct.h"
+
+#define PCH_MAGIC    "SPORKPCH"
+#define PCH_VERSION  1
+#define PCH_ALIGN    8
+
+/*
+ * The file is this header followed by sections found by their offset
+ * from the start of the file, so it works wherever it's mapped.
+ * Token lists and macro ops are stored as they are in memory, to be
+ * used in place.  Every section is aligned to PCH_ALIGN bytes.
+ */
+struct pch_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t token_size;   // sizeof(struct sp_pp_token), to reject files from other builds
+  uint32_t op_size;      // sizeof(struct sp_macro_op)
+  uint32_t size;         // of the whole file
+  int32_t cond_level;
+  uint8_t cond_state[PP_MAX_COND_NESTING];
+  uint32_t n_strings;
+  uint32_t strings;      // struct pch_string[n_strings], in string id order
+  uint32_t n_macros;
+  uint32_t macros;       // struct pch_macro[n_macros]
+  uint32_t n_files;
+  uint32_t files;        // struct pch_file[n_files]
+  uint32_t n_paths;
+  uint32_t paths;        // struct pch_path[n_paths]
+};
+
+struct pch_string {
+  uint32_t off;          // followed by '\0'
+  uint32_t len;
+};
+
+struct pch_macro {
+  int32_t name_id;
+  uint8_t is_function;
+  uint8_t is_variadic;
+  uint8_t is_named_variadic;
+  uint8_t pad;
+  uint32_t n_params;
+  uint32_t param_name_ids;
+  uint32_t param_tokens;  // n_params tokens
+  uint32_t n_body_tokens;
+  uint32_t body_tokens;
+  uint32_t n_ops;
+  uint32_t ops;
+};
+
+struct pch_file {
+  uint64_t dev;
+  uint64_t ino;
+  int32_t guard_id;
+  uint32_t once;
+  uint32_t path;         // path first used to include it, followed by '\0'
+  uint32_t path_len;
+};
+
+struct pch_path {
+  uint32_t file;         // index in the files section
+  uint32_t off;          // followed by '\0'
+  uint32_t len;
+  uint32_t pad;
+};
+
+/*
+ * Writing
+ */
+
+static int align_buffer(struct sp_buffer *buf)
+{
+  while (buf->size % PCH_ALIGN != 0) {
+    if (sp_buf_add_byte(buf, 0) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int add_section(struct sp_buffer *buf, const void *data, size_t size, uint32_t *ret_off)
+{
+  if (align_buffer(buf) < 0)
+    return -1;
+  *ret_off = (uint32_t) buf->size;
+  if (size > 0 && sp_buf_add_data(buf, data, size) < 0)
+    return -1;
+  return 0;
+}
+
+static int add_string(struct sp_buffer *buf, const char *str, size_t len, uint32_t *ret_off)
+{
+  *ret_off = (uint32_t) buf->size;
+  if (sp_buf_add_data(buf, str, len) < 0 || sp_buf_add_byte(buf, '\0') < 0)
+    return -1;
+  return 0;
+}
+
+// tokens lose their locations, which mean nothing to other preprocessors
+static int add_tokens(struct sp_buffer *buf, struct sp_pp_token_list *list, uint32_t *ret_off)
+{
+  if (align_buffer(buf) < 0)
+    return -1;
+  *ret_off = (uint32_t) buf->size;
+  struct sp_pp_token *tokens = sp_pp_token_list_tokens(list);
+  for (int i = 0; i < sp_pp_token_list_size(list); i++) {
+    struct sp_pp_token tok;
+    memset(&tok, 0, sizeof(tok));  // no stray padding bytes in the file
+    tok.type = tokens[i].type;
+    tok.flags = tokens[i].flags;
+    tok.data = tokens[i].data;
+    if (sp_buf_add_data(buf, &tok, sizeof(tok)) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int add_macro(struct sp_buffer *buf, struct sp_buffer *items, struct sp_macro_def *macro)
+{
+  struct pch_macro m;
+  memset(&m, 0, sizeof(m));
+  m.name_id = macro->name_id;
+  m.is_function = macro->is_function;
+  m.is_variadic = macro->is_variadic;
+  m.is_named_variadic = macro->is_named_variadic;
+  m.n_params = macro->n_params;
+  m.n_body_tokens = sp_pp_token_list_size(&macro->body);
+  m.n_ops = macro->n_ops;
+  if (add_section(buf, macro->param_name_ids, macro->n_params * sizeof(sp_string_id), &m.param_name_ids) < 0
+      || add_tokens(buf, &macro->params, &m.param_tokens) < 0
+      || add_tokens(buf, &macro->body, &m.body_tokens) < 0
+      || add_section(buf, macro->ops, macro->n_ops * sizeof(struct sp_macro_op), &m.ops) < 0)
+    return -1;
+  return sp_buf_add_data(items, &m, sizeof(m));
+}
+
+static int add_file(struct sp_buffer *buf, struct sp_buffer *items, struct sp_pp_include_file *file, const char *path)
+{
+  struct pch_file f;
+  memset(&f, 0, sizeof(f));
+  f.dev = file->identity.dev;
+  f.ino = file->identity.ino;
+  f.guard_id = file->guard_id;
+  f.once = file->once;
+  f.path_len = (uint32_t) strlen(path);
+  if (add_string(buf, path, f.path_len, &f.path) < 0)
+    return -1;
+  return sp_buf_add_data(items, &f, sizeof(f));
+}
+
+static int add_path(struct sp_buffer *buf, struct sp_buffer *items, uint32_t file_index, const char *path, size_t path_len)
+{
+  struct pch_path p;
+  memset(&p, 0, sizeof(p));
+  p.file = file_index;
+  p.len = (uint32_t) path_len;
+  if (add_string(buf, path, path_len, &p.off) < 0)
+    return -1;
+  return sp_buf_add_data(items, &p, sizeof(p));
+}
+
+static uint32_t get_file_index(struct sp_preprocessor *pp, struct sp_pp_include_file *file)
+{
+  uint32_t index = 0;
+  for (struct sp_pp_include_file *f = pp->include_file_list; f != file; f = f->next)
+    index++;
+  return index;
+}
+
+/*
+ * Write the state of the preprocessor after reading the prelude: the
+ * strings, the macros, the records of included files and the
+ * conditional state.  The prelude itself is recorded as a file
+ * included with '#pragma once', so that including it again from a
+ * file preprocessed with the snapshot does nothing.
+ */
+int sp_write_pp_pch(struct sp_preprocessor *pp, const char *prelude_filename, const char *filename)
+{
+  // macro bodies are stored parsed, which may add strings
+  struct sp_macro_table_walker w;
+  struct sp_macro_def *macro;
+  sp_rewind_macro_table(&w, &pp->macros);
+  while (sp_read_macro_from_table(&w, &macro)) {
+    if (sp_parse_pp_macro_def(pp, macro) < 0)
+      return -1;
+  }
+
+  struct sp_mem_pool pool;
+  struct sp_buffer buf;
+  struct sp_buffer items;
+  sp_init_mem_pool(&pool);
+  sp_init_buffer(&buf, &pool);
+  sp_init_buffer(&items, &pool);
+
+  struct pch_header head;
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, PCH_MAGIC, sizeof(head.magic));
+  head.version = PCH_VERSION;
+  head.token_size = sizeof(struct sp_pp_token);
+  head.op_size = sizeof(struct sp_macro_op);
+  head.cond_level = pp->cond_level;
+  for (int i = 0; i <= pp->cond_level; i++)
+    head.cond_state[i] = (uint8_t) pp->cond_state[i];
+  if (sp_buf_add_data(&buf, &head, sizeof(head)) < 0)
+    goto err_oom;
+
+  // strings
+  for (sp_string_id id = 0; id < pp->token_strings.num; id++) {
+    struct pch_string str;
+    str.len = (uint32_t) sp_get_string_len(&pp->token_strings, id);
+    if (add_string(&buf, sp_get_string(&pp->token_strings, id), str.len, &str.off) < 0
+        || sp_buf_add_data(&items, &str, sizeof(str)) < 0)
+      goto err_oom;
+  }
+  head.n_strings = pp->token_strings.num;
+  if (add_section(&buf, items.p, items.size, &head.strings) < 0)
+    goto err_oom;
+
+  // macros (predefined macros are added by every preprocessor)
+  items.size = 0;
+  sp_rewind_macro_table(&w, &pp->macros);
+  while (sp_read_macro_from_table(&w, &macro)) {
+    if (macro->pre_id != PP_MACRO_NOT_PREDEFINED)
+      continue;
+    if (add_macro(&buf, &items, macro) < 0)
+      goto err_oom;
+    head.n_macros++;
+  }
+  if (add_section(&buf, items.p, items.size, &head.macros) < 0)
+    goto err_oom;
+
+  // included files
+  items.size = 0;
+  for (struct sp_pp_include_file *file = pp->include_file_list; file; file = file->next) {
+    if (add_file(&buf, &items, file, file->path) < 0)
+      goto err_oom;
+    head.n_files++;
+  }
+  struct sp_pp_include_file prelude;
+  bool add_prelude = false;
+  if (sp_get_file_identity(prelude_filename, &prelude.identity)
+      && ! sp_get_ht_value(&pp->include_file_ids, &prelude.identity, sizeof(prelude.identity))) {
+    prelude.guard_id = -1;
+    prelude.once = true;
+    if (add_file(&buf, &items, &prelude, prelude_filename) < 0)
+      goto err_oom;
+    add_prelude = true;
+    head.n_files++;
+  }
+  if (add_section(&buf, items.p, items.size, &head.files) < 0)
+    goto err_oom;
+
+  // all paths used to include the files
+  items.size = 0;
+  const void *key = NULL;
+  size_t key_len;
+  while (sp_next_ht_key(&pp->include_files, &key, &key_len)) {
+    struct sp_pp_include_file *file = sp_get_ht_value(&pp->include_files, key, key_len);
+    if (add_path(&buf, &items, get_file_index(pp, file), key, key_len) < 0)
+      goto err_oom;
+    head.n_paths++;
+  }
+  if (add_prelude) {
+    if (add_path(&buf, &items, head.n_files-1, prelude_filename, strlen(prelude_filename)) < 0)
+      goto err_oom;
+    head.n_paths++;
+  }
+  if (add_section(&buf, items.p, items.size, &head.paths) < 0)
+    goto err_oom;
+
+  head.size = (uint32_t) buf.size;
+  memcpy(buf.p, &head, sizeof(head));
+
+  FILE *f = fopen(filename, "wb");
+  if (! f) {
+    sp_destroy_mem_pool(&pool);
+    return sp_set_error(pp->prog, "can't open '%s'", filename);
+  }
+  bool ok = fwrite(buf.p, 1, buf.size, f) == (size_t) buf.size;
+  if (fclose(f) != 0)
+    ok = false;
+  sp_destroy_mem_pool(&pool);
+  if (! ok)
+    return sp_set_error(pp->prog, "error writing '%s'", filename);
+  return 0;
+
+ err_oom:
+  sp_destroy_mem_pool(&pool);
+  return sp_set_error(pp->prog, "out of memory");
+}
+
+/*
+ * Reading
+ */
+
+int sp_map_pp_pch(struct sp_pp_pch *pch, struct sp_program *prog, const char *filename)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return sp_set_error(prog, "can't open '%s'", filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct pch_header)) {
+    close(fd);
+    return sp_set_error(prog, "invalid precompiled header '%s'", filename);
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return sp_set_error(prog, "can't read '%s'", filename);
+
+  const struct pch_header *head = data;
+  if (memcmp(head->magic, PCH_MAGIC, sizeof(head->magic)) != 0
+      || head->version != PCH_VERSION
+      || head->token_size != sizeof(struct sp_pp_token)
+      || head->op_size != sizeof(struct sp_macro_op)
+      || head->size != (size_t) st.st_size
+      || head->cond_level < -1
+      || head->cond_level >= PP_MAX_COND_NESTING) {
+    munmap(data, st.st_size);
+    return sp_set_error(prog, "invalid precompiled header '%s'", filename);
+  }
+  for (int i = 0; i <= head->cond_level; i++) {
+    if (head->cond_state[i] > PP_COND_DONE) {
+      munmap(data, st.st_size);
+      return sp_set_error(prog, "invalid precompiled header '%s'", filename);
+    }
+  }
+  pch->data = data;
+  pch->size = st.st_size;
+  return 0;
+}
+
+void sp_unmap_pp_pch(struct sp_pp_pch *pch)
+{
+  if (pch->data)
+    munmap(pch->data, pch->size);
+  pch->data = NULL;
+  pch->size = 0;
+}
+
+static const void *get_array(struct sp_pp_pch *pch, uint32_t off, uint32_t n, size_t elem_size)
+{
+  if (off % PCH_ALIGN != 0 || off > pch->size || n > (pch->size - off) / elem_size)
+    return NULL;
+  return (const char *) pch->data + off;
+}
+
+static const char *get_string(struct sp_pp_pch *pch, uint32_t off, uint32_t len)
+{
+  if (off >= pch->size || len >= pch->size - off)
+    return NULL;
+  const char *str = (const char *) pch->data + off;
+  if (str[len] != '\0')
+    return NULL;
+  return str;
+}
+
+static bool map_token_list(struct sp_pp_pch *pch, struct sp_pp_token_list *list, uint32_t off, uint32_t n)
+{
+  const void *tokens = get_array(pch, off, n, sizeof(struct sp_pp_token));
+  if (! tokens)
+    return false;
+  list->pool = NULL;  // never added to
+  list->heap = (n > 0) ? (struct sp_pp_token *) tokens : NULL;
+  list->hide_sets = NULL;
+  list->size = n;
+  list->cap = n;
+  return true;
+}
+
+// make sure bad tokens and ops can't send the preprocessor out of bounds
+static bool check_tokens(struct sp_preprocessor *pp, struct sp_pp_token_list *list)
+{
+  struct sp_pp_token *tokens = sp_pp_token_list_tokens(list);
+  for (int i = 0; i < sp_pp_token_list_size(list); i++) {
+    switch (tokens[i].type) {
+    case TOK_PP_PUNCT:
+      if (! sp_get_punct_name(tokens[i].data.punct_id))
+        return false;
+      break;
+    case TOK_PP_OTHER:
+      if (tokens[i].data.other < CHAR_MIN || tokens[i].data.other > UCHAR_MAX)
+        return false;
+      break;
+    case TOK_PP_HEADER_NAME:
+    case TOK_PP_IDENTIFIER:
+    case TOK_PP_NUMBER:
+    case TOK_PP_CHAR_CONST:
+    case TOK_PP_STRING:
+      if (tokens[i].data.str_id < 0 || tokens[i].data.str_id >= pp->token_strings.num)
+        return false;
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool check_ops(struct sp_macro_def *macro)
+{
+  int body_size = sp_pp_token_list_size(&macro->body);
+  for (int i = 0; i < macro->n_ops; i++) {
+    struct sp_macro_op *op = &macro->ops[i];
+    if (op->type > MACRO_OP_PASTE || op->param >= macro->n_params
+        || op->start < -1 || op->end < op->start || op->end > body_size)
+      return false;
+    if (op->type != MACRO_OP_TOKENS && op->type != MACRO_OP_PASTE && (op->param < 0 || op->start < 0))
+      return false;
+  }
+  return true;
+}
+
+static int load_strings(struct sp_preprocessor *pp, struct sp_pp_pch *pch, const struct pch_header *head)
+{
+  struct sp_string_table *strings = &pp->token_strings;
+  const struct pch_string *pch_strings = get_array(pch, head->strings, head->n_strings, sizeof(struct pch_string));
+  if (! pch_strings || head->n_strings > INT32_MAX)
+    return sp_set_error(pp->prog, "invalid precompiled header");
+  if (sp_reserve_strings(strings, head->n_strings) < 0)
+    return sp_set_error(pp->prog, "out of memory");
+  for (sp_string_id id = 0; id < (sp_string_id) head->n_strings; id++) {
+    const char *str = get_string(pch, pch_strings[id].off, pch_strings[id].len);
+    if (! str)
+      return sp_set_error(pp->prog, "invalid precompiled header");
+    // strings added by a new preprocessor were added in the same order when the snapshot was made
+    if (id < strings->num) {
+      if (strcmp(sp_get_string(strings, id), str) != 0)
+        return sp_set_error(pp->prog, "precompiled header doesn't match the preprocessor");
+      continue;
+    }
+    if (sp_lookup_string_len(strings, str, pch_strings[id].len) >= 0)
+      return sp_set_error(pp->prog, "invalid precompiled header");
+    if (sp_add_static_string(strings, str, pch_strings[id].len) < 0)
+      return sp_set_error(pp->prog, "out of memory");
+  }
+  return 0;
+}
+
+static int load_macros(struct sp_preprocessor *pp, struct sp_pp_pch *pch, const struct pch_header *head)
+{
+  const struct pch_macro *pch_macros = get_array(pch, head->macros, head->n_macros, sizeof(struct pch_macro));
+  if (! pch_macros)
+    return sp_set_error(pp->prog, "invalid precompiled header");
+  for (uint32_t i = 0; i < head->n_macros; i++) {
+    const struct pch_macro *m = &pch_macros[i];
+    if (m->name_id < 0 || m->name_id >= pp->token_strings.num)
+      return sp_set_error(pp->prog, "invalid precompiled header");
+    const sp_string_id *param_name_ids = get_array(pch, m->param_name_ids, m->n_params, sizeof(sp_string_id));
+    const void *ops = get_array(pch, m->ops, m->n_ops, sizeof(struct sp_macro_op));
+    if (! param_name_ids || ! ops || m->n_params > INT16_MAX || m->n_ops > INT32_MAX)
+      return sp_set_error(pp->prog, "invalid precompiled header");
+
+    struct sp_macro_def *macro = sp_malloc(pp->pool, sizeof(struct sp_macro_def));
+    if (! macro)
+      return sp_set_error(pp->prog, "out of memory");
+    macro->pre_id = PP_MACRO_NOT_PREDEFINED;
+    macro->name_id = m->name_id;
+    macro->is_function = m->is_function;
+    macro->is_variadic = m->is_variadic;
+    macro->is_named_variadic = m->is_named_variadic;
+    macro->enabled = true;
+    macro->is_parsed = true;
+    macro->def = NULL;
+    macro->def_size = 0;
+    macro->def_loc = 0;
+    macro->n_params = m->n_params;
+    macro->param_name_ids = (sp_string_id *) param_name_ids;
+    if (! map_token_list(pch, &macro->params, m->param_tokens, m->n_params)
+        || ! map_token_list(pch, &macro->body, m->body_tokens, m->n_body_tokens))
+      return sp_set_error(pp->prog, "invalid precompiled header");
+    macro->n_ops = m->n_ops;
+    macro->ops = (m->n_ops > 0) ? (struct sp_macro_op *) ops : NULL;
+    if (! check_tokens(pp, &macro->params) || ! check_tokens(pp, &macro->body) || ! check_ops(macro))
+      return sp_set_error(pp->prog, "invalid precompiled header");
+    if (sp_set_macro(&pp->macros, macro) < 0)
+      return sp_set_error(pp->prog, "out of memory");
+  }
+  return 0;
+}
+
+static int load_files(struct sp_preprocessor *pp, struct sp_pp_pch *pch, const struct pch_header *head)
+{
+  const struct pch_file *pch_files = get_array(pch, head->files, head->n_files, sizeof(struct pch_file));
+  const struct pch_path *pch_paths = get_array(pch, head->paths, head->n_paths, sizeof(struct pch_path));
+  if (! pch_files || ! pch_paths)
+    return sp_set_error(pp->prog, "invalid precompiled header");
+
+  struct sp_pp_include_file *files = sp_malloc(pp->pool, head->n_files * sizeof(struct sp_pp_include_file) + 1);
+  if (! files)
+    return sp_set_error(pp->prog, "out of memory");
+  for (uint32_t i = 0; i < head->n_files; i++) {
+    const struct pch_file *f = &pch_files[i];
+    struct sp_pp_include_file *file = &files[i];
+    file->path = get_string(pch, f->path, f->path_len);
+    if (! file->path || f->guard_id >= pp->token_strings.num)
+      return sp_set_error(pp->prog, "invalid precompiled header");
+    memset(&file->identity, 0, sizeof(file->identity));  // the key is hashed as bytes
+    file->identity.dev = f->dev;
+    file->identity.ino = f->ino;
+    file->guard_id = (f->guard_id < 0) ? -1 : f->guard_id;
+    file->once = f->once;
+    file->next = NULL;
+    if (sp_add_ht_entry(&pp->include_file_ids, &file->identity, sizeof(file->identity), file) < 0)
+      return sp_set_error(pp->prog, "out of memory");
+    *pp->include_file_list_end = file;
+    pp->include_file_list_end = &file->next;
+  }
+
+  for (uint32_t i = 0; i < head->n_paths; i++) {
+    const struct pch_path *p = &pch_paths[i];
+    const char *path = get_string(pch, p->off, p->len);
+    if (! path || p->file >= head->n_files)
+      return sp_set_error(pp->prog, "invalid precompiled header");
+    if (sp_add_ht_entry(&pp->include_files, path, p->len, &files[p->file]) < 0)
+      return sp_set_error(pp->prog, "out of memory");
+  }
+  return 0;
+}
+
+/*
+ * Start a new preprocessor (with nothing read yet) from a snapshot.
+ * The strings and token lists of the snapshot are used in place.
+ */
+int sp_load_pp_pch(struct sp_preprocessor *pp, struct sp_pp_pch *pch)
+{
+  const struct pch_header *head = pch->data;
+  if (load_strings(pp, pch, head) < 0
+      || load_macros(pp, pch, head) < 0
+      || load_files(pp, pch, head) < 0)
+    return -1;
+  pp->cond_level = head->cond_level;
+  for (int i = 0; i <= head->cond_level; i++)
+    pp->cond_state[i] = head->cond_state[i];
+  return 0;
+}
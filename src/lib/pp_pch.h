@@ -0,0 +1,25 @@
+/* pp_pch.h */
+
+#ifndef PP_PCH_H_FILE
+#define PP_PCH_H_FILE
+
+#include "internal.h"
+
+struct sp_preprocessor;
+
+/*
+ * A snapshot of the preprocessor state, mapped from a file made by
+ * sp_write_pp_pch().  Preprocessors started from it share its strings
+ * and macro bodies, so it must stay mapped while they're used.
+ */
+struct sp_pp_pch {
+  void *data;  // NULL if not mapped
+  size_t size;
+};
+
+int sp_write_pp_pch(struct sp_preprocessor *pp, const char *prelude_filename, const char *filename);
+int sp_map_pp_pch(struct sp_pp_pch *pch, struct sp_program *prog, const char *filename);
+void sp_unmap_pp_pch(struct sp_pp_pch *pch);
+int sp_load_pp_pch(struct sp_preprocessor *pp, struct sp_pp_pch *pch);
+
+#endif /* PP_PCH_H_FILE */
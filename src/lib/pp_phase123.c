@@ -10,6 +10,7 @@
 #include <inttypes.h>
 
 #include "preprocessor.h"
+#include "compiler.h"
 #include "input.h"
 #include "pp_token.h"
 #include "punct.h"
@@ -22,6 +23,9 @@
 #define ERR_UNTERMINATED_COMMENT     -6
 #define ERR_INVALID_ESCAPE_SEQUENCE  -7
 
+// read_token() result for whitespace, which is folded into the flags of the next token
+#define READ_WHITESPACE              0x100
+
 #define set_error sp_set_pp_error
 
 #define IS_SPACE(c)      ((c) == ' ' || (c) == '\r' || (c) == '\n' || (c) == '\t')
@@ -429,7 +433,7 @@ static int read_token(struct sp_input *in, struct sp_buffer *buf, size_t *pos, b
     }
     if (err)
       return err;
-    return (got_newline) ? '\n' : ' ';
+    return (got_newline) ? TOK_PP_NEWLINE : READ_WHITESPACE;
   }
 
   /* newlines */
@@ -445,7 +449,7 @@ static int read_token(struct sp_input *in, struct sp_buffer *buf, size_t *pos, b
       goto skip_newlines;
     if (err)
       return err;
-    return '\n';
+    return TOK_PP_NEWLINE;
   }
 
   /* <header> or "header" */
@@ -530,10 +534,12 @@ static int read_token(struct sp_input *in, struct sp_buffer *buf, size_t *pos, b
     SET_POS(start_pos);
   }
   
-  int c = CUR;
+  buf->size = 0;
+  if (sp_buf_add_byte(buf, CUR) < 0)
+    return ERR_OUT_OF_MEMORY;
   *pos = CUR_POS;
   ADVANCE();
-  return c;
+  return TOK_PP_OTHER;
 }
 
 static bool next_char_is_lparen(struct sp_input *in)
@@ -554,49 +560,19 @@ bool sp_next_pp_ph3_char_is_lparen(struct sp_preprocessor *pp)
   return next_char_is_lparen(pp->in);
 }
 
-static void get_input_location(struct sp_preprocessor *pp, size_t pos, struct sp_src_loc *loc)
-{
-  size_t start_pos;
-  uint16_t cur_file_id = sp_get_input_file_id(pp->in);
-
-  // start from last known position if possible
-  if (pp->tok_loc.pos != (size_t) -1 && pp->tok_loc.loc.file_id == cur_file_id && pp->tok_loc.pos <= pos) {
-    //printf("<cur %zu>", pos - pp->tok_loc.pos);
-    start_pos = pp->tok_loc.pos;
-    *loc = pp->tok_loc.loc;
-  } else if (pp->last_tok_loc.pos != (size_t) -1 && pp->last_tok_loc.loc.file_id == cur_file_id && pp->last_tok_loc.pos <= pos) {
-    //printf("<last %zu>", pos - pp->last_tok_loc.pos);
-    start_pos = pp->last_tok_loc.pos;
-    *loc = pp->last_tok_loc.loc;
-  } else {
-    //printf("\n\n*********** starting from beginning ***************\n\n");
-    start_pos = 0;
-    loc->file_id = cur_file_id;
-    loc->line = 1;
-    loc->col = 1;
-  }
-
-  // advance to requested position
-  if (pos > pp->in->size)
-    pos = pp->in->size;
-  for (size_t p = start_pos; p < pos; p++) {
-    if (pp->in->data[p] == '\n') {
-      loc->line++;
-      loc->col = 1;
-    } else
-      loc->col++;
-  }
-
-  // save current position as last known position
-  pp->last_tok_loc = pp->tok_loc;
-  pp->tok_loc.pos = pos;
-  pp->tok_loc.loc = *loc;
-}
-
 static int next_token(struct sp_preprocessor *pp, struct sp_pp_token *tok, bool parse_header)
 {
   size_t pos = 0;
-  int type = read_token(pp->in, &pp->tmp_buf, &pos, parse_header);
+  int type;
+  while (true) {
+    type = read_token(pp->in, &pp->tmp_buf, &pos, parse_header);
+    if (type == READ_WHITESPACE)
+      pp->next_tok_flags |= PP_TOK_FLAG_SPACE;
+    else if (type == TOK_PP_NEWLINE && ! pp->in_directive)
+      pp->next_tok_flags |= PP_TOK_FLAG_BOL;
+    else
+      break;
+  }
 
   // error
   if (type < 0) {
@@ -612,32 +588,23 @@ static int next_token(struct sp_preprocessor *pp, struct sp_pp_token *tok, bool
     return set_error(pp, "internal error");
   }
 
-  get_input_location(pp, pos, &tok->loc);
-  tok->macro_dead = false;
-  tok->paste_dead = false;
+  tok->loc = pp->in->loc_base + (sp_src_loc_id) pos;
+  tok->flags = pp->next_tok_flags;
+  pp->next_tok_flags = 0;
 
-  // EOF
-  if (type == TOK_PP_EOF) {
-    tok->type = TOK_PP_EOF;
-    return 0;
-  }
-  
-  // space
-  if (type == ' ') {
-    tok->type = TOK_PP_SPACE;
-    return 0;
-  }
-
-  // newline
-  if (type == '\n') {
-    tok->type = TOK_PP_NEWLINE;
+  // EOF and end of directive
+  if (type == TOK_PP_EOF || type == TOK_PP_NEWLINE) {
+    tok->type = type;
+    pp->in_directive = false;
+    if (type == TOK_PP_NEWLINE)
+      pp->next_tok_flags = PP_TOK_FLAG_BOL;
     return 0;
   }
 
   // other
-  if (type < 256) {
+  if (type == TOK_PP_OTHER) {
     tok->type = TOK_PP_OTHER;
-    tok->data.other = type;
+    tok->data.other = (unsigned char) pp->tmp_buf.p[0];
     return 0;
   }
 
@@ -657,6 +624,211 @@ static int next_token(struct sp_preprocessor *pp, struct sp_pp_token *tok, bool
   return 0;
 }
 
+/*
+ * Skip the rest of the line and its newline.  Strings and character
+ * constants are only followed to find comment starts inside them, so
+ * they may be unterminated (e.g. an apostrophe in text).
+ */
+static void skip_line(struct sp_input *in, int *err)
+{
+  while (CUR >= 0 && CUR != '\n') {
+    if (CUR == '\\') {
+      if (! skip_bs_newline(in))
+        ADVANCE();
+    } else if (CUR == '/') {
+      if (! skip_comments(in, err)) {
+        if (*err)
+          return;
+        ADVANCE();
+      }
+    } else if (CUR == '"' || CUR == '\'') {
+      int quote = CUR;
+      ADVANCE();
+      while (CUR >= 0 && CUR != '\n' && CUR != quote) {
+        if (CUR == '\\') {
+          if (skip_bs_newline(in))
+            continue;
+          ADVANCE();  // escaped character
+          if (CUR < 0 || CUR == '\n')
+            break;
+        }
+        ADVANCE();
+      }
+      if (CUR == quote)
+        ADVANCE();
+    } else
+      ADVANCE();
+  }
+  if (CUR == '\n')
+    ADVANCE();
+}
+
+/*
+ * Skip the lines of a group whose condition is false, stopping before
+ * the '#elif', '#else' or '#endif' that ends it (or at the end of the
+ * input).  Nothing is tokenized: nested conditionals are only
+ * followed to find their '#endif'.  Where the group ends is recorded
+ * for included files, so the next time it's skipped it's jumped over.
+ */
+int sp_skip_pp_ph3_group(struct sp_preprocessor *pp)
+{
+  struct sp_input *in = pp->in;
+  size_t start = CUR_POS;
+  size_t end;
+  if (in->skips && sp_find_pp_skip_range(in->skips, start, &end)) {
+    SET_POS(end);
+    pp->next_tok_flags = PP_TOK_FLAG_BOL;
+    return 0;
+  }
+
+  int depth = 0;
+  int err = 0;
+  while (CUR >= 0) {
+    size_t line_start = CUR_POS;
+    while (skip_spaces(in) || skip_bs_newline(in) || skip_comments(in, &err))
+      ;
+    if (err)
+      break;
+    if (CUR == '#') {
+      ADVANCE();
+      while (skip_spaces(in) || skip_bs_newline(in) || skip_comments(in, &err))
+        ;
+      if (err)
+        break;
+      if (IS_ALPHA(CUR)) {
+        if (read_ident(in, &pp->tmp_buf) < 0)
+          return set_error(pp, "out of memory");
+        const char *name = pp->tmp_buf.p;
+        if (strcmp(name, "if") == 0 || strcmp(name, "ifdef") == 0 || strcmp(name, "ifndef") == 0) {
+          depth++;
+        } else if (strcmp(name, "endif") == 0 || strcmp(name, "elif") == 0 || strcmp(name, "else") == 0) {
+          if (depth == 0) {
+            SET_POS(line_start);
+            break;
+          }
+          if (strcmp(name, "endif") == 0)
+            depth--;
+        }
+      }
+    }
+    skip_line(in, &err);
+    if (err)
+      break;
+  }
+  if (err)
+    return set_error(pp, "unterminated comment");
+  if (in->skips && sp_add_pp_skip_range(&pp->comp->skip_index, in->skips, start, CUR_POS) < 0)
+    return set_error(pp, "out of memory");
+  pp->next_tok_flags = PP_TOK_FLAG_BOL;
+  return 0;
+}
+
+/*
+ * Skip the rest of the line and the lines of text after it, stopping
+ * before the next line that starts with '#' (or at the end of the
+ * input).  Used by dependency scans, where text is never expanded.
+ */
+int sp_skip_pp_ph3_text(struct sp_preprocessor *pp)
+{
+  struct sp_input *in = pp->in;
+  int err = 0;
+  skip_line(in, &err);
+  while (! err && CUR >= 0) {
+    size_t line_start = CUR_POS;
+    while (skip_spaces(in) || skip_bs_newline(in) || skip_comments(in, &err))
+      ;
+    if (err)
+      break;
+    if (CUR == '#') {
+      SET_POS(line_start);
+      break;
+    }
+    skip_line(in, &err);
+  }
+  if (err)
+    return set_error(pp, "unterminated comment");
+  pp->next_tok_flags = PP_TOK_FLAG_BOL;
+  return 0;
+}
+
+/*
+ * Skip the rest of a directive line without tokenizing it, and return
+ * its text (without the newline) and the location where it starts.
+ * The text points to the input, so it's only valid until the input
+ * is freed.
+ */
+int sp_read_pp_ph3_directive_text(struct sp_preprocessor *pp, const char **ret_text, size_t *ret_size, sp_src_loc_id *ret_loc)
+{
+  struct sp_input *in = pp->in;
+  size_t start = CUR_POS;
+  int err = 0;
+  skip_line(in, &err);
+  if (err)
+    return set_error(pp, "unterminated comment");
+  size_t end = CUR_POS;
+  if (end > start && in->data[end-1] == '\n')
+    end--;
+  *ret_text = (const char *) &in->data[start];
+  *ret_size = end - start;
+  *ret_loc = in->loc_base + (sp_src_loc_id) start;
+  pp->in_directive = false;
+  pp->next_tok_flags = PP_TOK_FLAG_BOL;
+  return 0;
+}
+
+static int add_newlines(struct sp_buffer *out, const unsigned char *start, const unsigned char *end)
+{
+  for (const unsigned char *p = start; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+    if (sp_buf_add_byte(out, '\n') < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Write to 'out' the directive-only form of an input, for dependency
+ * scans.  Directive lines are copied as they are and the other lines
+ * are emptied, so every line keeps its number.  The first line of a
+ * run of text keeps a ';', since text outside of an '#ifndef' group
+ * means the file has no include guard.
+ *
+ * Returns -1 on unterminated comments (the input must then be scanned
+ * as it is, to report the error) or if out of memory.
+ */
+int sp_minimize_pp_input(struct sp_input *in, struct sp_buffer *out)
+{
+  int err = 0;
+  bool in_text = false;
+  SET_POS(0);
+  while (CUR >= 0) {
+    size_t line_start = CUR_POS;
+    while (skip_spaces(in) || skip_bs_newline(in) || skip_comments(in, &err))
+      ;
+    if (err)
+      return -1;
+    bool is_directive = (CUR == '#');
+    bool is_blank = (CUR < 0 || CUR == '\n');
+    skip_line(in, &err);
+    if (err)
+      return -1;
+    if (is_directive) {
+      if (sp_buf_add_data(out, &in->data[line_start], CUR_POS - line_start) < 0)
+        return -1;
+      in_text = false;
+      continue;
+    }
+    if (! is_blank && ! in_text) {
+      if (sp_buf_add_byte(out, ';') < 0)
+        return -1;
+      in_text = true;
+    }
+    if (add_newlines(out, &in->data[line_start], &in->data[CUR_POS]) < 0)
+      return -1;
+  }
+  SET_POS(0);
+  return 0;
+}
+
 static bool skip_hex_quad(const char **pstr)
 {
   const char *str = *pstr;
@@ -854,22 +1026,51 @@ int sp_string_to_pp_token(struct sp_preprocessor *pp, const char *str, struct sp
   return -1;
 }
 
+#define PEEK_MATCHES(pp, peek, parse_hdr) ((peek)->in == (pp)->in                       \
+                                           && (peek)->pos == CUR_IN_POS((pp)->in)     \
+                                           && (peek)->flags == (pp)->next_tok_flags   \
+                                           && (peek)->in_directive == (pp)->in_directive \
+                                           && (peek)->parse_header == (parse_hdr))
+
 int sp_next_pp_ph3_token(struct sp_preprocessor *pp, bool parse_header)
 {
+  struct sp_pp_ph3_peek *peek = &pp->ph3_peek;
+  if (peek->in) {
+    if (PEEK_MATCHES(pp, peek, parse_header)) {
+      pp->tok = peek->tok;
+      SET_IN_POS(pp->in, peek->end_pos);
+      pp->next_tok_flags = peek->end_flags;
+      pp->in_directive = peek->end_in_directive;
+      peek->in = NULL;
+      return 0;
+    }
+    peek->in = NULL;
+  }
   return next_token(pp, &pp->tok, parse_header);
 }
 
-int sp_peek_nonblank_pp_ph3_token(struct sp_preprocessor *pp, struct sp_pp_token *next, bool parse_header)
+int sp_peek_pp_ph3_token(struct sp_preprocessor *pp, struct sp_pp_token *next, bool parse_header)
 {
-  int rewind_pos = CUR_IN_POS(pp->in);
-  do {
-    if (next_token(pp, next, parse_header) < 0)
-      goto err;
-  } while (next->type == TOK_PP_SPACE || next->type == TOK_PP_NEWLINE);
-  SET_IN_POS(pp->in, rewind_pos);
+  struct sp_pp_ph3_peek *peek = &pp->ph3_peek;
+  if (peek->in && PEEK_MATCHES(pp, peek, parse_header)) {
+    *next = peek->tok;
+    return 0;
+  }
+
+  peek->in = NULL;
+  peek->pos = CUR_IN_POS(pp->in);
+  peek->flags = pp->next_tok_flags;
+  peek->in_directive = pp->in_directive;
+  peek->parse_header = parse_header;
+  if (next_token(pp, &peek->tok, parse_header) < 0)
+    return -1;
+  peek->end_pos = CUR_IN_POS(pp->in);
+  peek->end_flags = pp->next_tok_flags;
+  peek->end_in_directive = pp->in_directive;
+  SET_IN_POS(pp->in, peek->pos);
+  pp->next_tok_flags = peek->flags;
+  pp->in_directive = peek->in_directive;
+  peek->in = pp->in;
+  *next = peek->tok;
   return 0;
-  
- err:
-  SET_IN_POS(pp->in, rewind_pos);
-  return -1;
 }
@@ -23,7 +23,6 @@
 #define IS_EOF()               IS_TOK_TYPE(TOK_PP_EOF)
 #define IS_ENABLE_MACRO()      IS_TOK_TYPE(TOK_PP_ENABLE_MACRO)
 #define IS_END_OF_LIST()       IS_TOK_TYPE(TOK_PP_END_OF_LIST)
-#define IS_SPACE()             IS_TOK_TYPE(TOK_PP_SPACE)
 #define IS_NEWLINE()           IS_TOK_TYPE(TOK_PP_NEWLINE)
 #define IS_PP_HEADER_NAME()    IS_TOK_TYPE(TOK_PP_HEADER_NAME)
 #define IS_STRING()            IS_TOK_TYPE(TOK_PP_STRING)
@@ -37,7 +36,6 @@ static int token_to_string(struct sp_preprocessor *pp, struct sp_pp_token *tok,
   case TOK_PP_ENABLE_MACRO:
   case TOK_PP_END_OF_LIST:
   case TOK_PP_NEWLINE:
-  case TOK_PP_SPACE:
   case TOK_PP_PASTE_MARKER:
     set_error(pp, "invalid token to paste");
     return -1;
@@ -122,35 +120,132 @@ static int token_to_string(struct sp_preprocessor *pp, struct sp_pp_token *tok,
   return -1;
 }
 
-static int paste_tokens(struct sp_preprocessor *pp, struct sp_pp_token *tok1, struct sp_pp_token *tok2, struct sp_pp_token *ret)
+static int add_hide_set(struct sp_preprocessor *pp, sp_hide_set_id *tok_hs, sp_hide_set_id hs)
+{
+  if (hs == SP_EMPTY_HIDE_SET)
+    return 0;
+  int new_hs = sp_hide_set_union(&pp->hide_sets, *tok_hs, hs);
+  if (new_hs < 0)
+    return set_error(pp, "out of memory");
+  *tok_hs = (sp_hide_set_id) new_hs;
+  return 0;
+}
+
+static int add_token_spelling(struct sp_preprocessor *pp, struct sp_buffer *buf, struct sp_pp_token *tok)
+{
+  int ret;
+  switch (tok->type) {
+  case TOK_PP_OTHER:
+    ret = sp_buf_add_byte(buf, (uint8_t) tok->data.other);
+    break;
+
+  case TOK_PP_PUNCT:
+    ret = sp_buf_add_string(buf, sp_get_punct_name(tok->data.punct_id));
+    break;
+
+  case TOK_PP_IDENTIFIER:
+  case TOK_PP_HEADER_NAME:
+  case TOK_PP_NUMBER:
+  case TOK_PP_CHAR_CONST:
+  case TOK_PP_STRING:
+    ret = sp_buf_add_data(buf, sp_get_pp_token_string(pp, tok), sp_get_string_len(&pp->token_strings, tok->data.str_id));
+    break;
+
+  default:
+    return set_error(pp, "invalid token to paste");
+  }
+  if (ret < 0)
+    return set_error(pp, "out of memory");
+  return 0;
+}
+
+static bool is_identifier_spelling(const char *str, size_t len)
+{
+  for (size_t i = 0; i < len; i++) {
+    char c = str[i];
+    if (! ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'))
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Return the type of the token made by pasting two tokens, if it can
+ * be known without looking at the whole spelling; otherwise -1.
+ */
+static int get_pasted_type(struct sp_preprocessor *pp, struct sp_pp_token *tok1, struct sp_pp_token *tok2)
+{
+  if (tok1->type == TOK_PP_IDENTIFIER) {
+    if (tok2->type == TOK_PP_IDENTIFIER)
+      return TOK_PP_IDENTIFIER;
+    if (tok2->type == TOK_PP_NUMBER
+        && is_identifier_spelling(sp_get_pp_token_string(pp, tok2), sp_get_string_len(&pp->token_strings, tok2->data.str_id)))
+      return TOK_PP_IDENTIFIER;
+  }
+  // [6.4.8] a pp-number followed by digits or identifier characters is still a pp-number
+  if (tok1->type == TOK_PP_NUMBER && (tok2->type == TOK_PP_IDENTIFIER || tok2->type == TOK_PP_NUMBER))
+    return TOK_PP_NUMBER;
+  return -1;
+}
+
+/*
+ * Paste two tokens with hide sets 'hs1' and 'hs2', giving the result
+ * and its hide set.
+ */
+static int paste_tokens(struct sp_preprocessor *pp, struct sp_pp_token *tok1, sp_hide_set_id hs1,
+                        struct sp_pp_token *tok2, sp_hide_set_id hs2, struct sp_pp_token *ret, sp_hide_set_id *ret_hs)
 {
   //printf("PASTING ('%s'", sp_dump_pp_token(pp, tok1));
   //printf(" AND '%s')", sp_dump_pp_token(pp, tok2));
   
   if (tok1->type == TOK_PP_PASTE_MARKER) {
     *ret = *tok2;
+    *ret_hs = hs2;
+    pp_tok_copy_whitespace(ret, tok1);
     return 0;
   }
   if (tok2->type == TOK_PP_PASTE_MARKER) {
     *ret = *tok1;
+    *ret_hs = hs1;
     return 0;
   }
-  
-  char str[4096];
-  size_t str_len = 0;
-  if (token_to_string(pp, tok1, str + str_len, sizeof(str) - str_len, false) < 0)
-    return -1;
-  str_len += strlen(str);
-  if (token_to_string(pp, tok2, str + str_len, sizeof(str) - str_len, false) < 0)
-    return -1;
 
-  if (sp_string_to_pp_token(pp, str, ret) < 0)
-    return -1;
-  ret->paste_dead = true;
+  // [Prosser] the result is hidden from what's hidden from both operands
+  int hs = sp_hide_set_intersection(&pp->hide_sets, hs1, hs2);
+  if (hs < 0)
+    return set_error(pp, "out of memory");
+
+  int punct_id = -1;
+  if (tok1->type == TOK_PP_PUNCT && tok2->type == TOK_PP_PUNCT)
+    punct_id = sp_paste_puncts(tok1->data.punct_id, tok2->data.punct_id);
+  if (punct_id >= 0) {
+    ret->type = TOK_PP_PUNCT;
+    ret->data.punct_id = punct_id;
+  } else {
+    struct sp_buffer *buf = &pp->paste_buf;
+    buf->size = 0;
+    if (add_token_spelling(pp, buf, tok1) < 0 || add_token_spelling(pp, buf, tok2) < 0)
+      return -1;
+    int type = get_pasted_type(pp, tok1, tok2);
+    if (type >= 0) {
+      ret->type = type;
+      ret->data.str_id = sp_add_string_len(&pp->token_strings, buf->p, buf->size);
+      if (ret->data.str_id < 0)
+        return set_error(pp, "out of memory");
+    } else {
+      if (sp_buf_add_byte(buf, '\0') < 0)
+        return set_error(pp, "out of memory");
+      if (sp_string_to_pp_token(pp, buf->p, ret) < 0)
+        return -1;
+    }
+  }
+  ret->flags = PP_TOK_FLAG_PASTE_DEAD | (tok1->flags & PP_TOK_WHITESPACE_FLAGS);
+  *ret_hs = (sp_hide_set_id) hs;
+  ret->loc = tok1->loc;
   return 0;
 }
 
-static int stringify_list(struct sp_preprocessor *pp, struct sp_pp_token_list *list, struct sp_pp_token *ret)
+static int stringify_arg(struct sp_preprocessor *pp, struct sp_pp_token_span *arg, struct sp_pp_token *ret)
 {
   char str[4096];  // enough according to "5.2.4.1 Translation limits"
   char *cur = str;
@@ -159,39 +254,17 @@ static int stringify_list(struct sp_preprocessor *pp, struct sp_pp_token_list *l
     goto err;
   *cur++ = '"';
 
-  bool last_was_space = false;
-  struct sp_pp_token_list_walker w;
-  struct sp_pp_token *tok = sp_rewind_pp_token_list(&w, list);
-  while (sp_read_pp_token_from_list(&w, &tok)) {
-    switch (tok->type) {
-    case TOK_PP_EOF:
-      if (str + sizeof(str) <= cur+1)
-        goto err;
+  for (int i = arg->start; i < arg->end; i++) {
+    struct sp_pp_token *tok = sp_get_pp_token_span_token(arg, i);
+    if (str + sizeof(str) <= cur+1)
+      goto err;
+    if (i > arg->start && pp_tok_has_space(tok))
       *cur++ = ' ';
-      break;
-
-    case TOK_PP_ENABLE_MACRO:
-    case TOK_PP_END_OF_LIST:
-      break;
-
-    case TOK_PP_NEWLINE:
-    case TOK_PP_SPACE:
-      last_was_space = true;
-      break;
-
-    default:
-      if (str + sizeof(str) <= cur+1)
-        goto err;
-      if (last_was_space)
-        *cur++ = ' ';
-      if (str + sizeof(str) <= cur+1)
-        goto err;
-      if (token_to_string(pp, tok, cur, sizeof(str) - (cur-str), true) < 0)
-        return -1;
-      cur += strlen(cur);
-      last_was_space = false;
-      break;
-    }
+    if (str + sizeof(str) <= cur+1)
+      goto err;
+    if (token_to_string(pp, tok, cur, sizeof(str) - (cur-str), true) < 0)
+      return -1;
+    cur += strlen(cur);
   }
   if (str + sizeof(str) <= cur+1)
     goto err;
@@ -200,6 +273,7 @@ static int stringify_list(struct sp_preprocessor *pp, struct sp_pp_token_list *l
     goto err;
   *cur = '\0';
   ret->type = TOK_PP_STRING;
+  ret->flags = 0;
   ret->data.str_id = sp_add_string(&pp->token_strings, str);
   if (ret->data.str_id < 0)
     return set_error(pp, "out of memory");
@@ -209,6 +283,54 @@ static int stringify_list(struct sp_preprocessor *pp, struct sp_pp_token_list *l
   return set_error(pp, "string too large");
 }
 
+/*
+ * Add the current token to an argument.  While the tokens come in
+ * order from the same buffered list, the argument is just a view of
+ * that list; otherwise it's moved to a list of its own.
+ */
+static int add_macro_arg_token(struct sp_preprocessor *pp, struct sp_pp_token_span *arg, bool *is_copy)
+{
+  if (! *is_copy && pp->tok_list) {
+    if (sp_macro_arg_is_empty(arg)) {
+      arg->list = pp->tok_list;
+      arg->start = pp->tok_index;
+      arg->end = pp->tok_index + 1;
+      arg->hide_set = pp->tok_list_hide_set;
+      return 0;
+    }
+    if (arg->list == pp->tok_list && arg->end == pp->tok_index
+        && arg->hide_set == pp->tok_list_hide_set && ! pp->tok_changed) {
+      arg->end++;
+      return 0;
+    }
+  }
+
+  if (! *is_copy) {
+    struct sp_pp_token_list *copy = sp_new_pp_token_list(&pp->macro_exp_pool, arg->end - arg->start + 1);
+    if (! copy)
+      goto err_oom;
+    for (int i = arg->start; i < arg->end; i++) {
+      sp_hide_set_id hs = sp_get_pp_token_list_hide_set(arg->list, i);
+      if (add_hide_set(pp, &hs, arg->hide_set) < 0)
+        return -1;
+      if (sp_append_pp_token_with_hide_set(copy, sp_get_pp_token_span_token(arg, i), hs) < 0)
+        goto err_oom;
+    }
+    arg->list = copy;
+    arg->start = 0;
+    arg->end = sp_pp_token_list_size(copy);
+    arg->hide_set = SP_EMPTY_HIDE_SET;
+    *is_copy = true;
+  }
+  if (sp_append_pp_token_with_hide_set(arg->list, &pp->tok, pp->tok_hide_set) < 0)
+    goto err_oom;
+  arg->end++;
+  return 0;
+
+ err_oom:
+  return set_error(pp, "out of memory");
+}
+
 static struct sp_macro_args *read_macro_args(struct sp_preprocessor *pp, struct sp_macro_def *macro)
 {
   struct sp_macro_args *args = sp_new_macro_args(macro, &pp->macro_exp_pool);
@@ -219,10 +341,8 @@ static struct sp_macro_args *read_macro_args(struct sp_preprocessor *pp, struct
 
   //printf("READING %d MACRO ARGS FOR '%s'\n", macro->n_params, sp_get_macro_name(macro, pp));
 
-  do {
-    if (sp_next_pp_ph4_processed_token(pp, false) < 0)
-      return NULL;
-  } while (IS_SPACE());
+  if (sp_next_pp_ph4_processed_token(pp, false) < 0)
+    return NULL;
   if (! IS_PUNCT('(')) {
     set_error(pp, "expected '(', found '%s'", sp_dump_pp_token(pp, &pp->tok));
     goto err;
@@ -230,14 +350,18 @@ static struct sp_macro_args *read_macro_args(struct sp_preprocessor *pp, struct
 
   int paren_level = 0;
   bool arg_start = true;
+  int copy_index = -1;  // index of the argument that has its own list
   while (true) {
-    // skip initial spaces and newlines
-    do {
-      if (sp_next_pp_ph4_processed_token(pp, false) < 0)
-        goto err;
-      if (! arg_start)
-        break;
-    } while (IS_SPACE() || IS_NEWLINE());
+    if (sp_next_pp_ph4_processed_token(pp, false) < 0)
+      goto err;
+
+    // leading whitespace is not part of the argument, and newlines are just spaces
+    if (arg_start)
+      pp->tok.flags &= ~PP_TOK_WHITESPACE_FLAGS;
+    else if (pp_tok_is_bol(&pp->tok)) {
+      pp->tok.flags = (pp->tok.flags & ~PP_TOK_FLAG_BOL) | PP_TOK_FLAG_SPACE;
+      pp->tok_changed = true;
+    }
     arg_start = false;
     
     // check end or next
@@ -278,8 +402,11 @@ static struct sp_macro_args *read_macro_args(struct sp_preprocessor *pp, struct
       set_error(pp, "unterminated argument list for macro '%s'", sp_get_macro_name(macro, pp));
       goto err;
     }
-    if (sp_append_pp_token(&args->args[add_index], &pp->tok) < 0)
-      goto err_oom;
+    bool is_copy = (add_index == copy_index);
+    if (add_macro_arg_token(pp, &args->args[add_index], &is_copy) < 0)
+      goto err;
+    if (is_copy)
+      copy_index = add_index;
   }
 
   if (macro->is_variadic) {
@@ -297,30 +424,52 @@ static struct sp_macro_args *read_macro_args(struct sp_preprocessor *pp, struct
   // adjust stored number of args
   args->len = macro->n_params;
 
-  // append end-of-list marker to each arg
-  for (int i = 0; i < args->len; i++) {
-    struct sp_pp_token eoa = ((struct sp_pp_token) { .type = TOK_PP_END_OF_LIST });
-    if (sp_append_pp_token(&args->args[i], &eoa) < 0)
-      goto err_oom;
-  }
-  
   pp->macro_args_reading_level--;
   return args;
 
  err_oom:
-  set_error(pp, "expected '(', found '%s'", sp_dump_pp_token(pp, &pp->tok));
+  set_error(pp, "out of memory");
  err:
   return NULL;
 }
 
-static struct sp_pp_token_list *expand_arg(struct sp_preprocessor *pp, struct sp_pp_token_list *arg)
+static struct sp_pp_token_list_walker *push_ph4_input(struct sp_preprocessor *pp)
+{
+  if (pp->in_tokens_len == pp->in_tokens_cap) {
+    int new_cap = (pp->in_tokens_cap == 0) ? 32 : 2*pp->in_tokens_cap;
+    struct sp_pp_token_list_walker *new_in_tokens = sp_malloc(pp->pool, new_cap * sizeof(struct sp_pp_token_list_walker));
+    if (! new_in_tokens) {
+      set_error(pp, "out of memory");
+      return NULL;
+    }
+    if (pp->in_tokens) {
+      memcpy(new_in_tokens, pp->in_tokens, pp->in_tokens_len * sizeof(struct sp_pp_token_list_walker));
+      sp_free(pp->pool, pp->in_tokens);
+    }
+    pp->in_tokens = new_in_tokens;
+    pp->in_tokens_cap = new_cap;
+  }
+  return &pp->in_tokens[pp->in_tokens_len++];
+}
+
+static int add_span_to_ph4_input(struct sp_preprocessor *pp, struct sp_pp_token_span *span)
 {
-  struct sp_pp_token_list *exp_args = sp_new_pp_token_list(&pp->macro_exp_pool, sp_pp_token_list_size(arg));
-  if (! exp_args)
+  struct sp_pp_token_list_walker *w = push_ph4_input(pp);
+  if (! w)
+    return -1;
+  *w = sp_make_pp_token_span_walker(span);
+  return 0;
+}
+
+static struct sp_pp_token_list *expand_arg(struct sp_preprocessor *pp, struct sp_pp_token_span *arg)
+{
+  struct sp_pp_token_list *exp_arg = sp_new_pp_token_list(&pp->macro_exp_pool, arg->end - arg->start);
+  if (! exp_arg)
     goto err_oom;
 
-  //printf("ARG NEXT: %p\n", (void*) arg->next);
-  if (sp_add_pp_token_list_to_ph4_input(pp, arg) < 0)
+  // the argument is followed by an end-of-list marker
+  struct sp_pp_token_span end_of_arg = { &pp->end_of_arg, 0, 1, PP_SPAN_KEEP_WS, SP_EMPTY_HIDE_SET };
+  if (add_span_to_ph4_input(pp, &end_of_arg) < 0 || add_span_to_ph4_input(pp, arg) < 0)
     goto err;
   while (true) {
     if (sp_next_pp_ph4_processed_token(pp, true) < 0)
@@ -332,10 +481,10 @@ static struct sp_pp_token_list *expand_arg(struct sp_preprocessor *pp, struct sp
       set_error(pp, "end-of-file found while reading macro args");
       goto err;
     }
-    if (sp_append_pp_token(exp_args, &pp->tok) < 0)
+    if (sp_append_pp_token_with_hide_set(exp_arg, &pp->tok, pp->tok_hide_set) < 0)
       goto err_oom;
   }
-  return exp_args;
+  return exp_arg;
 
  err_oom:
   set_error(pp, "out of memory");
@@ -343,483 +492,606 @@ static struct sp_pp_token_list *expand_arg(struct sp_preprocessor *pp, struct sp
   return NULL;
 }
 
-static int append_arg_to_list(struct sp_pp_token_list *list, struct sp_pp_token_list *arg)
+/*
+ * A macro expansion under construction: spans of the macro body and
+ * of the arguments, and the new tokens (stringified, pasted, etc.)
+ * that don't exist anywhere else.
+ */
+struct macro_exp {
+  struct sp_pp_token_rope rope;
+  struct sp_pp_token_list *new_tokens;
+  struct sp_pp_token left;  // left operand of a '##' waiting for its right operand
+  sp_hide_set_id left_hs;
+};
+
+static int add_new_token(struct sp_preprocessor *pp, struct macro_exp *exp, struct sp_pp_token *tok, sp_hide_set_id hs)
 {
-  if (sp_macro_arg_is_empty(arg)) {
-    struct sp_pp_token placemarker;
-    placemarker.type = TOK_PP_PASTE_MARKER;
-    if (sp_append_pp_token(list, &placemarker) < 0)
-      return -1;
-    return 0;
-  }
-  
-  struct sp_pp_token_list_walker w;
-  struct sp_pp_token *t = sp_rewind_pp_token_list(&w, arg);
-  while (sp_read_pp_token_from_list(&w, &t)) {
-    if (pp_tok_is_end_of_list(t))
-      break;
-    if (sp_append_pp_token(list, t) < 0)
+  if (! exp->new_tokens) {
+    exp->new_tokens = sp_new_pp_token_list(&pp->macro_exp_pool, 0);
+    if (! exp->new_tokens)
       return -1;
   }
-  return 0;
+  if (sp_append_pp_token_with_hide_set(exp->new_tokens, tok, hs) < 0)
+    return -1;
+  int index = sp_pp_token_list_size(exp->new_tokens) - 1;
+  struct sp_pp_token_span span = { exp->new_tokens, index, index+1, PP_SPAN_KEEP_WS, SP_EMPTY_HIDE_SET };
+  return sp_append_pp_token_span(&exp->rope, &span);
 }
 
-static int append_list_to_list(struct sp_pp_token_list *dest, struct sp_pp_token_list *src)
+/*
+ * Get a token of a span and its hide set as they would be read
+ * through the span.
+ */
+static int get_span_token(struct sp_preprocessor *pp, struct sp_pp_token_span *span, int index,
+                          struct sp_pp_token *ret, sp_hide_set_id *ret_hs)
 {
-  struct sp_pp_token_list_walker w;
-  struct sp_pp_token *t = sp_rewind_pp_token_list(&w, src);
-  while (sp_read_pp_token_from_list(&w, &t)) {
-    if (pp_tok_is_end_of_list(t))
-      break;
-    if (sp_append_pp_token(dest, t) < 0)
-      return -1;
-  }
-  return 0;
+  *ret = *sp_get_pp_token_span_token(span, index);
+  if (index == span->start && span->ws != PP_SPAN_KEEP_WS)
+    ret->flags = (ret->flags & ~PP_TOK_WHITESPACE_FLAGS) | span->ws;
+  *ret_hs = sp_get_pp_token_list_hide_set(span->list, index);
+  return add_hide_set(pp, ret_hs, span->hide_set);
 }
 
-static struct sp_pp_token_list *expand_macro(struct sp_preprocessor *pp, struct sp_macro_def *macro, struct sp_macro_args *args)
+/*
+ * Add the tokens of a span to the expansion.  If 'kill_name' is set,
+ * identifiers with the macro's name are copied to be marked dead,
+ * since the list of the span is not ours to change.
+ */
+static int add_span_to_exp(struct sp_preprocessor *pp, struct sp_macro_def *macro, struct macro_exp *exp,
+                           struct sp_pp_token_span *span, bool kill_name)
 {
-#if 0
-  if (macro->is_function) {
-    printf("-----------------\n");
-    printf("expanding macro '%s' with %d args:\n", sp_get_macro_name(macro, pp), args->len);
-    for (int i = 0; i < args->len; i++) {
-      printf("[arg %d] ", i);
-      sp_dump_pp_token_list(&args->args[i], pp);
-      printf("\n");
+  struct sp_pp_token_span part = *span;
+  for (int i = span->start; kill_name && i < span->end; i++) {
+    struct sp_pp_token *t = sp_get_pp_token_span_token(span, i);
+    if (pp_tok_is_identifier(t) && t->data.str_id == macro->name_id && ! pp_tok_is_macro_dead(t)) {
+      part.end = i;
+      if (sp_append_pp_token_span(&exp->rope, &part) < 0)
+        goto err_oom;
+      struct sp_pp_token dead;
+      sp_hide_set_id dead_hs;
+      if (get_span_token(pp, span, i, &dead, &dead_hs) < 0)
+        return -1;
+      pp_tok_set_flag(&dead, PP_TOK_FLAG_MACRO_DEAD);
+      if (add_new_token(pp, exp, &dead, dead_hs) < 0)
+        goto err_oom;
+      part.start = i+1;
+      part.ws = PP_SPAN_KEEP_WS;
     }
-    printf("-----------------\n");
   }
-#endif
-  //printf("<%s>'s body = ", sp_get_macro_name(macro, pp)); sp_dump_pp_token_list(&macro->body, pp); printf("\n");
+  part.end = span->end;
+  if (sp_append_pp_token_span(&exp->rope, &part) < 0)
+    goto err_oom;
+  return 0;
 
-  struct sp_pp_token_list *macro_exp = sp_new_pp_token_list(&pp->macro_exp_pool, sp_pp_token_list_size(&macro->body));
-  if (! macro_exp)
-    goto err_out_of_memory;
-  
-  // replace args, expanding as necessary
-  struct sp_pp_token_list_walker w;
-  struct sp_pp_token *t = sp_rewind_pp_token_list(&w, &macro->body);
-  while (sp_read_pp_token_from_list(&w, &t)) {
-    // # parameter
-    if (macro->is_function && pp_tok_is_punct(t, '#')) {
-      struct sp_pp_token *next = sp_peek_nonblank_pp_token_from_list(&w);
-      if (! next) {
-        set_error(pp, "'#' must not be the end of the macro body");
-        goto err;
-      }
-      if (pp_tok_is_identifier(next)) {
-        struct sp_pp_token_list *arg = sp_get_macro_arg(macro, args, sp_get_pp_token_string_id(next));
-        if (arg) {
-          // keep everything up to and including next
-          do {
-            //printf("-> '%s'\n", sp_dump_pp_token(pp, t));
-            if (sp_append_pp_token(macro_exp, t) < 0)
-              goto err_out_of_memory;
-            if (t == next)
-              break;
-          } while (sp_read_pp_token_from_list(&w, &t));
-          continue;
-        }
-      }
-      set_error(pp, "'#' must be followed by argument name");
-      goto err;
-    }
+ err_oom:
+  return set_error(pp, "out of memory");
+}
 
-    // ## parameter
-    if (macro->is_function && pp_tok_is_punct(t, PUNCT_HASHES) && ! t->paste_dead) {
-      struct sp_pp_token *next = sp_peek_nonblank_pp_token_from_list(&w);
-      if (! next) {
-        set_error(pp, "'##' must not be the end of the macro body");
-        goto err;
-      }
-      if (pp_tok_is_identifier(next)) {
-        struct sp_pp_token_list *arg = sp_get_macro_arg(macro, args, sp_get_pp_token_string_id(next));
-        if (arg) {
-          // keep everything up to next
-          do {
-            if (t == next)
-              break;
-            //printf("-> '%s'\n", sp_dump_pp_token(pp, t));
-            if (sp_append_pp_token(macro_exp, t) < 0)
-              goto err_out_of_memory;
-          } while (sp_read_pp_token_from_list(&w, &t));
-          
-          // [6.10.3.3] parameter preceded by '##' is not expanded
-          if (append_arg_to_list(macro_exp, arg) < 0)
-            goto err_out_of_memory;
-          continue;
-        }
-      }
-    }
+/*
+ * Add the result of a paste, unless it's a placemarker.
+ */
+static int add_pasted_to_exp(struct sp_preprocessor *pp, struct sp_macro_def *macro, struct macro_exp *exp,
+                             struct sp_pp_token *pasted, sp_hide_set_id hs)
+{
+  if (pp_tok_is_paste_marker(pasted))
+    return 0;
+  // [6.10.3.4] 2. prevent any further expansion of an identifier with the same name as the macro being expanded
+  if (pp_tok_is_identifier(pasted) && pasted->data.str_id == macro->name_id)
+    pp_tok_set_flag(pasted, PP_TOK_FLAG_MACRO_DEAD);
+  return add_new_token(pp, exp, pasted, hs);
+}
 
-    // parameter
-    if (macro->is_function && pp_tok_is_identifier(t)) {
-      struct sp_pp_token_list *arg = sp_get_macro_arg(macro, args, sp_get_pp_token_string_id(t));
-      if (arg) {
-        struct sp_pp_token *hashes = sp_peek_nonblank_pp_token_from_list(&w);
-        if (hashes && pp_tok_is_punct(hashes, PUNCT_HASHES)) {
-          // [6.10.3.3] parameter followed by '##' is not expanded
-          if (append_arg_to_list(macro_exp, arg) < 0)
-            goto err_out_of_memory;
-        } else {
-          //printf("<expanding arg for %s>", sp_get_macro_name(macro, pp));
-          struct sp_pp_token_list *exp_arg = expand_arg(pp, arg);
-          //printf("</expanding arg for %s>", sp_get_macro_name(macro, pp));
-          if (! exp_arg)
-            goto err_out_of_memory;
-          if (append_list_to_list(macro_exp, exp_arg) < 0)
-            goto err_out_of_memory;
-        }
-        continue;
-      }
-    }
+/*
+ * Run the ops of the macro body, building the expansion as a rope of
+ * spans so the tokens of the body and of the arguments are not copied.
+ */
+static int expand_macro(struct sp_preprocessor *pp, struct sp_macro_def *macro, struct sp_macro_args *args, struct sp_pp_token_rope *ret)
+{
+  //printf("<%s>'s body = ", sp_get_macro_name(macro, pp)); sp_dump_pp_token_list(&macro->body, pp); printf("\n");
 
-    if (sp_append_pp_token(macro_exp, t) < 0)
-      goto err_out_of_memory;
-  }
+  struct macro_exp exp;
+  sp_init_pp_token_rope(&exp.rope, &pp->macro_exp_pool);
+  exp.new_tokens = NULL;
 
-  //printf("<%s>'s macro_exp = ", sp_get_macro_name(macro, pp)); sp_dump_pp_token_list(macro_exp, pp); printf("\n");
+  struct sp_pp_token *body = sp_pp_token_list_tokens(&macro->body);
+  for (int i = 0; i < macro->n_ops; i++) {
+    struct sp_macro_op *op = &macro->ops[i];
+    struct sp_pp_token_span span;
+    bool kill_name = false;
+    bool hide_sets = (pp->macro_engine == SP_MACRO_ENGINE_HIDE_SETS);
 
-  bool has_hash = false;
-  t = sp_rewind_pp_token_list(&w, macro_exp);
-  while (sp_read_pp_token_from_list(&w, &t)) {
-    if (pp_tok_is_punct(t, PUNCT_HASHES) || pp_tok_is_punct(t, '#')) {
-      has_hash = true;
+    switch (op->type) {
+    case MACRO_OP_PASTE:
+    default:
+      continue;
+
+    case MACRO_OP_TOKENS:
+      span = (struct sp_pp_token_span) { &macro->body, op->start, op->end, PP_SPAN_KEEP_WS, SP_EMPTY_HIDE_SET };
       break;
-    }
-  }
-  
-  // paste and stringify
-  struct sp_pp_token_list *out;
-  if (has_hash) {
-    out = sp_new_pp_token_list(&pp->macro_exp_pool, sp_pp_token_list_size(macro_exp));
-    t = sp_rewind_pp_token_list(&w, macro_exp);
-    while (sp_read_pp_token_from_list(&w, &t)) {
-      // paste
-      if (! pp_tok_is_space(t)) {
-        struct sp_pp_token_list_pos save_pos = sp_get_pp_token_list_pos(&w);
-        struct sp_pp_token *next;
-        if (sp_read_nonblank_pp_token_from_list(&w, &next)) {
-          if (pp_tok_is_punct(next, PUNCT_HASHES) && ! next->paste_dead) {
-            struct sp_pp_token *second;
-            struct sp_pp_token pasted;
-          paste_again:
-            if (sp_read_nonblank_pp_token_from_list(&w, &second)) {
-              if (paste_tokens(pp, t, second, &pasted) < 0)
-                goto err;
-              //printf("<pasted: '%s'>", sp_dump_pp_token(pp, &pasted));
-              next = sp_peek_nonblank_pp_token_from_list(&w);
-              if (next && pp_tok_is_punct(next, PUNCT_HASHES)) {
-                sp_read_nonblank_pp_token_from_list(&w, &next); // skip '##'
-                t = &pasted;
-                goto paste_again;
-              }
-              if (sp_append_pp_token(out, &pasted) < 0)
-                goto err_out_of_memory;
-              continue;
-            }
-          }
-        }
-        sp_set_pp_token_list_pos(&w, save_pos);
-      }
 
-      // stringify
-      if (macro->is_function && pp_tok_is_punct(t, '#')) {
-        struct sp_pp_token *next = sp_peek_nonblank_pp_token_from_list(&w);
-        if (pp_tok_is_identifier(next) && sp_get_macro_arg(macro, args, sp_get_pp_token_string_id(next))) {
-          if (! sp_read_nonblank_pp_token_from_list(&w, &next)) {
-            set_error(pp, "'#' must not be the end of the macro body");
-            goto err;
-          }
-          struct sp_pp_token_list *arg = sp_get_macro_arg(macro, args, sp_get_pp_token_string_id(next));
-          if (! arg) {
-            set_error(pp, "'#' must be followed by a parameter name");
-            goto err;
+    case MACRO_OP_PARAM:
+      {
+        // each argument is expanded only once, however many times it's used
+        struct sp_pp_token_list *exp_arg = args->exp_args[op->param];
+        if (! exp_arg) {
+          exp_arg = expand_arg(pp, &args->args[op->param]);
+          if (! exp_arg)
+            return -1;
+          // [6.10.3.4] 2. prevent any further expansion of an identifier with the same name as the macro being expanded
+          struct sp_pp_token *t = sp_pp_token_list_tokens(exp_arg);
+          for (int j = 0; ! hide_sets && j < sp_pp_token_list_size(exp_arg); j++) {
+            if (pp_tok_is_identifier(&t[j]) && t[j].data.str_id == macro->name_id)
+              pp_tok_set_flag(&t[j], PP_TOK_FLAG_MACRO_DEAD);
           }
-          struct sp_pp_token stringified;
-          //printf("<%s stringifying ", sp_get_macro_name(macro, pp)); sp_dump_pp_token_list(arg, pp); printf(">");
-          if (stringify_list(pp, arg, &stringified) < 0)
-            goto err;
-          if (sp_append_pp_token(out, &stringified) < 0)
-            goto err_out_of_memory;
-          continue;
+          args->exp_args[op->param] = exp_arg;
         }
+        span = (struct sp_pp_token_span) { exp_arg, 0, sp_pp_token_list_size(exp_arg), body[op->start].flags & PP_TOK_WHITESPACE_FLAGS, SP_EMPTY_HIDE_SET };
       }
+      break;
 
-      // remove placemarkers
-      if (pp_tok_is_paste_marker(t)) {
-        continue;
-      }
-      
-      if (sp_append_pp_token(out, t) < 0)
-        goto err_out_of_memory;
-    }
-    //printf("<%s>'s out = ", sp_get_macro_name(macro, pp)); sp_dump_pp_token_list(out, pp); printf("\n");
-  } else {
-    out = macro_exp;
-  }
+    case MACRO_OP_PARAM_NOEXP:
+      span = args->args[op->param];
+      span.ws = body[op->start].flags & PP_TOK_WHITESPACE_FLAGS;
+      kill_name = ! hide_sets;
+      break;
 
-  // remove all remaining paste markers
-  bool has_paste_marker = false;
-  t = sp_rewind_pp_token_list(&w, out);
-  while (sp_read_pp_token_from_list(&w, &t)) {
-    if (pp_tok_is_paste_marker(t)) {
-      has_paste_marker = true;
+    case MACRO_OP_STRINGIFY:
+      {
+        struct sp_pp_token stringified;
+        if (stringify_arg(pp, &args->args[op->param], &stringified) < 0)
+          return -1;
+        stringified.loc = body[op->start].loc;
+        pp_tok_copy_whitespace(&stringified, &body[op->start]);
+        if (! exp.new_tokens && ! (exp.new_tokens = sp_new_pp_token_list(&pp->macro_exp_pool, 0)))
+          goto err_oom;
+        if (sp_append_pp_token(exp.new_tokens, &stringified) < 0)
+          goto err_oom;
+        int index = sp_pp_token_list_size(exp.new_tokens) - 1;
+        span = (struct sp_pp_token_span) { exp.new_tokens, index, index+1, PP_SPAN_KEEP_WS, SP_EMPTY_HIDE_SET };
+      }
       break;
     }
-  }
-  if (has_paste_marker) {
-    struct sp_pp_token_list *out2 = sp_new_pp_token_list(&pp->macro_exp_pool, sp_pp_token_list_size(out));
-    t = sp_rewind_pp_token_list(&w, out);
-    while (sp_read_pp_token_from_list(&w, &t)) {
-      if (pp_tok_is_paste_marker(t))
+
+    bool paste_before = (i > 0 && macro->ops[i-1].type == MACRO_OP_PASTE);
+    bool paste_after = (i+1 < macro->n_ops && macro->ops[i+1].type == MACRO_OP_PASTE);
+
+    // [6.10.3.3] an empty argument next to '##' is a placemarker
+    if (paste_before) {
+      struct sp_pp_token right, pasted;
+      sp_hide_set_id right_hs = SP_EMPTY_HIDE_SET, pasted_hs = SP_EMPTY_HIDE_SET;
+      if (sp_macro_arg_is_empty(&span)) {
+        right = (struct sp_pp_token) { .type = TOK_PP_PASTE_MARKER, .flags = span.ws };
+      } else {
+        if (get_span_token(pp, &span, span.start++, &right, &right_hs) < 0)
+          return -1;
+        span.ws = PP_SPAN_KEEP_WS;
+      }
+      if (paste_tokens(pp, &exp.left, exp.left_hs, &right, right_hs, &pasted, &pasted_hs) < 0)
+        return -1;
+      exp.left = pasted;
+      exp.left_hs = pasted_hs;
+      if (sp_macro_arg_is_empty(&span) && paste_after)
         continue;
-      if (sp_append_pp_token(out2, t) < 0)
-        goto err_out_of_memory;
+      if (add_pasted_to_exp(pp, macro, &exp, &exp.left, exp.left_hs) < 0)
+        goto err_oom;
     }
-    out = out2;
+    if (paste_after) {
+      if (sp_macro_arg_is_empty(&span)) {
+        exp.left = (struct sp_pp_token) { .type = TOK_PP_PASTE_MARKER, .flags = span.ws };
+        exp.left_hs = SP_EMPTY_HIDE_SET;
+      } else {
+        if (get_span_token(pp, &span, span.end-1, &exp.left, &exp.left_hs) < 0)
+          return -1;
+        span.end--;
+      }
+    }
+    if (add_span_to_exp(pp, macro, &exp, &span, kill_name) < 0)
+      return -1;
   }
-  
-  // [6.10.3.4] 2. prevent any further expansion of an identifier with the same name as the macro being expanded
-  t = sp_rewind_pp_token_list(&w, out);
-  while (sp_read_pp_token_from_list(&w, &t)) {
-    if (pp_tok_is_identifier(t) && t->data.str_id == macro->name_id)
-      t->macro_dead = true;
+
+  if (pp->macro_engine == SP_MACRO_ENGINE_DEFAULT) {
+    // add marker to re-enable macro:
+    struct sp_pp_token enable_macro = pp->tok;
+    enable_macro.type = TOK_PP_ENABLE_MACRO;
+    enable_macro.flags = 0;
+    enable_macro.data.str_id = macro->name_id;
+    if (add_new_token(pp, &exp, &enable_macro, SP_EMPTY_HIDE_SET) < 0)
+      goto err_oom;
+    macro->enabled = false;
   }
-  
-  // add marker to re-enable macro:
-  struct sp_pp_token enable_macro = pp->tok;
-  enable_macro.type = TOK_PP_ENABLE_MACRO;
-  enable_macro.data.str_id = macro->name_id;
-  if (sp_append_pp_token(out, &enable_macro) < 0)
-    goto err_out_of_memory;
 
-  macro->enabled = false;
-  return out;
+  *ret = exp.rope;
+  return 0;
 
- err_out_of_memory:
-  set_error(pp, "out of memory");
- err:
-  return NULL;
+ err_oom:
+  return set_error(pp, "out of memory");
 }
 
 void dump_input_buffer(struct sp_preprocessor *pp)
 {
-  if (! pp->in_tokens)
-    return;
-
-  struct sp_pp_token_list_walker *tokens = pp->in_tokens;
-  while (tokens) {
-    struct sp_pp_token_list_pos save_pos = sp_get_pp_token_list_pos(tokens);
+  for (int i = pp->in_tokens_len-1; i >= 0; i--) {
+    struct sp_pp_token_list_walker *tokens = &pp->in_tokens[i];
+    int save_pos = sp_get_pp_token_list_pos(tokens);
     struct sp_pp_token *next;
     while (sp_read_pp_token_from_list(tokens, &next))
       printf("%s", sp_dump_pp_token(pp, next));
     sp_set_pp_token_list_pos(tokens, save_pos);
-    tokens = tokens->next;
   }
 }
 
 int sp_add_pp_token_list_to_ph4_input(struct sp_preprocessor *pp, struct sp_pp_token_list *list)
 {
-  struct sp_pp_token_list_walker *w = sp_new_pp_token_list_walker(&pp->macro_exp_pool, list);
-  if (! w)
-    return set_error(pp, "out of memory");
-#if 0
-  if (list == pp->in_tokens) {
-    printf("\n\n");
-    printf("ERROR: adding input buffer to input buffer! input buffer contains:\n");
-    sp_dump_pp_token_list(list, pp);
-    printf("\n\n");
+  struct sp_pp_token_span span = { list, 0, sp_pp_token_list_size(list), PP_SPAN_KEEP_WS, SP_EMPTY_HIDE_SET };
+  return add_span_to_ph4_input(pp, &span);
+}
+
+/*
+ * Add an expansion to the input, with 'hs' added to the hide set of
+ * all its tokens.
+ */
+static int add_rope_to_ph4_input(struct sp_preprocessor *pp, struct sp_pp_token_rope *rope, sp_hide_set_id hs)
+{
+  for (int i = rope->len-1; i >= 0; i--) {
+    struct sp_pp_token_span *span = &rope->spans[i];
+    int span_hs = sp_hide_set_union(&pp->hide_sets, span->hide_set, hs);
+    if (span_hs < 0)
+      return set_error(pp, "out of memory");
+    span->hide_set = (sp_hide_set_id) span_hs;
+    if (add_span_to_ph4_input(pp, span) < 0)
+      return -1;
   }
-#endif
-#if 0
-  printf("\n");
-  printf("=============================================================\n");
-  printf("adding list to input buffer, input buffer currently contains:\n");
-  printf("===[");
-  dump_input_buffer(pp);
-  printf("]===\n");
-  printf("=============================================================\n");
-#endif
-  w->next = pp->in_tokens;
-  pp->in_tokens = w;
   return 0;
 }
 
-static int peek_nonblank_token(struct sp_preprocessor *pp, struct sp_pp_token *tok)
+/*
+ * [Prosser] Get the hide set for the expansion of a macro invoked by
+ * a name with hide set 'hs' (for function-like macros, intersected
+ * with the hide set of the closing parenthesis).
+ */
+static int get_expansion_hide_set(struct sp_preprocessor *pp, struct sp_macro_def *macro, sp_hide_set_id hs)
+{
+  if (pp->macro_engine != SP_MACRO_ENGINE_HIDE_SETS)
+    return SP_EMPTY_HIDE_SET;
+  int ret = sp_hide_set_add(&pp->hide_sets, hs, macro->name_id);
+  if (ret < 0)
+    return set_error(pp, "out of memory");
+  return ret;
+}
+
+static int peek_token(struct sp_preprocessor *pp, struct sp_pp_token *tok)
 {
   // peek in buffer
-  if (pp->in_tokens) {
-    bool found = false;
-    struct sp_pp_token_list_walker *tokens = pp->in_tokens;
-    while (tokens) {
-      struct sp_pp_token_list_pos save_pos = sp_get_pp_token_list_pos(tokens);
-      struct sp_pp_token *next;
-      while (sp_read_pp_token_from_list(tokens, &next)) {
-        if (! pp_tok_is_space(next) && ! pp_tok_is_newline(next) && ! pp_tok_is_enable_macro(next)) {
-          //printf("NEXT NONBLANK: '%s' (type %d)\n", sp_dump_pp_token(pp, next), next->type);
-          *tok = *next;
-          found = true;
-          break;
-        }
+  for (int i = pp->in_tokens_len-1; i >= 0; i--) {
+    struct sp_pp_token_list_walker *tokens = &pp->in_tokens[i];
+    for (int pos = sp_get_pp_token_list_pos(tokens); pos < tokens->end; pos++) {
+      struct sp_pp_token *next = &sp_pp_token_list_tokens(tokens->list)[pos];
+      if (! pp_tok_is_enable_macro(next)) {
+        //printf("NEXT: '%s' (type %d)\n", sp_dump_pp_token(pp, next), next->type);
+        *tok = *next;
+        return 0;
       }
-      sp_set_pp_token_list_pos(tokens, save_pos);
-      if (found)
-        break;
-      tokens = tokens->next;
     }
-    
-    if (found)
-      return 0;
   }
 
   // peek in input
-  return sp_peek_nonblank_pp_ph3_token(pp, tok, false);
+  return sp_peek_pp_ph3_token(pp, tok, false);
 }
 
-static bool next_token_from_buffer(struct sp_preprocessor *pp)
+/*
+ * Remove spent lists from the top of the input stack, re-enabling
+ * the macros they expanded.
+ */
+static void pop_spent_ph4_input(struct sp_preprocessor *pp)
 {
-  if (pp->in_tokens) {
-    while (pp->in_tokens && ! sp_peek_pp_token_from_list(pp->in_tokens))
-      pp->in_tokens = pp->in_tokens->next;
-    
-    if (pp->in_tokens) {
-      struct sp_pp_token *tok;
-      if (sp_read_pp_token_from_list(pp->in_tokens, &tok)) {
-        pp->tok = *tok;
-        //printf("* read from macro_exp: '%s'\n", sp_dump_pp_token(pp, tok));
-
-        // we MUST ensure that any spent list is removed from pp->in_tokens:
-        while (pp->in_tokens && ! sp_peek_pp_token_from_list(pp->in_tokens))
-          pp->in_tokens = pp->in_tokens->next;
-        if (! pp->in_tokens && pp->macro_expansion_level == 0)
-          sp_clear_mem_pool(&pp->macro_exp_pool);
-        
-        return true;
-      }
-    }
+  int old_len = pp->in_tokens_len;
+  while (pp->in_tokens_len > 0) {
+    struct sp_pp_token_list_walker *w = &pp->in_tokens[pp->in_tokens_len-1];
+    if (sp_peek_pp_token_from_list(w))
+      break;
+    if (w->enable_macro)
+      w->enable_macro->enabled = true;
+    pp->in_tokens_len--;
+  }
+  if (pp->profile && pp->in_tokens_len < old_len)
+    sp_pp_profile_input_popped(pp->profile, pp->in_tokens_len);
+}
+
+/*
+ * Tell the profiler that the replacement of the macro being expanded
+ * was pushed on top of the first 'in_depth' lists of the input stack.
+ */
+static void profile_expanded(struct sp_preprocessor *pp, int in_depth, int arg_tokens, int tokens_produced)
+{
+  sp_pp_profile_expanded(pp->profile, in_depth, arg_tokens, tokens_produced);
+  // an empty replacement has nothing to rescan
+  if (pp->in_tokens_len == in_depth)
+    sp_pp_profile_input_popped(pp->profile, in_depth);
+}
+
+static int count_arg_tokens(struct sp_macro_args *args)
+{
+  int n = 0;
+  for (int i = 0; args && i < args->len; i++)
+    n += args->args[i].end - args->args[i].start;
+  return n;
+}
+
+static int count_rope_tokens(struct sp_pp_token_rope *rope)
+{
+  int n = 0;
+  for (int i = 0; i < rope->len; i++)
+    n += rope->spans[i].end - rope->spans[i].start;
+  // don't count the marker that re-enables the macro
+  if (n > 0) {
+    struct sp_pp_token_span *last = &rope->spans[rope->len-1];
+    if (pp_tok_is_enable_macro(sp_get_pp_token_span_token(last, last->end-1)))
+      n--;
+  }
+  return n;
+}
+
+/*
+ * Called when the input stack runs out while an expansion is being
+ * recorded: at the top level it's complete and can be stored; deeper
+ * down, it's reaching past its end (e.g. for macro arguments).
+ */
+static int end_memo_recording(struct sp_preprocessor *pp)
+{
+  if (pp->macro_expansion_level > 0) {
+    sp_pp_memo_abort(&pp->memo);
+    return 0;
+  }
+  if (sp_pp_memo_finish(&pp->memo, pp->empty_exp_flags) < 0)
+    return set_error(pp, "out of memory");
+  return 0;
+}
+
+/*
+ * Read the next token from the input stack into pp->tok.  Returns 1
+ * if a token was read, 0 if the stack is empty, or -1 on error.
+ */
+static int next_token_from_buffer(struct sp_preprocessor *pp)
+{
+  if (pp->in_tokens_len == 0)
+    return 0;
 
-    if (pp->macro_expansion_level == 0)
+  pop_spent_ph4_input(pp);
+  if (pp->in_tokens_len == 0) {
+    // the last token read from the expansion is gone, so it can be freed
+    if (pp->macro_expansion_level == 0) {
       sp_clear_mem_pool(&pp->macro_exp_pool);
+      sp_clear_hide_set_table(&pp->hide_sets);
+    }
+    return 0;
   }
-  
-  return false;
+
+  struct sp_pp_token_list_walker *w = &pp->in_tokens[pp->in_tokens_len-1];
+  int index = sp_get_pp_token_list_pos(w);
+  struct sp_pp_token *tok;
+  if (! sp_read_pp_token_from_list(w, &tok))
+    return 0;
+  pp->tok = *tok;
+  pp->tok_list = w->list;
+  pp->tok_index = index;
+  pp->tok_list_hide_set = w->hide_set;
+  pp->tok_changed = false;
+  if (index == w->ws_index) {
+    pp->tok.flags = (pp->tok.flags & ~PP_TOK_WHITESPACE_FLAGS) | w->ws;
+    pp->tok_changed = true;
+  }
+  pp->tok_hide_set = sp_get_pp_token_list_hide_set(w->list, index);
+  if (add_hide_set(pp, &pp->tok_hide_set, w->hide_set) < 0)
+    return -1;
+  //printf("* read from macro_exp: '%s'\n", sp_dump_pp_token(pp, tok));
+  return 1;
 }
 
 int sp_next_pp_ph4_processed_token(struct sp_preprocessor *pp, bool expand_macros)
 {
   while (true) {
-    if (! next_token_from_buffer(pp))
+    int from_buffer = next_token_from_buffer(pp);
+    if (from_buffer < 0)
+      return -1;
+    if (! from_buffer) {
+      if (pp->memo.recording && end_memo_recording(pp) < 0)
+        return -1;
       NEXT_TOKEN();
+      pp->tok_hide_set = SP_EMPTY_HIDE_SET;
+      pp->tok_list = NULL;
+    }
 
     //if (pp->macro_args_reading_level) printf("macro arg -> '%s'\n", sp_dump_pp_token(pp, &pp->tok));
 
     if (IS_ENABLE_MACRO()) {
-      struct sp_macro_def *macro = sp_get_idht_value(&pp->macros, sp_get_pp_token_string_id(&pp->tok));
+      struct sp_macro_def *macro = sp_get_macro(&pp->macros, sp_get_pp_token_string_id(&pp->tok));
       if (! macro)
         return set_error(pp, "internal error: enable macro for unknown macro id '%d'", sp_get_pp_token_string_id(&pp->tok));
       macro->enabled = true;
+      pp->empty_exp_flags |= pp->tok.flags & PP_TOK_WHITESPACE_FLAGS;
       continue;
     }
-    
-    if (IS_NEWLINE()) {
-      if (pp->macro_args_reading_level) {
-        if (pp->last_was_space)
-          continue;
-        pp->tok.type = TOK_PP_SPACE;
-        pp->last_was_space = true;
-      } else
-        pp->at_newline = true;
-      return 0;
-    }
-
-    if (IS_SPACE()) {
-      if (pp->last_was_space)
-        continue;
-      pp->last_was_space = true;
-      return 0;
-    }
 
     if (IS_EOF()) {
       if (pp->macro_args_reading_level)
         return set_error(pp, "unterminated argument list for macro");
       if (! pp->in->next)
-        return 0;
+        break;
       if (pp->in->base_cond_level != pp->cond_level)
         return set_error(pp, "unterminated preprocessing conditional");
+      if (pp->in->guard_state == SP_INPUT_GUARD_ENDED)
+        pp->in->include_file->guard_id = pp->in->guard_id;
       struct sp_input *next = pp->in->next;
       sp_free_input(pp->in);
       pp->in = next;
-      pp->at_newline = true;
-      pp->last_was_space = false;
+      pp->ph3_peek.in = NULL;
+      pp->next_tok_flags = PP_TOK_FLAG_BOL;
       continue;
     }
     
-    if (IS_PUNCT('#')) {
+    if (IS_PUNCT('#') && ! from_buffer && pp_tok_is_bol(&pp->tok)) {
       //printf("!!!PUNCT!!! %d\n", pp->macro_args_reading_level);
-      if (! pp->at_newline) {
-        pp->at_newline = false;
-        pp->last_was_space = false;
-        return 0;
-      }
       if (pp->macro_args_reading_level)
         return set_error(pp, "preprocessing directive in macro arguments");
       if (sp_process_pp_directive(pp) < 0)
         return -1;
-      pp->at_newline = true;
-      pp->last_was_space = false;
       continue;
     }
 
-    if (expand_macros && pp_tok_is_identifier(&pp->tok) && ! pp->tok.macro_dead) {
+    // a token outside of a directive means the file can't be a single '#ifndef' group
+    if (! from_buffer && pp->in->guard_state != SP_INPUT_GUARD_IN_GROUP)
+      pp->in->guard_state = SP_INPUT_GUARD_NONE;
+
+    // a dependency scan skips text lines without expanding them
+    if (pp->scan_only && ! from_buffer) {
+      if (sp_skip_pp_ph3_text(pp) < 0)
+        return -1;
+      continue;
+    }
+
+    // whitespace of macros that expanded to nothing goes to the next token
+    if (pp->empty_exp_flags) {
+      pp->tok.flags |= pp->empty_exp_flags;
+      pp->empty_exp_flags = 0;
+      pp->tok_changed = true;
+    }
+
+    if (expand_macros && pp_tok_is_identifier(&pp->tok) && ! pp_tok_is_macro_dead(&pp->tok)) {
       struct sp_pp_token ident = pp->tok;
+      sp_hide_set_id ident_hs = pp->tok_hide_set;
       sp_string_id ident_id = sp_get_pp_token_string_id(&ident);
 
       //printf("-> ident '%s' (%d)\n", sp_get_string(&pp->token_strings, ident_id), ident_id);
       
-      struct sp_pp_token next;
-      if (peek_nonblank_token(pp, &next) < 0)
-        return -1;
-
-      if (! pp_tok_is_punct(&next, PUNCT_HASHES)) {
-        struct sp_macro_def *macro = sp_get_idht_value(&pp->macros, ident_id);
-        if (macro) {
-          if (! macro->enabled) {
-            // kill identifier with the name of a disabled macro
-            pp->tok.macro_dead = true;
-          } else if (! macro->is_function || pp_tok_is_punct(&next, '(')) {
-            pp->macro_expansion_level++;
-            struct sp_pp_token_list *macro_exp;
-            struct sp_macro_args *args = NULL;
-            if (macro->is_function) {
-              //printf("<reading args for %s>", sp_get_macro_name(macro, pp));
-              args = read_macro_args(pp, macro);
-              if (! args)
+      struct sp_macro_def *macro = sp_get_own_macro(&pp->macros, ident_id);
+      if (pp->memo.recording && sp_pp_memo_add_dep(&pp->memo, ident_id) < 0)
+        return set_error(pp, "out of memory");
+      if (macro) {
+        if (sp_parse_pp_macro_def(pp, macro) < 0)
+          return -1;
+        bool hidden;
+        if (pp->macro_engine == SP_MACRO_ENGINE_HIDE_SETS)
+          hidden = sp_hide_set_contains(&pp->hide_sets, ident_hs, ident_id);
+        else
+          hidden = ! macro->enabled;
+        if (hidden) {
+          // kill identifier with the name of a disabled macro
+          pp_tok_set_flag(&pp->tok, PP_TOK_FLAG_MACRO_DEAD);
+        } else if (! macro->is_function && macro->pre_id == PP_MACRO_NOT_PREDEFINED && macro->n_ops <= 1) {
+          // object-like macro without '##': read the body in place
+          if (pp->profile && sp_pp_profile_enter(pp->profile, pp, macro) < 0)
+            return set_error(pp, "out of memory");
+          int in_depth = pp->in_tokens_len;
+          if (macro->n_ops == 0) {
+            // the whitespace of the macro name goes to the next token
+            pp->empty_exp_flags |= ident.flags & PP_TOK_WHITESPACE_FLAGS;
+            if (pp->profile)
+              profile_expanded(pp, in_depth, 0, 0);
+            continue;
+          }
+          int hs = get_expansion_hide_set(pp, macro, ident_hs);
+          if (hs < 0)
+            return -1;
+          struct sp_pp_token_list_walker *w = push_ph4_input(pp);
+          if (! w)
+            return -1;
+          if (! from_buffer)
+            pp->exp_loc = ident.loc;
+          struct sp_pp_token_span body = { &macro->body, 0, sp_pp_token_list_size(&macro->body), ident.flags & PP_TOK_WHITESPACE_FLAGS, (sp_hide_set_id) hs };
+          *w = sp_make_pp_token_span_walker(&body);
+          if (pp->macro_engine == SP_MACRO_ENGINE_DEFAULT) {
+            w->enable_macro = macro;
+            macro->enabled = false;
+          }
+          if (pp->profile)
+            profile_expanded(pp, in_depth, 0, sp_pp_token_list_size(&macro->body));
+          continue;
+        } else {
+          // only the name of a function-like macro needs a look at the next token
+          if (macro->is_function) {
+            struct sp_pp_token next;
+            if (peek_token(pp, &next) < 0)
+              return -1;
+            if (! pp_tok_is_punct(&next, '('))
+              break;
+          }
+          // only invocations in the source text are memoized, since nothing is disabled there
+          bool memo = (pp->macro_memo && macro->is_function && macro->pre_id == PP_MACRO_NOT_PREDEFINED
+                       && pp->in_tokens_len == 0 && pp->macro_expansion_level == 0);
+          if (pp->profile && sp_pp_profile_enter(pp->profile, pp, macro) < 0)
+            return set_error(pp, "out of memory");
+          if (! from_buffer)
+            pp->exp_loc = ident.loc;
+          pp->macro_expansion_level++;
+          struct sp_pp_token_rope macro_exp;
+          struct sp_macro_args *args = NULL;
+          if (macro->is_function) {
+            //printf("<reading args for %s>", sp_get_macro_name(macro, pp));
+            args = read_macro_args(pp, macro);
+            if (! args)
+              return -1;
+            int hs = sp_hide_set_intersection(&pp->hide_sets, ident_hs, pp->tok_hide_set);
+            if (hs < 0)
+              return set_error(pp, "out of memory");
+            ident_hs = (sp_hide_set_id) hs;
+          }
+          if (memo) {
+            if (sp_pp_memo_make_key(&pp->memo, macro, args, ident.flags & PP_TOK_WHITESPACE_FLAGS) < 0)
+              return set_error(pp, "out of memory");
+            struct sp_pp_memo_entry *entry = sp_pp_memo_lookup(&pp->memo);
+            if (entry) {
+              int in_depth = pp->in_tokens_len;
+              if (sp_add_pp_token_list_to_ph4_input(pp, &entry->result) < 0)
                 return -1;
+              if (pp->profile)
+                profile_expanded(pp, in_depth, count_arg_tokens(args), sp_pp_token_list_size(&entry->result));
+              pp->macro_expansion_level--;
+              continue;
             }
-            if (macro->pre_id != PP_MACRO_NOT_PREDEFINED) {
-              //printf("<expanding predefined macro %s>", sp_get_macro_name(macro, pp));
-              macro_exp = sp_expand_predefined_macro(pp, macro, args, ident.loc);
-            } else {
-              //printf("<expanding macro %s>", sp_get_macro_name(macro, pp));
-              macro_exp = expand_macro(pp, macro, args);
-            }
-            if (! macro_exp)
+            // record from here: the arguments are expanded with the body
+            sp_pp_memo_start(&pp->memo, macro->name_id);
+          }
+          int exp_hs = get_expansion_hide_set(pp, macro, ident_hs);
+          if (exp_hs < 0)
+            return -1;
+          if (macro->pre_id != PP_MACRO_NOT_PREDEFINED) {
+            //printf("<expanding predefined macro %s>", sp_get_macro_name(macro, pp));
+            if (pp->memo.recording)
+              sp_pp_memo_abort(&pp->memo);
+            struct sp_pp_token_list *list = sp_expand_predefined_macro(pp, macro, args, ident.loc);
+            if (! list)
               return -1;
-            if (sp_add_pp_token_list_to_ph4_input(pp, macro_exp) < 0)
+            sp_init_pp_token_rope(&macro_exp, &pp->macro_exp_pool);
+            struct sp_pp_token_span span = { list, 0, sp_pp_token_list_size(list), PP_SPAN_KEEP_WS, SP_EMPTY_HIDE_SET };
+            if (sp_append_pp_token_span(&macro_exp, &span) < 0)
+              return set_error(pp, "out of memory");
+          } else {
+            //printf("<expanding macro %s>", sp_get_macro_name(macro, pp));
+            if (expand_macro(pp, macro, args, &macro_exp) < 0)
               return -1;
-            pp->macro_expansion_level--;
-            continue;
           }
+
+          // the expansion takes the place of the macro name
+          if (macro_exp.len > 0)
+            macro_exp.spans[0].ws = ident.flags & PP_TOK_WHITESPACE_FLAGS;
+          else if (pp->macro_engine == SP_MACRO_ENGINE_HIDE_SETS)
+            pp->empty_exp_flags |= ident.flags & PP_TOK_WHITESPACE_FLAGS;
+          int in_depth = pp->in_tokens_len;
+          if (add_rope_to_ph4_input(pp, &macro_exp, (sp_hide_set_id) exp_hs) < 0)
+            return -1;
+          if (pp->profile)
+            profile_expanded(pp, in_depth, count_arg_tokens(args), count_rope_tokens(&macro_exp));
+          pp->macro_expansion_level--;
+          continue;
         }
       }
     }
     
-    pp->last_was_space = false;
-    pp->at_newline = false;
-    return 0;
+    break;
   }
+
+  if (pp->memo.recording && pp->macro_expansion_level == 0 && sp_pp_memo_add_token(&pp->memo, &pp->tok) < 0)
+    return set_error(pp, "out of memory");
+  return 0;
 }
 
 int sp_next_pp_ph4_token(struct sp_preprocessor *pp)
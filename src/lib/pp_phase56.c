@@ -241,7 +241,7 @@ static void add_char_str_value(void *data, size_t *ppos, uint32_t val)
   *ppos = pos;
 }
 
-static int conv_string(struct sp_preprocessor *pp, struct sp_src_loc loc, const char *src, void *dest, size_t *dest_len, bool is_wide)
+static int conv_string(struct sp_preprocessor *pp, sp_src_loc_id loc, const char *src, void *dest, size_t *dest_len, bool is_wide)
 {
   const unsigned char *str = (const unsigned char *)src;
   
@@ -504,7 +504,7 @@ static int conv_number(struct sp_preprocessor *pp, struct sp_pp_token *tok, stru
   errno = 0;
   ret->data.float_const.n = strtod(str, &end);
   if (errno != 0)
-    return set_error(pp, "invalid float constant: '%s'", str);
+    return set_error_at(pp, tok->loc, "invalid float constant: '%s'", str);
   if (read_float_const_flags(pp, end, &ret->data.float_const.flags) < 0)
     return -1;
   return 0;
@@ -538,7 +538,6 @@ static int conv_pp_token(struct sp_preprocessor *pp, struct sp_pp_token *tok, st
   case TOK_PP_OTHER:
     return set_error_at(pp, tok->loc, "invalid character: '%c'", tok->data.other);
 
-  case TOK_PP_SPACE:
   case TOK_PP_NEWLINE:
   case TOK_PP_ENABLE_MACRO:
   case TOK_PP_END_OF_LIST:
@@ -556,10 +555,7 @@ int sp_next_token(struct sp_preprocessor *pp, struct sp_token *ret)
   if (! pp->init_ph6 && init_ph6(pp) < 0)
     return -1;
 
-  do {
-    NEXT_TOKEN();
-  } while (pp_tok_is_space(CUR) || pp_tok_is_newline(CUR));
-
+  NEXT_TOKEN();
   ret->loc = CUR->loc;
   
   // string
@@ -568,18 +564,16 @@ int sp_next_token(struct sp_preprocessor *pp, struct sp_token *ret)
     struct sp_pp_token first = *CUR;
 
     // read all following string tokens
-    while (pp_tok_is_string(NEXT) || pp_tok_is_space(NEXT) || pp_tok_is_newline(NEXT)) {
+    while (pp_tok_is_string(NEXT)) {
       NEXT_TOKEN();
-      if (pp_tok_is_string(CUR)) {
-        if (! strings) {
-          sp_clear_mem_pool(&pp->str_join_pool);
-          strings = sp_new_pp_token_list(&pp->str_join_pool, 0);
-          if (! strings || sp_append_pp_token(strings, &first) < 0)
-            goto err_oom;
-        }
-        if (sp_append_pp_token(strings, CUR) < 0)
+      if (! strings) {
+        sp_clear_mem_pool(&pp->str_join_pool);
+        strings = sp_new_pp_token_list(&pp->str_join_pool, 0);
+        if (! strings || sp_append_pp_token(strings, &first) < 0)
           goto err_oom;
       }
+      if (sp_append_pp_token(strings, CUR) < 0)
+        goto err_oom;
     }
 
     // join strings
@@ -0,0 +1,166 @@
+/* pp_profile.c */
+
+#define _POSIX_C_SOURCE 199309L  // for clock_gettime()
+
+#include <string.h>
+#include <time.h>
+
+#include "pp_profile.h"
+#include "preprocessor.h"
+#include "pp_macro.h"
+
+static uint64_t get_time_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+void sp_init_pp_profile(struct sp_pp_profile *prof)
+{
+  sp_init_mem_pool(&prof->pool);
+  sp_init_ht(&prof->names, &prof->pool);
+  sp_init_idht(&prof->ids, &prof->pool);
+  prof->list = NULL;
+  prof->len = 0;
+  prof->stack = NULL;
+  prof->stack_len = 0;
+  prof->stack_cap = 0;
+}
+
+void sp_destroy_pp_profile(struct sp_pp_profile *prof)
+{
+  sp_destroy_mem_pool(&prof->pool);
+}
+
+/*
+ * Start profiling a new preprocessor.  Its name ids mean nothing to
+ * the previous one, so macros are found by name again.
+ */
+void sp_start_pp_profile(struct sp_pp_profile *prof)
+{
+  sp_init_idht(&prof->ids, &prof->pool);
+  prof->stack_len = 0;
+  for (struct sp_pp_macro_profile *mp = prof->list; mp; mp = mp->next)
+    mp->active = 0;
+}
+
+static struct sp_pp_macro_profile *get_macro_profile(struct sp_pp_profile *prof, struct sp_preprocessor *pp, struct sp_macro_def *macro)
+{
+  struct sp_pp_macro_profile *mp = sp_get_idht_value(&prof->ids, macro->name_id);
+  if (mp)
+    return mp;
+
+  const char *name = sp_get_macro_name(macro, pp);
+  size_t name_len = strlen(name);
+  mp = sp_get_ht_value(&prof->names, name, name_len);
+  if (! mp) {
+    mp = sp_malloc(&prof->pool, sizeof(struct sp_pp_macro_profile));
+    char *name_copy = sp_malloc(&prof->pool, name_len + 1);
+    if (! mp || ! name_copy)
+      return NULL;
+    memcpy(name_copy, name, name_len + 1);
+    memset(&mp->data, 0, sizeof(mp->data));
+    mp->data.name = name_copy;
+    mp->active = 0;
+    if (sp_add_ht_entry(&prof->names, name_copy, name_len, mp) < 0)
+      return NULL;
+    mp->next = prof->list;
+    prof->list = mp;
+    prof->len++;
+  }
+  if (sp_add_idht_entry(&prof->ids, macro->name_id, mp) < 0)
+    return NULL;
+  return mp;
+}
+
+/*
+ * Start timing an expansion of 'macro'.  Every call must be followed
+ * by a call to sp_pp_profile_expanded() when the replacement is pushed
+ * to the input.
+ */
+int sp_pp_profile_enter(struct sp_pp_profile *prof, struct sp_preprocessor *pp, struct sp_macro_def *macro)
+{
+  struct sp_pp_macro_profile *mp = get_macro_profile(prof, pp, macro);
+  if (! mp)
+    return -1;
+
+  if (prof->stack_len == prof->stack_cap) {
+    int new_cap = (prof->stack_cap == 0) ? 32 : 2*prof->stack_cap;
+    struct sp_pp_profile_frame *new_stack = sp_malloc(&prof->pool, new_cap * sizeof(struct sp_pp_profile_frame));
+    if (! new_stack)
+      return -1;
+    if (prof->stack) {
+      memcpy(new_stack, prof->stack, prof->stack_len * sizeof(struct sp_pp_profile_frame));
+      sp_free(&prof->pool, prof->stack);
+    }
+    prof->stack = new_stack;
+    prof->stack_cap = new_cap;
+  }
+
+  if (prof->stack_len > 0)
+    prof->stack[prof->stack_len-1].macro->data.nested++;
+  mp->data.invocations++;
+  mp->active++;
+  struct sp_pp_profile_frame *frame = &prof->stack[prof->stack_len++];
+  frame->macro = mp;
+  frame->nested_time = 0;
+  frame->in_depth = -1;
+  frame->start = get_time_ns();
+  return 0;
+}
+
+static void leave_frame(struct sp_pp_profile *prof, uint64_t now)
+{
+  struct sp_pp_profile_frame *frame = &prof->stack[--prof->stack_len];
+  struct sp_pp_macro_profile *mp = frame->macro;
+  uint64_t elapsed = now - frame->start;
+
+  mp->data.excl_time += (elapsed - frame->nested_time) * 1e-9;
+  // a macro expanded inside itself is only timed once
+  if (--mp->active == 0)
+    mp->data.incl_time += elapsed * 1e-9;
+  if (prof->stack_len > 0)
+    prof->stack[prof->stack_len-1].nested_time += elapsed;
+}
+
+/*
+ * Note that the replacement of the innermost expansion was pushed to
+ * the input stack, on top of its first 'in_depth' entries.  The
+ * expansion is done when they are all that's left.
+ */
+void sp_pp_profile_expanded(struct sp_pp_profile *prof, int in_depth, int arg_tokens, int tokens_produced)
+{
+  struct sp_pp_profile_frame *frame = &prof->stack[prof->stack_len-1];
+  frame->macro->data.arg_tokens += arg_tokens;
+  frame->macro->data.tokens_produced += tokens_produced;
+  frame->in_depth = in_depth;
+}
+
+/*
+ * Finish the expansions whose replacements were rescanned, now that
+ * only 'in_depth' entries are left in the input stack.
+ */
+void sp_pp_profile_input_popped(struct sp_pp_profile *prof, int in_depth)
+{
+  if (prof->stack_len == 0 || prof->stack[prof->stack_len-1].in_depth < in_depth)
+    return;
+  uint64_t now = get_time_ns();
+  while (prof->stack_len > 0 && prof->stack[prof->stack_len-1].in_depth >= in_depth)
+    leave_frame(prof, now);
+}
+
+/*
+ * Return an array with the profiles of all macros seen (prof->len
+ * elements), or NULL if out of memory.
+ */
+struct sp_macro_profile *sp_make_pp_profile_report(struct sp_pp_profile *prof)
+{
+  struct sp_macro_profile *report = sp_malloc(&prof->pool, (prof->len > 0 ? prof->len : 1) * sizeof(struct sp_macro_profile));
+  if (! report)
+    return NULL;
+  int i = prof->len;
+  for (struct sp_pp_macro_profile *mp = prof->list; mp; mp = mp->next)
+    report[--i] = mp->data;
+  return report;
+}
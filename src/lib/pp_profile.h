@@ -0,0 +1,59 @@
+/* pp_profile.h */
+
+#ifndef PP_PROFILE_H_FILE
+#define PP_PROFILE_H_FILE
+
+#include "internal.h"
+#include "hashtable.h"
+#include "id_hashtable.h"
+
+struct sp_preprocessor;
+struct sp_macro_def;
+
+struct sp_pp_macro_profile {
+  struct sp_pp_macro_profile *next;
+  struct sp_macro_profile data;
+  int active;  // invocations of the macro being expanded
+};
+
+struct sp_pp_profile_frame {
+  struct sp_pp_macro_profile *macro;
+  uint64_t start;
+  uint64_t nested_time;
+  int in_depth;  // size of the input stack under the replacement, or -1 until it's pushed
+};
+
+/*
+ * Counters and times of macro expansions, kept by macro name across
+ * all files preprocessed.
+ *
+ * An expansion is timed from the macro name until its replacement has
+ * been rescanned, which includes reading and pre-expanding the
+ * arguments and the expansions of the macros found in the
+ * replacement.  Those are nested in it, and their time is only left
+ * out of its exclusive time.
+ *
+ * A replacement reaching into the text after it (a function-like
+ * macro name at its end) is done when the input stack is popped under
+ * it, but its frame stays open until the frames above it are done.
+ */
+struct sp_pp_profile {
+  struct sp_mem_pool pool;
+  struct sp_hashtable names;  // name -> struct sp_pp_macro_profile
+  struct sp_id_hashtable ids; // name id in the current preprocessor -> struct sp_pp_macro_profile
+  struct sp_pp_macro_profile *list;
+  int len;
+  struct sp_pp_profile_frame *stack;
+  int stack_len;
+  int stack_cap;
+};
+
+void sp_init_pp_profile(struct sp_pp_profile *prof);
+void sp_destroy_pp_profile(struct sp_pp_profile *prof);
+void sp_start_pp_profile(struct sp_pp_profile *prof);
+int sp_pp_profile_enter(struct sp_pp_profile *prof, struct sp_preprocessor *pp, struct sp_macro_def *macro);
+void sp_pp_profile_expanded(struct sp_pp_profile *prof, int in_depth, int arg_tokens, int tokens_produced);
+void sp_pp_profile_input_popped(struct sp_pp_profile *prof, int in_depth);
+struct sp_macro_profile *sp_make_pp_profile_report(struct sp_pp_profile *prof);
+
+#endif /* PP_PROFILE_H_FILE */
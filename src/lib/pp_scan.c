@@ -0,0 +1,58 @@
+/* pp_scan.c */
+
+#include <string.h>
+
+#include "pp_scan.h"
+#include "preprocessor.h"
+#include "input.h"
+
+void sp_init_pp_scan_cache(struct sp_pp_scan_cache *cache)
+{
+  sp_init_mem_pool(&cache->pool);
+  sp_init_ht(&cache->files, &cache->pool);
+  sp_init_buffer(&cache->buf, &cache->pool);
+}
+
+void sp_destroy_pp_scan_cache(struct sp_pp_scan_cache *cache)
+{
+  sp_destroy_mem_pool(&cache->pool);
+}
+
+static struct sp_pp_scan_file *add_scan_file(struct sp_pp_scan_cache *cache, const char *filename)
+{
+  size_t filename_len = strlen(filename);
+  struct sp_pp_scan_file *file = sp_malloc(&cache->pool, sizeof(struct sp_pp_scan_file) + cache->buf.size);
+  char *path = sp_malloc(&cache->pool, filename_len + 1);
+  if (! file || ! path)
+    return NULL;
+  file->size = cache->buf.size;
+  memcpy(file->data, cache->buf.p, cache->buf.size);
+  memcpy(path, filename, filename_len + 1);
+  if (sp_add_ht_entry(&cache->files, path, filename_len, file) < 0)
+    return NULL;
+  return file;
+}
+
+/*
+ * Open the directive-only form of a file, making it the first time
+ * the file is opened.  If the file can't be minimized it's opened as
+ * it is, and not cached.  Returns NULL if the file can't be read or
+ * out of memory.
+ */
+struct sp_input *sp_open_pp_scan_input(struct sp_pp_scan_cache *cache, const char *filename)
+{
+  struct sp_pp_scan_file *file = sp_get_ht_value(&cache->files, filename, strlen(filename));
+  if (! file) {
+    struct sp_input *in = sp_new_input_from_file(filename);
+    if (! in)
+      return NULL;
+    cache->buf.size = 0;
+    if (sp_minimize_pp_input(in, &cache->buf) < 0)
+      return in;
+    sp_free_input(in);
+    file = add_scan_file(cache, filename);
+    if (! file)
+      return NULL;
+  }
+  return sp_new_input_from_data(file->data, file->size);
+}
@@ -0,0 +1,32 @@
+/* pp_scan.h */
+
+#ifndef PP_SCAN_H_FILE
+#define PP_SCAN_H_FILE
+
+#include "internal.h"
+#include "hashtable.h"
+#include "buffer.h"
+
+struct sp_input;
+
+struct sp_pp_scan_file {
+  size_t size;
+  unsigned char data[];
+};
+
+/*
+ * Directive-only forms of the files read by dependency scans, kept by
+ * path for all scans done by a program.  Files are assumed not to
+ * change while the program is alive.
+ */
+struct sp_pp_scan_cache {
+  struct sp_mem_pool pool;
+  struct sp_hashtable files;  // path -> struct sp_pp_scan_file
+  struct sp_buffer buf;
+};
+
+void sp_init_pp_scan_cache(struct sp_pp_scan_cache *cache);
+void sp_destroy_pp_scan_cache(struct sp_pp_scan_cache *cache);
+struct sp_input *sp_open_pp_scan_input(struct sp_pp_scan_cache *cache, const char *filename);
+
+#endif /* PP_SCAN_H_FILE */
@@ -0,0 +1,90 @@
+/* pp_skip.c */
+
+#include <string.h>
+
+#include "pp_skip.h"
+#include "input.h"
+
+void sp_init_pp_skip_index(struct sp_pp_skip_index *index)
+{
+  sp_init_mem_pool(&index->pool);
+  sp_init_ht(&index->files, &index->pool);
+}
+
+void sp_destroy_pp_skip_index(struct sp_pp_skip_index *index)
+{
+  sp_destroy_mem_pool(&index->pool);
+}
+
+/*
+ * Return the skipped groups of a file, adding an empty list the first
+ * time.  Returns NULL if out of memory.
+ */
+struct sp_pp_skip_file *sp_get_pp_skip_file(struct sp_pp_skip_index *index, const struct sp_file_identity *identity)
+{
+  struct sp_pp_skip_file *file = sp_get_ht_value(&index->files, identity, sizeof(*identity));
+  if (file)
+    return file;
+
+  struct sp_file_identity *key = sp_malloc(&index->pool, sizeof(*identity));
+  file = sp_malloc(&index->pool, sizeof(struct sp_pp_skip_file));
+  if (! key || ! file)
+    return NULL;
+  *key = *identity;
+  file->ranges = NULL;
+  file->len = 0;
+  file->cap = 0;
+  if (sp_add_ht_entry(&index->files, key, sizeof(*key), file) < 0)
+    return NULL;
+  return file;
+}
+
+// index of the first range starting at or after 'start'
+static int find_range(struct sp_pp_skip_file *file, size_t start)
+{
+  int lo = 0, hi = file->len;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (file->ranges[mid].start < start)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+bool sp_find_pp_skip_range(struct sp_pp_skip_file *file, size_t start, size_t *ret_end)
+{
+  int i = find_range(file, start);
+  if (i == file->len || file->ranges[i].start != start)
+    return false;
+  *ret_end = file->ranges[i].end;
+  return true;
+}
+
+int sp_add_pp_skip_range(struct sp_pp_skip_index *index, struct sp_pp_skip_file *file, size_t start, size_t end)
+{
+  if (end > UINT32_MAX)
+    return 0;  // too big to record, it will just be skipped again
+  int i = find_range(file, start);
+  if (i < file->len && file->ranges[i].start == start)
+    return 0;
+
+  if (file->len == file->cap) {
+    int new_cap = (file->cap == 0) ? 16 : 2*file->cap;
+    struct sp_pp_skip_range *new_ranges = sp_malloc(&index->pool, new_cap * sizeof(struct sp_pp_skip_range));
+    if (! new_ranges)
+      return -1;
+    if (file->ranges) {
+      memcpy(new_ranges, file->ranges, file->len * sizeof(struct sp_pp_skip_range));
+      sp_free(&index->pool, file->ranges);
+    }
+    file->ranges = new_ranges;
+    file->cap = new_cap;
+  }
+  memmove(&file->ranges[i+1], &file->ranges[i], (file->len - i) * sizeof(struct sp_pp_skip_range));
+  file->ranges[i].start = (uint32_t) start;
+  file->ranges[i].end = (uint32_t) end;
+  file->len++;
+  return 0;
+}
@@ -0,0 +1,44 @@
+/* pp_skip.h */
+
+#ifndef PP_SKIP_H_FILE
+#define PP_SKIP_H_FILE
+
+#include "internal.h"
+#include "hashtable.h"
+
+struct sp_file_identity;
+
+struct sp_pp_skip_range {
+  uint32_t start;  // start of the first line of the group
+  uint32_t end;    // start of the line that ends it, or the end of the file
+};
+
+/*
+ * The groups skipped in a file, sorted by start.
+ */
+struct sp_pp_skip_file {
+  struct sp_pp_skip_range *ranges;
+  int len;
+  int cap;
+};
+
+/*
+ * Groups of included files that were skipped because their condition
+ * was false, kept by file identity for all files preprocessed by a
+ * program.  Where a skipped group ends depends only on the text of
+ * the file, so a group found again (whatever the macros that made it
+ * inactive) is jumped over without reading it.  Files are assumed not
+ * to change while the program is alive.
+ */
+struct sp_pp_skip_index {
+  struct sp_mem_pool pool;
+  struct sp_hashtable files;  // identity -> struct sp_pp_skip_file
+};
+
+void sp_init_pp_skip_index(struct sp_pp_skip_index *index);
+void sp_destroy_pp_skip_index(struct sp_pp_skip_index *index);
+struct sp_pp_skip_file *sp_get_pp_skip_file(struct sp_pp_skip_index *index, const struct sp_file_identity *identity);
+bool sp_find_pp_skip_range(struct sp_pp_skip_file *file, size_t start, size_t *ret_end);
+int sp_add_pp_skip_range(struct sp_pp_skip_index *index, struct sp_pp_skip_file *file, size_t start, size_t end);
+
+#endif /* PP_SKIP_H_FILE */
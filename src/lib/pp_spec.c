@@ -0,0 +1,535 @@
+/* pp_spec.c */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pp_spec.h"
+#include "preprocessor.h"
+#include "compiler.h"
+#include "program.h"
+#include "ast.h"
+
+/*
+ * Speculative preprocessing of the headers included by the main file.
+ *
+ * Before the main file is preprocessed, a dependency scan predicts
+ * the headers it includes directly.  Each one is preprocessed on a
+ * worker thread by a preprocessor forked from the snapshot (see
+ * sp_comp_set_prelude()), as if the main file had included it right
+ * at the start, while logging the macros it reads from the snapshot,
+ * the files it looks at and the macros it changes.
+ *
+ * When the main thread reaches the '#include' of a predicted header,
+ * it checks the log against its own state: every macro read must
+ * have the same definition, and every file looked at must have the
+ * same include record (so that the same files are skipped).  If they
+ * do, the header would expand to the same tokens with the same effects
+ * if preprocessed now, so its tokens are spliced into the input (with
+ * their strings and locations translated) and its effects replayed.
+ * Otherwise, the header is preprocessed by the main thread as usual.
+ */
+
+void sp_init_pp_spec(struct sp_pp_spec *spec)
+{
+  sp_init_mem_pool(&spec->pool);
+  spec->job_list = NULL;
+  spec->next_job = NULL;
+  spec->threads = NULL;
+  spec->n_threads = 0;
+  memset(&spec->stats, 0, sizeof(spec->stats));
+}
+
+void sp_destroy_pp_spec(struct sp_pp_spec *spec)
+{
+  sp_stop_pp_spec(spec);
+  sp_destroy_mem_pool(&spec->pool);
+}
+
+int sp_log_pp_spec_include(struct sp_pp_spec_log *log, struct sp_pp_include_file *file, const char *path, bool top_level)
+{
+  if (log->len == log->cap) {
+    int new_cap = (log->cap == 0) ? 16 : 2*log->cap;
+    struct sp_pp_spec_include *new_includes = sp_malloc(log->pool, new_cap * sizeof(struct sp_pp_spec_include));
+    if (! new_includes)
+      return -1;
+    if (log->includes)
+      memcpy(new_includes, log->includes, log->len * sizeof(struct sp_pp_spec_include));
+    log->includes = new_includes;
+    log->cap = new_cap;
+  }
+  struct sp_pp_spec_include *inc = &log->includes[log->len++];
+  inc->file = file;
+  inc->path = path;
+  inc->top_level = top_level;
+  return 0;
+}
+
+static void init_log(struct sp_pp_spec_log *log, struct sp_mem_pool *pool)
+{
+  log->pool = pool;
+  log->includes = NULL;
+  log->len = 0;
+  log->cap = 0;
+}
+
+/* ================================================ */
+/* == worker threads ============================== */
+
+static int run_job(struct sp_pp_spec *spec, struct sp_pp_spec_job *job)
+{
+  struct sp_compiler *comp = &job->prog->comp;
+  job->ast = sp_new_ast(&job->pool, &job->prog->src_file_names);
+  struct sp_preprocessor *pp = sp_malloc(&job->pool, sizeof(struct sp_preprocessor));
+  if (! job->ast || ! pp || sp_copy_ast_src_locs(job->ast, spec->base_ast) < 0)
+    return -1;
+  int ret = sp_init_forked_preprocessor(pp, comp, &job->pool, spec->base);
+  job->pp = pp;
+  if (ret < 0)
+    return -1;
+
+  sp_init_macro_log(&job->macro_log, &job->pool);
+  pp->macros.log = &job->macro_log;
+  init_log(&job->log, &job->pool);
+  pp->spec_log = &job->log;
+
+  // read the header as the main thread would after opening it
+  if (sp_set_preprocessor_io(pp, job->path, job->ast) < 0)
+    return -1;
+  struct sp_pp_include_file *file = sp_get_pp_include_file(pp, job->path);
+  if (! file || sp_log_pp_spec_include(&job->log, file, job->path, true) < 0)
+    return -1;
+  pp->in->include_file = file;
+  pp->in->guard_state = SP_INPUT_GUARD_START;
+  pp->in->skips = sp_get_pp_skip_file(&comp->skip_index, &file->identity);
+  if (! pp->in->skips)
+    return -1;
+
+  sp_init_pp_token_list(&job->output, &job->pool, 0);
+  while (true) {
+    struct sp_pp_token tok;
+    if (sp_next_pp_token(pp, &tok) < 0)
+      return -1;
+    if (pp_tok_is_eof(&tok))
+      break;
+    if (sp_append_pp_token(&job->output, &tok) < 0)
+      return -1;
+  }
+  if (pp->cond_level != pp->in->base_cond_level)
+    return -1;
+  if (pp->in->guard_state == SP_INPUT_GUARD_ENDED)
+    file->guard_id = pp->in->guard_id;
+  return 0;
+}
+
+static void *run_worker(void *data)
+{
+  struct sp_pp_spec *spec = data;
+  pthread_mutex_lock(&spec->lock);
+  while (spec->next_job) {
+    struct sp_pp_spec_job *job = spec->next_job;
+    spec->next_job = job->next;
+    if (job->state != SP_PP_SPEC_JOB_QUEUED)
+      continue;
+    job->state = SP_PP_SPEC_JOB_RUNNING;
+    pthread_mutex_unlock(&spec->lock);
+    int ret = run_job(spec, job);
+    pthread_mutex_lock(&spec->lock);
+    job->state = (ret < 0) ? SP_PP_SPEC_JOB_FAILED : SP_PP_SPEC_JOB_DONE;
+    pthread_cond_broadcast(&spec->job_done);
+  }
+  pthread_mutex_unlock(&spec->lock);
+  return NULL;
+}
+
+/* ================================================ */
+/* == prediction ================================== */
+
+// the search lists are built by prepending, so add them last first
+static int copy_search_dirs(struct sp_compiler *comp, struct sp_include_search_dir *dir, bool is_system)
+{
+  if (! dir)
+    return 0;
+  if (copy_search_dirs(comp, dir->next, is_system) < 0)
+    return -1;
+  return sp_comp_add_include_search_dir(comp, dir->dir, is_system);
+}
+
+static struct sp_pp_spec_job *add_job(struct sp_pp_spec *spec, struct sp_compiler *comp, const struct sp_file_identity *identity, const char *path)
+{
+  struct sp_pp_spec_job *job = sp_malloc(&spec->pool, sizeof(struct sp_pp_spec_job));
+  struct sp_file_identity *key = sp_malloc(&spec->pool, sizeof(*identity));
+  char *path_copy = sp_malloc(&spec->pool, strlen(path) + 1);
+  if (! job || ! key || ! path_copy)
+    return NULL;
+  *key = *identity;
+  strcpy(path_copy, path);
+  job->path = path_copy;
+  job->state = SP_PP_SPEC_JOB_QUEUED;
+  job->pp = NULL;
+  job->ast = NULL;
+  job->prog = sp_new_program();
+  if (! job->prog)
+    return NULL;
+  sp_init_mem_pool(&job->pool);
+  job->next = spec->job_list;
+  spec->job_list = job;
+
+  // the job's program has the same settings and knows the same files, so the snapshot's locations work
+  struct sp_compiler *job_comp = &job->prog->comp;
+  job_comp->macro_engine = comp->macro_engine;
+  job_comp->macro_memo = comp->macro_memo;
+  if (copy_search_dirs(job_comp, comp->user_include_search_dirs, false) < 0
+      || copy_search_dirs(job_comp, comp->sys_include_search_dirs, true) < 0)
+    return NULL;
+  struct sp_string_table *file_names = &comp->prog->src_file_names;
+  for (sp_string_id id = 0; id < file_names->num; id++) {
+    if (sp_add_string(&job->prog->src_file_names, sp_get_string(file_names, id)) < 0)
+      return NULL;
+  }
+
+  if (sp_add_ht_entry(&spec->jobs, key, sizeof(*key), job) < 0)
+    return NULL;
+  return job;
+}
+
+/*
+ * Find the headers included by the main file with a dependency scan
+ * from the snapshot.  A scan that fails predicts nothing: the error
+ * is found again by the main thread.
+ */
+static int predict_includes(struct sp_pp_spec *spec, struct sp_compiler *comp, const char *filename)
+{
+  struct sp_mem_pool pool;
+  sp_init_mem_pool(&pool);
+  struct sp_pp_spec_log log;
+  init_log(&log, &pool);
+
+  struct sp_ast *ast = sp_new_ast(&pool, &comp->prog->src_file_names);
+  bool scanned = false;
+  if (ast && sp_copy_ast_src_locs(ast, spec->base_ast) >= 0) {
+    struct sp_preprocessor pp;
+    if (sp_init_forked_preprocessor(&pp, comp, &pool, spec->base) >= 0) {
+      pp.scan_only = true;
+      pp.spec_log = &log;
+      if (sp_set_preprocessor_io(&pp, filename, ast) >= 0) {
+        struct sp_pp_token tok;
+        do {
+          if (sp_next_pp_token(&pp, &tok) < 0)
+            break;
+        } while (! pp_tok_is_eof(&tok));
+        scanned = pp_tok_is_eof(&tok);
+      }
+    }
+    memset(&pp.include_stats, 0, sizeof(pp.include_stats));  // the scan isn't counted
+    sp_destroy_preprocessor(&pp);
+  }
+
+  int ret = 0;
+  for (int i = 0; scanned && i < log.len; i++) {
+    struct sp_pp_spec_include *inc = &log.includes[i];
+    if (! inc->top_level || ! inc->path
+        || sp_get_ht_value(&spec->jobs, &inc->file->identity, sizeof(inc->file->identity)))
+      continue;
+    if (! add_job(spec, comp, &inc->file->identity, inc->path)) {
+      ret = sp_set_error(comp->prog, "out of memory");
+      break;
+    }
+    spec->stats.predicted++;
+  }
+  sp_destroy_mem_pool(&pool);
+  return ret;
+}
+
+/*
+ * Start preprocessing the headers included by a file on 'n_threads'
+ * worker threads.  The compiler must have a snapshot.
+ */
+int sp_start_pp_spec(struct sp_pp_spec *spec, struct sp_compiler *comp, const char *filename, int n_threads)
+{
+  spec->base = comp->prelude.pp;
+  spec->base_ast = comp->prelude.ast;
+  sp_init_ht(&spec->jobs, &spec->pool);
+  if (predict_includes(spec, comp, filename) < 0) {
+    sp_stop_pp_spec(spec);
+    return -1;
+  }
+  if (! spec->job_list)
+    return 0;
+
+  // jobs were added by prepending, run them in the order they're needed
+  struct sp_pp_spec_job *list = NULL;
+  while (spec->job_list) {
+    struct sp_pp_spec_job *job = spec->job_list;
+    spec->job_list = job->next;
+    job->next = list;
+    list = job;
+  }
+  spec->job_list = list;
+  spec->next_job = list;
+
+  spec->threads = sp_malloc(&spec->pool, n_threads * sizeof(pthread_t));
+  if (! spec->threads) {
+    sp_stop_pp_spec(spec);
+    return sp_set_error(comp->prog, "out of memory");
+  }
+  pthread_mutex_init(&spec->lock, NULL);
+  pthread_cond_init(&spec->job_done, NULL);
+  for (int i = 0; i < n_threads; i++) {
+    if (pthread_create(&spec->threads[spec->n_threads], NULL, run_worker, spec) != 0)
+      break;
+    spec->n_threads++;
+  }
+  if (spec->n_threads == 0) {
+    // without threads, every header is preprocessed by the main thread
+    pthread_cond_destroy(&spec->job_done);
+    pthread_mutex_destroy(&spec->lock);
+    sp_stop_pp_spec(spec);
+  }
+  return 0;
+}
+
+/*
+ * Wait for the worker threads and free all jobs.  The preprocessor
+ * they were spliced into must be destroyed first.
+ */
+void sp_stop_pp_spec(struct sp_pp_spec *spec)
+{
+  if (spec->n_threads > 0) {
+    pthread_mutex_lock(&spec->lock);
+    spec->next_job = NULL;
+    pthread_mutex_unlock(&spec->lock);
+    for (int i = 0; i < spec->n_threads; i++)
+      pthread_join(spec->threads[i], NULL);
+    pthread_cond_destroy(&spec->job_done);
+    pthread_mutex_destroy(&spec->lock);
+    spec->n_threads = 0;
+  }
+
+  for (struct sp_pp_spec_job *job = spec->job_list; job; job = job->next) {
+    if (job->pp)
+      sp_destroy_preprocessor(job->pp);
+    sp_destroy_mem_pool(&job->pool);
+    sp_free_program(job->prog);
+  }
+  spec->job_list = NULL;
+  spec->next_job = NULL;
+  spec->threads = NULL;
+  sp_clear_mem_pool(&spec->pool);
+}
+
+/* ================================================ */
+/* == validation and splicing ===================== */
+
+static sp_string_id lookup_job_string(struct sp_preprocessor *pp, struct sp_preprocessor *job_pp, sp_string_id id)
+{
+  if (id < job_pp->token_strings.first_id)
+    return id;
+  return sp_lookup_string_len(&pp->token_strings, sp_get_string(&job_pp->token_strings, id),
+                              sp_get_string_len(&job_pp->token_strings, id));
+}
+
+/*
+ * Check that the job would do the same if preprocessed now by 'pp',
+ * which just opened the header as 'in'.
+ */
+static bool job_matches(struct sp_pp_spec *spec, struct sp_pp_spec_job *job, struct sp_preprocessor *pp, struct sp_input *in)
+{
+  struct sp_preprocessor *job_pp = job->pp;
+  if (strcmp(job->path, sp_get_ast_file_name(pp->ast, sp_get_input_file_id(in))) != 0
+      || job->macro_log.incomplete)
+    return false;
+
+  // the header's range must be the last one, so the job's ranges can follow it
+  struct sp_src_loc_table *locs = &pp->ast->src_locs;
+  struct sp_src_file_range *job_range = &job->ast->src_locs.ranges[spec->base_ast->src_locs.len];
+  if (locs->next_base != in->loc_base + in->size + 1 || job_range->size != in->size)
+    return false;
+
+  // a date or time made by the job could differ from the one made by 'pp'
+  if (job_pp->date_str_id != spec->base->date_str_id || job_pp->time_str_id != spec->base->time_str_id)
+    return false;
+
+  sp_string_id id = -1;
+  struct sp_macro_def *macro;
+  while (sp_next_macro_log_read(&job->macro_log, &id, &macro)) {
+    sp_string_id pp_id = lookup_job_string(pp, job_pp, id);
+    struct sp_macro_def *cur = (pp_id >= 0) ? sp_get_macro(&pp->macros, pp_id) : NULL;
+    if (cur == macro)
+      continue;
+    if (! cur || ! macro || cur->pre_id != macro->pre_id)
+      return false;
+    if (sp_parse_pp_macro_def(pp, cur) < 0 || ! sp_macros_are_equal(cur, macro))
+      return false;
+  }
+  for (int i = 0; i < job->macro_log.n_writes; i++) {
+    struct sp_macro_def *written = job->macro_log.writes[i].macro;
+    if (written && ! written->def)
+      return false;
+  }
+
+  for (int i = 0; i < job->log.len; i++) {
+    struct sp_file_identity *identity = &job->log.includes[i].file->identity;
+    struct sp_pp_include_file *base_file = sp_get_ht_value(&spec->base->include_file_ids, identity, sizeof(*identity));
+    struct sp_pp_include_file *file = sp_get_ht_value(&pp->include_file_ids, identity, sizeof(*identity));
+    if (base_file) {
+      if (! file || file->once != base_file->once || file->guard_id != base_file->guard_id)
+        return false;
+    } else if (file && (file->once || file->guard_id >= 0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Make the state of 'pp' what it would be after preprocessing the
+ * header, and add the tokens of the header to its input.
+ */
+static int splice_job(struct sp_pp_spec *spec, struct sp_pp_spec_job *job, struct sp_preprocessor *pp, struct sp_input *in)
+{
+  struct sp_preprocessor *job_pp = job->pp;
+
+  // strings added by the job, in the order they were added
+  struct sp_string_table *job_strings = &job_pp->token_strings;
+  sp_string_id first_id = job_strings->first_id;
+  int n_strings = job_strings->num - first_id;
+  sp_string_id *str_map = sp_malloc(&job->pool, (n_strings + 1) * sizeof(sp_string_id));
+  if (! str_map)
+    goto err_oom;
+  for (int i = 0; i < n_strings; i++) {
+    str_map[i] = sp_add_string_len(&pp->token_strings, sp_get_string(job_strings, first_id + i),
+                                   sp_get_string_len(job_strings, first_id + i));
+    if (str_map[i] < 0)
+      goto err_oom;
+  }
+#define MAP_STRING(id) (((id) < first_id) ? (id) : str_map[(id) - first_id])
+
+  // the ranges of the files included by the header follow the header's
+  struct sp_src_loc_table *job_locs = &job->ast->src_locs;
+  int header_range = spec->base_ast->src_locs.len;
+  sp_src_loc_id loc_start = job_locs->ranges[header_range].base;
+  sp_src_loc_id loc_delta = in->loc_base - loc_start;
+  for (int i = header_range + 1; i < job_locs->len; i++) {
+    struct sp_src_file_range *r = &job_locs->ranges[i];
+    sp_string_id file_id = sp_add_ast_file_name(pp->ast, sp_get_string(&job->prog->src_file_names, r->file_id));
+    if (file_id < 0 || sp_add_src_loc_file_lines(&pp->ast->src_locs, (uint16_t) file_id, r->size, r->lines) == 0)
+      goto err_oom;
+  }
+#define MAP_LOC(loc) (((loc) >= loc_start) ? (loc) + loc_delta : (loc))
+
+  // records of the files looked at, in the order they were first looked at
+  for (int i = 0; i < job->log.len; i++) {
+    struct sp_pp_include_file *job_file = job->log.includes[i].file;
+    struct sp_pp_include_file *file = sp_add_pp_include_path(pp, &job_file->identity, job_file->path);
+    if (! file)
+      goto err_oom;
+    file->once = job_file->once;
+    file->guard_id = MAP_STRING(job_file->guard_id);
+  }
+  const void *key = NULL;
+  size_t key_len;
+  while (sp_next_ht_key(&job_pp->include_files, &key, &key_len)) {
+    struct sp_pp_include_file *job_file = sp_get_ht_value(&job_pp->include_files, key, key_len);
+    if (! sp_get_ht_value(&pp->include_files, key, key_len)
+        && ! sp_add_pp_include_path(pp, &job_file->identity, (const char *) key))
+      goto err_oom;
+  }
+  pp->include_stats.includes += job_pp->include_stats.includes;
+  pp->include_stats.skipped_guarded += job_pp->include_stats.skipped_guarded;
+  pp->include_stats.skipped_once += job_pp->include_stats.skipped_once;
+
+  for (int i = 0; i < job->macro_log.n_writes; i++) {
+    struct sp_macro_write *write = &job->macro_log.writes[i];
+    sp_string_id name_id = MAP_STRING(write->name_id);
+    if (! write->macro) {
+      if (sp_delete_macro(&pp->macros, name_id) < 0)
+        goto err_oom;
+    } else {
+      struct sp_macro_def *job_macro = write->macro;
+      const char *def = sp_add_macro_def_text(pp, job_macro->def, job_macro->def_size);
+      if (! def)
+        goto err_oom;
+      struct sp_macro_def *macro = sp_new_unparsed_macro_def(pp, name_id, job_macro->is_function,
+                                                             def, job_macro->def_size, MAP_LOC(job_macro->def_loc));
+      if (! macro)
+        return -1;
+      if (sp_set_macro(&pp->macros, macro) < 0)
+        goto err_oom;
+    }
+    if (pp->macro_memo)
+      sp_pp_memo_macro_changed(&pp->memo, name_id);
+  }
+
+  // the tokens were fully expanded by the job, so they're not expanded again
+  struct sp_pp_token *toks = sp_pp_token_list_tokens(&job->output);
+  int n_toks = sp_pp_token_list_size(&job->output);
+  for (int i = 0; i < n_toks; i++) {
+    struct sp_pp_token *tok = &toks[i];
+    switch (tok->type) {
+    case TOK_PP_IDENTIFIER:
+      pp_tok_set_flag(tok, PP_TOK_FLAG_MACRO_DEAD);
+      // fallthrough
+    case TOK_PP_HEADER_NAME:
+    case TOK_PP_NUMBER:
+    case TOK_PP_CHAR_CONST:
+    case TOK_PP_STRING:
+      tok->data.str_id = MAP_STRING(tok->data.str_id);
+      break;
+    }
+    tok->loc = MAP_LOC(tok->loc);
+  }
+#undef MAP_STRING
+#undef MAP_LOC
+  if (n_toks > 0 && sp_add_pp_token_list_to_ph4_input(pp, &job->output) < 0)
+    return -1;
+  return 0;
+
+ err_oom:
+  return sp_set_pp_error(pp, "out of memory");
+}
+
+/*
+ * Called by 'pp' (the main thread) when it opens a header included by
+ * the main file.  If the header was preprocessed ahead and the result
+ * is still good, splice it and return 1 (the caller must then close
+ * 'in').  Returns 0 if the header must be preprocessed as usual, or
+ * -1 on error.
+ */
+int sp_splice_pp_spec_include(struct sp_pp_spec *spec, struct sp_preprocessor *pp, struct sp_pp_include_file *file, struct sp_input *in)
+{
+  struct sp_pp_spec_job *job = sp_get_ht_value(&spec->jobs, &file->identity, sizeof(file->identity));
+  if (! job)
+    return 0;
+
+  // a job not started yet is done sooner by the main thread
+  pthread_mutex_lock(&spec->lock);
+  while (job->state == SP_PP_SPEC_JOB_RUNNING)
+    pthread_cond_wait(&spec->job_done, &spec->lock);
+  enum sp_pp_spec_job_state state = job->state;
+  job->state = SP_PP_SPEC_JOB_TAKEN;
+  pthread_mutex_unlock(&spec->lock);
+
+  switch (state) {
+  case SP_PP_SPEC_JOB_QUEUED:
+    spec->stats.late++;
+    return 0;
+
+  case SP_PP_SPEC_JOB_DONE:
+    if (job_matches(spec, job, pp, in))
+      break;
+    // fallthrough
+  case SP_PP_SPEC_JOB_FAILED:
+    spec->stats.mispredicted++;
+    return 0;
+
+  default:
+    return 0;  // included again
+  }
+
+  if (splice_job(spec, job, pp, in) < 0)
+    return -1;
+  spec->stats.spliced++;
+  return 1;
+}
@@ -0,0 +1,87 @@
+/* pp_spec.h */
+
+#ifndef PP_SPEC_H_FILE
+#define PP_SPEC_H_FILE
+
+#include <pthread.h>
+
+#include "internal.h"
+#include "hashtable.h"
+#include "pp_macro.h"
+#include "pp_token_list.h"
+
+struct sp_compiler;
+struct sp_preprocessor;
+struct sp_pp_include_file;
+struct sp_input;
+
+/*
+ * A file looked at by '#include' (opened or skipped).
+ */
+struct sp_pp_spec_include {
+  struct sp_pp_include_file *file;
+  const char *path;  // path the file was opened with, NULL if skipped
+  bool top_level;    // included by the main file
+};
+
+/*
+ * The files looked at by a preprocessor, in order.
+ */
+struct sp_pp_spec_log {
+  struct sp_mem_pool *pool;
+  struct sp_pp_spec_include *includes;
+  int len;
+  int cap;
+};
+
+enum sp_pp_spec_job_state {
+  SP_PP_SPEC_JOB_QUEUED,
+  SP_PP_SPEC_JOB_RUNNING,
+  SP_PP_SPEC_JOB_DONE,
+  SP_PP_SPEC_JOB_FAILED,
+  SP_PP_SPEC_JOB_TAKEN,  // spliced, cancelled or given up by the main thread
+};
+
+/*
+ * A header preprocessed on a worker thread, with its own program (for
+ * the file names it adds) and a preprocessor forked from the snapshot.
+ */
+struct sp_pp_spec_job {
+  struct sp_pp_spec_job *next;
+  enum sp_pp_spec_job_state state;  // changed with the lock held
+  const char *path;
+  struct sp_program *prog;
+  struct sp_mem_pool pool;
+  struct sp_ast *ast;
+  struct sp_preprocessor *pp;  // NULL until started
+  struct sp_macro_log macro_log;
+  struct sp_pp_spec_log log;
+  struct sp_pp_token_list output;  // tokens after macro expansion, up to the end of the header
+};
+
+/*
+ * Headers included by the main file, preprocessed ahead on worker
+ * threads (see pp_spec.c).
+ */
+struct sp_pp_spec {
+  struct sp_mem_pool pool;
+  struct sp_preprocessor *base;  // snapshot all jobs start from
+  struct sp_ast *base_ast;
+  struct sp_hashtable jobs;      // identity -> struct sp_pp_spec_job
+  struct sp_pp_spec_job *job_list;
+  struct sp_pp_spec_job *next_job;  // next job to start
+  pthread_mutex_t lock;
+  pthread_cond_t job_done;
+  pthread_t *threads;
+  int n_threads;
+  struct sp_spec_include_stats stats;
+};
+
+void sp_init_pp_spec(struct sp_pp_spec *spec);
+void sp_destroy_pp_spec(struct sp_pp_spec *spec);
+int sp_start_pp_spec(struct sp_pp_spec *spec, struct sp_compiler *comp, const char *filename, int n_threads);
+void sp_stop_pp_spec(struct sp_pp_spec *spec);
+int sp_log_pp_spec_include(struct sp_pp_spec_log *log, struct sp_pp_include_file *file, const char *path, bool top_level);
+int sp_splice_pp_spec_include(struct sp_pp_spec *spec, struct sp_preprocessor *pp, struct sp_pp_include_file *file, struct sp_input *in);
+
+#endif /* PP_SPEC_H_FILE */
@@ -0,0 +1,439 @@
+/* pp_stream.c
+ *
+ * Preprocessed token streams: the output of phase 4 saved in a binary
+ * file, to be read back (by sp_next_token() or sp_next_pp_token())
+ * without lexing or expanding macros again.
+ */
+
+#define _POSIX_C_SOURCE 200809L  // for mmap()
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pp_stream.h"
+#include "preprocessor.h"
+#include "ast.h"
+#include "input.h"
+#include "punct.h"
+
+#define STREAM_MAGIC    "SPORKTOK"
+#define STREAM_VERSION  1
+#define STREAM_ALIGN    8
+
+/*
+ * Format, version 1.  All numbers are in the byte order of the machine
+ * that wrote the file, and all offsets are from the start of the file
+ * to sections aligned to STREAM_ALIGN bytes, so the file is used in
+ * place wherever it's mapped.  Files written by a build whose
+ * 'struct sp_pp_token' has another size are rejected.
+ *
+ *   header   struct stream_header
+ *   strings  struct stream_string[n_strings], the token strings of the
+ *            preprocessor in string id order (ids in the tokens are
+ *            indices here); each string is stored followed by '\0'
+ *   tokens   struct sp_pp_token[n_tokens] as in memory, up to but not
+ *            including the end of file
+ *   files    struct stream_file[n_files], the name and line table of
+ *            every file with locations
+ *   ranges   struct stream_range[n_ranges], sorted by base: where the
+ *            locations of each file opened start
+ *
+ * Tokens are as returned by sp_next_pp_token(), so their locations are
+ * in the text (tokens of macro expansions are at the invocation), with
+ * identifiers marked so they're never expanded again and empty hide
+ * sets.  A location maps to a file and line exactly as in the table it
+ * was saved from: the range with the largest base not above it gives
+ * the file, and the offset from the base is looked up in the file's
+ * line table (the offsets where each line starts).
+ *
+ * A new version is needed for any change to these structures or to
+ * the meaning of the fields of the tokens.
+ */
+struct stream_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t token_size;   // sizeof(struct sp_pp_token)
+  uint32_t size;         // of the whole file
+  uint32_t eof_loc;      // location of the end of file
+  uint32_t n_strings;
+  uint32_t strings;
+  uint32_t n_tokens;
+  uint32_t tokens;
+  uint32_t n_files;
+  uint32_t files;
+  uint32_t n_ranges;
+  uint32_t ranges;
+};
+
+struct stream_string {
+  uint32_t off;          // followed by '\0'
+  uint32_t len;
+};
+
+struct stream_file {
+  uint32_t name;         // followed by '\0'
+  uint32_t name_len;
+  uint32_t lines;        // int32_t n_lines followed by uint32_t line_start[n_lines]
+  uint32_t pad;
+};
+
+struct stream_range {
+  uint32_t base;
+  uint32_t size;         // the range is [base, base+size]
+  uint32_t file;         // index in the files section
+  uint32_t pad;
+};
+
+/*
+ * Writing
+ */
+
+static int align_buffer(struct sp_buffer *buf)
+{
+  while (buf->size % STREAM_ALIGN != 0) {
+    if (sp_buf_add_byte(buf, 0) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int add_section(struct sp_buffer *buf, const void *data, size_t size, uint32_t *ret_off)
+{
+  if (align_buffer(buf) < 0)
+    return -1;
+  *ret_off = (uint32_t) buf->size;
+  if (size > 0 && sp_buf_add_data(buf, data, size) < 0)
+    return -1;
+  return 0;
+}
+
+static int add_string(struct sp_buffer *buf, const char *str, size_t len, uint32_t *ret_off)
+{
+  *ret_off = (uint32_t) buf->size;
+  if (sp_buf_add_data(buf, str, len) < 0 || sp_buf_add_byte(buf, '\0') < 0)
+    return -1;
+  return 0;
+}
+
+static int add_tokens(struct sp_buffer *buf, struct sp_pp_token_list *list, uint32_t *ret_off)
+{
+  if (align_buffer(buf) < 0)
+    return -1;
+  *ret_off = (uint32_t) buf->size;
+  struct sp_pp_token *tokens = sp_pp_token_list_tokens(list);
+  for (int i = 0; i < sp_pp_token_list_size(list); i++) {
+    struct sp_pp_token tok;
+    memset(&tok, 0, sizeof(tok));  // no stray padding bytes in the file
+    tok.type = tokens[i].type;
+    tok.flags = tokens[i].flags;
+    tok.data = tokens[i].data;
+    tok.loc = tokens[i].loc;
+    if (pp_tok_is_identifier(&tok))
+      pp_tok_set_flag(&tok, PP_TOK_FLAG_MACRO_DEAD);
+    if (sp_buf_add_data(buf, &tok, sizeof(tok)) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int add_file(struct sp_buffer *buf, struct sp_buffer *items, struct sp_ast *ast, struct sp_src_file_range *r)
+{
+  struct stream_file f;
+  memset(&f, 0, sizeof(f));
+  const char *name = sp_get_ast_file_name(ast, r->file_id);
+  f.name_len = (uint32_t) strlen(name);
+  if (add_string(buf, name, f.name_len, &f.name) < 0
+      || add_section(buf, r->lines, sizeof(struct sp_src_file_lines) + r->lines->n_lines*sizeof(uint32_t), &f.lines) < 0)
+    return -1;
+  return sp_buf_add_data(items, &f, sizeof(f));
+}
+
+/*
+ * Write the tokens read from a preprocessor (without the end of file)
+ * with its strings and the locations of its AST.
+ */
+int sp_write_pp_stream(struct sp_preprocessor *pp, struct sp_pp_token_list *tokens, sp_src_loc_id eof_loc, const char *filename)
+{
+  struct sp_mem_pool pool;
+  struct sp_buffer buf;
+  struct sp_buffer items;
+  sp_init_mem_pool(&pool);
+  sp_init_buffer(&buf, &pool);
+  sp_init_buffer(&items, &pool);
+
+  struct stream_header head;
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, STREAM_MAGIC, sizeof(head.magic));
+  head.version = STREAM_VERSION;
+  head.token_size = sizeof(struct sp_pp_token);
+  head.eof_loc = eof_loc;
+  if (sp_buf_add_data(&buf, &head, sizeof(head)) < 0)
+    goto err_oom;
+
+  // strings
+  for (sp_string_id id = 0; id < pp->token_strings.num; id++) {
+    struct stream_string str;
+    str.len = (uint32_t) sp_get_string_len(&pp->token_strings, id);
+    if (add_string(&buf, sp_get_string(&pp->token_strings, id), str.len, &str.off) < 0
+        || sp_buf_add_data(&items, &str, sizeof(str)) < 0)
+      goto err_oom;
+  }
+  head.n_strings = pp->token_strings.num;
+  if (add_section(&buf, items.p, items.size, &head.strings) < 0)
+    goto err_oom;
+
+  // tokens
+  head.n_tokens = sp_pp_token_list_size(tokens);
+  if (add_tokens(&buf, tokens, &head.tokens) < 0)
+    goto err_oom;
+
+  // files, once each (files included more than once share their lines)
+  struct sp_src_loc_table *locs = &pp->ast->src_locs;
+  uint32_t *range_files = sp_malloc(&pool, (locs->len + 1) * sizeof(uint32_t));
+  if (! range_files)
+    goto err_oom;
+  items.size = 0;
+  for (int i = 0; i < locs->len; i++) {
+    int same = 0;
+    while (same < i && locs->ranges[same].file_id != locs->ranges[i].file_id)
+      same++;
+    if (same < i) {
+      range_files[i] = range_files[same];
+      continue;
+    }
+    if (add_file(&buf, &items, pp->ast, &locs->ranges[i]) < 0)
+      goto err_oom;
+    range_files[i] = head.n_files++;
+  }
+  if (add_section(&buf, items.p, items.size, &head.files) < 0)
+    goto err_oom;
+
+  // ranges
+  items.size = 0;
+  for (int i = 0; i < locs->len; i++) {
+    struct stream_range r;
+    memset(&r, 0, sizeof(r));
+    r.base = locs->ranges[i].base;
+    r.size = locs->ranges[i].size;
+    r.file = range_files[i];
+    if (sp_buf_add_data(&items, &r, sizeof(r)) < 0)
+      goto err_oom;
+  }
+  head.n_ranges = locs->len;
+  if (add_section(&buf, items.p, items.size, &head.ranges) < 0)
+    goto err_oom;
+
+  head.size = (uint32_t) buf.size;
+  memcpy(buf.p, &head, sizeof(head));
+
+  FILE *f = fopen(filename, "wb");
+  if (! f) {
+    sp_destroy_mem_pool(&pool);
+    return sp_set_error(pp->prog, "can't open '%s'", filename);
+  }
+  bool ok = fwrite(buf.p, 1, buf.size, f) == (size_t) buf.size;
+  if (fclose(f) != 0)
+    ok = false;
+  sp_destroy_mem_pool(&pool);
+  if (! ok)
+    return sp_set_error(pp->prog, "error writing '%s'", filename);
+  return 0;
+
+ err_oom:
+  sp_destroy_mem_pool(&pool);
+  return sp_set_error(pp->prog, "out of memory");
+}
+
+/*
+ * Reading
+ */
+
+int sp_map_pp_stream(struct sp_pp_stream *stream, struct sp_program *prog, const char *filename)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return sp_set_error(prog, "can't open '%s'", filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct stream_header)) {
+    close(fd);
+    return sp_set_error(prog, "invalid token stream '%s'", filename);
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return sp_set_error(prog, "can't read '%s'", filename);
+
+  const struct stream_header *head = data;
+  if (memcmp(head->magic, STREAM_MAGIC, sizeof(head->magic)) != 0
+      || head->version != STREAM_VERSION
+      || head->token_size != sizeof(struct sp_pp_token)
+      || head->size != (size_t) st.st_size) {
+    munmap(data, st.st_size);
+    return sp_set_error(prog, "invalid token stream '%s'", filename);
+  }
+  stream->data = data;
+  stream->size = st.st_size;
+  return 0;
+}
+
+void sp_unmap_pp_stream(struct sp_pp_stream *stream)
+{
+  if (stream->data)
+    munmap(stream->data, stream->size);
+  stream->data = NULL;
+  stream->size = 0;
+}
+
+static const void *get_array(struct sp_pp_stream *stream, uint32_t off, uint32_t n, size_t elem_size)
+{
+  if (off % STREAM_ALIGN != 0 || off > stream->size || n > (stream->size - off) / elem_size)
+    return NULL;
+  return (const char *) stream->data + off;
+}
+
+static const char *get_string(struct sp_pp_stream *stream, uint32_t off, uint32_t len)
+{
+  if (off >= stream->size || len >= stream->size - off)
+    return NULL;
+  const char *str = (const char *) stream->data + off;
+  if (str[len] != '\0')
+    return NULL;
+  return str;
+}
+
+static int load_strings(struct sp_preprocessor *pp, struct sp_pp_stream *stream, const struct stream_header *head)
+{
+  struct sp_string_table *strings = &pp->token_strings;
+  const struct stream_string *stream_strings = get_array(stream, head->strings, head->n_strings, sizeof(struct stream_string));
+  if (! stream_strings || head->n_strings > INT32_MAX)
+    return sp_set_error(pp->prog, "invalid token stream");
+  if (sp_reserve_strings(strings, head->n_strings) < 0)
+    return sp_set_error(pp->prog, "out of memory");
+  for (sp_string_id id = 0; id < (sp_string_id) head->n_strings; id++) {
+    const char *str = get_string(stream, stream_strings[id].off, stream_strings[id].len);
+    if (! str)
+      return sp_set_error(pp->prog, "invalid token stream");
+    // strings added by a new preprocessor were added in the same order when the stream was written
+    if (id < strings->num) {
+      if (strcmp(sp_get_string(strings, id), str) != 0)
+        return sp_set_error(pp->prog, "token stream doesn't match the preprocessor");
+      continue;
+    }
+    if (sp_lookup_string_len(strings, str, stream_strings[id].len) >= 0)
+      return sp_set_error(pp->prog, "invalid token stream");
+    if (sp_add_static_string(strings, str, stream_strings[id].len) < 0)
+      return sp_set_error(pp->prog, "out of memory");
+  }
+  return 0;
+}
+
+static int load_tokens(struct sp_preprocessor *pp, struct sp_pp_stream *stream, const struct stream_header *head, struct sp_pp_token_list *list)
+{
+  const struct sp_pp_token *tokens = get_array(stream, head->tokens, head->n_tokens, sizeof(struct sp_pp_token));
+  if (! tokens || head->n_tokens > INT32_MAX)
+    return sp_set_error(pp->prog, "invalid token stream");
+
+  // make sure bad tokens can't send the preprocessor out of bounds or back into macros
+  for (uint32_t i = 0; i < head->n_tokens; i++) {
+    switch (tokens[i].type) {
+    case TOK_PP_PUNCT:
+      if (! sp_get_punct_name(tokens[i].data.punct_id))
+        return sp_set_error(pp->prog, "invalid token stream");
+      continue;
+    case TOK_PP_OTHER:
+      if (tokens[i].data.other < CHAR_MIN || tokens[i].data.other > UCHAR_MAX)
+        return sp_set_error(pp->prog, "invalid token stream");
+      continue;
+    case TOK_PP_IDENTIFIER:
+      if (! pp_tok_is_macro_dead(&tokens[i]))
+        return sp_set_error(pp->prog, "invalid token stream");
+      // fallthrough
+    case TOK_PP_NUMBER:
+    case TOK_PP_CHAR_CONST:
+    case TOK_PP_STRING:
+      if (tokens[i].data.str_id < 0 || tokens[i].data.str_id >= pp->token_strings.num)
+        return sp_set_error(pp->prog, "invalid token stream");
+      continue;
+    default:
+      return sp_set_error(pp->prog, "invalid token stream");
+    }
+  }
+
+  list->pool = NULL;  // never added to
+  list->heap = (head->n_tokens > 0) ? (struct sp_pp_token *) tokens : NULL;
+  list->hide_sets = NULL;
+  list->size = head->n_tokens;
+  list->cap = head->n_tokens;
+  return 0;
+}
+
+static int load_locations(struct sp_preprocessor *pp, struct sp_pp_stream *stream, const struct stream_header *head, struct sp_ast *ast)
+{
+  const struct stream_file *files = get_array(stream, head->files, head->n_files, sizeof(struct stream_file));
+  const struct stream_range *ranges = get_array(stream, head->ranges, head->n_ranges, sizeof(struct stream_range));
+  sp_string_id *file_ids = sp_malloc(pp->pool, (head->n_files + 1) * sizeof(sp_string_id));
+  if (! files || ! ranges)
+    return sp_set_error(pp->prog, "invalid token stream");
+  if (! file_ids)
+    return sp_set_error(pp->prog, "out of memory");
+
+  for (uint32_t i = 0; i < head->n_files; i++) {
+    const char *name = get_string(stream, files[i].name, files[i].name_len);
+    if (! name)
+      return sp_set_error(pp->prog, "invalid token stream");
+    file_ids[i] = sp_add_ast_file_name(ast, name);
+    if (file_ids[i] < 0)
+      return sp_set_error(pp->prog, "out of memory");
+    if (file_ids[i] > UINT16_MAX)
+      return sp_set_error(pp->prog, "too many files");
+  }
+
+  for (uint32_t i = 0; i < head->n_ranges; i++) {
+    const struct stream_range *r = &ranges[i];
+    if (r->file >= head->n_files)
+      return sp_set_error(pp->prog, "invalid token stream");
+    const struct sp_src_file_lines *lines = get_array(stream, files[r->file].lines, 1, sizeof(struct sp_src_file_lines));
+    if (! lines || lines->n_lines < 1
+        || ! get_array(stream, files[r->file].lines, 1, sizeof(struct sp_src_file_lines) + lines->n_lines*sizeof(uint32_t)))
+      return sp_set_error(pp->prog, "invalid token stream");
+    if (sp_add_src_loc_file_range(&ast->src_locs, (uint16_t) file_ids[r->file], r->base, r->size,
+                                  (struct sp_src_file_lines *) lines) == 0)
+      return sp_set_error(pp->prog, "invalid token stream");
+  }
+  return 0;
+}
+
+/*
+ * Start a new preprocessor (not started from a snapshot) reading the
+ * tokens of a mapped stream, with their locations added to an empty
+ * AST.
+ */
+int sp_load_pp_stream(struct sp_preprocessor *pp, struct sp_pp_stream *stream, struct sp_ast *ast)
+{
+  const struct stream_header *head = stream->data;
+  struct sp_pp_token_list *tokens = sp_malloc(pp->pool, sizeof(struct sp_pp_token_list));
+  if (! tokens)
+    return sp_set_error(pp->prog, "out of memory");
+  if (load_strings(pp, stream, head) < 0
+      || load_tokens(pp, stream, head, tokens) < 0
+      || load_locations(pp, stream, head, ast) < 0)
+    return -1;
+
+  // the tokens come before the end of an empty file
+  struct sp_input *in = sp_new_input_from_data("", 0);
+  if (! in)
+    return sp_set_error(pp->prog, "out of memory");
+  struct sp_src_loc eof;
+  in->file_id = sp_get_ast_src_loc(ast, head->eof_loc, &eof) ? eof.file_id : 0;
+  in->loc_base = head->eof_loc;
+  in->base_cond_level = pp->cond_level;
+  pp->in = in;
+  pp->ast = ast;
+  pp->next_tok_flags = PP_TOK_FLAG_BOL;
+  return sp_add_pp_token_list_to_ph4_input(pp, tokens);
+}
@@ -0,0 +1,28 @@
+/* pp_stream.h */
+
+#ifndef PP_STREAM_H_FILE
+#define PP_STREAM_H_FILE
+
+#include "internal.h"
+#include "pp_token_list.h"
+
+struct sp_preprocessor;
+struct sp_ast;
+
+/*
+ * Preprocessed tokens of a file, mapped from a file made by
+ * sp_write_pp_stream().  The preprocessor and AST loaded from it use
+ * its strings, tokens and line tables in place, so it must stay
+ * mapped while they're used.
+ */
+struct sp_pp_stream {
+  void *data;  // NULL if not mapped
+  size_t size;
+};
+
+int sp_write_pp_stream(struct sp_preprocessor *pp, struct sp_pp_token_list *tokens, sp_src_loc_id eof_loc, const char *filename);
+int sp_map_pp_stream(struct sp_pp_stream *stream, struct sp_program *prog, const char *filename);
+void sp_unmap_pp_stream(struct sp_pp_stream *stream);
+int sp_load_pp_stream(struct sp_preprocessor *pp, struct sp_pp_stream *stream, struct sp_ast *ast);
+
+#endif /* PP_STREAM_H_FILE */
@@ -21,12 +21,11 @@ const char *sp_get_pp_token_punct(struct sp_pp_token *tok)
 
 bool sp_pp_tokens_are_equal(struct sp_pp_token *t1, struct sp_pp_token *t2)
 {
-  if (t1->type != t2->type)
+  if (t1->type != t2->type || pp_tok_has_space(t1) != pp_tok_has_space(t2))
     return false;
 
   switch (t1->type) {
   case TOK_PP_EOF:
-  case TOK_PP_SPACE:
   case TOK_PP_NEWLINE:
   case TOK_PP_END_OF_LIST:
   case TOK_PP_PASTE_MARKER:
@@ -52,7 +51,7 @@ bool sp_pp_tokens_are_equal(struct sp_pp_token *t1, struct sp_pp_token *t2)
 
 const char *sp_dump_pp_token(struct sp_preprocessor *pp, struct sp_pp_token *tok)
 {
-  static char str[256];
+  static SP_THREAD_LOCAL char str[256];
 
 #if 1
 #define MARK_COLOR(x)    "\x1b[31m" x "\x1b[0m"
@@ -89,10 +88,6 @@ const char *sp_dump_pp_token(struct sp_preprocessor *pp, struct sp_pp_token *tok
     snprintf(str, sizeof(str), MARK_COLOR("<newline>"));
     return str;
 
-  case TOK_PP_SPACE:
-    snprintf(str, sizeof(str), " ");
-    return str;
-
   case TOK_PP_OTHER:
     snprintf(str, sizeof(str), OTHER_COLOR("%c"), tok->data.other);
     return str;
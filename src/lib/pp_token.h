@@ -3,10 +3,11 @@
 #ifndef PP_TOKEN_H_FILE
 #define PP_TOKEN_H_FILE
 
+#include "internal.h"
+
 enum sp_pp_token_type {
-  TOK_PP_EOF = 256,
-  TOK_PP_SPACE,
-  TOK_PP_NEWLINE,
+  TOK_PP_EOF,
+  TOK_PP_NEWLINE,      // end of directive line, only seen while reading directives
   TOK_PP_ENABLE_MACRO,
   TOK_PP_END_OF_LIST,
   TOK_PP_PASTE_MARKER,
@@ -20,16 +21,27 @@ enum sp_pp_token_type {
   TOK_PP_OTHER,
 };
 
+#define PP_TOK_FLAG_MACRO_DEAD  (1<<0)
+#define PP_TOK_FLAG_PASTE_DEAD  (1<<1)
+#define PP_TOK_FLAG_SPACE       (1<<2)  // has leading whitespace
+#define PP_TOK_FLAG_BOL         (1<<3)  // first token of its line
+#define PP_TOK_FLAG_TEXT_LOC    (1<<4)  // 'loc' is in the text, see sp_next_pp_token()
+
+#define PP_TOK_WHITESPACE_FLAGS (PP_TOK_FLAG_SPACE|PP_TOK_FLAG_BOL)
+
+/*
+ * Kept to 12 bytes: macro bodies, arguments and expansions are all
+ * arrays of these.  Hide sets are kept outside (see sp_pp_token_list).
+ */
 struct sp_pp_token {
-  enum sp_pp_token_type type;
-  struct sp_src_loc loc;
-  bool macro_dead;
-  bool paste_dead;
+  uint8_t type;             // enum sp_pp_token_type
+  uint8_t flags;            // PP_TOK_FLAG_xxx
   union {
     sp_string_id str_id;
-    int punct_id;
-    int other;
+    int32_t punct_id;
+    int32_t other;
   } data;
+  sp_src_loc_id loc;
 };
 
 struct sp_preprocessor;
@@ -46,7 +58,6 @@ bool sp_pp_tokens_are_equal(struct sp_pp_token *t1, struct sp_pp_token *t2);
 #define pp_tok_is_paste_marker(tok) ((tok)->type == TOK_PP_PASTE_MARKER)
 #define pp_tok_is_enable_macro(tok) ((tok)->type == TOK_PP_ENABLE_MACRO)
 #define pp_tok_is_newline(tok)      ((tok)->type == TOK_PP_NEWLINE)
-#define pp_tok_is_space(tok)        ((tok)->type == TOK_PP_SPACE)
 #define pp_tok_is_number(tok)       ((tok)->type == TOK_PP_NUMBER)
 #define pp_tok_is_header_name(tok)  ((tok)->type == TOK_PP_HEADER_NAME)
 #define pp_tok_is_string(tok)       ((tok)->type == TOK_PP_STRING)
@@ -54,4 +65,14 @@ bool sp_pp_tokens_are_equal(struct sp_pp_token *t1, struct sp_pp_token *t2);
 #define pp_tok_is_any_punct(tok)    ((tok)->type == TOK_PP_PUNCT)
 #define pp_tok_is_punct(tok, p)     ((tok)->type == TOK_PP_PUNCT && (tok)->data.punct_id == (p))
 
+#define pp_tok_is_macro_dead(tok)   (((tok)->flags & PP_TOK_FLAG_MACRO_DEAD) != 0)
+#define pp_tok_is_paste_dead(tok)   (((tok)->flags & PP_TOK_FLAG_PASTE_DEAD) != 0)
+#define pp_tok_set_flag(tok, f)     ((tok)->flags |= (f))
+
+#define pp_tok_has_space(tok)       (((tok)->flags & PP_TOK_WHITESPACE_FLAGS) != 0)
+#define pp_tok_is_bol(tok)          (((tok)->flags & PP_TOK_FLAG_BOL) != 0)
+#define pp_tok_has_text_loc(tok)    (((tok)->flags & PP_TOK_FLAG_TEXT_LOC) != 0)
+#define pp_tok_copy_whitespace(dst, src) \
+  ((dst)->flags = ((dst)->flags & ~PP_TOK_WHITESPACE_FLAGS) | ((src)->flags & PP_TOK_WHITESPACE_FLAGS))
+
 #endif /* PP_TOKEN_H_FILE */
@@ -1,85 +1,169 @@
 /* pp_token_list.c */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "internal.h"
 #include "pp_token_list.h"
 #include "mem_pool.h"
 #include "pp_token.h"
 
-struct sp_pp_token_list *sp_new_pp_token_list(struct sp_mem_pool *pool, int page_size)
+struct sp_pp_token_list *sp_new_pp_token_list(struct sp_mem_pool *pool, int capacity)
 {
   struct sp_pp_token_list *tl = sp_malloc(pool, sizeof(struct sp_pp_token_list));
   if (! tl)
     return NULL;
-  sp_init_pp_token_list(tl, pool, page_size);
+  sp_init_pp_token_list(tl, pool, capacity);
   return tl;
 }
 
-void sp_init_pp_token_list(struct sp_pp_token_list *tl, struct sp_mem_pool *pool, int page_size)
+void sp_init_pp_token_list(struct sp_pp_token_list *tl, struct sp_mem_pool *pool, int capacity)
 {
-  if (page_size == 0)
-    page_size = 1;
   tl->pool = pool;
-  tl->page_list = NULL;
-  tl->last_page = NULL;
-  tl->page_size = page_size;
+  tl->heap = NULL;
+  tl->hide_sets = NULL;
+  tl->size = 0;
+  // 'cap' is the size of the first heap allocation until we go past 'small'
+  tl->cap = (capacity > PP_TOKEN_LIST_INLINE_SIZE) ? capacity : 2*PP_TOKEN_LIST_INLINE_SIZE;
 }
 
-int sp_append_pp_token(struct sp_pp_token_list *tl, struct sp_pp_token *tok)
+#define token_list_elem_size(with_hide_sets) \
+  (sizeof(struct sp_pp_token) + ((with_hide_sets) ? sizeof(sp_hide_set_id) : 0))
+
+/*
+ * Move the tokens to a heap block of 'new_cap' tokens, followed by as
+ * many hide sets if 'with_hide_sets' is set.  The block is grown in
+ * place when possible, so the hide sets are kept in the same block to
+ * not get in the way of that.
+ */
+static int resize_pp_token_list(struct sp_pp_token_list *tl, int new_cap, bool with_hide_sets)
 {
-  if (! tl->last_page || tl->last_page->size == tl->page_size) {
-    struct sp_pp_token_list_page *node = sp_malloc(tl->pool, (sizeof(struct sp_pp_token_list_page)
-                                                              + tl->page_size*sizeof(struct sp_pp_token)));
-    if (! node)
+  size_t old_size = tl->cap * token_list_elem_size(tl->hide_sets != NULL);
+  size_t new_size = new_cap * token_list_elem_size(with_hide_sets);
+  struct sp_pp_token *new_heap = tl->heap;
+  if (! tl->heap || ! sp_extend(tl->pool, tl->heap, old_size, new_size)) {
+    new_heap = sp_malloc(tl->pool, new_size);
+    if (! new_heap)
       return -1;
-    node->next = NULL;
-    node->size = 0;
-
-    if (! tl->last_page)
-      tl->page_list = node;
-    else
-      tl->last_page->next = node;
-    tl->last_page = node;
+    memcpy(new_heap, sp_pp_token_list_tokens(tl), tl->size * sizeof(struct sp_pp_token));
   }
+  if (with_hide_sets) {
+    sp_hide_set_id *new_hide_sets = (sp_hide_set_id *) (new_heap + new_cap);
+    if (tl->hide_sets)
+      memmove(new_hide_sets, tl->hide_sets, tl->size * sizeof(sp_hide_set_id));
+    else {
+      for (int i = 0; i < tl->size; i++)
+        new_hide_sets[i] = SP_EMPTY_HIDE_SET;
+    }
+    tl->hide_sets = new_hide_sets;
+  }
+  if (tl->heap && new_heap != tl->heap)
+    sp_free(tl->pool, tl->heap);
+  tl->heap = new_heap;
+  tl->cap = new_cap;
+  return 0;
+}
+
+static int grow_pp_token_list(struct sp_pp_token_list *tl)
+{
+  int new_cap = (tl->heap) ? 2*tl->cap : tl->cap;
+  return resize_pp_token_list(tl, new_cap, tl->hide_sets != NULL);
+}
+
+int sp_append_pp_token(struct sp_pp_token_list *tl, struct sp_pp_token *tok)
+{
+  int cap = (tl->heap) ? tl->cap : PP_TOKEN_LIST_INLINE_SIZE;
+  if (tl->size == cap && grow_pp_token_list(tl) < 0)
+    return -1;
+  if (tl->hide_sets)
+    tl->hide_sets[tl->size] = SP_EMPTY_HIDE_SET;
+  sp_pp_token_list_tokens(tl)[tl->size++] = *tok;
+  return 0;
+}
 
-  tl->last_page->tokens[tl->last_page->size++] = *tok;
+int sp_append_pp_token_with_hide_set(struct sp_pp_token_list *tl, struct sp_pp_token *tok, sp_hide_set_id hs)
+{
+  // before the heap is used, 'cap' is the size of its first allocation
+  if (hs != SP_EMPTY_HIDE_SET && ! tl->hide_sets && resize_pp_token_list(tl, tl->cap, true) < 0)
+    return -1;
+  if (sp_append_pp_token(tl, tok) < 0)
+    return -1;
+  if (tl->hide_sets)
+    tl->hide_sets[tl->size-1] = hs;
   return 0;
 }
 
 bool sp_pp_token_lists_are_equal(struct sp_pp_token_list *l1, struct sp_pp_token_list *l2)
 {
-  struct sp_pp_token_list_walker w1, w2;
+  if (l1->size != l2->size)
+    return false;
 
-  struct sp_pp_token *t1 = sp_rewind_pp_token_list(&w1, l1);
-  struct sp_pp_token *t2 = sp_rewind_pp_token_list(&w2, l2);
-  while (true) {
-    bool ok1 = sp_read_pp_token_from_list(&w1, &t1);
-    bool ok2 = sp_read_pp_token_from_list(&w2, &t2);
-    if (ok1 != ok2)
-      return false;
-    if (! ok1)
-      break;
-    if (! sp_pp_tokens_are_equal(t1, t2))
+  struct sp_pp_token *t1 = sp_pp_token_list_tokens(l1);
+  struct sp_pp_token *t2 = sp_pp_token_list_tokens(l2);
+  for (int i = 0; i < l1->size; i++) {
+    if (! sp_pp_tokens_are_equal(&t1[i], &t2[i]))
       return false;
   }
   return true;
 }
 
-int sp_pp_token_list_size(struct sp_pp_token_list *tl)
-{
-  int size = 0;
-  for (struct sp_pp_token_list_page *page = tl->page_list; page != NULL; page = page->next)
-    size += page->size;
-  return size;
-}
-
 void sp_dump_pp_token_list(struct sp_pp_token_list *list, struct sp_preprocessor *pp)
 {
   struct sp_pp_token *t;
   struct sp_pp_token_list_walker w = sp_make_pp_token_list_walker(list);
-  while (sp_read_pp_token_from_list(&w, &t))
+  bool first = true;
+  while (sp_read_pp_token_from_list(&w, &t)) {
+    if (! first && pp_tok_has_space(t))
+      printf(" ");
     printf("%s", sp_dump_pp_token(pp, t));
+    first = false;
+  }
+}
+
+/* ======================================================================= */
+/* === ROPE ============================================================== */
+/* ======================================================================= */
+
+void sp_init_pp_token_rope(struct sp_pp_token_rope *rope, struct sp_mem_pool *pool)
+{
+  rope->pool = pool;
+  rope->spans = NULL;
+  rope->len = 0;
+  rope->cap = 0;
+}
+
+int sp_append_pp_token_span(struct sp_pp_token_rope *rope, struct sp_pp_token_span *span)
+{
+  if (span->start >= span->end)
+    return 0;
+
+  // extend the last span if the new one follows it
+  if (rope->len > 0 && span->ws == PP_SPAN_KEEP_WS) {
+    struct sp_pp_token_span *last = &rope->spans[rope->len-1];
+    if (last->list == span->list && last->end == span->start && last->hide_set == span->hide_set) {
+      last->end = span->end;
+      return 0;
+    }
+  }
+
+  if (rope->len == rope->cap) {
+    int new_cap = (rope->cap == 0) ? 8 : 2*rope->cap;
+    if (! rope->spans
+        || ! sp_extend(rope->pool, rope->spans, rope->cap*sizeof(struct sp_pp_token_span), new_cap*sizeof(struct sp_pp_token_span))) {
+      struct sp_pp_token_span *new_spans = sp_malloc(rope->pool, new_cap*sizeof(struct sp_pp_token_span));
+      if (! new_spans)
+        return -1;
+      if (rope->spans) {
+        memcpy(new_spans, rope->spans, rope->len*sizeof(struct sp_pp_token_span));
+        sp_free(rope->pool, rope->spans);
+      }
+      rope->spans = new_spans;
+    }
+    rope->cap = new_cap;
+  }
+
+  rope->spans[rope->len++] = *span;
+  return 0;
 }
 
 /* ======================================================================= */
@@ -102,54 +186,42 @@ struct sp_pp_token_list_walker sp_make_pp_token_list_walker(struct sp_pp_token_l
   return w;
 }
 
+struct sp_pp_token_list_walker sp_make_pp_token_span_walker(struct sp_pp_token_span *span)
+{
+  struct sp_pp_token_list_walker w;
+  w.list = span->list;
+  w.index = span->start;
+  w.end = span->end;
+  w.ws_index = (span->ws == PP_SPAN_KEEP_WS) ? -1 : span->start;
+  w.ws = span->ws;
+  w.hide_set = span->hide_set;
+  w.enable_macro = NULL;
+  return w;
+}
+
 struct sp_pp_token *sp_rewind_pp_token_list(struct sp_pp_token_list_walker *w, struct sp_pp_token_list *tl)
 {
-  //printf("rewind list to node %p\n", (void *) tl->page_list);
   w->list = tl;
-  w->page = tl->page_list;
   w->index = 0;
+  w->end = tl->size;
+  w->ws_index = -1;
+  w->ws = 0;
+  w->hide_set = SP_EMPTY_HIDE_SET;
+  w->enable_macro = NULL;
   return sp_peek_pp_token_from_list(w);
 }
 
 bool sp_read_pp_token_from_list(struct sp_pp_token_list_walker *w, struct sp_pp_token **ret)
 {
-  if (! w->page)
+  if (w->index >= w->end)
     return false;
-
-  *ret = &w->page->tokens[w->index++];
-  if (w->index >= w->page->size) {
-    w->page = w->page->next;
-    w->index = 0;
-  }
-  return true;
-}
-
-bool sp_read_nonblank_pp_token_from_list(struct sp_pp_token_list_walker *w, struct sp_pp_token **ret)
-{
-  do {
-    if (! sp_read_pp_token_from_list(w, ret))
-      return false;
-  } while (pp_tok_is_space(*ret) || pp_tok_is_newline(*ret));
+  *ret = &sp_pp_token_list_tokens(w->list)[w->index++];
   return true;
 }
 
 struct sp_pp_token *sp_peek_pp_token_from_list(struct sp_pp_token_list_walker *w)
 {
-  if (! w->page)
+  if (w->index >= w->end)
     return NULL;
-  return &w->page->tokens[w->index];
-}
-
-struct sp_pp_token *sp_peek_nonblank_pp_token_from_list(struct sp_pp_token_list_walker *w)
-{
-  struct sp_pp_token_list_pos pos = sp_get_pp_token_list_pos(w);
-
-  struct sp_pp_token *tok = NULL;
-  do {
-    if (! sp_read_pp_token_from_list(w, &tok))
-      break;
-  } while (pp_tok_is_space(tok) || pp_tok_is_newline(tok));
-
-  sp_set_pp_token_list_pos(w, pos);
-  return tok;
+  return &sp_pp_token_list_tokens(w->list)[w->index];
 }
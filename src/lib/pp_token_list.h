@@ -5,51 +5,96 @@
 
 #include "internal.h"
 #include "pp_token.h"
+#include "hide_set.h"
 
 struct sp_mem_pool;
+struct sp_macro_def;
 
-struct sp_pp_token_list_page {
-  struct sp_pp_token_list_page *next;
+#define PP_TOKEN_LIST_INLINE_SIZE 4
+
+/*
+ * Tokens are stored contiguously: in 'small' while they fit, then in
+ * a pool-allocated array that doubles as needed.  Lists are copied by
+ * value (e.g. macro bodies), so the storage is always found with
+ * sp_pp_token_list_tokens() instead of a pointer kept in the list.
+ *
+ * The hide set expansion engine gives each token a hide set.  They are
+ * kept outside the tokens, so the tokens stay small for the default
+ * engine: 'hide_sets' is only set when a token with a non-empty hide
+ * set is added, and then points right after the tokens in 'heap'.
+ */
+struct sp_pp_token_list {
+  struct sp_mem_pool *pool;
+  struct sp_pp_token *heap;
+  sp_hide_set_id *hide_sets;  // in 'heap', after 'cap' tokens; NULL if all hide sets are empty
   int size;
-  struct sp_pp_token tokens[];
+  int cap;
+  struct sp_pp_token small[PP_TOKEN_LIST_INLINE_SIZE];
 };
 
-struct sp_pp_token_list_pos {
-  struct sp_pp_token_list_page *page;
-  int index;
+#define PP_SPAN_KEEP_WS 0xff
+
+/*
+ * A view of tokens [start, end) of a list.  If 'ws' is not
+ * PP_SPAN_KEEP_WS, the first token is read with 'ws' as its
+ * whitespace flags, and every token is read with 'hide_set' added
+ * to its own (the list itself is never changed).
+ */
+struct sp_pp_token_span {
+  struct sp_pp_token_list *list;
+  int start;
+  int end;
+  uint8_t ws;
+  sp_hide_set_id hide_set;
 };
 
-struct sp_pp_token_list {
+/*
+ * A sequence of spans, read one after the other.  Used to build
+ * macro expansions out of the macro body and arguments without
+ * copying their tokens.
+ */
+struct sp_pp_token_rope {
   struct sp_mem_pool *pool;
-  struct sp_pp_token_list_page *page_list;
-  struct sp_pp_token_list_page *last_page;
-  int page_size;
+  struct sp_pp_token_span *spans;
+  int len;
+  int cap;
 };
 
 struct sp_pp_token_list_walker {
-  struct sp_pp_token_list_walker *next;
   struct sp_pp_token_list *list;
-  struct sp_pp_token_list_page *page;
   int index;
+  int end;
+  int ws_index;  // index of the token that gets 'ws', or -1
+  uint8_t ws;
+  sp_hide_set_id hide_set;            // added to the hide set of every token read
+  struct sp_macro_def *enable_macro;  // macro to re-enable when done, or NULL
 };
 
-struct sp_pp_token_list *sp_new_pp_token_list(struct sp_mem_pool *pool, int tokens_per_page);
-void sp_init_pp_token_list(struct sp_pp_token_list *tl, struct sp_mem_pool *pool, int tokens_per_page);
-int sp_pp_token_list_size(struct sp_pp_token_list *tl);
+struct sp_pp_token_list *sp_new_pp_token_list(struct sp_mem_pool *pool, int capacity);
+void sp_init_pp_token_list(struct sp_pp_token_list *tl, struct sp_mem_pool *pool, int capacity);
 int sp_append_pp_token(struct sp_pp_token_list *tl, struct sp_pp_token *tok);
+int sp_append_pp_token_with_hide_set(struct sp_pp_token_list *tl, struct sp_pp_token *tok, sp_hide_set_id hs);
 
 bool sp_pp_token_lists_are_equal(struct sp_pp_token_list *l1, struct sp_pp_token_list *l2);
 void sp_dump_pp_token_list(struct sp_pp_token_list *list, struct sp_preprocessor *pp);
 
+void sp_init_pp_token_rope(struct sp_pp_token_rope *rope, struct sp_mem_pool *pool);
+int sp_append_pp_token_span(struct sp_pp_token_rope *rope, struct sp_pp_token_span *span);
+
 struct sp_pp_token_list_walker *sp_new_pp_token_list_walker(struct sp_mem_pool *pool, struct sp_pp_token_list *tl);
 struct sp_pp_token_list_walker sp_make_pp_token_list_walker(struct sp_pp_token_list *tl);
+struct sp_pp_token_list_walker sp_make_pp_token_span_walker(struct sp_pp_token_span *span);
 struct sp_pp_token *sp_rewind_pp_token_list(struct sp_pp_token_list_walker *w, struct sp_pp_token_list *tl);
 bool sp_read_pp_token_from_list(struct sp_pp_token_list_walker *w, struct sp_pp_token **ret);
-bool sp_read_nonblank_pp_token_from_list(struct sp_pp_token_list_walker *w, struct sp_pp_token **ret);
 struct sp_pp_token *sp_peek_pp_token_from_list(struct sp_pp_token_list_walker *w);
-struct sp_pp_token *sp_peek_nonblank_pp_token_from_list(struct sp_pp_token_list_walker *w);
 
-#define sp_get_pp_token_list_pos(w)      ((struct sp_pp_token_list_pos) { .page = (w)->page, .index = (w)->index })
-#define sp_set_pp_token_list_pos(w,pos)  do { (w)->page = (pos).page; (w)->index = (pos).index; } while (0)
+#define sp_pp_token_list_size(tl)        ((tl)->size)
+#define sp_pp_token_list_tokens(tl)      ((tl)->heap ? (tl)->heap : (tl)->small)
+#define sp_get_pp_token_list_hide_set(tl, i) ((tl)->hide_sets ? (tl)->hide_sets[i] : SP_EMPTY_HIDE_SET)
+
+#define sp_get_pp_token_span_token(s, i) (&sp_pp_token_list_tokens((s)->list)[i])
+
+#define sp_get_pp_token_list_pos(w)      ((w)->index)
+#define sp_set_pp_token_list_pos(w,pos)  ((w)->index = (pos))
 
 #endif /* PP_TOKEN_LIST_H_FILE */
@@ -14,32 +14,131 @@
 #include "pp_token_list.h"
 #include "pp_macro.h"
 
-void sp_init_preprocessor(struct sp_preprocessor *pp, struct sp_compiler *comp, struct sp_mem_pool *pool)
+static void init_preprocessor(struct sp_preprocessor *pp, struct sp_compiler *comp, struct sp_mem_pool *pool, struct sp_preprocessor *base)
 {
   pp->prog = comp->prog;
   pp->comp = comp;
   pp->pool = pool;
+  pp->macro_engine = comp->macro_engine;
+  pp->macro_memo = comp->macro_memo;
+  pp->scan_only = false;
+  pp->profile = (comp->macro_profile) ? &comp->profile : NULL;
+  pp->spec = NULL;
+  pp->spec_log = NULL;
   pp->in = NULL;
   pp->ast = NULL;
-  pp->at_newline = false;
-  pp->last_was_space = false;
+  pp->next_tok_flags = 0;
+  pp->in_directive = false;
+  pp->ph3_peek.in = NULL;
   pp->macro_args_reading_level = 0;
   pp->macro_expansion_level = 0;
+  pp->empty_exp_flags = 0;
+  pp->tok_hide_set = SP_EMPTY_HIDE_SET;
+  pp->tok_list = NULL;
+  pp->exp_loc = 0;
   pp->cond_level = -1;
+  pp->cond_expr = NULL;
+  pp->cond_expr_cap = 0;
   pp->date_str_id = -1;
   pp->time_str_id = -1;
   pp->in_tokens = NULL;
+  pp->in_tokens_len = 0;
+  pp->in_tokens_cap = 0;
   pp->init_ph6 = false;
-  sp_init_idht(&pp->macros, pool);
-  sp_init_string_table(&pp->token_strings, pool);
+  sp_init_macro_table(&pp->macros, (base) ? &base->macros : NULL, pool);
+  sp_init_ht(&pp->macro_def_texts, pool);
+  sp_init_ht(&pp->include_files, pool);
+  sp_init_ht(&pp->include_file_ids, pool);
+  pp->include_file_list = NULL;
+  pp->include_file_list_end = &pp->include_file_list;
+  memset(&pp->include_stats, 0, sizeof(pp->include_stats));
+  sp_init_string_table_over(&pp->token_strings, (base) ? &base->token_strings : NULL, pool);
   sp_init_buffer(&pp->tmp_buf, pool);
+  sp_init_buffer(&pp->paste_buf, pool);
   sp_init_mem_pool(&pp->macro_exp_pool);
+  sp_init_hide_set_table(&pp->hide_sets, &pp->macro_exp_pool);
+  sp_init_pp_memo(&pp->memo);
+  if (pp->profile)
+    sp_start_pp_profile(pp->profile);
   sp_init_mem_pool(&pp->directive_pool);
   sp_init_mem_pool(&pp->str_join_pool);
 
+  struct sp_pp_token end_of_list = { .type = TOK_PP_END_OF_LIST };
+  sp_init_pp_token_list(&pp->end_of_arg, pool, 1);
+  sp_append_pp_token(&pp->end_of_arg, &end_of_list);  // fits in the inline storage, can't fail
+}
+
+void sp_init_preprocessor(struct sp_preprocessor *pp, struct sp_compiler *comp, struct sp_mem_pool *pool)
+{
+  init_preprocessor(pp, comp, pool, NULL);
   sp_add_predefined_macros(pp);
 }
 
+/*
+ * Copy the records of included files, which are changed by the files
+ * preprocessed (e.g. when an include guard is found).
+ */
+static int copy_include_files(struct sp_preprocessor *pp, struct sp_preprocessor *base)
+{
+  for (struct sp_pp_include_file *base_file = base->include_file_list; base_file; base_file = base_file->next) {
+    struct sp_pp_include_file *file = sp_malloc(pp->pool, sizeof(struct sp_pp_include_file));
+    if (! file)
+      return -1;
+    *file = *base_file;
+    file->next = NULL;
+    if (sp_add_ht_entry(&pp->include_file_ids, &file->identity, sizeof(file->identity), file) < 0)
+      return -1;
+    *pp->include_file_list_end = file;
+    pp->include_file_list_end = &file->next;
+  }
+
+  // the paths are shared with the base
+  const void *key = NULL;
+  size_t key_len;
+  while (sp_next_ht_key(&base->include_files, &key, &key_len)) {
+    struct sp_pp_include_file *base_file = sp_get_ht_value(&base->include_files, key, key_len);
+    struct sp_pp_include_file *file = sp_get_ht_value(&pp->include_file_ids, &base_file->identity, sizeof(base_file->identity));
+    if (sp_add_ht_entry(&pp->include_files, key, key_len, file) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Start a new preprocessor (with nothing read yet) from the state of
+ * 'base', which must be frozen and must outlive it.  The strings and
+ * macros of the base are shared, not copied: only the ones added,
+ * changed or removed are kept by the new preprocessor.
+ */
+int sp_init_forked_preprocessor(struct sp_preprocessor *pp, struct sp_compiler *comp, struct sp_mem_pool *pool, struct sp_preprocessor *base)
+{
+  init_preprocessor(pp, comp, pool, base);
+  pp->date_str_id = base->date_str_id;
+  pp->time_str_id = base->time_str_id;
+  pp->cond_level = base->cond_level;
+  for (int i = 0; i <= base->cond_level; i++)
+    pp->cond_state[i] = base->cond_state[i];
+  if (copy_include_files(pp, base) < 0)
+    return sp_set_error(pp->prog, "out of memory");
+  return 0;
+}
+
+/*
+ * Prepare a preprocessor to be the base of forked ones: nothing may
+ * change it after this, so the macros still unparsed are parsed now.
+ */
+int sp_freeze_preprocessor(struct sp_preprocessor *pp)
+{
+  struct sp_macro_table_walker w;
+  struct sp_macro_def *macro;
+  sp_rewind_macro_table(&w, &pp->macros);
+  while (sp_read_macro_from_table(&w, &macro)) {
+    if (sp_parse_pp_macro_def(pp, macro) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 void sp_destroy_preprocessor(struct sp_preprocessor *pp)
 {
   while (pp->in) {
@@ -50,11 +149,27 @@ void sp_destroy_preprocessor(struct sp_preprocessor *pp)
   sp_destroy_mem_pool(&pp->directive_pool);
   sp_destroy_mem_pool(&pp->macro_exp_pool);
   sp_destroy_mem_pool(&pp->str_join_pool);
+
+  struct sp_macro_memo_stats *stats = &pp->comp->macro_memo_stats;
+  stats->lookups += pp->memo.stats.lookups;
+  stats->hits += pp->memo.stats.hits;
+  stats->stores += pp->memo.stats.stores;
+  stats->stale += pp->memo.stats.stale;
+  stats->uncacheable += pp->memo.stats.uncacheable;
+  sp_destroy_pp_memo(&pp->memo);
+
+  pp->comp->include_stats.includes += pp->include_stats.includes;
+  pp->comp->include_stats.skipped_guarded += pp->include_stats.skipped_guarded;
+  pp->comp->include_stats.skipped_once += pp->include_stats.skipped_once;
 }
 
 int sp_set_preprocessor_io(struct sp_preprocessor *pp, const char *filename, struct sp_ast *ast)
 {
-  struct sp_input *in = sp_new_input_from_file(filename);
+  struct sp_input *in;
+  if (pp->scan_only)
+    in = sp_open_pp_scan_input(&pp->comp->scan_cache, filename);
+  else
+    in = sp_new_input_from_file(filename);
   if (! in)
     return sp_set_error(pp->prog, "can't open '%s'", filename);
   sp_string_id file_id = sp_add_ast_file_name(ast, filename);
@@ -63,20 +178,32 @@ int sp_set_preprocessor_io(struct sp_preprocessor *pp, const char *filename, str
     return sp_set_error(pp->prog, "out of memory");
   }
   in->file_id = (uint16_t) file_id;
+  in->loc_base = sp_add_ast_src_file(ast, file_id, in->data, in->size);
+  if (in->loc_base == 0) {
+    sp_free_input(in);
+    return sp_set_error(pp->prog, "out of memory");
+  }
   
   pp->in = in;
   pp->in->base_cond_level = pp->cond_level;
   pp->ast = ast;
-  pp->tok_loc.pos = -1;
-  pp->last_tok_loc.pos = -1;
-  pp->at_newline = true;
+  pp->next_tok_flags = PP_TOK_FLAG_BOL;
+  pp->in_directive = false;
   pp->macro_args_reading_level = 0;
   pp->macro_expansion_level = 0;
-  pp->last_was_space = false;
+  pp->empty_exp_flags = 0;
   return 0;
 }
 
-int sp_set_pp_error_at(struct sp_preprocessor *pp, struct sp_src_loc loc, char *fmt, ...)
+static int set_error_at(struct sp_preprocessor *pp, sp_src_loc_id loc_id, const char *str)
+{
+  struct sp_src_loc loc;
+  if (! sp_get_ast_src_loc(pp->ast, loc_id, &loc))
+    return sp_set_error(pp->prog, "%s", str);
+  return sp_set_error(pp->prog, "%s:%d:%d: %s", sp_get_ast_file_name(pp->ast, loc.file_id), loc.line, loc.col, str);
+}
+
+int sp_set_pp_error_at(struct sp_preprocessor *pp, sp_src_loc_id loc, char *fmt, ...)
 {
   char str[256];
   va_list ap;
@@ -84,8 +211,7 @@ int sp_set_pp_error_at(struct sp_preprocessor *pp, struct sp_src_loc loc, char *
   vsnprintf(str, sizeof(str), fmt, ap);
   va_end(ap);
 
-  sp_set_error(pp->prog, "%s:%d:%d: %s", sp_get_ast_file_name(pp->ast, loc.file_id), loc.line, loc.col, str);
-  return -1;
+  return set_error_at(pp, loc, str);
 }
 
 int sp_set_pp_error(struct sp_preprocessor *pp, char *fmt, ...)
@@ -96,27 +222,32 @@ int sp_set_pp_error(struct sp_preprocessor *pp, char *fmt, ...)
   vsnprintf(str, sizeof(str), fmt, ap);
   va_end(ap);
 
-  sp_set_error(pp->prog, "%s:%d:%d: %s", sp_get_ast_file_name(pp->ast, pp->tok.loc.file_id), pp->tok.loc.line, pp->tok.loc.col, str);
-  return -1;
+  return set_error_at(pp, pp->tok.loc, str);
 }
 
-void sp_dump_macros(struct sp_preprocessor *pp)
+int sp_dump_macros(struct sp_preprocessor *pp)
 {
-  sp_string_id name_id = -1;
-  while (sp_next_idht_key(&pp->macros, &name_id)) {
-    struct sp_macro_def *macro = sp_get_idht_value(&pp->macros, name_id);
-    if (macro->pre_id == PP_MACRO_NOT_PREDEFINED)
-      sp_dump_macro(macro, pp);
+  struct sp_macro_table_walker w;
+  struct sp_macro_def *macro;
+  sp_rewind_macro_table(&w, &pp->macros);
+  while (sp_read_macro_from_table(&w, &macro)) {
+    if (macro->pre_id == PP_MACRO_NOT_PREDEFINED && sp_dump_macro(macro, pp) < 0)
+      return -1;
   }
 
-  name_id = -1;
-  while (sp_next_idht_key(&pp->macros, &name_id)) {
-    struct sp_macro_def *macro = sp_get_idht_value(&pp->macros, name_id);
-    if (macro->pre_id != PP_MACRO_NOT_PREDEFINED)
-      sp_dump_macro(macro, pp);
+  sp_rewind_macro_table(&w, &pp->macros);
+  while (sp_read_macro_from_table(&w, &macro)) {
+    if (macro->pre_id != PP_MACRO_NOT_PREDEFINED && sp_dump_macro(macro, pp) < 0)
+      return -1;
   }
+  return 0;
 }
 
+/*
+ * Read the next token of the preprocessed text.  The location of the
+ * returned token is where it appears in the text: its own if it was
+ * read from the text, or that of the macro invocation it came from.
+ */
 int sp_next_pp_token(struct sp_preprocessor *pp, struct sp_pp_token *tok)
 {
   // We consider "preprocessing" to stop at phase 4; phases 5-6 are
@@ -124,5 +255,11 @@ int sp_next_pp_token(struct sp_preprocessor *pp, struct sp_pp_token *tok)
   if (sp_next_pp_ph4_token(pp) < 0)
     return -1;
   *tok = pp->tok;
+  if (! pp_tok_has_text_loc(tok)) {
+    // tokens of a macro expansion are placed at the invocation
+    if (pp->tok_list)
+      tok->loc = pp->exp_loc;
+    pp_tok_set_flag(tok, PP_TOK_FLAG_TEXT_LOC);
+  }
   return 0;
 }
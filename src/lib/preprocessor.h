@@ -11,10 +11,15 @@
 #include "buffer.h"
 #include "id_hashtable.h"
 #include "pp_macro.h"
+#include "hide_set.h"
+#include "pp_memo.h"
+#include "pp_profile.h"
 
 struct sp_ast;
 struct sp_token;
 struct sp_compiler;
+struct sp_pp_spec;
+struct sp_pp_spec_log;
 
 #define PP_MAX_COND_NESTING 64  /* [5.2.4.1] says we need at least 63 */
 
@@ -24,9 +29,33 @@ enum sp_pp_cond_state {
   PP_COND_DONE,      // waiting for #endif
 };
 
-struct sp_pp_file_location {
-  struct sp_src_loc loc;
+/*
+ * A file found by #include.  It's found by any path used to include
+ * it, or by its identity if included through a new path.
+ */
+struct sp_pp_include_file {
+  struct sp_pp_include_file *next;  // next file included for the first time
+  const char *path;                 // path first used to include it
+  struct sp_file_identity identity;
+  sp_string_id guard_id;  // macro guarding the whole file, or -1
+  bool once;              // has '#pragma once'
+};
+
+/*
+ * A token peeked in phase 3, kept so that reading it next doesn't scan
+ * it again.  It's only used if the input is still where it was when
+ * the token was peeked.
+ */
+struct sp_pp_ph3_peek {
+  struct sp_input *in;  // NULL if there's no peeked token
   size_t pos;
+  uint8_t flags;
+  bool in_directive;
+  bool parse_header;
+  size_t end_pos;
+  uint8_t end_flags;
+  bool end_in_directive;
+  struct sp_pp_token tok;
 };
 
 struct sp_preprocessor {
@@ -35,7 +64,9 @@ struct sp_preprocessor {
   struct sp_ast *ast;
 
   struct sp_input *in;
-  struct sp_pp_token_list_walker *in_tokens;
+  struct sp_pp_token_list_walker *in_tokens;  // stack of buffered lists, read from the top
+  int in_tokens_len;
+  int in_tokens_cap;
 
   struct sp_mem_pool *pool;
   struct sp_mem_pool macro_exp_pool;
@@ -44,23 +75,47 @@ struct sp_preprocessor {
   struct sp_string_table token_strings;
   
   struct sp_buffer tmp_buf;
-  struct sp_id_hashtable macros;
+  struct sp_buffer paste_buf;
+  struct sp_macro_table macros;
+  struct sp_hashtable macro_def_texts;  // text of '#define's, shared by equal definitions
+  enum sp_macro_engine macro_engine;
+  bool macro_memo;
+  bool scan_only;  // only run directives, skipping all text (for dependency scans)
+  struct sp_pp_memo memo;
+  struct sp_pp_profile *profile;  // NULL if not profiling
+  struct sp_pp_spec *spec;          // headers preprocessed ahead on other threads, or NULL
+  struct sp_pp_spec_log *spec_log;  // files looked at, NULL if not kept (see pp_spec.c)
+  struct sp_hashtable include_files;     // path -> struct sp_pp_include_file
+  struct sp_hashtable include_file_ids;  // identity -> struct sp_pp_include_file
+  struct sp_pp_include_file *include_file_list;  // in the order first included
+  struct sp_pp_include_file **include_file_list_end;
+  struct sp_include_stats include_stats;
 
   sp_string_id date_str_id;
   sp_string_id time_str_id;
 
   // phase 3:
-  struct sp_pp_file_location tok_loc;
-  struct sp_pp_file_location last_tok_loc;
   struct sp_pp_token tok;
+  uint8_t next_tok_flags;  // whitespace seen before the next token
+  bool in_directive;       // return end of line as TOK_PP_NEWLINE
+  struct sp_pp_ph3_peek ph3_peek;
 
   // phase 4:
   int macro_args_reading_level;
   int macro_expansion_level;
-  bool last_was_space;
-  bool at_newline;
+  uint8_t empty_exp_flags;
+  sp_hide_set_id tok_hide_set;        // hide set of 'tok' (only used by the hide set engine)
+  struct sp_pp_token_list *tok_list;  // buffered list 'tok' was read from, or NULL
+  int tok_index;                      // index of 'tok' in 'tok_list'
+  sp_hide_set_id tok_list_hide_set;   // hide set added to the tokens of 'tok_list'
+  bool tok_changed;                   // 'tok' differs from its copy in 'tok_list'
+  sp_src_loc_id exp_loc;              // name of the last macro expanded from the text
+  struct sp_hide_set_table hide_sets; // hide sets of the current expansion, in 'macro_exp_pool'
+  struct sp_pp_token_list end_of_arg; // marks the end of an argument being expanded
   enum sp_pp_cond_state cond_state[PP_MAX_COND_NESTING];
   int cond_level;
+  struct sp_pp_token *cond_expr;  // expanded tokens of the #if being evaluated
+  int cond_expr_cap;
 
   // phase 6:
   bool init_ph6;
@@ -69,19 +124,30 @@ struct sp_preprocessor {
 };
 
 void sp_init_preprocessor(struct sp_preprocessor *pp, struct sp_compiler *comp, struct sp_mem_pool *pool);
+int sp_init_forked_preprocessor(struct sp_preprocessor *pp, struct sp_compiler *comp, struct sp_mem_pool *pool, struct sp_preprocessor *base);
+int sp_freeze_preprocessor(struct sp_preprocessor *pp);
 void sp_destroy_preprocessor(struct sp_preprocessor *pp);
 int sp_set_pp_error(struct sp_preprocessor *pp, char *fmt, ...) SP_PRINTF_FORMAT(2,3);
-int sp_set_pp_error_at(struct sp_preprocessor *pp, struct sp_src_loc, char *fmt, ...) SP_PRINTF_FORMAT(3,4);
+int sp_set_pp_error_at(struct sp_preprocessor *pp, sp_src_loc_id loc, char *fmt, ...) SP_PRINTF_FORMAT(3,4);
 int sp_set_preprocessor_io(struct sp_preprocessor *pp, const char *filename, struct sp_ast *ast);
-void sp_dump_macros(struct sp_preprocessor *pp);
+int sp_dump_macros(struct sp_preprocessor *pp);
 int sp_add_preprocessor_search_dir(struct sp_preprocessor *pp, const char *dir, bool is_system);
 
-int sp_peek_nonblank_pp_ph3_token(struct sp_preprocessor *pp, struct sp_pp_token *next, bool parse_header);
+int sp_peek_pp_ph3_token(struct sp_preprocessor *pp, struct sp_pp_token *next, bool parse_header);
 int sp_next_pp_ph3_token(struct sp_preprocessor *pp, bool parse_header);
 bool sp_next_pp_ph3_char_is_lparen(struct sp_preprocessor *pp);
+int sp_skip_pp_ph3_group(struct sp_preprocessor *pp);
+int sp_skip_pp_ph3_text(struct sp_preprocessor *pp);
+int sp_read_pp_ph3_directive_text(struct sp_preprocessor *pp, const char **ret_text, size_t *ret_size, sp_src_loc_id *ret_loc);
+int sp_minimize_pp_input(struct sp_input *in, struct sp_buffer *out);
 int sp_string_to_pp_token(struct sp_preprocessor *pp, const char *str, struct sp_pp_token *ret);
 
 int sp_process_pp_directive(struct sp_preprocessor *pp);
+int sp_parse_pp_macro_def(struct sp_preprocessor *pp, struct sp_macro_def *macro);
+struct sp_pp_include_file *sp_get_pp_include_file(struct sp_preprocessor *pp, const char *filename);
+struct sp_pp_include_file *sp_add_pp_include_path(struct sp_preprocessor *pp, const struct sp_file_identity *identity, const char *filename);
+int sp_add_pp_once_file(struct sp_preprocessor *pp, const char *filename);
+int sp_eval_pp_cond_expr(struct sp_preprocessor *pp, struct sp_pp_token *toks, int n_toks, bool *ret);
 int sp_next_pp_ph4_processed_token(struct sp_preprocessor *pp, bool expand_macros);
 int sp_next_pp_ph4_token(struct sp_preprocessor *pp);
 int sp_add_pp_token_list_to_ph4_input(struct sp_preprocessor *pp, struct sp_pp_token_list *list);
@@ -48,11 +48,98 @@ int sp_add_include_search_dir(struct sp_program *prog, const char *dir, bool is_
   return sp_comp_add_include_search_dir(&prog->comp, dir, is_system);
 }
 
+void sp_set_macro_engine(struct sp_program *prog, enum sp_macro_engine engine)
+{
+  prog->comp.macro_engine = engine;
+}
+
+void sp_set_macro_memo(struct sp_program *prog, bool enable)
+{
+  prog->comp.macro_memo = enable;
+}
+
+void sp_get_macro_memo_stats(struct sp_program *prog, struct sp_macro_memo_stats *stats)
+{
+  *stats = prog->comp.macro_memo_stats;
+}
+
+void sp_get_include_stats(struct sp_program *prog, struct sp_include_stats *stats)
+{
+  *stats = prog->comp.include_stats;
+}
+
+void sp_set_macro_profile(struct sp_program *prog, bool enable)
+{
+  prog->comp.macro_profile = enable;
+}
+
+/*
+ * Set '*profile' to an array with the profiles of all macros expanded
+ * since profiling was enabled, and return its length.  The array is
+ * valid until the program is freed.
+ */
+int sp_get_macro_profile(struct sp_program *prog, struct sp_macro_profile **profile)
+{
+  *profile = sp_make_pp_profile_report(&prog->comp.profile);
+  if (! *profile)
+    return sp_set_error(prog, "out of memory");
+  return prog->comp.profile.len;
+}
+
+/*
+ * Preprocess the headers included by each file on 'n_threads' worker
+ * threads, ahead of the main thread (0 to disable).
+ */
+void sp_set_spec_includes(struct sp_program *prog, int n_threads)
+{
+  prog->comp.spec_threads = n_threads;
+}
+
+void sp_get_spec_include_stats(struct sp_program *prog, struct sp_spec_include_stats *stats)
+{
+  *stats = prog->comp.spec.stats;
+}
+
 int sp_preprocess_file(struct sp_program *prog, const char *filename)
 {
   return sp_comp_preprocess_file(&prog->comp, filename);
 }
 
+int sp_write_preprocessed_file(struct sp_program *prog, const char *filename, int fd)
+{
+  return sp_comp_write_preprocessed_file(&prog->comp, filename, fd);
+}
+
+int sp_use_pch(struct sp_program *prog, const char *filename)
+{
+  return sp_comp_use_pch(&prog->comp, filename);
+}
+
+int sp_set_prelude(struct sp_program *prog, const char *filename)
+{
+  return sp_comp_set_prelude(&prog->comp, filename);
+}
+
+int sp_save_token_stream(struct sp_program *prog, const char *filename, const char *stream_filename)
+{
+  return sp_comp_save_token_stream(&prog->comp, filename, stream_filename);
+}
+
+void sp_set_token_stream_input(struct sp_program *prog, bool enable)
+{
+  prog->comp.token_stream_input = enable;
+}
+
+int sp_save_pch(struct sp_program *prog, const char *prelude_filename, const char *filename)
+{
+  return sp_comp_save_pch(&prog->comp, prelude_filename, filename);
+}
+
+int sp_scan_file_deps(struct sp_program *prog, const char *filename, enum sp_deps_format format)
+{
+  return sp_comp_scan_file(&prog->comp, filename, format);
+}
+
 int sp_compile_file(struct sp_program *prog, const char *filename)
 {
   struct sp_mem_pool ast_pool;
@@ -61,8 +61,46 @@ static struct punct {
   { PUNCT_HASHES,      "##"  },
 };
 
+/*
+ * Names of the punctuators with more than one character, indexed by
+ * id - PUNCT_ARROW.
+ */
+static const char *const long_punct_names[] = {
+  [PUNCT_ARROW      - PUNCT_ARROW] = "->",
+  [PUNCT_PLUSPLUS   - PUNCT_ARROW] = "++",
+  [PUNCT_MINUSMINUS - PUNCT_ARROW] = "--",
+  [PUNCT_LSHIFT     - PUNCT_ARROW] = "<<",
+  [PUNCT_RSHIFT     - PUNCT_ARROW] = ">>",
+  [PUNCT_LEQ        - PUNCT_ARROW] = "<=",
+  [PUNCT_GEQ        - PUNCT_ARROW] = ">=",
+  [PUNCT_EQ         - PUNCT_ARROW] = "==",
+  [PUNCT_NEQ        - PUNCT_ARROW] = "!=",
+  [PUNCT_AND        - PUNCT_ARROW] = "&&",
+  [PUNCT_OR         - PUNCT_ARROW] = "||",
+  [PUNCT_ELLIPSIS   - PUNCT_ARROW] = "...",
+  [PUNCT_MULEQ      - PUNCT_ARROW] = "*=",
+  [PUNCT_DIVEQ      - PUNCT_ARROW] = "/=",
+  [PUNCT_MODEQ      - PUNCT_ARROW] = "%=",
+  [PUNCT_PLUSEQ     - PUNCT_ARROW] = "+=",
+  [PUNCT_MINUSEQ    - PUNCT_ARROW] = "-=",
+  [PUNCT_LSHIFTEQ   - PUNCT_ARROW] = "<<=",
+  [PUNCT_RSHIFTEQ   - PUNCT_ARROW] = ">>=",
+  [PUNCT_ANDEQ      - PUNCT_ARROW] = "&=",
+  [PUNCT_XOREQ      - PUNCT_ARROW] = "^=",
+  [PUNCT_OREQ       - PUNCT_ARROW] = "|=",
+  [PUNCT_HASHES     - PUNCT_ARROW] = "##",
+};
+
+/*
+ * Return the name of a punctuator, or NULL if the id isn't one.
+ */
 const char *sp_get_punct_name(int punct_id)
 {
+  if (punct_id >= PUNCT_ARROW) {
+    if (punct_id - PUNCT_ARROW >= ARRAY_SIZE(long_punct_names))
+      return NULL;
+    return long_punct_names[punct_id - PUNCT_ARROW];
+  }
   for (int i = 0; i < ARRAY_SIZE(puncts); i++)
     if (puncts[i].id == punct_id)
       return puncts[i].name;
@@ -76,3 +114,49 @@ int sp_get_punct_id(const char *name)
       return puncts[i].id;
   return -1;
 }
+
+/*
+ * Every pair of punctuators that pastes into another one.
+ */
+static const struct punct_paste {
+  int left;
+  int right;
+  int result;
+} punct_pastes[] = {
+  { '-',               '>',        PUNCT_ARROW      },
+  { '+',               '+',        PUNCT_PLUSPLUS   },
+  { '-',               '-',        PUNCT_MINUSMINUS },
+  { '<',               '<',        PUNCT_LSHIFT     },
+  { '>',               '>',        PUNCT_RSHIFT     },
+  { '<',               '=',        PUNCT_LEQ        },
+  { '>',               '=',        PUNCT_GEQ        },
+  { '=',               '=',        PUNCT_EQ         },
+  { '!',               '=',        PUNCT_NEQ        },
+  { '&',               '&',        PUNCT_AND        },
+  { '|',               '|',        PUNCT_OR         },
+  { '*',               '=',        PUNCT_MULEQ      },
+  { '/',               '=',        PUNCT_DIVEQ      },
+  { '%',               '=',        PUNCT_MODEQ      },
+  { '+',               '=',        PUNCT_PLUSEQ     },
+  { '-',               '=',        PUNCT_MINUSEQ    },
+  { PUNCT_LSHIFT,      '=',        PUNCT_LSHIFTEQ   },
+  { '<',               PUNCT_LEQ,  PUNCT_LSHIFTEQ   },
+  { PUNCT_RSHIFT,      '=',        PUNCT_RSHIFTEQ   },
+  { '>',               PUNCT_GEQ,  PUNCT_RSHIFTEQ   },
+  { '&',               '=',        PUNCT_ANDEQ      },
+  { '^',               '=',        PUNCT_XOREQ      },
+  { '|',               '=',        PUNCT_OREQ       },
+  { '#',               '#',        PUNCT_HASHES     },
+};
+
+/*
+ * Return the punctuator made by pasting two punctuators, or -1 if
+ * they don't make one.
+ */
+int sp_paste_puncts(int punct_id1, int punct_id2)
+{
+  for (int i = 0; i < ARRAY_SIZE(punct_pastes); i++)
+    if (punct_pastes[i].left == punct_id1 && punct_pastes[i].right == punct_id2)
+      return punct_pastes[i].result;
+  return -1;
+}
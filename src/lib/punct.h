@@ -31,5 +31,6 @@ enum {
 
 int sp_get_punct_id(const char *name);
 const char *sp_get_punct_name(int punct_id);
+int sp_paste_puncts(int punct_id1, int punct_id2);
 
 #endif /* PUNCT_H_FILE */
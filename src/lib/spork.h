@@ -16,13 +16,69 @@
 
 struct sp_program;
 
+enum sp_macro_engine {
+  SP_MACRO_ENGINE_DEFAULT,    // disable macros while their expansion is read
+  SP_MACRO_ENGINE_HIDE_SETS,  // Prosser's algorithm: every token carries its hide set
+};
+
+enum sp_deps_format {
+  SP_DEPS_MAKE,  // "file.o: file.c header.h ..." Makefile rule
+  SP_DEPS_JSON,  // {"file": "file.c", "includes": ["header.h", ...]}
+};
+
+struct sp_macro_memo_stats {
+  unsigned long lookups;      // invocations looked up in the memo
+  unsigned long hits;         // invocations replayed from the memo
+  unsigned long stores;       // expansions added to the memo
+  unsigned long stale;        // entries dropped because a macro they used changed
+  unsigned long uncacheable;  // expansions that couldn't be added
+};
+
+struct sp_include_stats {
+  unsigned long includes;         // #include directives processed
+  unsigned long skipped_guarded;  // files not opened because their include guard was defined
+  unsigned long skipped_once;     // files not opened because of '#pragma once'
+};
+
+struct sp_spec_include_stats {
+  unsigned long predicted;     // headers preprocessed ahead on worker threads
+  unsigned long spliced;       // used as preprocessed ahead
+  unsigned long mispredicted;  // preprocessed again, since the state they needed had changed
+  unsigned long late;          // preprocessed by the main thread, since no worker had started them
+};
+
+struct sp_macro_profile {
+  const char *name;
+  unsigned long invocations;
+  unsigned long arg_tokens;       // tokens read in the arguments
+  unsigned long tokens_produced;  // tokens in the replacements, before rescanning
+  unsigned long nested;           // expansions done while expanding the macro
+  double incl_time;               // seconds, including nested expansions
+  double excl_time;               // seconds, excluding nested expansions
+};
+
 struct sp_program *sp_new_program(void);
 void sp_free_program(struct sp_program *prog);
 
 int sp_set_error(struct sp_program *prog, const char *fmt, ...) SP_PRINTF_FORMAT(2,3);
 const char *sp_get_error(struct sp_program *prog);
 int sp_add_include_search_dir(struct sp_program *prog, const char *dir, bool is_system);
+void sp_set_macro_engine(struct sp_program *prog, enum sp_macro_engine engine);
+void sp_set_macro_memo(struct sp_program *prog, bool enable);
+void sp_get_macro_memo_stats(struct sp_program *prog, struct sp_macro_memo_stats *stats);
+void sp_get_include_stats(struct sp_program *prog, struct sp_include_stats *stats);
+void sp_set_macro_profile(struct sp_program *prog, bool enable);
+int sp_get_macro_profile(struct sp_program *prog, struct sp_macro_profile **profile);
+void sp_set_spec_includes(struct sp_program *prog, int n_threads);
+void sp_get_spec_include_stats(struct sp_program *prog, struct sp_spec_include_stats *stats);
+int sp_save_pch(struct sp_program *prog, const char *prelude_filename, const char *filename);
+int sp_use_pch(struct sp_program *prog, const char *filename);
+int sp_set_prelude(struct sp_program *prog, const char *filename);
+int sp_save_token_stream(struct sp_program *prog, const char *filename, const char *stream_filename);
+void sp_set_token_stream_input(struct sp_program *prog, bool enable);
 int sp_compile_file(struct sp_program *prog, const char *filename);
 int sp_preprocess_file(struct sp_program *prog, const char *filename);
+int sp_write_preprocessed_file(struct sp_program *prog, const char *filename, int fd);
+int sp_scan_file_deps(struct sp_program *prog, const char *filename, enum sp_deps_format format);
 
 #endif /* SPORK_H_FILE */
@@ -0,0 +1,183 @@
+/* src_loc.c */
+
+#include <string.h>
+
+#include "src_loc.h"
+
+void sp_init_src_loc_table(struct sp_src_loc_table *t, struct sp_mem_pool *pool)
+{
+  t->pool = pool;
+  t->ranges = NULL;
+  t->len = 0;
+  t->cap = 0;
+  t->next_base = 1;  // 0 is never a valid location
+  sp_init_idht(&t->file_lines, pool);
+}
+
+static struct sp_src_file_lines *get_file_lines(struct sp_src_loc_table *t, uint16_t file_id, const void *data, size_t size)
+{
+  // files included more than once share the line table
+  struct sp_src_file_lines *lines = sp_get_idht_value(&t->file_lines, file_id);
+  if (lines)
+    return lines;
+
+  int n_lines = 1;
+  const char *start = data;
+  const char *end = start + size;
+  for (const char *p = start; (p = memchr(p, '\n', end - p)) != NULL; p++)
+    n_lines++;
+
+  lines = sp_malloc(t->pool, sizeof(struct sp_src_file_lines) + n_lines*sizeof(uint32_t));
+  if (! lines)
+    return NULL;
+  lines->n_lines = 0;
+  lines->line_start[lines->n_lines++] = 0;
+  for (const char *p = start; (p = memchr(p, '\n', end - p)) != NULL; p++)
+    lines->line_start[lines->n_lines++] = (uint32_t) (p + 1 - start);
+
+  if (sp_add_idht_entry(&t->file_lines, file_id, lines) < 0)
+    return NULL;
+  return lines;
+}
+
+static sp_src_loc_id add_range(struct sp_src_loc_table *t, uint16_t file_id, size_t size, struct sp_src_file_lines *lines)
+{
+  // the range includes one past the end, for the end-of-file location
+  if (size >= UINT32_MAX - t->next_base)
+    return 0;
+
+  if (t->len == t->cap) {
+    int new_cap = (t->cap == 0) ? 16 : 2*t->cap;
+    struct sp_src_file_range *new_ranges = sp_malloc(t->pool, new_cap * sizeof(struct sp_src_file_range));
+    if (! new_ranges)
+      return 0;
+    if (t->ranges) {
+      memcpy(new_ranges, t->ranges, t->len * sizeof(struct sp_src_file_range));
+      sp_free(t->pool, t->ranges);
+    }
+    t->ranges = new_ranges;
+    t->cap = new_cap;
+  }
+
+  struct sp_src_file_range *r = &t->ranges[t->len++];
+  r->base = t->next_base;
+  r->size = (uint32_t) size;
+  r->file_id = file_id;
+  r->lines = lines;
+  t->next_base += (sp_src_loc_id) size + 1;
+  return r->base;
+}
+
+sp_src_loc_id sp_add_src_loc_file(struct sp_src_loc_table *t, uint16_t file_id, const void *data, size_t size)
+{
+  struct sp_src_file_lines *lines = get_file_lines(t, file_id, data, size);
+  if (! lines)
+    return 0;
+  return add_range(t, file_id, size, lines);
+}
+
+/*
+ * Add a range for a file whose lines are already known (from the
+ * range of the file in another table).  The lines are copied unless
+ * the table has them already.
+ */
+sp_src_loc_id sp_add_src_loc_file_lines(struct sp_src_loc_table *t, uint16_t file_id, size_t size, struct sp_src_file_lines *from)
+{
+  struct sp_src_file_lines *lines = sp_get_idht_value(&t->file_lines, file_id);
+  if (! lines) {
+    size_t lines_size = sizeof(struct sp_src_file_lines) + from->n_lines*sizeof(uint32_t);
+    lines = sp_malloc(t->pool, lines_size);
+    if (! lines)
+      return 0;
+    memcpy(lines, from, lines_size);
+    if (sp_add_idht_entry(&t->file_lines, file_id, lines) < 0)
+      return 0;
+  }
+  return add_range(t, file_id, size, lines);
+}
+
+/*
+ * Add a range at a given base (not before the end of the last range),
+ * for locations saved elsewhere.  The lines are not copied, so they
+ * must live as long as the table.
+ */
+sp_src_loc_id sp_add_src_loc_file_range(struct sp_src_loc_table *t, uint16_t file_id, sp_src_loc_id base, size_t size, struct sp_src_file_lines *lines)
+{
+  if (base < t->next_base)
+    return 0;
+  t->next_base = base;
+  return add_range(t, file_id, size, lines);
+}
+
+/*
+ * Start an empty table with the ranges of another one, so that its
+ * locations mean the same in both.  The line tables are shared.
+ */
+int sp_copy_src_loc_ranges(struct sp_src_loc_table *t, struct sp_src_loc_table *from)
+{
+  if (from->len > 0) {
+    t->ranges = sp_malloc(t->pool, from->cap * sizeof(struct sp_src_file_range));
+    if (! t->ranges)
+      return -1;
+    memcpy(t->ranges, from->ranges, from->len * sizeof(struct sp_src_file_range));
+  }
+  t->len = from->len;
+  t->cap = from->cap;
+  t->next_base = from->next_base;
+  return 0;
+}
+
+static struct sp_src_file_range *find_range(struct sp_src_loc_table *t, sp_src_loc_id id)
+{
+  if (id == 0 || t->len == 0)
+    return NULL;
+
+  // find the last range starting at or before id
+  int lo = 0, hi = t->len - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (t->ranges[mid].base <= id)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  struct sp_src_file_range *r = &t->ranges[lo];
+  if (id < r->base || id - r->base > r->size)
+    return NULL;
+  return r;
+}
+
+/*
+ * Return the base of the range containing a location, which tells
+ * apart different inclusions of the same file, or 0 if there's none.
+ */
+sp_src_loc_id sp_get_src_loc_base(struct sp_src_loc_table *t, sp_src_loc_id id)
+{
+  struct sp_src_file_range *r = find_range(t, id);
+  return (r) ? r->base : 0;
+}
+
+bool sp_get_src_loc(struct sp_src_loc_table *t, sp_src_loc_id id, struct sp_src_loc *ret)
+{
+  struct sp_src_file_range *r = find_range(t, id);
+  if (! r)
+    return false;
+  uint32_t pos = id - r->base;
+
+  // find the line containing pos
+  struct sp_src_file_lines *lines = r->lines;
+  int lo = 0;
+  int hi = lines->n_lines - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (lines->line_start[mid] <= pos)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  ret->file_id = r->file_id;
+  ret->line = (uint16_t) (lo + 1);
+  ret->col = (uint16_t) (pos - lines->line_start[lo] + 1);
+  return true;
+}
@@ -0,0 +1,43 @@
+/* src_loc.h */
+
+#ifndef SRC_LOC_H_FILE
+#define SRC_LOC_H_FILE
+
+#include "internal.h"
+#include "id_hashtable.h"
+
+struct sp_src_file_lines {
+  int n_lines;
+  uint32_t line_start[];
+};
+
+struct sp_src_file_range {
+  sp_src_loc_id base;
+  uint32_t size;
+  uint16_t file_id;
+  struct sp_src_file_lines *lines;
+};
+
+/*
+ * Maps 32-bit location handles to (file, line, column).  Every input
+ * file opened gets a range of handles [base, base+size], so the
+ * handle of a token is just its file's base plus its byte offset.
+ */
+struct sp_src_loc_table {
+  struct sp_mem_pool *pool;
+  struct sp_src_file_range *ranges;
+  int len;
+  int cap;
+  sp_src_loc_id next_base;
+  struct sp_id_hashtable file_lines;
+};
+
+void sp_init_src_loc_table(struct sp_src_loc_table *t, struct sp_mem_pool *pool);
+sp_src_loc_id sp_add_src_loc_file(struct sp_src_loc_table *t, uint16_t file_id, const void *data, size_t size);
+sp_src_loc_id sp_add_src_loc_file_lines(struct sp_src_loc_table *t, uint16_t file_id, size_t size, struct sp_src_file_lines *from);
+sp_src_loc_id sp_add_src_loc_file_range(struct sp_src_loc_table *t, uint16_t file_id, sp_src_loc_id base, size_t size, struct sp_src_file_lines *lines);
+int sp_copy_src_loc_ranges(struct sp_src_loc_table *t, struct sp_src_loc_table *from);
+bool sp_get_src_loc(struct sp_src_loc_table *t, sp_src_loc_id id, struct sp_src_loc *ret);
+sp_src_loc_id sp_get_src_loc_base(struct sp_src_loc_table *t, sp_src_loc_id id);
+
+#endif /* SRC_LOC_H_FILE */
@@ -7,9 +7,21 @@
 #define GROW_SIZE 256
 
 void sp_init_string_table(struct sp_string_table *s, struct sp_mem_pool *pool)
+{
+  sp_init_string_table_over(s, NULL, pool);
+}
+
+/*
+ * Start a table with the strings of 'base' (which may be NULL).  New
+ * strings get ids after the ones in 'base', and are only added to the
+ * new table.
+ */
+void sp_init_string_table_over(struct sp_string_table *s, struct sp_string_table *base, struct sp_mem_pool *pool)
 {
   s->pool = pool;
-  s->num = 0;
+  s->base = base;
+  s->first_id = (base) ? base->num : 0;
+  s->num = s->first_id;
   s->cap = 0;
   s->entries = NULL;
   sp_init_ht(&s->string_to_id, pool);
@@ -17,64 +29,136 @@ void sp_init_string_table(struct sp_string_table *s, struct sp_mem_pool *pool)
 
 void sp_destroy_string_table(struct sp_string_table *s)
 {
-  for (sp_string_id i = 0; i < s->num; i++)
+  for (sp_string_id i = 0; i < s->num - s->first_id; i++)
     sp_free(s->pool, s->entries[i].str);
   sp_free(s->pool, s->entries);
   sp_destroy_ht(&s->string_to_id);
 }
 
+// strings are keyed without their terminating '\0', so they can be looked up by length
 static void update_hashtable(struct sp_string_table *s)
 {
-  for (sp_string_id i = 0; i < s->num; i++)
-    sp_add_ht_entry(&s->string_to_id, s->entries[i].str, s->entries[i].len, &s->entries[i].id);
+  for (sp_string_id i = 0; i < s->num - s->first_id; i++)
+    sp_add_ht_entry(&s->string_to_id, s->entries[i].str, s->entries[i].len - 1, &s->entries[i].id);
+}
+
+static int grow_entries(struct sp_string_table *s, sp_string_id new_cap)
+{
+  struct sp_string_table_entry *new_entries = sp_malloc(s->pool, new_cap * sizeof(s->entries[0]));
+  if (new_entries == NULL)
+    return -1;
+  if (s->entries) {
+    memcpy(new_entries, s->entries, (s->num - s->first_id) * sizeof(s->entries[0]));
+    sp_free(s->pool, s->entries);
+  }
+  s->entries = new_entries;
+  s->cap = new_cap;
+  return 0;
+}
+
+static sp_string_id add_entry(struct sp_string_table *s, char *str, size_t len)
+{
+  struct sp_string_table_entry *e = &s->entries[s->num - s->first_id];
+  e->id = s->num;
+  e->len = len + 1;
+  e->str = str;
+  if (sp_add_ht_entry(&s->string_to_id, str, len, &e->id) < 0)
+    return -1;
+  return s->num++;
 }
 
 sp_string_id sp_add_string(struct sp_string_table *s, const char *str)
 {
-  sp_string_id cur = sp_lookup_string(s, str);
+  return sp_add_string_len(s, str, strlen(str));
+}
+
+/*
+ * Add the 'len' bytes at 'str' (which don't have to be followed by
+ * '\0') as a string.
+ */
+sp_string_id sp_add_string_len(struct sp_string_table *s, const char *str, size_t len)
+{
+  sp_string_id cur = sp_lookup_string_len(s, str, len);
   if (cur >= 0)
     return cur;
 
-  if (s->num == s->cap) {
-    sp_string_id new_cap = (s->cap + GROW_SIZE) / GROW_SIZE * GROW_SIZE;
-    void *new_entries = sp_realloc(s->pool, s->entries, new_cap * sizeof(s->entries[0]));
-    if (new_entries == NULL)
+  if (s->num - s->first_id == s->cap) {
+    if (grow_entries(s, (s->cap + GROW_SIZE) / GROW_SIZE * GROW_SIZE) < 0)
       return -1;
-    s->entries = new_entries;
-    s->cap = new_cap;
     update_hashtable(s);
   }
 
-  s->entries[s->num].id = s->num;
-  s->entries[s->num].len = strlen(str) + 1;
-  s->entries[s->num].str = sp_malloc(s->pool, s->entries[s->num].len);
-  if (! s->entries[s->num].str)
+  char *copy = sp_malloc(s->pool, len + 1);
+  if (! copy)
     return -1;
-  memcpy(s->entries[s->num].str, str, s->entries[s->num].len);
-  if (sp_add_ht_entry(&s->string_to_id, s->entries[s->num].str, s->entries[s->num].len, &s->entries[s->num].id) < 0)
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return add_entry(s, copy, len);
+}
+
+/*
+ * Make room for 'n' more strings, so that adding them doesn't grow the
+ * table (and rebuild the hash table) again and again.
+ */
+int sp_reserve_strings(struct sp_string_table *s, int n)
+{
+  sp_string_id new_cap = (s->num - s->first_id + n + GROW_SIZE - 1) / GROW_SIZE * GROW_SIZE;
+  if (new_cap <= s->cap)
+    return 0;
+  if (grow_entries(s, new_cap) < 0)
     return -1;
-  return s->num++;
+  if (sp_alloc_ht_len(&s->string_to_id, new_cap) < 0)
+    return -1;
+  update_hashtable(s);
+  return 0;
+}
+
+/*
+ * Add a string without copying it: 'str' must be followed by '\0' and
+ * stay valid while the table is used, and the table must be in a
+ * memory pool (which doesn't free strings one by one).  Unlike
+ * sp_add_string(), the string is always added, so it must not be in
+ * the table already.
+ */
+sp_string_id sp_add_static_string(struct sp_string_table *s, const char *str, size_t len)
+{
+  if (s->num - s->first_id == s->cap && sp_reserve_strings(s, 1) < 0)
+    return -1;
+  return add_entry(s, (char *) str, len);
 }
 
 sp_string_id sp_lookup_string(struct sp_string_table *s, const char *str)
 {
-#if 0
-  for (sp_string_id i = 0; i < s->num; i++) {
-    if (strcmp(str, s->entries[i].str) == 0)
-      return i;
+  return sp_lookup_string_len(s, str, strlen(str));
+}
+
+sp_string_id sp_lookup_string_len(struct sp_string_table *s, const char *str, size_t len)
+{
+  if (s->base) {
+    sp_string_id id = sp_lookup_string_len(s->base, str, len);
+    if (id >= 0)
+      return id;
   }
-#else
-  sp_string_id *p_id = sp_get_ht_value(&s->string_to_id, str, strlen(str)+1);
+  sp_string_id *p_id = sp_get_ht_value(&s->string_to_id, str, len);
   if (! p_id)
     return -1;
   return *p_id;
-#endif
-  return -1;
 }
 
 const char *sp_get_string(struct sp_string_table *s, sp_string_id id)
 {
-  if (id >= 0 && id < s->num)
-    return s->entries[id].str;
+  if (id >= s->first_id && id < s->num)
+    return s->entries[id - s->first_id].str;
+  if (id >= 0 && id < s->first_id)
+    return sp_get_string(s->base, id);
   return NULL;
 }
+
+size_t sp_get_string_len(struct sp_string_table *s, sp_string_id id)
+{
+  if (id >= s->first_id && id < s->num)
+    return s->entries[id - s->first_id].len - 1;
+  if (id >= 0 && id < s->first_id)
+    return sp_get_string_len(s->base, id);
+  return 0;
+}
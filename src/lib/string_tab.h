@@ -13,18 +13,31 @@ struct sp_string_table_entry {
   sp_string_id id;
 };
 
+/*
+ * A table can be started over a base table, whose strings keep their
+ * ids and are shared without copying.  The base must not change while
+ * the table is used.
+ */
 struct sp_string_table {
   struct sp_mem_pool *pool;
-  sp_string_id num;
+  struct sp_string_table *base;  // NULL if none
+  sp_string_id first_id;         // id of entries[0] (the number of strings in the base)
+  sp_string_id num;              // including the strings in the base
   sp_string_id cap;
   struct sp_string_table_entry *entries;
   struct sp_hashtable string_to_id;
 };
 
 void sp_init_string_table(struct sp_string_table *s, struct sp_mem_pool *pool);
+void sp_init_string_table_over(struct sp_string_table *s, struct sp_string_table *base, struct sp_mem_pool *pool);
 void sp_destroy_string_table(struct sp_string_table *s);
 sp_string_id sp_add_string(struct sp_string_table *s, const char *string);
+sp_string_id sp_add_string_len(struct sp_string_table *s, const char *string, size_t len);
+int sp_reserve_strings(struct sp_string_table *s, int n);
+sp_string_id sp_add_static_string(struct sp_string_table *s, const char *string, size_t len);
 sp_string_id sp_lookup_string(struct sp_string_table *s, const char *string);
+sp_string_id sp_lookup_string_len(struct sp_string_table *s, const char *string, size_t len);
 const char *sp_get_string(struct sp_string_table *s, sp_string_id id);
+size_t sp_get_string_len(struct sp_string_table *s, sp_string_id id);
 
 #endif /* STRING_TAB_H_FILE */
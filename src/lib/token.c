@@ -84,7 +84,7 @@ static char to_hex_char(int i)
 
 const char *sp_dump_token(struct sp_token *tok, struct sp_string_table *tab)
 {
-  static char str[256];
+  static SP_THREAD_LOCAL char str[256];
 
 #if 1
 #define MARK_COLOR(x)     "\x1b[31m" x "\x1b[0m"
@@ -60,7 +60,7 @@ enum sp_keyword_type {
 
 struct sp_token {
   enum sp_token_type type;
-  struct sp_src_loc loc;
+  sp_src_loc_id loc;
   union {
     sp_string_id str_id;
     int punct_id;
@@ -1,10 +1,28 @@
 /* main.c */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <spork.h>
 
+static enum sp_macro_engine macro_engine = SP_MACRO_ENGINE_DEFAULT;
+static bool macro_memo = false;
+static bool macro_profile = false;
+static bool include_stats = false;
+static const char *pch_filename = NULL;
+static const char *prelude_filename = NULL;
+static int spec_includes = 0;
+static const char *output_filename = NULL;
+static bool token_stream_input = false;
+
+#define MACRO_PROFILE_TOP_N 20
+
 static const char *include_dirs[] = {
   "tests/sys_include"
   //"/usr/include"
@@ -18,6 +36,11 @@ struct sp_program *create_prog(void)
     return NULL;
   }
 
+  sp_set_macro_engine(prog, macro_engine);
+  sp_set_macro_memo(prog, macro_memo);
+  sp_set_macro_profile(prog, macro_profile);
+  sp_set_spec_includes(prog, spec_includes);
+  sp_set_token_stream_input(prog, token_stream_input);
   for (int i = 0; i < (int) (sizeof(include_dirs)/sizeof(include_dirs[0])); i++) {
     if (sp_add_include_search_dir(prog, include_dirs[i], true) < 0) {
       printf("ERROR: %s\n", sp_get_error(prog));
@@ -25,35 +48,219 @@ struct sp_program *create_prog(void)
       return NULL;
     }
   }
+  if (pch_filename && sp_use_pch(prog, pch_filename) < 0) {
+    printf("ERROR: %s\n", sp_get_error(prog));
+    sp_free_program(prog);
+    return NULL;
+  }
+  if (prelude_filename && sp_set_prelude(prog, prelude_filename) < 0) {
+    printf("ERROR: %s\n", sp_get_error(prog));
+    sp_free_program(prog);
+    return NULL;
+  }
 
   return prog;
 }
 
-void preprocess(const char *filename)
+void print_include_stats(struct sp_program *prog)
+{
+  struct sp_include_stats stats;
+  sp_get_include_stats(prog, &stats);
+  fprintf(stderr, "includes: %lu processed, %lu skipped by include guard, %lu skipped by #pragma once\n",
+          stats.includes, stats.skipped_guarded, stats.skipped_once);
+}
+
+void print_spec_include_stats(struct sp_program *prog)
+{
+  struct sp_spec_include_stats stats;
+  sp_get_spec_include_stats(prog, &stats);
+  fprintf(stderr, "spec includes: %lu predicted, %lu spliced, %lu mispredicted, %lu late\n",
+          stats.predicted, stats.spliced, stats.mispredicted, stats.late);
+}
+
+void print_macro_memo_stats(struct sp_program *prog)
+{
+  struct sp_macro_memo_stats stats;
+  sp_get_macro_memo_stats(prog, &stats);
+  double hit_rate = (stats.lookups > 0) ? 100.0 * stats.hits / stats.lookups : 0;
+  fprintf(stderr, "macro memo: %lu lookups, %lu hits (%.1f%%), %lu stored, %lu stale, %lu uncacheable\n",
+          stats.lookups, stats.hits, hit_rate, stats.stores, stats.stale, stats.uncacheable);
+}
+
+static int compare_excl_time(const void *p1, const void *p2)
+{
+  const struct sp_macro_profile *m1 = p1;
+  const struct sp_macro_profile *m2 = p2;
+  return (m1->excl_time < m2->excl_time) - (m1->excl_time > m2->excl_time);
+}
+
+void print_macro_profile(struct sp_program *prog)
+{
+  struct sp_macro_profile *profile;
+  int n = sp_get_macro_profile(prog, &profile);
+  if (n < 0) {
+    fprintf(stderr, "ERROR: %s\n", sp_get_error(prog));
+    return;
+  }
+  qsort(profile, n, sizeof(struct sp_macro_profile), compare_excl_time);
+  fprintf(stderr, "%-24s %10s %10s %10s %10s %10s %10s\n",
+          "macro", "calls", "arg toks", "produced", "nested", "incl ms", "excl ms");
+  for (int i = 0; i < n && i < MACRO_PROFILE_TOP_N; i++)
+    fprintf(stderr, "%-24s %10lu %10lu %10lu %10lu %10.3f %10.3f\n",
+            profile[i].name, profile[i].invocations, profile[i].arg_tokens, profile[i].tokens_produced,
+            profile[i].nested, profile[i].incl_time * 1000, profile[i].excl_time * 1000);
+}
+
+void save_pch(const char *prelude_filename, const char *filename)
 {
   struct sp_program *prog = create_prog();
-  if (sp_preprocess_file(prog, filename) < 0)
-    printf("\nERROR: %s\n", sp_get_error(prog));
+  if (! prog)
+    return;
+  if (sp_save_pch(prog, prelude_filename, filename) < 0)
+    printf("ERROR: %s\n", sp_get_error(prog));
   sp_free_program(prog);
 }
 
-void compile(const char *filename)
+void save_tokens(const char *filename, const char *stream_filename)
 {
   struct sp_program *prog = create_prog();
-  if (sp_compile_file(prog, filename) < 0)
-    printf("\nERROR: %s\n", sp_get_error(prog));
+  if (! prog)
+    return;
+  if (sp_save_token_stream(prog, filename, stream_filename) < 0)
+    printf("ERROR: %s\n", sp_get_error(prog));
+  sp_free_program(prog);
+}
+
+void preprocess(int n_files, char **filenames)
+{
+  struct sp_program *prog = create_prog();
+  if (! prog)
+    return;
+  int fd = -1;
+  if (output_filename) {
+    fd = (strcmp(output_filename, "-") == 0) ? STDOUT_FILENO : open(output_filename, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) {
+      printf("ERROR: can't open '%s': %s\n", output_filename, strerror(errno));
+      sp_free_program(prog);
+      return;
+    }
+  }
+  for (int i = 0; i < n_files; i++) {
+    int ret = (fd >= 0) ? sp_write_preprocessed_file(prog, filenames[i], fd) : sp_preprocess_file(prog, filenames[i]);
+    if (ret < 0) {
+      printf("\nERROR: %s\n", sp_get_error(prog));
+      break;
+    }
+  }
+  if (fd >= 0 && fd != STDOUT_FILENO)
+    close(fd);
+  if (macro_memo)
+    print_macro_memo_stats(prog);
+  if (macro_profile)
+    print_macro_profile(prog);
+  if (include_stats)
+    print_include_stats(prog);
+  if (spec_includes > 0)
+    print_spec_include_stats(prog);
+  sp_free_program(prog);
+}
+
+void scan_deps(int n_files, char **filenames, enum sp_deps_format format)
+{
+  // one program for all files, so headers they share are only read once
+  struct sp_program *prog = create_prog();
+  if (! prog)
+    return;
+  for (int i = 0; i < n_files; i++) {
+    if (sp_scan_file_deps(prog, filenames[i], format) < 0) {
+      printf("\nERROR: %s\n", sp_get_error(prog));
+      break;
+    }
+  }
+  if (include_stats)
+    print_include_stats(prog);
+  sp_free_program(prog);
+}
+
+void compile(int n_files, char **filenames)
+{
+  struct sp_program *prog = create_prog();
+  if (! prog)
+    return;
+  for (int i = 0; i < n_files; i++) {
+    if (sp_compile_file(prog, filenames[i]) < 0) {
+      printf("\nERROR: %s\n", sp_get_error(prog));
+      break;
+    }
+  }
+  if (macro_profile)
+    print_macro_profile(prog);
+  if (include_stats)
+    print_include_stats(prog);
+  if (spec_includes > 0)
+    print_spec_include_stats(prog);
   sp_free_program(prog);
 }
 
 int main(int argc, char **argv)
 {
-  if (argc < 2) {
-    printf("USAGE: %s [-E] filename.spork\n", argv[0]);
+  bool only_preprocess = false;
+  bool only_deps = false;
+  const char *save_pch_filename = NULL;
+  const char *save_tokens_filename = NULL;
+  enum sp_deps_format deps_format = SP_DEPS_MAKE;
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (strcmp(argv[arg], "-E") == 0)
+      only_preprocess = true;
+    else if (strcmp(argv[arg], "-M") == 0)
+      only_deps = true;
+    else if (strcmp(argv[arg], "-M-json") == 0) {
+      only_deps = true;
+      deps_format = SP_DEPS_JSON;
+    }
+    else if (strcmp(argv[arg], "-hide-sets") == 0)
+      macro_engine = SP_MACRO_ENGINE_HIDE_SETS;
+    else if (strcmp(argv[arg], "-macro-memo") == 0)
+      macro_memo = true;
+    else if (strcmp(argv[arg], "-macro-profile") == 0)
+      macro_profile = true;
+    else if (strcmp(argv[arg], "-include-stats") == 0)
+      include_stats = true;
+    else if (strcmp(argv[arg], "-pch") == 0 && arg+1 < argc)
+      pch_filename = argv[++arg];
+    else if (strcmp(argv[arg], "-prelude") == 0 && arg+1 < argc)
+      prelude_filename = argv[++arg];
+    else if (strcmp(argv[arg], "-spec-includes") == 0 && arg+1 < argc)
+      spec_includes = atoi(argv[++arg]);
+    else if (strcmp(argv[arg], "-o") == 0 && arg+1 < argc)
+      output_filename = argv[++arg];
+    else if (strcmp(argv[arg], "-save-pch") == 0 && arg+1 < argc)
+      save_pch_filename = argv[++arg];
+    else if (strcmp(argv[arg], "-save-tokens") == 0 && arg+1 < argc)
+      save_tokens_filename = argv[++arg];
+    else if (strcmp(argv[arg], "-tokens") == 0)
+      token_stream_input = true;
+    else
+      break;
+  }
+  if (arg >= argc || ((save_pch_filename || save_tokens_filename) && arg != argc-1)) {
+    printf("USAGE: %s [-E [-o file.i|-]] [-hide-sets] [-macro-memo] [-macro-profile] [-include-stats] [-pch file.pch] [-prelude prelude.h] [-spec-includes N] filename.spork...\n", argv[0]);
+    printf("       %s -M|-M-json [-include-stats] [-pch file.pch] [-prelude prelude.h] filename.spork...\n", argv[0]);
+    printf("       %s -save-pch file.pch [-pch file.pch] [-prelude prelude.h] prelude.h\n", argv[0]);
+    printf("       %s -save-tokens file.tok [-pch file.pch] [-prelude prelude.h] [-spec-includes N] filename.spork\n", argv[0]);
+    printf("       %s -tokens [-E [-o file.i|-]] file.tok...\n", argv[0]);
     return 1;
   }
-  if (strcmp(argv[1], "-E") == 0)
-    preprocess(argv[2]);
+  if (save_pch_filename)
+    save_pch(argv[arg], save_pch_filename);
+  else if (save_tokens_filename)
+    save_tokens(argv[arg], save_tokens_filename);
+  else if (only_deps)
+    scan_deps(argc - arg, &argv[arg], deps_format);
+  else if (only_preprocess)
+    preprocess(argc - arg, &argv[arg]);
   else
-    compile(argv[1]);
+    compile(argc - arg, &argv[arg]);
   return 0;
 }
@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Check that token streams with corrupted tokens are rejected with an
+# error instead of being used.  Run from the top directory with the
+# spork binary to test (default: src/spork).
+
+SPORK=${1:-src/spork}
+TOK=${TMPDIR:-/tmp}/bad_stream.$$.tok
+BAD=${TMPDIR:-/tmp}/bad_stream.$$.bad
+trap 'rm -f "$TOK" "$BAD"' EXIT
+
+TOK_PP_PUNCT=10
+TOK_PP_OTHER=11
+
+u32() { od -An -tu4 -j "$1" -N 4 "$TOK" | tr -d ' '; }
+u8()  { od -An -tu1 -j "$1" -N 1 "$TOK" | tr -d ' '; }
+
+"$SPORK" -save-tokens "$TOK" tests/test.c || exit 1
+token_size=$(u32 12)
+n_tokens=$(u32 32)
+tokens=$(u32 36)
+
+# the first punctuator
+i=0
+while [ $i -lt "$n_tokens" ] && [ "$(u8 $((tokens + i*token_size)))" != $TOK_PP_PUNCT ]; do
+  i=$((i + 1))
+done
+[ $i -lt "$n_tokens" ] || { echo "no punctuator in stream"; exit 1; }
+tok=$((tokens + i*token_size))
+data=$((tok + token_size - 8))  # the data and location are last
+
+fail=0
+for type in $TOK_PP_PUNCT $TOK_PP_OTHER; do
+  cp "$TOK" "$BAD"
+  printf "\\$(printf %o $type)" | dd of="$BAD" bs=1 seek=$tok conv=notrunc 2>/dev/null
+  printf '\177\177\177\177' | dd of="$BAD" bs=1 seek=$data conv=notrunc 2>/dev/null
+  out=$("$SPORK" -tokens -E -o /dev/null "$BAD" 2>&1)
+  status=$?
+  if [ $status -ge 128 ] || ! echo "$out" | grep -q "invalid token stream"; then
+    echo "FAIL: token type $type with bad data: status $status: $out"
+    fail=1
+  fi
+done
+[ $fail = 0 ] && echo "bad token streams: OK"
+exit $fail
@@ -0,0 +1,44 @@
+/* Benchmark: expansion-heavy input (nested function-like macros,
+ * argument pre-expansion, pasting and object-like constants). */
+
+#define ONE       1
+#define TWO       (ONE + ONE)
+#define FOUR      (TWO * TWO)
+#define SIZE      (FOUR * FOUR * FOUR)
+
+#define ID(x)     x
+#define SQ(x)     ((x) * (x))
+#define CAT(a,b)  a ## b
+#define XCAT(a,b) CAT(a,b)
+#define STR(x)    # x
+#define XSTR(x)   STR(x)
+
+#define L0(x)     ID(ID(ID(ID(x))))
+#define L1(x)     L0(L0(L0(L0(x))))
+#define L2(x)     L1(L1(L1(L1(x))))
+
+#define D0(x)     x + x
+#define D1(x)     D0(D0(x))
+#define D2(x)     D1(D1(x))
+#define D3(x)     D2(D2(x))
+#define D4(x)     D3(D3(x))
+
+#define FIELD(n)  int XCAT(field_, n) = SQ(SIZE) + L1(n);
+#define ROW(n)    FIELD(n ## 0) FIELD(n ## 1) FIELD(n ## 2) FIELD(n ## 3) FIELD(n ## 4) \
+                  FIELD(n ## 5) FIELD(n ## 6) FIELD(n ## 7) FIELD(n ## 8) FIELD(n ## 9)
+#define TABLE(n)  ROW(n ## 0) ROW(n ## 1) ROW(n ## 2) ROW(n ## 3) ROW(n ## 4) \
+                  ROW(n ## 5) ROW(n ## 6) ROW(n ## 7) ROW(n ## 8) ROW(n ## 9)
+
+#define BLOCK(n)  TABLE(n ## 0) TABLE(n ## 1) TABLE(n ## 2) TABLE(n ## 3) TABLE(n ## 4) \
+                  TABLE(n ## 5) TABLE(n ## 6) TABLE(n ## 7) TABLE(n ## 8) TABLE(n ## 9)
+
+BLOCK(1)
+BLOCK(2)
+BLOCK(3)
+BLOCK(4)
+BLOCK(5)
+
+int sq = SQ(SQ(SQ(SQ(SQ(SIZE)))));
+int nested = L2(SIZE) + L2(SQ(ONE)) + L2(L2(TWO));
+int sum =  D4(SQ(FOUR)) + D4(L1(SIZE)) + D4(XCAT(ON, E));
+const char *s = XSTR(SQ(SIZE)) XSTR(L1(FOUR));
@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Write cond.c, the conditional expression benchmark, to a file
+# (default: tests/bench/cond.c): configuration tests on version and
+# feature macros, most of them false.  The tests are made with a fixed
+# seed, so the output is the same on every run.
+
+OUT=${1:-tests/bench/cond.c}
+
+awk 'function rnd(n) {  # Park-Miller: exact in double precision
+  seed = (seed * 16807) % 2147483647
+  return seed % n
+}
+BEGIN {
+  seed = 20261019
+  split("HAVE_THREADS HAVE_MMAP HAVE_SSE2 HAVE_NEON HAVE_ALTIVEC", feat, " ")
+
+  print "/* Benchmark: configuration headers full of #if tests on version and"
+  print " * feature macros, most of them false. */"
+  print ""
+  print "#define VERSION_MAJOR 4"
+  print "#define VERSION_MINOR 17"
+  print "#define VERSION_PATCH 2"
+  print "#define VERSION_NUM(a, b, c) (((a) << 16) | ((b) << 8) | (c))"
+  print "#define VERSION VERSION_NUM(VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH)"
+  print "#define HAVE_THREADS 1"
+  print "#define HAVE_MMAP 1"
+  print "#define CACHE_LINE 64"
+  print "#define PAGE_SIZE 4096"
+  print ""
+
+  for (i = 0; i < 600; i++) {
+    major = 2 + rnd(5)
+    minor = rnd(31)
+    patch = rnd(10)
+    f1 = feat[1 + rnd(5)]
+    f2 = feat[1 + rnd(5)]
+    lines = 1 + rnd(128)
+    mod = 2 + rnd(8)
+    printf "#if VERSION >= VERSION_NUM(%d, %d, %d) && (defined(%s) || defined %s) && CACHE_LINE * %d <= PAGE_SIZE\n", major, minor, patch, f1, f2, lines
+    printf "int feature_%d_a;\n", i
+    printf "#elif (VERSION_MINOR > %d ? %s + 0 : PAGE_SIZE / CACHE_LINE %% %d) != 0 || -1 < 0u\n", minor, f1, mod
+    printf "int feature_%d_b;\n", i
+    print "#else"
+    printf "int feature_%d_c;\n", i
+    print "#endif"
+  }
+}' > "$OUT"
@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Write memo.c, the macro memoization benchmark, to a file (default:
+# tests/bench/memo.c): a few expensive invocations repeated many times.
+
+OUT=${1:-tests/bench/memo.c}
+
+{
+  cat <<'EOF'
+/* Benchmark: the same expensive invocations repeated in the source
+ * text, as with assertion or logging macros used all over a file. */
+
+#define ONE       1
+#define TWO       (ONE + ONE)
+#define FOUR      (TWO * TWO)
+
+#define ID(x)     x
+#define L0(x)     ID(ID(ID(ID(x))))
+#define L1(x)     L0(L0(L0(L0(x))))
+#define L2(x)     L1(L1(L1(L1(x))))
+
+#define D0(x)     x + x
+#define D1(x)     D0(D0(x))
+#define D2(x)     D1(D1(x))
+#define D3(x)     D2(D2(x))
+
+#define CHECK(c)  do { if (! (L2(c))) fail(D3(FOUR)); } while (0)
+#define LOG(lvl)  if (L2(lvl) >= D2(TWO)) log_line(D2(ONE))
+
+EOF
+  awk 'BEGIN {
+    split("p|q != 0|n < FOUR", check, "|")
+    for (i = 0; i < 600; i++)
+      printf "CHECK(%s); LOG(%d);\n", check[1 + i % 3], i % 4
+  }'
+} > "$OUT"
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Write pch.h, the prelude of the precompiled header benchmark, to a
+# file (default: tests/bench/pch.h): a large block of register,
+# feature and helper macros, as used by pch.c.
+
+OUT=${1:-tests/bench/pch.h}
+
+awk 'BEGIN {
+  print "/* pch.h: prelude of the precompiled header benchmark, a large"
+  print " * block of configuration and helper macros */"
+  print "#ifndef PCH_H"
+  print "#define PCH_H"
+  print "#define CFG_LEVEL 3"
+  print "#define CAT_(a, b) a ## b"
+  print "#define CAT(a, b) CAT_(a, b)"
+  print "#define STR_(x) #x"
+  print "#define STR(x) STR_(x)"
+  for (i = 0; i < 1000; i++) {
+    printf "#define REG_%d_BASE    (0x%08xu)\n", i, 1073741824 + 256*i
+    printf "#define REG_%d_CTRL(n) (*(volatile unsigned *) (REG_%d_BASE + 4 * (n)))\n", i, i
+    printf "#define REG_%d_MASK    ((1u << %d) - 1)\n", i, i % 32
+    if (i % 4 == 0) {
+      printf "#if CFG_LEVEL > %d\n", (5 - int(i / 4) % 5) % 5
+      printf "#define FEAT_%d 1\n#else\n#define FEAT_%d 0\n#endif\n", i, i
+    }
+    if (i % 10 == 0)
+      printf "#define CALL_%d(f, ...) CAT(f, _%d)(REG_%d_BASE, __VA_ARGS__)\n", i, i, i
+  }
+  print ""
+  print "#endif"
+}' > "$OUT"
@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Write scan.c and scan.h, the dependency scan benchmark, to a
+# directory (default: tests/bench): expansion-heavy text in a file and
+# in a header it includes.
+
+DIR=${1:-tests/bench}
+
+{
+  cat <<'EOF'
+/* scan.h: header of the dependency scan benchmark */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#define ONE       1
+#define TWO       (ONE + ONE)
+#define FOUR      (TWO * TWO)
+
+#define ID(x)     x
+#define L0(x)     ID(ID(ID(ID(x))))
+#define L1(x)     L0(L0(L0(L0(x))))
+#define L2(x)     L1(L1(L1(L1(x))))
+
+#define D0(x)     x + x
+#define D1(x)     D0(D0(x))
+#define D2(x)     D1(D1(x))
+#define D3(x)     D2(D2(x))
+
+#define CHECK(c)  do { if (! (L2(c))) fail(D3(FOUR)); } while (0)
+#define LOG(lvl)  if (L2(lvl) >= D2(TWO)) log_line(D2(ONE))
+
+EOF
+  awk 'BEGIN {
+    for (i = 0; i < 150; i++)
+      printf "static inline int check_%d(int n) { CHECK(n != %d); LOG(%d); return D2(n); }\n", i, i, i % 4
+  }'
+  printf '\n#endif /* SCAN_H */\n'
+} > "$DIR/scan.h"
+
+{
+  cat <<'EOF'
+/* Benchmark: dependency scan (-M) of a file with expansion-heavy
+ * text and a header full of it, against preprocessing it (-E). */
+
+#include "scan.h"
+
+#ifdef __WIN32__
+#include "scan_win32.h"
+#endif
+
+EOF
+  awk 'BEGIN {
+    for (i = 0; i < 300; i++)
+      printf "int f_%d(int n) { CHECK(n < FOUR); LOG(%d); return D3(n) + check_%d(n); }\n", i, i % 4, i % 150
+  }'
+  printf '\n#include "scan.h"\n'
+} > "$DIR/scan.c"
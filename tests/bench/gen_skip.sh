@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Write skip.c and skip.h, the skipped group benchmark, to a directory
+# (default: tests/bench).  skip.h has a group for each of 8 variants,
+# and skip.c includes it 64 times, so most of it is skipped each time.
+
+DIR=${1:-tests/bench}
+
+awk -v dir="$DIR" 'BEGIN {
+  h = dir "/skip.h"
+  print "/* skip.h: header of the skipped group benchmark, included once for" > h
+  print " * every table with a different VARIANT (so it has no guard) */" > h
+  print "" > h
+  for (v = 0; v < 8; v++) {
+    printf "#if VARIANT == %d\n", v > h
+    for (i = 0; i < 60; i++) {
+      printf "/* entry %d of variant %d: the layout of this entry depends on the variant */\n", i, v > h
+      printf "int CAT(TABLE, _v%d_%d)(int a, const char *s) { return a + s[%d] * %d; }\n", v, i, i % 7, v + 1 > h
+      if (i % 20 == 0)
+        printf "#ifdef DEBUG_TABLES\nint CAT(TABLE, _debug_%d) = %d;\n#endif\n", i, i > h
+    }
+    print "#endif" > h
+    print "" > h
+  }
+  print "#undef TABLE" > h
+  print "#undef VARIANT" > h
+  close(h)
+
+  c = dir "/skip.c"
+  print "/* Benchmark: a header included many times, with most of it in" > c
+  print " * groups skipped by every inclusion. */" > c
+  print "" > c
+  print "#define CAT_(a, b) a ## b" > c
+  print "#define CAT(a, b) CAT_(a, b)" > c
+  print "" > c
+  for (t = 0; t < 64; t++)
+    printf "#define TABLE table_%d\n#define VARIANT %d\n#include \"skip.h\"\n", t, t % 8 > c
+  close(c)
+}'
@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# Write the headers spec_00.h ... spec_15.h included by spec.c, the
+# speculative include benchmark, to a directory (default: tests/bench).
+# Each header is independent of the others and expensive to expand.
+
+DIR=${1:-tests/bench}
+
+awk -v dir="$DIR" 'BEGIN {
+  for (i = 0; i < 16; i++) {
+    n = sprintf("%02d", i)
+    f = dir "/spec_" n ".h"
+    S = "S" n
+    printf "/* spec_%s.h: header of the speculative include benchmark, independent of the others */\n\n", n > f
+    printf "#ifndef SPEC_%s_H\n#define SPEC_%s_H\n\n", n, n > f
+    printf "#define %s_ADD(a, b)  ((a) + (b))\n", S > f
+    printf "#define %s_MUL(a, b)  ((a) * (b))\n", S > f
+    printf "#define %s_SQ(a)      %s_MUL(a, a)\n", S, S > f
+    printf "#define %s_POLY(x)    %s_ADD(%s_SQ(x), %s_ADD(%s_MUL(%d, x), %d))\n", S, S, S, S, S, i + 2, i + 7 > f
+    printf "#define %s_POLY2(x)   %s_POLY(%s_POLY(x))\n", S, S, S > f
+    printf "#define %s_FN(n)      static int s%s_f ## n(int x) { return %s_POLY2(x) + n; }\n\n", S, n, S > f
+    for (j = 0; j < 200; j++)
+      printf "%s_FN(%d)\n", S, j > f
+    printf "\n#endif\n" > f
+    close(f)
+  }
+}'
@@ -0,0 +1,31 @@
+/* Benchmark: preprocessing a short file that includes a large
+ * prelude, with and without a precompiled header of it.
+ * The prelude is written by gen_pch.sh (see "make bench"). */
+
+#include "pch.h"
+
+int f_0(int n) { REG_0_CTRL(n) = REG_0_MASK; return FEAT_0 + CALL_0(write, n, STR(REG_0_BASE)); }
+int f_40(int n) { REG_40_CTRL(n) = REG_40_MASK; return FEAT_40 + CALL_40(write, n, STR(REG_40_BASE)); }
+int f_80(int n) { REG_80_CTRL(n) = REG_80_MASK; return FEAT_80 + CALL_80(write, n, STR(REG_80_BASE)); }
+int f_120(int n) { REG_120_CTRL(n) = REG_120_MASK; return FEAT_120 + CALL_120(write, n, STR(REG_120_BASE)); }
+int f_160(int n) { REG_160_CTRL(n) = REG_160_MASK; return FEAT_160 + CALL_160(write, n, STR(REG_160_BASE)); }
+int f_200(int n) { REG_200_CTRL(n) = REG_200_MASK; return FEAT_200 + CALL_200(write, n, STR(REG_200_BASE)); }
+int f_240(int n) { REG_240_CTRL(n) = REG_240_MASK; return FEAT_240 + CALL_240(write, n, STR(REG_240_BASE)); }
+int f_280(int n) { REG_280_CTRL(n) = REG_280_MASK; return FEAT_280 + CALL_280(write, n, STR(REG_280_BASE)); }
+int f_320(int n) { REG_320_CTRL(n) = REG_320_MASK; return FEAT_320 + CALL_320(write, n, STR(REG_320_BASE)); }
+int f_360(int n) { REG_360_CTRL(n) = REG_360_MASK; return FEAT_360 + CALL_360(write, n, STR(REG_360_BASE)); }
+int f_400(int n) { REG_400_CTRL(n) = REG_400_MASK; return FEAT_400 + CALL_400(write, n, STR(REG_400_BASE)); }
+int f_440(int n) { REG_440_CTRL(n) = REG_440_MASK; return FEAT_440 + CALL_440(write, n, STR(REG_440_BASE)); }
+int f_480(int n) { REG_480_CTRL(n) = REG_480_MASK; return FEAT_480 + CALL_480(write, n, STR(REG_480_BASE)); }
+int f_520(int n) { REG_520_CTRL(n) = REG_520_MASK; return FEAT_520 + CALL_520(write, n, STR(REG_520_BASE)); }
+int f_560(int n) { REG_560_CTRL(n) = REG_560_MASK; return FEAT_560 + CALL_560(write, n, STR(REG_560_BASE)); }
+int f_600(int n) { REG_600_CTRL(n) = REG_600_MASK; return FEAT_600 + CALL_600(write, n, STR(REG_600_BASE)); }
+int f_640(int n) { REG_640_CTRL(n) = REG_640_MASK; return FEAT_640 + CALL_640(write, n, STR(REG_640_BASE)); }
+int f_680(int n) { REG_680_CTRL(n) = REG_680_MASK; return FEAT_680 + CALL_680(write, n, STR(REG_680_BASE)); }
+int f_720(int n) { REG_720_CTRL(n) = REG_720_MASK; return FEAT_720 + CALL_720(write, n, STR(REG_720_BASE)); }
+int f_760(int n) { REG_760_CTRL(n) = REG_760_MASK; return FEAT_760 + CALL_760(write, n, STR(REG_760_BASE)); }
+int f_800(int n) { REG_800_CTRL(n) = REG_800_MASK; return FEAT_800 + CALL_800(write, n, STR(REG_800_BASE)); }
+int f_840(int n) { REG_840_CTRL(n) = REG_840_MASK; return FEAT_840 + CALL_840(write, n, STR(REG_840_BASE)); }
+int f_880(int n) { REG_880_CTRL(n) = REG_880_MASK; return FEAT_880 + CALL_880(write, n, STR(REG_880_BASE)); }
+int f_920(int n) { REG_920_CTRL(n) = REG_920_MASK; return FEAT_920 + CALL_920(write, n, STR(REG_920_BASE)); }
+int f_960(int n) { REG_960_CTRL(n) = REG_960_MASK; return FEAT_960 + CALL_960(write, n, STR(REG_960_BASE)); }
@@ -0,0 +1,131 @@
+/* Benchmark: deep recursion in the style of preprocessor metaprogramming
+ * libraries: numbered macro chains that nest 32 levels deep, and EVAL
+ * chains that rescan their argument hundreds of times. */
+
+#define CAT(a, ...)           PRIMITIVE_CAT(a, __VA_ARGS__)
+#define PRIMITIVE_CAT(a, ...) a ## __VA_ARGS__
+
+#define EVAL(...)     EVAL1(EVAL1(EVAL1(__VA_ARGS__)))
+#define EVAL1(...)    EVAL2(EVAL2(EVAL2(__VA_ARGS__)))
+#define EVAL2(...)    EVAL3(EVAL3(EVAL3(__VA_ARGS__)))
+#define EVAL3(...)    EVAL4(EVAL4(EVAL4(__VA_ARGS__)))
+#define EVAL4(...)    EVAL5(EVAL5(EVAL5(__VA_ARGS__)))
+#define EVAL5(...)    __VA_ARGS__
+
+#define INC(x)        PRIMITIVE_CAT(INC_, x)
+#define INC_0  1
+#define INC_1  2
+#define INC_2  3
+#define INC_3  4
+#define INC_4  5
+#define INC_5  6
+#define INC_6  7
+#define INC_7  8
+#define INC_8  9
+#define INC_9  10
+#define INC_10 11
+#define INC_11 12
+#define INC_12 13
+#define INC_13 14
+#define INC_14 15
+#define INC_15 16
+#define INC_16 17
+#define INC_17 18
+#define INC_18 19
+#define INC_19 20
+#define INC_20 21
+#define INC_21 22
+#define INC_22 23
+#define INC_23 24
+#define INC_24 25
+#define INC_25 26
+#define INC_26 27
+#define INC_27 28
+#define INC_28 29
+#define INC_29 30
+#define INC_30 31
+#define INC_31 32
+#define INC_32 33
+
+#define REPEAT(n, m, d)  CAT(REPEAT_, n)(m, d)
+#define REPEAT_0(m, d)
+#define REPEAT_1(m, d)  REPEAT_0(m, d) m(0, d)
+#define REPEAT_2(m, d)  REPEAT_1(m, d) m(1, d)
+#define REPEAT_3(m, d)  REPEAT_2(m, d) m(2, d)
+#define REPEAT_4(m, d)  REPEAT_3(m, d) m(3, d)
+#define REPEAT_5(m, d)  REPEAT_4(m, d) m(4, d)
+#define REPEAT_6(m, d)  REPEAT_5(m, d) m(5, d)
+#define REPEAT_7(m, d)  REPEAT_6(m, d) m(6, d)
+#define REPEAT_8(m, d)  REPEAT_7(m, d) m(7, d)
+#define REPEAT_9(m, d)  REPEAT_8(m, d) m(8, d)
+#define REPEAT_10(m, d) REPEAT_9(m, d) m(9, d)
+#define REPEAT_11(m, d) REPEAT_10(m, d) m(10, d)
+#define REPEAT_12(m, d) REPEAT_11(m, d) m(11, d)
+#define REPEAT_13(m, d) REPEAT_12(m, d) m(12, d)
+#define REPEAT_14(m, d) REPEAT_13(m, d) m(13, d)
+#define REPEAT_15(m, d) REPEAT_14(m, d) m(14, d)
+#define REPEAT_16(m, d) REPEAT_15(m, d) m(15, d)
+#define REPEAT_17(m, d) REPEAT_16(m, d) m(16, d)
+#define REPEAT_18(m, d) REPEAT_17(m, d) m(17, d)
+#define REPEAT_19(m, d) REPEAT_18(m, d) m(18, d)
+#define REPEAT_20(m, d) REPEAT_19(m, d) m(19, d)
+#define REPEAT_21(m, d) REPEAT_20(m, d) m(20, d)
+#define REPEAT_22(m, d) REPEAT_21(m, d) m(21, d)
+#define REPEAT_23(m, d) REPEAT_22(m, d) m(22, d)
+#define REPEAT_24(m, d) REPEAT_23(m, d) m(23, d)
+#define REPEAT_25(m, d) REPEAT_24(m, d) m(24, d)
+#define REPEAT_26(m, d) REPEAT_25(m, d) m(25, d)
+#define REPEAT_27(m, d) REPEAT_26(m, d) m(26, d)
+#define REPEAT_28(m, d) REPEAT_27(m, d) m(27, d)
+#define REPEAT_29(m, d) REPEAT_28(m, d) m(28, d)
+#define REPEAT_30(m, d) REPEAT_29(m, d) m(29, d)
+#define REPEAT_31(m, d) REPEAT_30(m, d) m(30, d)
+#define REPEAT_32(m, d) REPEAT_31(m, d) m(31, d)
+
+#define ENUM(n, m, d)  CAT(ENUM_, n)(m, d)
+#define ENUM_1(m, d)   m(0, d)
+#define ENUM_2(m, d)  ENUM_1(m, d), m(1, d)
+#define ENUM_3(m, d)  ENUM_2(m, d), m(2, d)
+#define ENUM_4(m, d)  ENUM_3(m, d), m(3, d)
+#define ENUM_5(m, d)  ENUM_4(m, d), m(4, d)
+#define ENUM_6(m, d)  ENUM_5(m, d), m(5, d)
+#define ENUM_7(m, d)  ENUM_6(m, d), m(6, d)
+#define ENUM_8(m, d)  ENUM_7(m, d), m(7, d)
+#define ENUM_9(m, d)  ENUM_8(m, d), m(8, d)
+#define ENUM_10(m, d) ENUM_9(m, d), m(9, d)
+#define ENUM_11(m, d) ENUM_10(m, d), m(10, d)
+#define ENUM_12(m, d) ENUM_11(m, d), m(11, d)
+#define ENUM_13(m, d) ENUM_12(m, d), m(12, d)
+#define ENUM_14(m, d) ENUM_13(m, d), m(13, d)
+#define ENUM_15(m, d) ENUM_14(m, d), m(14, d)
+#define ENUM_16(m, d) ENUM_15(m, d), m(15, d)
+#define ENUM_17(m, d) ENUM_16(m, d), m(16, d)
+#define ENUM_18(m, d) ENUM_17(m, d), m(17, d)
+#define ENUM_19(m, d) ENUM_18(m, d), m(18, d)
+#define ENUM_20(m, d) ENUM_19(m, d), m(19, d)
+#define ENUM_21(m, d) ENUM_20(m, d), m(20, d)
+#define ENUM_22(m, d) ENUM_21(m, d), m(21, d)
+#define ENUM_23(m, d) ENUM_22(m, d), m(22, d)
+#define ENUM_24(m, d) ENUM_23(m, d), m(23, d)
+#define ENUM_25(m, d) ENUM_24(m, d), m(24, d)
+#define ENUM_26(m, d) ENUM_25(m, d), m(25, d)
+#define ENUM_27(m, d) ENUM_26(m, d), m(26, d)
+#define ENUM_28(m, d) ENUM_27(m, d), m(27, d)
+#define ENUM_29(m, d) ENUM_28(m, d), m(28, d)
+#define ENUM_30(m, d) ENUM_29(m, d), m(29, d)
+#define ENUM_31(m, d) ENUM_30(m, d), m(30, d)
+#define ENUM_32(m, d) ENUM_31(m, d), m(31, d)
+
+#define PARAM(i, d)       d ## i
+#define FIELD(i, d)       int CAT(d, i) = INC(i);
+#define FUNC(name)        int name(ENUM(16, PARAM, int p));
+#define STRUCT(name)      struct name { EVAL(REPEAT(32, FIELD, name ## _)) }; FUNC(name ## _init)
+
+#define STRUCTS(n) STRUCT(s ## n ## 0) STRUCT(s ## n ## 1) STRUCT(s ## n ## 2) STRUCT(s ## n ## 3)
+#define TABLE(n)   STRUCTS(n ## 0) STRUCTS(n ## 1) STRUCTS(n ## 2) STRUCTS(n ## 3) \
+                   STRUCTS(n ## 4) STRUCTS(n ## 5) STRUCTS(n ## 6) STRUCTS(n ## 7)
+
+TABLE(0)
+TABLE(1)
+TABLE(2)
+TABLE(3)
@@ -0,0 +1,22 @@
+/* Benchmark: a file made of many independent headers, each one
+ * expensive to expand, for speculative preprocessing of includes.
+ * The headers are written by gen_spec.sh (see "make bench"). */
+
+#include "spec_00.h"
+#include "spec_01.h"
+#include "spec_02.h"
+#include "spec_03.h"
+#include "spec_04.h"
+#include "spec_05.h"
+#include "spec_06.h"
+#include "spec_07.h"
+#include "spec_08.h"
+#include "spec_09.h"
+#include "spec_10.h"
+#include "spec_11.h"
+#include "spec_12.h"
+#include "spec_13.h"
+#include "spec_14.h"
+#include "spec_15.h"
+
+int spec_main(int x) { return s00_f0(x) + s15_f199(x); }
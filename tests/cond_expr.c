@@ -0,0 +1,51 @@
+// integer arithmetic of #if expressions
+
+#define A 5
+#define B(x) ((x) * 2)
+#if A + 3 * 2 == 11 && B(A) == 10
+ok1
+#endif
+#if -1 < 0u
+bad1
+#else
+ok2
+#endif
+#if (2 || 1/0) && !(0 && 1/0)
+ok3
+#endif
+#if 0x7fffffffffffffff + 0 > 0 && 18446744073709551615u == -1
+ok4
+#endif
+#if 'a' == 97 && '\377' < 0 && '\n' == 10 && L'\xff' == 255
+ok5
+#endif
+#if (1 ? -1 : 0u) > 0
+ok6
+#endif
+#if (0 ? 1 : 2) == 2 && (1, 2) == 2
+ok7
+#endif
+#if -1 >> 1 == -1 && 1 << 62 == 4611686018427387904 && (-9) / 2 == -4 && (-9) % 2 == -1
+ok8
+#endif
+#if defined A && !defined(C) && defined(B) + defined A == 2
+ok9
+#endif
+#if UNDEFINED_THING == 0 && 010 == 8 && 0x1fULL == 31 && 10lu == 10
+ok10
+#endif
+#if ~0 == -1 && ~0u == 18446744073709551615 && (1 != 2) == 1 && (3 & 6 | 8 ^ 1) == 11
+ok11
+#endif
+#if 2 >= 2 && 3 <= 2
+bad
+#elif 1 ? 0 ? 1 : 1 : 0
+ok12
+#endif
+
+// division by zero is only an error where it's evaluated
+#if 0 && (1 / 0 || 1 % 0)
+bad
+#elif 1 || 1 / 0
+ok13
+#endif
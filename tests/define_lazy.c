@@ -0,0 +1,24 @@
+/* macros are only tokenized when used */
+
+#define UNUSED(a, b) a ## b + "never read"
+#define URL "http://example.com" /* a comment
+  spanning lines */ + 1
+#define JOIN(a, \
+  b) a ## \
+  b
+#define QUOTES '"' + '\'' // trailing comment
+
+// redefinitions with the same tokens
+#define SUM 1 + 2
+#define SUM 1   +   2
+#define SUM /* c */ 1 + 2
+#define PAIR(x,y) x y
+#define PAIR( x , y ) x  y
+
+#if SUM == 3 && JOIN(1, 0) == 10
+int ok = 1;
+#endif
+char *u = URL;
+int c = JOIN(ab, cd);
+int q = QUOTES;
+PAIR(1, 2)
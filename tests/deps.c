@@ -0,0 +1,22 @@
+// dependency scan (-M): only directives are run, text is skipped
+
+#define HEADER "include2.h"
+#define ONCE(x) x
+
+/* #include "not_included.h" */
+x = "#include \"not_included.h\"";
+y = '#'; # include "not_included.h"
+// \
+#include "not_included.h"
+
+#if 0
+#include "not_included.h"
+#elif defined(HEADER)
+  # include HEADER
+#endif
+
+/* a comment spanning
+   lines */ #include "once.h"
+#if ONCE(1)
+#include "once.h"
+#endif
@@ -0,0 +1,12 @@
+// files made of a single #ifndef group are not read again while the macro is defined
+
+#include "guard.h"
+#include "guard.h"
+#include "guard2.h"
+#include "guard2.h"
+#include "guard3.h"
+#include "guard3.h"
+
+#undef GUARD_H
+#include "guard.h"
+#include "guard.h"
@@ -0,0 +1,7 @@
+/* guarded header: a single #ifndef group */
+#ifndef GUARD_H
+#define GUARD_H
+
+guarded
+
+#endif /* GUARD_H */
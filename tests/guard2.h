@@ -0,0 +1,6 @@
+// not guarded: there's a token after the group
+#ifndef GUARD2_H
+#define GUARD2_H
+guard2
+#endif
+after_group
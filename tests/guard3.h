@@ -0,0 +1,7 @@
+// not guarded: the group has an #else
+#ifndef GUARD3_H
+#define GUARD3_H
+guard3
+#else
+guard3_again
+#endif
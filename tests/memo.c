@@ -0,0 +1,35 @@
+// repeated invocations, with macros they use changing in between
+
+#define ADD(a, b)   ((a) + (b))
+#define TWICE(x)    ADD(x, x)
+#define VAL         1
+#define EMPTY()
+#define G(x)        [x]
+#define NAME(x)     G
+
+TWICE(VAL)
+TWICE(VAL)
+TWICE( VAL )
+
+#undef VAL
+#define VAL 2
+TWICE(VAL)
+TWICE(VAL)
+
+#undef ADD
+#define ADD(a, b) a * b
+TWICE(VAL)
+TWICE(3)
+
+x EMPTY() y
+x EMPTY() y
+x EMPTY()y
+
+NAME(1)(2)
+NAME(1) (3)
+NAME(1) z
+NAME(1)
+(4)
+
+__LINE__ TWICE(__LINE__)
+__LINE__ TWICE(__LINE__)
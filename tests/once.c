@@ -0,0 +1,8 @@
+// '#pragma once' files are recognized by identity, not by path
+
+#include "once.h"
+#include "once.h"
+#include "./once.h"
+#include "../tests/once.h"
+
+done
@@ -0,0 +1,3 @@
+#pragma once
+// read only once, whatever path is used to include it
+once
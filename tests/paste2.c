@@ -0,0 +1,15 @@
+#define CAT(a,b) a ## b
+#define CAT3(a,b,c) a ## b ## c
+#define STRCAT(a,b) # a ## b
+#define F(x) x F
+#define SELF(a,b) a ## b(1)
+#define G(x, ...) x ## __VA_ARGS__ end
+#define H(x) [ x ## x ]
+#define E(x,y) < x ## y >
+CAT(,) CAT(a,) CAT(,b) CAT(a b, c d)
+CAT3(,,) CAT3(a,,) CAT3(,b,) CAT3(,,c) CAT3(x, y, z) CAT3( 1 , 2 3 , 4 )
+F(F)(1) SELF(SE,LF)
+G(a,) G(a,b) G(,b,c) G(,)
+H() H(ab) H( p q )
+E( , z ) E(z , ) E(,)
+CAT(C,AT)(1,2)
@@ -0,0 +1,9 @@
+#define CAT(a,b) a ## b
+#define CAT3(a,b,c) a ## b ## c
+CAT(foo, bar) CAT(x, 12) CAT(12, x) CAT(1, 2) CAT(1, .5) CAT(1, e10) CAT(0x, ff)
+CAT(<, <) CAT(<<, =) CAT(<, <=) CAT(-, >) CAT(+, +) CAT(&, &) CAT(|, =) CAT(#, #) CAT(>, >=)
+CAT(L, "wide") CAT(L, 'c') CAT(u8, x) CAT(_, 1) CAT3(a, 1, b) CAT3(1, a, 2) CAT3(<, <, =)
+CAT3(x, , y) CAT3(, , z) CAT3(, 3, ) CAT(1, e) CAT3(1, e, -)
+
+#define LONG(x) x ## x ## x ## x ## x ## x ## x ## x ## x
+LONG(abcdefghijklmnopqrstuvwxyz)
@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Check that -E writes tokens so that they lex back as the same
+# tokens.  Run from the top directory with the spork binary to test
+# (default: src/spork).
+
+SPORK=${1:-src/spork}
+case $SPORK in /*) ;; *) SPORK=$PWD/$SPORK ;; esac
+DIR=${TMPDIR:-/tmp}/pp_output.$$
+trap 'rm -rf "$DIR"' EXIT
+mkdir "$DIR" || exit 1
+
+fail=0
+
+# check <name> <expected output lines, without line markers>
+check() {
+  out=$(cd "$DIR" && "$SPORK" -E -o - "$1" 2>&1 | grep -v '^#')
+  if [ "$out" != "$2" ]; then
+    echo "FAIL: $1: got:"
+    echo "$out"
+    echo "expected:"
+    echo "$2"
+    fail=1
+  fi
+}
+
+# a sign after a number's exponent letter would continue the number
+cat > "$DIR/exponent.c" <<'EOF'
+#define PASTE(a, b) a ## b
+#define EN PASTE(1, e)
+#define PN PASTE(0x1, p)
+x = EN+2;
+y = PN-1;
+z = EN*2;
+EOF
+check exponent.c 'x = 1e +2;
+y = 0x1p -1;
+z = 1e*2;'
+
+# a file included again starts on a new line, even after an inclusion
+# that ended on the same line
+printf 'int g;\n' > "$DIR/again.h"
+cat > "$DIR/again.c" <<'EOF'
+#include "again.h"
+#undef G
+#include "again.h"
+EOF
+check again.c 'int g;
+int g;'
+
+[ $fail = 0 ] && echo "preprocessed output: OK"
+exit $fail
@@ -0,0 +1,50 @@
+// lines of groups that are not active are skipped without tokenizing
+
+#define ON 1
+
+#if 0
+don't stop at an apostrophe
+"or an unterminated string
+#if ON
+#error nested group
+#else
+#error nested else
+#endif
+/* a comment
+#endif
+   spanning lines */
+x = "#endif";  y = '#';  # endif
+// line comment \
+#endif
+#  /* comment */  define A 1
+# \
+  else
+f
+#endif
+
+#ifdef ON
+a
+#elif garbage ( here
+#error inactive elif
+#else
+#error inactive else
+#endif
+
+#ifndef ON
+#elif ON
+b
+#endif
+
+#if 0
+#  if 1
+#  elif 1
+#  else
+#  endif
+#elif 0
+#else
+c
+#endif
+  /* block */ #if 0
+d
+   #endif
+e
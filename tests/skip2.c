@@ -0,0 +1,17 @@
+// groups of a header skipped before are jumped over when skipped again
+
+#define MODE 1
+#include "skip2.h"
+#define EXTRA
+#include "skip2.h"
+#undef MODE
+#define MODE 2
+#include "skip2.h"
+#undef EXTRA
+#include "skip2.h"
+#undef MODE
+#define MODE 3
+#include "skip2.h"
+#undef MODE
+#define MODE 1
+#include "skip2.h"
@@ -0,0 +1,21 @@
+/* included with different macros, so different groups are skipped */
+#if MODE == 1
+mode_1
+#  ifdef EXTRA
+mode_1_extra
+#  endif
+#elif MODE == 2
+mode_2 /* a comment
+#endif
+   spanning lines */
+#else
+mode_other
+#  if 0
+#  error nested group
+#  endif
+#endif
+#ifdef EXTRA
+extra
+#else
+no_extra
+#endif
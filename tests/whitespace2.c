@@ -0,0 +1,20 @@
+#define EMPTY
+#define str(x) #x
+#define xstr(x) str(x)
+#define F(a, b) a b
+#define G(x) [x]
+#define H(x) -x-
+- EMPTY -
+a EMPTY+b
+const char *s1 = str(  a   b
+   c  "x\n"   'y'  );
+const char *s2 = xstr(F( 1 , 2 ) G( z ));
+const char *s3 = str();
+const char *s4 = xstr(EMPTY a EMPTY);
+F(
+ p,
+ q
+)
+#define P(x,y) x ## y
+P( a , b ) P(,c) P(d,)
+x EMPTY EMPTY y